@@ -1529,6 +1529,7 @@ FlashBank_UnMap(void *module_owner, uint32_t base, uint32_t mapsize)
 void
 AMDFlash_Delete(AMD_Flash * flash)
 {
+	CycleTimer_Unregister(&flash->erase_timeout);
 	free(flash->rmap);
 	free(flash);
 }
@@ -1537,12 +1538,17 @@ void
 AMDFlashBank_Delete(BusDevice * bdev)
 {
 	AMDFlashBank *bank = bdev->owner;
+	int i;
+	for (i = 0; i < bank->nr_chips; i++) {
+		AMDFlash_Delete(bank->flash[i]);
+		bank->flash[i] = NULL;
+	}
 	if (bank->disk_image) {
 		DiskImage_Close(bank->disk_image);
 		bank->disk_image = NULL;
 	} else {
 		if (bank->host_mem) {
-			free(bank->host_mem);
+			sg_free(bank->host_mem);
 		}
 	}
 	if (bank->stat_image) {
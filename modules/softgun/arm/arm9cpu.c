@@ -65,27 +65,33 @@
 #include "arm9cpu.h"
 
 // Local/Private Headers
+#include "bbcache_arm.h"
 #include "idecode_arm.h"
 #include "instructions_arm.h"
 #include "mmu_arm9.h"
 #include "thumb_decode.h"
 
 // Leigun Core Headers
+#include "asyncmanager.h"
 #include "bus.h"
 #include "configfile.h"
 #include "coprocessor.h"
 #include "cycletimer.h"
+#include "profiler.h"
+#include "snapshot.h"
 #include "xy_tree.h"
 #include "leigun/leigun.h"
 #include "leigun/device.h"
 #include "leigun/globalclock.h"
 
 // External headers
+#include <uv.h>
 
 // System headers
 #include <unistd.h>
 #include <stdint.h>
 #include <stdbool.h>
+#include <stddef.h>
 #include <stdio.h>
 #include <stdlib.h>
 #include <signal.h>
@@ -120,13 +126,13 @@
 //==============================================================================
 //= Variables
 //==============================================================================
-ARM9 gcpu;
+__MACHINE_LOCAL__ ARM9 gcpu;
 
 uint32_t debugflags = 0;
-uint32_t mmu_vector_base = 0;
-uint32_t do_alignment_check = 0;
+__MACHINE_LOCAL__ uint32_t mmu_vector_base = 0;
+__MACHINE_LOCAL__ uint32_t do_alignment_check = 0;
 
-CycleTimer htimer;
+__MACHINE_LOCAL__ CycleTimer htimer;
 
 
 //==============================================================================
@@ -150,14 +156,19 @@ static void ARM9_InitRegs(ARM9 * arm);
 static void hello_proc(void *cd);
 static void irq_change(SigNode * node, int value, void *clientData);
 static void fiq_change(SigNode * node, int value, void *clientData);
-static void arm_throttle(void *clientData);
-static void ARM_ThrottleInit(ARM9 * arm);
+static void horizon_cut(void *clientData);
+static void arm_restored(void *clientData);
 static void dump_stack(void);
 static void dump_regs(void);
 static void Do_Debug(void);
-static inline void CheckSignals(void);
+static __DISPATCH_INLINE__ void CheckSignals(void);
 static inline void debug_print_instruction(uint32_t icode);
+static inline void ARM9_Sync(void);
 static void Thumb_Loop(void);
+static inline void ARM9_Step32(void);
+#ifndef LEIGUN_THREADED_DISPATCH
+static inline void ARM9_RunBlock(BBCache_Block_t * blk);
+#endif
 static void ARM9_Loop32(void);
 
 static Device_MPU_t *create(void);
@@ -611,8 +622,10 @@ hello_proc(void *cd)
 static void
 irq_change(SigNode * node, int value, void *clientData)
 {
+	ARM9 *arm = clientData;
 	if ((value == SIG_LOW) || (value == SIG_PULLDOWN)) {
 		ARM_PostIrq();
+		Throttle_Wakeup(arm->throttle);
 	} else {
 		ARM_UnPostIrq();
 	}
@@ -621,65 +634,15 @@ irq_change(SigNode * node, int value, void *clientData)
 static void
 fiq_change(SigNode * node, int value, void *clientData)
 {
+	ARM9 *arm = clientData;
 	if ((value == SIG_LOW) || (value == SIG_PULLDOWN)) {
 		ARM_PostFiq();
+		Throttle_Wakeup(arm->throttle);
 	} else {
 		ARM_UnPostFiq();
 	}
 }
 
-/*
- *************************************************************************+
- * Throttle timer for OS not using the halt instruction 
- *************************************************************************+
- */
-static void
-arm_throttle(void *clientData)
-{
-	ARM9 *arm = (ARM9 *) clientData;;
-	struct timespec tv_now;
-	uint32_t nsecs;
-	int64_t exp_cpu_cycles, done_cpu_cycles;
-	done_cpu_cycles = CycleCounter_Get() - arm->last_throttle_cycles;
-	arm->cycles_ahead += done_cpu_cycles;
-	do {
-		struct timespec tout;
-		tout.tv_nsec = 10000000;	/* 10 ms */
-		tout.tv_sec = 0;
-
-		clock_gettime(CLOCK_MONOTONIC, &tv_now);
-		nsecs = (tv_now.tv_nsec - arm->tv_last_throttle.tv_nsec) +
-		    (int64_t) 1000000000 *(tv_now.tv_sec - arm->tv_last_throttle.tv_sec);
-		exp_cpu_cycles = NanosecondsToCycles(nsecs);
-		if (arm->cycles_ahead > exp_cpu_cycles) {
-			// FIXME: FIO_WaitEventTimeout(&tout);
-		}
-	} while (arm->cycles_ahead > exp_cpu_cycles);
-	arm->cycles_ahead -= exp_cpu_cycles;
-	/*
-	 **********************************************************
-	 * Forget about catch up if CPU is more than on second
-	 * behind to avoid a longer phase of overspeed. Sound
-	 * doesn't like it !
-	 **********************************************************
-	 */
-	if (-arm->cycles_ahead > (CycleTimerRate_Get() >> 2)) {
-		arm->cycles_ahead = 0;
-	}
-	arm->last_throttle_cycles = CycleCounter_Get();
-	arm->tv_last_throttle = tv_now;
-	CycleTimer_Mod(&arm->throttle_timer, CycleTimerRate_Get() / 10);
-	return;
-}
-
-static void
-ARM_ThrottleInit(ARM9 * arm)
-{
-	clock_gettime(CLOCK_MONOTONIC, &arm->tv_last_throttle);
-	arm->last_throttle_cycles = 0;
-	CycleTimer_Add(&arm->throttle_timer, CycleTimerRate_Get() / 25, arm_throttle, arm);
-}
-
 static void
 dump_stack(void)
 {
@@ -764,7 +727,7 @@ Do_Debug(void)
  *	and for the signals IRQ and FIQ
  * -----------------------------------------------------------------------
  */
-static inline void
+static __DISPATCH_INLINE__ void
 CheckSignals(void)
 {
 	if (gcpu.signals) {
@@ -804,6 +767,84 @@ debug_print_instruction(uint32_t icode)
 #endif
 }
 
+/*
+ * ---------------------------------------------------------------------
+ * Called by the CycleTimer queue when a timer expiring inside the
+ * running batch is added. The batch ends after the current block.
+ * ---------------------------------------------------------------------
+ */
+static void
+horizon_cut(void *clientData)
+{
+	ARM9 *arm = clientData;
+	arm->batch_cycles = 0;
+}
+
+/*
+ * ---------------------------------------------------------------------
+ * End of an instruction batch: Account the cycles executed since the
+ * last sync to the GlobalClock, fire the due timer and start a new batch
+ * which ends at the next event. The cycles are taken from the
+ * CycleCounter, so a batch left by an abort longjmp is accounted too.
+ * ---------------------------------------------------------------------
+ */
+static inline void
+ARM9_Sync(void)
+{
+	uint64_t rest;
+	rest = GlobalClock_Advance(gcpu.clk, CycleCounter - gcpu.synced_cycles);
+	gcpu.synced_cycles = CycleCounter;
+	CycleTimers_Check();
+	gcpu.batch_cycles = CycleTimers_Horizon(rest);
+}
+
+#ifdef LEIGUN_THREADED_DISPATCH
+/*
+ * -----------------------------------------------------------------
+ * Threaded Thumb loop: every dispatch slot has its own copy of the
+ * loop body ending in its own jump to the next instruction. The
+ * label table of the decoder is built on the first entry.
+ * -----------------------------------------------------------------
+ */
+#define THUMB_HANDLER(n) \
+	DISPATCH_LABEL(n): \
+	if ((n) == 0) { \
+		ThumbInstructionProc_Find(ICODE)(); \
+	} else { \
+		thumbDispatch.proc[n](); \
+	} \
+	while (unlikely(gcpu.batch_cycles <= 0)) { \
+		ARM9_Sync(); \
+	} \
+	CycleCounter += 2; \
+	gcpu.batch_cycles -= 2; \
+	CheckSignals(); \
+	ICODE = MMU_IFetch16(ARM_NIA); \
+	ARM_NIA += 2; \
+	goto *thumbTarget[THUMB_INSTR_INDEX(ICODE)];
+
+static __MACHINE_LOCAL__ const void **thumbTarget;
+
+static void
+Thumb_Loop(void)
+{
+	static const void *const labels[DISPATCH_SLOTS] = DISPATCH_LABELS;
+	if (unlikely(!thumbTarget)) {
+		thumbTarget = Dispatch_MapTargets(&thumbDispatch, labels);
+	}
+	setjmp(gcpu.abort_jump);
+	do {
+		ARM9_Sync();
+	} while (gcpu.batch_cycles <= 0);
+	CycleCounter += 2;
+	gcpu.batch_cycles -= 2;
+	CheckSignals();
+	ICODE = MMU_IFetch16(ARM_NIA);
+	ARM_NIA += 2;
+	goto *thumbTarget[THUMB_INSTR_INDEX(ICODE)];
+	DISPATCH_HANDLERS(THUMB_HANDLER)
+}
+#else
 static void
 Thumb_Loop(void)
 {
@@ -812,16 +853,69 @@ Thumb_Loop(void)
 	//fprintf(stderr,"Entering Thumb loop\n");
 	setjmp(gcpu.abort_jump);
 	while (1) {
-		GlobalClock_ConsumeCycle(gcpu.clk, 2);
+		ARM9_Sync();
+		while (gcpu.batch_cycles > 0) {
+			CycleCounter += 2;
+			gcpu.batch_cycles -= 2;
+			CheckSignals();
+			ICODE = MMU_IFetch16(ARM_NIA);
+			ARM_NIA += 2;
+			instr = ThumbInstruction_Find(ICODE);
+			//fprintf(stderr,"Instruction %08x, name %s at %08x\n",ICODE,instr->name,ARM_NIA);
+			iproc = ThumbInstructionProc_Find(ICODE);
+			iproc();
+		}
+	}
+}
+#endif
+
+/*
+ * -----------------------------------------------------------------
+ * Execute one instruction which is not backed by host memory
+ * (For example from io-mapped flash)
+ * -----------------------------------------------------------------
+ */
+static inline void
+ARM9_Step32(void)
+{
+	InstructionProc *iproc;
+	CycleCounter += 2;
+	gcpu.batch_cycles -= 2;
+	ICODE = MMU_IFetch(ARM_NIA);
+	ARM_NIA += 4;
+	iproc = InstructionProcFind(ICODE);
+	debug_print_instruction(ICODE);
+	iproc();
+}
+
+/*
+ * -----------------------------------------------------------------
+ * Run a predecoded block until its end, a taken branch, a pending
+ * signal or the end of the batch. The cycles are charged before each
+ * instruction like in ARM9_Step32, so an instruction leaving the
+ * block by an abort longjmp is accounted by the next ARM9_Sync.
+ * -----------------------------------------------------------------
+ */
+#ifndef LEIGUN_THREADED_DISPATCH
+static inline void
+ARM9_RunBlock(BBCache_Block_t * blk)
+{
+	BBCache_Entry_t *entry = blk->entry;
+	BBCache_Entry_t *end = blk->entry + blk->ninstr;
+	uint32_t nia = ARM_NIA;
+	while (1) {
 		CycleCounter += 2;
-		CheckSignals();
-		ICODE = MMU_IFetch16(ARM_NIA);
-		ARM_NIA += 2;
-		instr = ThumbInstruction_Find(ICODE);
-		//fprintf(stderr,"Instruction %08x, name %s at %08x\n",ICODE,instr->name,ARM_NIA);
-		iproc = ThumbInstructionProc_Find(ICODE);
-		iproc();
-		CycleTimers_Check();
+		gcpu.batch_cycles -= 2;
+		ICODE = entry->icode;
+		nia += 4;
+		ARM_NIA = nia;
+		debug_print_instruction(ICODE);
+		entry->proc();
+		entry++;
+		if (unlikely((ARM_NIA != nia) || gcpu.signals || (entry == end)
+			     || (gcpu.batch_cycles <= 0))) {
+			break;
+		}
 	}
 }
 
@@ -833,44 +927,127 @@ Thumb_Loop(void)
 static void
 ARM9_Loop32(void)
 {
-	InstructionProc *iproc;
+	uint8_t *hva;
 	/* Exceptions use goto (longjmp) */
 	setjmp(gcpu.abort_jump);
 	while (1) {
+		ARM9_Sync();
+		while (gcpu.batch_cycles > 0) {
 #if VERBOSE
-		fprintf(stdout, "CIA %08x\n", ARM_GET_CIA);
+			fprintf(stdout, "CIA %08x\n", ARM_GET_CIA);
 #endif
-		CheckSignals();
-		GlobalClock_ConsumeCycle(gcpu.clk, 6);
-		CycleCounter += 6;
-		ICODE = MMU_IFetch(ARM_NIA);
-		ARM_NIA += 4;
-		iproc = InstructionProcFind(ICODE);
-		debug_print_instruction(ICODE);
-		iproc();
-		CycleTimers_Check();
+			CheckSignals();
+			hva = MMU_IFetchHVA(ARM_NIA);
+			if (likely(hva)) {
+				ARM9_RunBlock(BBCache_Get(hva, ARM_NIA));
+			} else {
+				ARM9_Step32();
+			}
+		}
+	}
+}
+#else
+/*
+ * -----------------------------------------------------------------
+ * Threaded version of ARM9_RunBlock inside of the main loop. Every
+ * dispatch slot has a handler which calls the proc of the entry and
+ * jumps to the handler of the next entry, so every call and every
+ * jump has its own site. Leaving the block goes back to the loop.
+ * -----------------------------------------------------------------
+ */
+#define ARM_BLOCK_NEXT \
+	CycleCounter += 2; \
+	gcpu.batch_cycles -= 2; \
+	ICODE = entry->icode; \
+	nia += 4; \
+	ARM_NIA = nia; \
+	debug_print_instruction(ICODE); \
+	goto *labels[entry->slot];
+
+#define ARM_BLOCK_HANDLER(n) \
+	DISPATCH_LABEL(n): \
+	entry->proc(); \
+	entry++; \
+	if (unlikely((ARM_NIA != nia) || gcpu.signals || (entry == end) \
+		     || (gcpu.batch_cycles <= 0))) { \
+		goto block_end; \
+	} \
+	ARM_BLOCK_NEXT
 
-#if VERBOSE
-		fprintf(stdout, "CIA %08x\n", ARM_GET_CIA);
+static void
+ARM9_Loop32(void)
+{
+	static const void *const labels[DISPATCH_SLOTS] = DISPATCH_LABELS;
+	BBCache_Block_t *blk;
+	BBCache_Entry_t *entry;
+	BBCache_Entry_t *end;
+	uint32_t nia;
+	uint8_t *hva;
+	/* Exceptions use goto (longjmp) */
+	setjmp(gcpu.abort_jump);
+	while (1) {
+		ARM9_Sync();
+		while (gcpu.batch_cycles > 0) {
+			CheckSignals();
+			hva = MMU_IFetchHVA(ARM_NIA);
+			if (unlikely(!hva)) {
+				ARM9_Step32();
+				continue;
+			}
+			blk = BBCache_Get(hva, ARM_NIA);
+			entry = blk->entry;
+			end = blk->entry + blk->ninstr;
+			nia = ARM_NIA;
+			ARM_BLOCK_NEXT
+ block_end:
+			;
+		}
+	}
+	DISPATCH_HANDLERS(ARM_BLOCK_HANDLER)
+}
 #endif
-		CheckSignals();
-		ICODE = MMU_IFetch(ARM_NIA);
-		ARM_NIA += 4;
-		iproc = InstructionProcFind(ICODE);
-		debug_print_instruction(ICODE);
-		iproc();
 
-#if VERBOSE
-		fprintf(stdout, "CIA %08x\n", ARM_GET_CIA);
-		fflush(stdout);
-#endif
-		CheckSignals();
-		ICODE = MMU_IFetch(ARM_NIA);
-		ARM_NIA += 4;
-		iproc = InstructionProcFind(ICODE);
-		debug_print_instruction(ICODE);
-		iproc();
-	}
+/*
+ * -----------------------------------------------------
+ * The registers were restored from a snapshot
+ * -----------------------------------------------------
+ */
+static void
+arm_restored(void *clientData)
+{
+	ARM9 *arm = clientData;
+	arm->synced_cycles = CycleCounter;
+	arm->batch_cycles = 0;
+	fprintf(stderr, "ARM registers restored, PC %08x\n", ARM_NIA);
+}
+
+/*
+ * -----------------------------------------------------
+ * Address of the next instruction for the profiler.
+ * Every main loop ends its batch at the instruction
+ * reaching the horizon, so the sample timer fires right
+ * after the instruction executed at the sampled cycle.
+ * -----------------------------------------------------
+ */
+static uint32_t
+profiler_get_pc(void *clientData)
+{
+	return ARM_NIA;
+}
+
+/*
+ * -----------------------------------------------------
+ * The decoder tables are shared by the CPUs of all
+ * machines in the process. They are read only after
+ * initialization.
+ * -----------------------------------------------------
+ */
+static void
+init_decoders(void)
+{
+	IDecoder_New();
+	InitInstructions();
+	ThumbDecoder_New();
 }
 
 /*
@@ -881,6 +1058,7 @@ ARM9_Loop32(void)
 static Device_MPU_t *
 create(void)
 {
+	static uv_once_t decoders_once = UV_ONCE_INIT;
 	uint32_t cpu_clock = 200000000;
 	int i;
 	const char *instancename = "arm";
@@ -890,13 +1068,13 @@ create(void)
 	Config_ReadUInt32(&cpu_clock, "global", "cpu_clock");
 	fprintf(stderr, "Creating ARM9 CPU with clock %d HZ\n", cpu_clock);
 	memset(arm, 0, sizeof(ARM9));
-	IDecoder_New();
+	uv_once(&decoders_once, init_decoders);
+	BBCache_Init();
 	ARM9_InitRegs(&gcpu);
-	InitInstructions();
-	ThumbDecoder_New();
 	SET_REG_CPSR(MODE_SVC | FLAG_F | FLAG_I);
 	GlobalClock_Registor(&run, dev, cpu_clock);
 	CycleTimers_Init(instancename, cpu_clock);
+	CycleTimers_SetHorizonProc(horizon_cut, arm);
 	CycleTimer_Add(&htimer, 285000000, hello_proc, NULL);
 	arm->irqNode = SigNode_New("%s.irq", instancename);
 	arm->fiqNode = SigNode_New("%s.fiq", instancename);
@@ -917,7 +1095,13 @@ create(void)
 	arm->dbgops.get_bkpt_ins = debugger_get_bkpt_ins;
 	arm->debugger = Debugger_New(&arm->dbgops, arm);
 	gcpu.signal_mask |= ARM_SIG_RESTART_IDEC | ARM_SIG_DEBUGMODE;
-	ARM_ThrottleInit(arm);
+	arm->throttle = Throttle_New(instancename);
+	MMU_ArmInit("mmu");
+	/* The register block from registers to reg_dummy contains no pointers */
+	Snapshot_RegisterState("arm.registers", arm->registers,
+			       offsetof(ARM9, reg_dummy) - offsetof(ARM9, registers),
+			       arm_restored, arm);
+	Profiler_RegisterCpu(instancename, profiler_get_pc, arm);
 	for (i = 0; i < 16; i++) {
 		char regname[10];
 		uint32_t value;
@@ -936,6 +1120,7 @@ run(GlobalClock_LocalClock_t *clk, void *data)
 	uint32_t addr = 0;
 	uint32_t dbgwait;
 	arm->clk = clk;
+	arm->synced_cycles = CycleCounter;
 	if (Config_ReadUInt32(&addr, "global", "start_address") < 0) {
 		addr = 0;
 	}
@@ -950,18 +1135,17 @@ run(GlobalClock_LocalClock_t *clk, void *data)
 		fprintf(stderr, "Starting CPU at %08x\n", addr);
 	}
 	gettimeofday(&gcpu.starttime, NULL);
-	ARM_NIA = addr;
+	if (!Snapshot_IsRestored()) {
+		ARM_NIA = addr;
+	}
 	/* A long jump to this label redecides which main loop is used  */
 	setjmp(gcpu.restart_idec_jump);
 	gcpu.signals &= ~ARM_SIG_RESTART_IDEC;
 	gcpu.signals_raw &= ~ARM_SIG_RESTART_IDEC;
 	while (1) {
 		if (unlikely(gcpu.dbg_state == DBG_STATE_STOPPED)) {
-			struct timespec tout;
-			tout.tv_nsec = 0;
-			tout.tv_sec = 10000;
-			// FIXME: FIO_WaitEventTimeout(&tout);
-			sleep(1);
+			/* The debugger is served by the callbacks of the machine */
+			AsyncManager_WaitMachine(1000);
 		} else {
 			if (REG_CPSR & FLAG_T) {
 				Thumb_Loop();
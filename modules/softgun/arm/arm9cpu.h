@@ -11,6 +11,7 @@
 #include "signode.h"
 #include "cycletimer.h"
 #include "globalclock.h"
+#include "throttle.h"
 /*
  * ------------------------------------------------------
  * ARM9_RegPointerSet
@@ -40,8 +41,8 @@ typedef struct ARM9_RegPointerSet {
 } ARM9_RegPointerSet;
 
 extern uint64_t cpu_cyclecounter;
-extern uint32_t mmu_vector_base;
-extern uint32_t do_alignment_check;
+extern __MACHINE_LOCAL__ uint32_t mmu_vector_base;
+extern __MACHINE_LOCAL__ uint32_t do_alignment_check;
 
 #define MODE_USER 	(0x10)
 #define MODE_FIQ  	(0x11)
@@ -159,13 +160,13 @@ typedef struct ARM9 {
 	DebugBackendOps dbgops;
 
 	/* Throttling cpu to real speed */
-	struct timespec tv_last_throttle;
-	CycleCounter_t last_throttle_cycles;
-	CycleTimer throttle_timer;
-	int64_t cycles_ahead;	/* Number of cycles ahead of real cpu */
+	Throttle *throttle;
 
 	uint32_t cpuArchitecture;
 	GlobalClock_LocalClock_t *clk;
+	/* Instruction batch up to the next event */
+	CycleCounter_t synced_cycles;	/* CycleCounter at the last GlobalClock sync */
+	int64_t batch_cycles;	/* Cycles left until the event horizon */
 } ARM9;
 
 #define ARCH_ARMV5		(0)
@@ -177,7 +178,7 @@ typedef struct ARM9 {
 #define DBG_STATE_STOPPED	(2)
 #define DBG_STATE_STEP		(3)
 #define DBG_STATE_BREAK		(4)
-extern ARM9 gcpu;
+extern __MACHINE_LOCAL__ ARM9 gcpu;
 
 /*
  * Bit in field cpu_signals
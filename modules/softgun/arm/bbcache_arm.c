@@ -0,0 +1,311 @@
+//===-- arm/bbcache_arm.c -----------------------------------------*- C -*-===//
+//
+//              The Leigun Embedded System Simulator Platform : modules
+//
+// Licensed under the Apache License, Version 2.0 (the "License");
+// you may not use this file except in compliance with the License.
+// You may obtain a copy of the License at
+//
+//     http://www.apache.org/licenses/LICENSE-2.0
+//
+// Unless required by applicable law or agreed to in writing, software
+// distributed under the License is distributed on an "AS IS" BASIS,
+// WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+// See the License for the specific language governing permissions and
+// limitations under the License.
+//
+//===----------------------------------------------------------------------===//
+///
+/// @file
+/// Basic block cache of predecoded ARM instructions
+///
+//===----------------------------------------------------------------------===//
+
+//==============================================================================
+//= Dependencies
+//==============================================================================
+// Main Module Header
+#include "bbcache_arm.h"
+
+// Local/Private Headers
+#include "arm9cpu.h"
+#include "idecode_arm.h"
+#include "mmu_arm.h"
+
+// Leigun Core Headers
+#include "bus.h"
+#include "sgstring.h"
+
+// External headers
+
+// System headers
+#include <stdint.h>
+
+
+//==============================================================================
+//= Constants(also Enumerations)
+//==============================================================================
+#define BBCACHE_BLOCKS		(8192)
+#define BBCACHE_PAGES		(4096)
+#define PAGE_HASH_SIZE		(1024)
+#define PAGE_HASH_INDEX(hva)	((((uintptr_t)(hva)) >> 10) & (PAGE_HASH_SIZE - 1))
+
+
+//==============================================================================
+//= Types
+//==============================================================================
+/*
+ * A 1kB page which contains at least one cached block.
+ * Writes to it have to drop the blocks.
+ */
+typedef struct BBCache_Page_s {
+	struct BBCache_Page_s *hash_next;
+	uint8_t *hva_page;
+	BBCache_Block_t *first_block;
+} BBCache_Page_t;
+
+
+//==============================================================================
+//= Variables
+//==============================================================================
+__MACHINE_LOCAL__ BBCache_Block_t **bbcacheHash;
+
+static __MACHINE_LOCAL__ struct {
+	BBCache_Block_t *blocks;
+	uint32_t blocks_used;
+	BBCache_Page_t *pages;
+	uint32_t pages_used;
+	BBCache_Page_t **page_hash;
+} bbcache;
+
+
+//==============================================================================
+//= Function definitions(static)
+//==============================================================================
+static BBCache_Page_t *
+find_page(uint8_t * hva_page)
+{
+	BBCache_Page_t *page = bbcache.page_hash[PAGE_HASH_INDEX(hva_page)];
+	while (page) {
+		if (page->hva_page == hva_page) {
+			return page;
+		}
+		page = page->hash_next;
+	}
+	return NULL;
+}
+
+/*
+ * -------------------------------------------------------------------
+ * Get the page descriptor for a new block. When the page becomes a
+ * code page the data TLB entries pointing to it are dropped, so the
+ * next write to it takes the slow path and reaches the cache.
+ * -------------------------------------------------------------------
+ */
+static BBCache_Page_t *
+get_page(uint8_t * hva_page)
+{
+	BBCache_Page_t *page = find_page(hva_page);
+	if (page) {
+		return page;
+	}
+	page = &bbcache.pages[bbcache.pages_used++];
+	page->hva_page = hva_page;
+	page->first_block = NULL;
+	page->hash_next = bbcache.page_hash[PAGE_HASH_INDEX(hva_page)];
+	bbcache.page_hash[PAGE_HASH_INDEX(hva_page)] = page;
+	MMU_InvalidateWriteHva(hva_page);
+	return page;
+}
+
+static void
+unlink_block(BBCache_Block_t * blk)
+{
+	BBCache_Block_t **prev = &bbcacheHash[BBCACHE_HASH_INDEX(blk->hva)];
+	while (*prev) {
+		if (*prev == blk) {
+			*prev = blk->hash_next;
+			return;
+		}
+		prev = &(*prev)->hash_next;
+	}
+}
+
+/*
+ * ----------------------------------------------------------------
+ * A block ends at the page end or after an instruction which
+ * always leaves the straight line (B, BL, SWI with condition AL).
+ * Other branches are detected while executing the block.
+ * ----------------------------------------------------------------
+ */
+static inline bool
+ends_block(uint32_t icode)
+{
+	if ((icode & 0xfe000000) == 0xea000000) {
+		return true;
+	}
+	if ((icode & 0xff000000) == 0xef000000) {
+		return true;
+	}
+	return false;
+}
+
+/*
+ * -------------------------------------------------------------------
+ * Clear only the hash buckets which are in use. Guests invalidate
+ * the instruction cache line by line, so most flushes find only a
+ * few blocks decoded since the previous one.
+ * -------------------------------------------------------------------
+ */
+static void
+flush_all(void)
+{
+	uint32_t i;
+	for (i = 0; i < bbcache.blocks_used; i++) {
+		bbcacheHash[BBCACHE_HASH_INDEX(bbcache.blocks[i].hva)] = NULL;
+	}
+	for (i = 0; i < bbcache.pages_used; i++) {
+		bbcache.page_hash[PAGE_HASH_INDEX(bbcache.pages[i].hva_page)] = NULL;
+	}
+	bbcache.blocks_used = 0;
+	bbcache.pages_used = 0;
+}
+
+
+//==============================================================================
+//= Function definitions(global)
+//==============================================================================
+void
+BBCache_Init(void)
+{
+	bbcacheHash = sg_calloc(sizeof(BBCache_Block_t *) * BBCACHE_HASH_SIZE);
+	bbcache.page_hash = sg_calloc(sizeof(BBCache_Page_t *) * PAGE_HASH_SIZE);
+	bbcache.blocks = sg_calloc(sizeof(BBCache_Block_t) * BBCACHE_BLOCKS);
+	bbcache.pages = sg_calloc(sizeof(BBCache_Page_t) * BBCACHE_PAGES);
+	bbcache.blocks_used = 0;
+	bbcache.pages_used = 0;
+	Bus_SetHostWriteProc(BBCache_InvalidateRange);
+}
+
+/*
+ * ------------------------------------------------------------------
+ * Decode a new block starting at hva. va is only used for finding
+ * the position within the 1kB page.
+ * ------------------------------------------------------------------
+ */
+BBCache_Block_t *
+BBCache_Translate(uint8_t * hva, uint32_t va)
+{
+	BBCache_Block_t *blk;
+	BBCache_Page_t *page;
+	uint8_t *hva_page = hva - (va & BBCACHE_PAGE_MASK);
+	uint32_t room = (BBCACHE_PAGE_MASK + 1 - (va & BBCACHE_PAGE_MASK)) >> 2;
+	uint32_t i;
+
+	if (unlikely((bbcache.blocks_used == BBCACHE_BLOCKS)
+		     || (bbcache.pages_used == BBCACHE_PAGES))) {
+		flush_all();
+	}
+	page = get_page(hva_page);
+	blk = &bbcache.blocks[bbcache.blocks_used++];
+	blk->hva = hva;
+	if (room > BBCACHE_MAX_INSTR) {
+		room = BBCACHE_MAX_INSTR;
+	}
+	for (i = 0; i < room; i++) {
+		uint32_t icode = HMemRead32(hva + (i << 2));
+		blk->entry[i].icode = icode;
+		blk->entry[i].proc = InstructionProcFind(icode);
+#ifdef LEIGUN_THREADED_DISPATCH
+		blk->entry[i].slot = InstructionSlotFind(icode);
+#endif
+		if (ends_block(icode)) {
+			i++;
+			break;
+		}
+	}
+	blk->ninstr = i;
+	blk->page_next = page->first_block;
+	page->first_block = blk;
+	blk->hash_next = bbcacheHash[BBCACHE_HASH_INDEX(hva)];
+	bbcacheHash[BBCACHE_HASH_INDEX(hva)] = blk;
+	return blk;
+}
+
+/*
+ * -------------------------------------------------------------------
+ * Drop all blocks on instruction cache invalidation. The running
+ * block is left through the restart of the instruction decoder.
+ * -------------------------------------------------------------------
+ */
+void
+BBCache_Flush(void)
+{
+	if (bbcache.blocks_used == 0) {
+		return;
+	}
+	flush_all();
+	ARM_PostRestartIdecoder();
+}
+
+bool
+BBCache_IsCodePage(uint8_t * hva_page)
+{
+	if (bbcache.pages_used == 0) {
+		return false;
+	}
+	return find_page(hva_page) != NULL;
+}
+
+/*
+ * -------------------------------------------------------------------
+ * Called from the data write slow path when a code page is written.
+ * The page descriptor stays allocated until the next flush but is
+ * removed from the lookup, so the page is writable at full speed
+ * again until code from it is executed the next time.
+ * -------------------------------------------------------------------
+ */
+void
+BBCache_InvalidatePage(uint8_t * hva_page)
+{
+	BBCache_Page_t **prev = &bbcache.page_hash[PAGE_HASH_INDEX(hva_page)];
+	BBCache_Page_t *page;
+	BBCache_Block_t *blk;
+	while ((page = *prev)) {
+		if (page->hva_page == hva_page) {
+			*prev = page->hash_next;
+			break;
+		}
+		prev = &page->hash_next;
+	}
+	if (!page) {
+		return;
+	}
+	for (blk = page->first_block; blk; blk = blk->page_next) {
+		unlink_block(blk);
+	}
+	page->first_block = NULL;
+	ARM_PostRestartIdecoder();
+}
+
+/*
+ * -------------------------------------------------------------------
+ * Called by the bus when another bus master (DMA) wrote host memory.
+ * These writes do not go through the data TLB, so the code pages
+ * they touch are looked up here. addr is the bus address of hva, it
+ * has the same offset in the page as the virtual address.
+ * -------------------------------------------------------------------
+ */
+void
+BBCache_InvalidateRange(uint8_t * hva, uint32_t addr, uint32_t count)
+{
+	uint8_t *hva_page = hva - (addr & BBCACHE_PAGE_MASK);
+	if ((bbcache.pages_used == 0) || (count == 0)) {
+		return;
+	}
+	for (; hva_page < hva + count; hva_page += BBCACHE_PAGE_MASK + 1) {
+		if (find_page(hva_page)) {
+			BBCache_InvalidatePage(hva_page);
+		}
+	}
+}
@@ -0,0 +1,120 @@
+//===-- arm/bbcache_arm.h -----------------------------------------*- C -*-===//
+//
+//              The Leigun Embedded System Simulator Platform : modules
+//
+// Licensed under the Apache License, Version 2.0 (the "License");
+// you may not use this file except in compliance with the License.
+// You may obtain a copy of the License at
+//
+//     http://www.apache.org/licenses/LICENSE-2.0
+//
+// Unless required by applicable law or agreed to in writing, software
+// distributed under the License is distributed on an "AS IS" BASIS,
+// WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+// See the License for the specific language governing permissions and
+// limitations under the License.
+//
+//===----------------------------------------------------------------------===//
+///
+/// @file
+/// Basic block cache of predecoded ARM instructions
+///
+/// Guest code is decoded once into a block of {instruction proc, icode}
+/// pairs. Blocks are indexed by the Host Virtual Address of their first
+/// instruction, so they survive TLB flushes and context switches. A block
+/// never crosses a 1kB page (the TLB granularity).
+///
+/// Pages containing cached code are write protected in the data TLB.
+/// The first write to such a page goes through the slow path, which
+/// drops all blocks of the page. Writes of DMA masters are reported by
+/// the bus and drop the blocks of the pages they touch. Instruction cache
+/// invalidation through CP15 flushes the whole cache.
+///
+//===----------------------------------------------------------------------===//
+#pragma once
+#ifdef __cplusplus
+extern "C" {
+#endif
+//==============================================================================
+//= Dependencies
+//==============================================================================
+// Local/Private Headers
+#include "idecode_arm.h"
+
+// Leigun Core Headers
+#include "compiler_extensions.h"
+
+// External headers
+
+// System headers
+#include <stdbool.h>
+#include <stdint.h>
+
+
+//==============================================================================
+//= Constants(also Enumerations)
+//==============================================================================
+#define BBCACHE_MAX_INSTR	(32)
+#define BBCACHE_PAGE_MASK	(0x3ff)
+#define BBCACHE_HASH_SIZE	(8192)
+#define BBCACHE_HASH_INDEX(hva)	((((uintptr_t)(hva)) >> 2) & (BBCACHE_HASH_SIZE - 1))
+
+
+//==============================================================================
+//= Types
+//==============================================================================
+typedef struct BBCache_Entry_s {
+	InstructionProc *proc;
+	uint32_t icode;
+#ifdef LEIGUN_THREADED_DISPATCH
+	uint16_t slot;		/* Dispatch slot of proc */
+#endif
+} BBCache_Entry_t;
+
+typedef struct BBCache_Block_s {
+	struct BBCache_Block_s *hash_next;
+	struct BBCache_Block_s *page_next;
+	uint8_t *hva;		/* Host virtual address of the first instruction */
+	uint32_t ninstr;
+	BBCache_Entry_t entry[BBCACHE_MAX_INSTR];
+} BBCache_Block_t;
+
+
+//==============================================================================
+//= Variables
+//==============================================================================
+extern __MACHINE_LOCAL__ BBCache_Block_t **bbcacheHash;
+
+
+//==============================================================================
+//= Functions
+//==============================================================================
+void BBCache_Init(void);
+BBCache_Block_t *BBCache_Translate(uint8_t * hva, uint32_t va);
+void BBCache_Flush(void);
+bool BBCache_IsCodePage(uint8_t * hva_page);
+void BBCache_InvalidatePage(uint8_t * hva_page);
+void BBCache_InvalidateRange(uint8_t * hva, uint32_t addr, uint32_t count);
+
+/*
+ * -----------------------------------------------------------------
+ * Find the block starting at a host address, decode it if it is
+ * not yet in the cache.
+ * -----------------------------------------------------------------
+ */
+static inline BBCache_Block_t *
+BBCache_Get(uint8_t * hva, uint32_t va)
+{
+	BBCache_Block_t *blk = bbcacheHash[BBCACHE_HASH_INDEX(hva)];
+	while (blk) {
+		if (likely(blk->hva == hva)) {
+			return blk;
+		}
+		blk = blk->hash_next;
+	}
+	return BBCache_Translate(hva, va);
+}
+
+#ifdef __cplusplus
+}
+#endif
@@ -51,6 +51,9 @@ typedef struct IDecoder {
 
 static Instruction *imem;
 InstructionProc **iProcTab;
+#ifdef LEIGUN_THREADED_DISPATCH
+Dispatch_Map armDispatch;
+#endif
 static IDecoder *idecoder;
 
 static int alloc_pointer = 0;
@@ -1747,6 +1750,10 @@ IDecoder_New()
 		}
 		iProcTab[i] = instr->proc;
 	}
+#ifdef LEIGUN_THREADED_DISPATCH
+	Dispatch_MapInit(&armDispatch, iProcTab, INSTR_INDEX_MAX + 1);
+	fprintf(stderr, "%u dispatch slots", armDispatch.nrSlots);
+#endif
 	fprintf(stderr, "\n");
 //      fprintf(stderr,"\nMedium Nr of Instructions %f\n",(float)sum/validcount);
 }
@@ -2,6 +2,9 @@
 #define IDECODE_H
 #include <stdint.h>
 #include <compiler_extensions.h>
+#ifdef LEIGUN_THREADED_DISPATCH
+#include "dispatch.h"
+#endif
 
 #define INSTR_INDEX(icode) ( (((icode)&0xfff00000)>>20) | (((icode) & 0xf0)<<8) )
 #define INSTR_UNINDEX(i) (((i)&0xfff)<<20 | ((((i)>>12)&0xf)<<4) )
@@ -15,6 +18,9 @@
 struct ARM9;
 typedef void InstructionProc(void);
 extern InstructionProc **iProcTab;
+#ifdef LEIGUN_THREADED_DISPATCH
+extern Dispatch_Map armDispatch;
+#endif
 
 typedef struct Instruction {
 	uint32_t mask;
@@ -34,4 +40,12 @@ InstructionProcFind(uint32_t icode)
 	InstructionProc *proc = iProcTab[index];
 	return proc;
 }
+
+#ifdef LEIGUN_THREADED_DISPATCH
+static __DISPATCH_INLINE__ unsigned int
+InstructionSlotFind(uint32_t icode)
+{
+	return armDispatch.slot[INSTR_INDEX(icode)];
+}
+#endif
 #endif
@@ -7,9 +7,11 @@
 #include <sys/types.h>
 
 #include "arm9cpu.h"
+#include "bbcache_arm.h"
 #include "cycletimer.h"
 //#include "mmu.h"
 #include "bus.h"
+#include "mmu_arm.h"
 #include "compiler_extensions.h"
 #include "sgstring.h"
 
@@ -576,7 +578,7 @@ pa_read(void *clientData, uint32_t icode)
 static void
 invinstcache_write(void *clientData, uint32_t icode, uint32_t value)
 {
-
+	BBCache_Flush();
 }
 
 static uint32_t
@@ -588,7 +590,7 @@ invinstcache_read(void *clientData, uint32_t icode)
 static void
 invinstcachelnmva_write(void *clientData, uint32_t icode, uint32_t value)
 {
-
+	BBCache_Flush();
 }
 
 static uint32_t
@@ -940,7 +942,7 @@ invitlbunlckd_read(void *clientData, uint32_t icode)
 static void
 invitlbunlckd_write(void *clientData, uint32_t icode, uint32_t value)
 {
-
+	MMU_InvalidateTlb();
 }
 
 static uint32_t
@@ -953,7 +955,8 @@ invitlbmva_read(void *clientData, uint32_t icode)
 static void
 invitlbmva_write(void *clientData, uint32_t icode, uint32_t value)
 {
-
+	/* Bits 0 - 7 are the ASID */
+	MMU_InvalidateTlbMva(value & 0xfffff000);
 }
 
 static uint32_t
@@ -966,7 +969,8 @@ invitlbasid_read(void *clientData, uint32_t icode)
 static void
 invitlbasid_write(void *clientData, uint32_t icode, uint32_t value)
 {
-
+	/* The TLB is tagged with the CPU mode only */
+	MMU_InvalidateTlb();
 }
 
 static uint32_t
@@ -979,7 +983,7 @@ invdtlbunlckd_read(void *clientData, uint32_t icode)
 static void
 invdtlbunlckd_write(void *clientData, uint32_t icode, uint32_t value)
 {
-
+	MMU_InvalidateTlb();
 }
 
 static uint32_t
@@ -992,7 +996,8 @@ invdtlbmva_read(void *clientData, uint32_t icode)
 static void
 invdtlbmva_write(void *clientData, uint32_t icode, uint32_t value)
 {
-
+	/* Bits 0 - 7 are the ASID */
+	MMU_InvalidateTlbMva(value & 0xfffff000);
 }
 
 static uint32_t
@@ -1005,7 +1010,8 @@ invdtlbasid_read(void *clientData, uint32_t icode)
 static void
 invdtlbasid_write(void *clientData, uint32_t icode, uint32_t value)
 {
-
+	/* The TLB is tagged with the CPU mode only */
+	MMU_InvalidateTlb();
 }
 
 static uint32_t
@@ -1018,7 +1024,7 @@ invutlbunlckd_read(void *clientData, uint32_t icode)
 static void
 invutlbunlckd_write(void *clientData, uint32_t icode, uint32_t value)
 {
-
+	MMU_InvalidateTlb();
 }
 
 static uint32_t
@@ -1031,7 +1037,8 @@ invutlbmva_read(void *clientData, uint32_t icode)
 static void
 invutlbmva_write(void *clientData, uint32_t icode, uint32_t value)
 {
-
+	/* Bits 0 - 7 are the ASID */
+	MMU_InvalidateTlbMva(value & 0xfffff000);
 }
 
 static uint32_t
@@ -1044,7 +1051,8 @@ invutlbasid_read(void *clientData, uint32_t icode)
 static void
 invutlbasid_write(void *clientData, uint32_t icode, uint32_t value)
 {
-
+	/* The TLB is tagged with the CPU mode only */
+	MMU_InvalidateTlb();
 }
 
 static uint32_t
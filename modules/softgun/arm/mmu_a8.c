@@ -1,5 +1,7 @@
 #include <stdint.h>
 #include <stdbool.h>
+#include "arm9cpu.h"
+#include "mmu_arm.h"
 #define CR(crn,op1,crm,op2)     (((crn) << 12) | ((op1) << 8) | ((crm) << 4) | (op2))
 typedef void McrProc(void *clientData, uint32_t icode, uint32_t value);
 typedef uint32_t MrcProc(void *clientData, uint32_t icode);
@@ -22,6 +24,19 @@ mainIdMrc(void *clientData, uint32_t icode)
 	return 0x413FC082;
 }
 
+static void
+invTlbMcr(void *clientData, uint32_t icode, uint32_t value)
+{
+	MMU_InvalidateTlb();
+}
+
+static void
+invTlbMvaMcr(void *clientData, uint32_t icode, uint32_t value)
+{
+	/* Bits 0 - 7 are the ASID */
+	MMU_InvalidateTlbMva(value & 0xfffff000);
+}
+
 static ControlReg controlReg[] = {
 	{
 	 .name = "Main ID",
@@ -509,6 +524,7 @@ static ControlReg controlReg[] = {
 	 .op1 = 0,
 	 .crm = 5,
 	 .op2 = 0,
+	 .mcrProc = invTlbMcr,
 	 },
 	{
 	 .name = "Invalidate ITLB entry by MVA",
@@ -516,6 +532,7 @@ static ControlReg controlReg[] = {
 	 .op1 = 0,
 	 .crm = 5,
 	 .op2 = 1,
+	 .mcrProc = invTlbMvaMcr,
 	 },
 	{
 	 .name = "Invalidate Instruction TLB entry on ASID match",
@@ -523,6 +540,7 @@ static ControlReg controlReg[] = {
 	 .op1 = 0,
 	 .crm = 5,
 	 .op2 = 2,
+	 .mcrProc = invTlbMcr,
 	 },
 	{
 	 .name = "Invalidate DTLB unlocked entries",
@@ -530,6 +548,7 @@ static ControlReg controlReg[] = {
 	 .op1 = 0,
 	 .crm = 6,
 	 .op2 = 0,
+	 .mcrProc = invTlbMcr,
 	 },
 	{
 	 .name = "Invalidate DTLB entry by MVA",
@@ -537,6 +556,7 @@ static ControlReg controlReg[] = {
 	 .op1 = 0,
 	 .crm = 6,
 	 .op2 = 1,
+	 .mcrProc = invTlbMvaMcr,
 	 },
 	{
 	 .name = "Invaildate DTLB entry on ASID match",
@@ -544,6 +564,7 @@ static ControlReg controlReg[] = {
 	 .op1 = 0,
 	 .crm = 6,
 	 .op2 = 2,
+	 .mcrProc = invTlbMcr,
 	 },
 	{
 	 .name = "Invalidate unified TLB unlocked entries",
@@ -551,6 +572,7 @@ static ControlReg controlReg[] = {
 	 .op1 = 0,
 	 .crm = 7,
 	 .op2 = 0,
+	 .mcrProc = invTlbMcr,
 	 },
 	{
 	 .name = "Invalidate unified TLB entry by MVA",
@@ -558,6 +580,7 @@ static ControlReg controlReg[] = {
 	 .op1 = 0,
 	 .crm = 7,
 	 .op2 = 1,
+	 .mcrProc = invTlbMvaMcr,
 	 },
 	{
 	 .name = "Invalidate unified TLB entry on ASID match",
@@ -565,6 +588,7 @@ static ControlReg controlReg[] = {
 	 .op1 = 0,
 	 .crm = 7,
 	 .op2 = 2,
+	 .mcrProc = invTlbMcr,
 	 },
 	{
 	 .name = "Performance Monitor Control",
@@ -41,10 +41,13 @@
 #include <sys/types.h>
 
 #include "arm9cpu.h"
+#include "bbcache_arm.h"
 #include "cycletimer.h"
 #include "mmu_arm.h"
 #include "bus.h"
 #include "compiler_extensions.h"
+#include "configfile.h"
+#include "debugvars.h"
 #include "sgstring.h"
 
 #ifdef DEBUG
@@ -53,57 +56,179 @@
 #define dbgprintf(...)
 #endif
 
+#define SECTLB_SIZE	(64)
+#define SECTLB_INDEX(addr)	(((addr) >> 20) & (SECTLB_SIZE - 1))
+#define SECTION_MASK	(0xfffff)
+#define TLB_SETS_DEFAULT	(256)
+
 /* Enter a Physical address to the Tlb */
-TlbEntry tlbe_read;
-TlbEntry tlbe_write;
-TlbEntry tlbe_ifetch;
-STlbEntry stlb_ifetch[STLB_SIZE];
-STlbEntry stlb_read[STLB_SIZE];
-STlbEntry stlb_write[STLB_SIZE];
-uint32_t stlb_version;
+__MACHINE_LOCAL__ TlbEntry tlbe_read;
+__MACHINE_LOCAL__ TlbEntry tlbe_write;
+__MACHINE_LOCAL__ TlbEntry tlbe_ifetch;
+__MACHINE_LOCAL__ STlbEntry *stlb_ifetch;
+__MACHINE_LOCAL__ STlbEntry *stlb_read;
+__MACHINE_LOCAL__ STlbEntry *stlb_write;
+__MACHINE_LOCAL__ uint32_t stlb_set_mask;
+__MACHINE_LOCAL__ uint32_t stlb_version = 1;
+__MACHINE_LOCAL__ uint64_t stlb_hits;
+
+/*
+ * ----------------------------------------------------------------
+ * Sections mapping contiguous host memory are cached in a
+ * direct mapped table with 1MB entries. Only for reads and
+ * instruction fetches, writes have to see the traced pages and
+ * the code pages of the basic block cache at page granularity.
+ * ----------------------------------------------------------------
+ */
+static __MACHINE_LOCAL__ STlbEntry sectlb_ifetch[SECTLB_SIZE];
+static __MACHINE_LOCAL__ STlbEntry sectlb_read[SECTLB_SIZE];
+static __MACHINE_LOCAL__ uint32_t stlb_victim;
+static __MACHINE_LOCAL__ uint32_t stlb_sets;
+static __MACHINE_LOCAL__ uint64_t sectlb_hits;
+static __MACHINE_LOCAL__ uint64_t tlb_walks;
 
 static void
 stlb_init(void)
 {
-	int i;
-	for (i = 0; i < STLB_SIZE; i++) {
+	uint32_t i;
+	for (i = 0; i < stlb_sets * STLB_WAYS; i++) {
 		stlb_ifetch[i].version = 0;
 		stlb_read[i].version = 0;
 		stlb_write[i].version = 0;
 	}
+	for (i = 0; i < SECTLB_SIZE; i++) {
+		sectlb_ifetch[i].version = 0;
+		sectlb_read[i].version = 0;
+	}
+}
+
+/*
+ * ---------------------------------------------------------------
+ * The part of the page which is mapped by one block of host
+ * memory. Pages are never larger than a host block in the TLB.
+ * ---------------------------------------------------------------
+ */
+static inline uint32_t
+host_mask(uint8_t ** map, uint32_t pa)
+{
+	if (map[pa >> MEM_MAP_SHIFT]) {
+		return MEM_MAP_BLOCKMASK;
+	} else {
+		return twoLevelMMap.scnd_lvl_blockmask;
+	}
+}
+
+/*
+ * ---------------------------------------------------------------
+ * Check if a section is one contiguous piece of host memory 
+ * ---------------------------------------------------------------
+ */
+static bool
+section_is_contiguous(uint32_t pa, uint8_t * hva)
+{
+	uint32_t pa_base = pa & ~SECTION_MASK;
+	uint8_t *hva_base = hva - (pa & SECTION_MASK);
+	uint32_t ofs;
+	for (ofs = 0; ofs <= SECTION_MASK; ofs += Mem_SmallPageSize()) {
+		if (Bus_GetHVARead(pa_base + ofs) != hva_base + ofs) {
+			return false;
+		}
+	}
+	return true;
+}
+
+/*
+ * ---------------------------------------------------------------
+ * Find a way in the set of va. Prefer a free way, else replace
+ * round robin.
+ * ---------------------------------------------------------------
+ */
+static STlbEntry *
+stlb_victim_way(STlbEntry * stlb, uint32_t va)
+{
+	STlbEntry *set = stlb + STLB_SET(va) * STLB_WAYS;
+	int i;
+	for (i = 0; i < STLB_WAYS; i++) {
+		if ((set[i].version != stlb_version) || (set[i].cpu_mode == ~0U)) {
+			return &set[i];
+		}
+	}
+	stlb_victim++;
+	return &set[stlb_victim & (STLB_WAYS - 1)];
 }
 
 /*
  * -------------------------------------------------------
  * enter_hva_to_both_tlbe
  *
- * Enter HVAs to the first and second level TLB Cache
+ * Enter HVAs to the first and second level TLB Cache.
+ * Sections go to the section table if the host memory
+ * is contiguous.
  * -------------------------------------------------------
  */
-void
-enter_hva_to_both_tlbe_read(uint32_t va, uint8_t * hva)
+static uint8_t *
+enter_hva_to_both_tlbe(TlbEntry * tlbe, STlbEntry * stlb, STlbEntry * sectlb,
+		       uint32_t va, uint32_t pa, uint32_t page_mask, uint8_t * hva)
 {
 	STlbEntry *stlbe;
-	int index = STLB_INDEX(va);
-	stlbe = stlb_read + index;
-	tlbe_read.hva = stlbe->hva = hva - (va & 0x3ff);
-	tlbe_read.va = stlbe->va = va & 0xfffffc00;
-	tlbe_read.cpu_mode = stlbe->cpu_mode = ARM_SIGNALING_MODE;
+	uint32_t mask;
+	if ((page_mask == SECTION_MASK) && section_is_contiguous(pa, hva)) {
+		stlbe = &sectlb[SECTLB_INDEX(va)];
+		mask = SECTION_MASK;
+	} else {
+		mask = page_mask & host_mask(mem_map_read, pa) & 0xfff;
+		stlbe = stlb_victim_way(stlb, va);
+	}
+	stlbe->hva = hva - (va & mask);
+	stlbe->va = va & ~mask;
+	stlbe->mask = mask;
+	stlbe->cpu_mode = ARM_SIGNALING_MODE;
 	stlbe->version = stlb_version;
+	return tlbe_enter_stlbe(tlbe, stlbe, va);
 }
 
-void
-enter_hva_to_both_tlbe_write(uint32_t va, uint8_t * hva)
+static void
+enter_hva_to_both_tlbe_write(uint32_t va, uint32_t pa, uint32_t page_mask, uint8_t * hva)
 {
 	STlbEntry *stlbe;
-	int index = STLB_INDEX(va);
-	stlbe = stlb_write + index;
-	tlbe_write.hva = stlbe->hva = hva - (va & 0x3ff);
-	tlbe_write.va = stlbe->va = va & 0xfffffc00;
+	uint32_t mask = page_mask & host_mask(mem_map_write, pa) & 0xfff;
+	uint8_t *hva_page = hva - (va & BBCACHE_PAGE_MASK);
+	uint32_t ofs;
+	if (unlikely(BBCache_IsCodePage(hva_page))) {
+		BBCache_InvalidatePage(hva_page);
+	}
+	/* Other code pages in the page have to stay write protected */
+	for (ofs = 0; ofs <= mask; ofs += BBCACHE_PAGE_MASK + 1) {
+		if (unlikely(BBCache_IsCodePage(hva - (va & mask) + ofs))) {
+			mask = BBCACHE_PAGE_MASK;
+			break;
+		}
+	}
+	stlbe = stlb_victim_way(stlb_write, va);
+	tlbe_write.hva = stlbe->hva = hva - (va & mask);
+	tlbe_write.va = stlbe->va = va & ~mask;
+	tlbe_write.mask = stlbe->mask = mask;
 	tlbe_write.cpu_mode = stlbe->cpu_mode = ARM_SIGNALING_MODE;
 	stlbe->version = stlb_version;
 }
 
+/*
+ * -------------------------------------------------------
+ * Second chance for a miss in the set associative TLB
+ * -------------------------------------------------------
+ */
+static inline uint8_t *
+sectlb_match(TlbEntry * tlbe, STlbEntry * sectlb, uint32_t addr)
+{
+	STlbEntry *stlbe = &sectlb[SECTLB_INDEX(addr)];
+	if ((stlbe->version == stlb_version) &&
+	    ((addr & ~SECTION_MASK) == stlbe->va) && (stlbe->cpu_mode == ARM_SIGNALING_MODE)) {
+		sectlb_hits++;
+		return tlbe_enter_stlbe(tlbe, stlbe, addr);
+	}
+	return NULL;
+}
+
 /*
  * -----------------------------------------
  * First level tlb  Physical address
@@ -115,6 +240,7 @@ enter_pa_to_tlbe_read(uint32_t va, uint32_t pa)
 {
 	tlbe_read.va = va & 0xfffffc00;
 	tlbe_read.pa = pa & 0xfffffc00;
+	tlbe_read.mask = 0x3ff;
 	tlbe_read.cpu_mode = ARM_SIGNALING_MODE;
 	tlbe_read.hva = NULL;
 }
@@ -124,25 +250,11 @@ enter_pa_to_tlbe_write(uint32_t va, uint32_t pa)
 {
 	tlbe_write.va = va & 0xfffffc00;
 	tlbe_write.pa = pa & 0xfffffc00;
+	tlbe_write.mask = 0x3ff;
 	tlbe_write.cpu_mode = ARM_SIGNALING_MODE;
 	tlbe_write.hva = NULL;
 }
 
-/*
- * ---------------------------------------------------------------
- * Enter the Virtual address of the Host System to into
- * the tlb (HVA)
- * ---------------------------------------------------------------
- */
-
-static inline void
-enter_hva_to_tlbe_write(uint32_t va, uint8_t * hva)
-{
-	tlbe_write.va = va & 0xfffffc00;
-	tlbe_write.hva = hva - (va & 0x3ff);
-	tlbe_write.cpu_mode = ARM_SIGNALING_MODE;
-}
-
 static inline void
 invalidate_stlb()
 {
@@ -162,6 +274,17 @@ invalidate_tlb()
 	invalidate_stlb();
 }
 
+static void
+invalidate_stlb_mva(STlbEntry * stlbe, int n, uint32_t va)
+{
+	int i;
+	for (i = 0; i < n; i++, stlbe++) {
+		if ((va & ~stlbe->mask) == stlbe->va) {
+			stlbe->cpu_mode = ~0;
+		}
+	}
+}
+
 /*
  * -------------------------------------------------------------------
  * Invalidate TLB
@@ -174,6 +297,100 @@ MMU_InvalidateTlb()
 	invalidate_tlb();
 }
 
+/*
+ * -------------------------------------------------------------------
+ * Invalidate the entries for one modified virtual address 
+ * in all CPU modes. The other entries stay valid. 
+ * -------------------------------------------------------------------
+ */
+void
+MMU_InvalidateTlbMva(uint32_t va)
+{
+	if (!stlb_sets) {
+		return;
+	}
+	tlbe_ifetch.cpu_mode = ~0;
+	tlbe_write.cpu_mode = ~0;
+	tlbe_read.cpu_mode = ~0;
+	invalidate_stlb_mva(stlb_ifetch + STLB_SET(va) * STLB_WAYS, STLB_WAYS, va);
+	invalidate_stlb_mva(stlb_read + STLB_SET(va) * STLB_WAYS, STLB_WAYS, va);
+	invalidate_stlb_mva(stlb_write + STLB_SET(va) * STLB_WAYS, STLB_WAYS, va);
+	invalidate_stlb_mva(&sectlb_ifetch[SECTLB_INDEX(va)], 1, va);
+	invalidate_stlb_mva(&sectlb_read[SECTLB_INDEX(va)], 1, va);
+}
+
+/*
+ * -------------------------------------------------------------------
+ * Drop the write TLB entries for a page of host memory. Used by the
+ * basic block cache to catch the next write to a code page.
+ * -------------------------------------------------------------------
+ */
+void
+MMU_InvalidateWriteHva(uint8_t * hva_page)
+{
+	uint32_t i;
+	if (TLBE_IS_HVA(tlbe_write) && (hva_page >= tlbe_write.hva)
+	    && (hva_page <= tlbe_write.hva + tlbe_write.mask)) {
+		tlbe_write.cpu_mode = ~0;
+	}
+	for (i = 0; i < stlb_sets * STLB_WAYS; i++) {
+		STlbEntry *stlbe = &stlb_write[i];
+		if ((hva_page >= stlbe->hva) && (hva_page <= stlbe->hva + stlbe->mask)) {
+			stlbe->cpu_mode = ~0;
+		}
+	}
+}
+
+/*
+ * -------------------------------------------------------------------
+ * Instruction fetch with a miss in both TLB levels. Returns NULL
+ * and the physical address in taddr when the code is not in
+ * host memory.
+ * -------------------------------------------------------------------
+ */
+uint8_t *
+_MMU_IFetchHVA(uint32_t addr, uint32_t * taddr)
+{
+	uint32_t page_mask;
+	uint8_t *hva;
+	if ((hva = sectlb_match(&tlbe_ifetch, sectlb_ifetch, addr))) {
+		return hva;
+	}
+	tlb_walks++;
+	*taddr = MMU9_TranslatePage(addr, MMU_ACCESS_IFETCH | MMU_ACCESS_DATA_READ, &page_mask);
+	hva = Bus_GetHVARead(*taddr);
+	if (likely(hva)) {
+		enter_hva_to_both_tlbe(&tlbe_ifetch, stlb_ifetch, sectlb_ifetch, addr, *taddr,
+				       page_mask, hva);
+	}
+	return hva;
+}
+
+/*
+ * -------------------------------------------------------------------
+ * Data read with a miss in both TLB levels
+ * -------------------------------------------------------------------
+ */
+static inline uint8_t *
+read_miss(uint32_t addr, uint32_t * taddr)
+{
+	uint32_t page_mask;
+	uint8_t *hva;
+	if ((hva = sectlb_match(&tlbe_read, sectlb_read, addr))) {
+		return hva;
+	}
+	tlb_walks++;
+	*taddr = MMU9_TranslatePage(addr, MMU_ACCESS_DATA_READ, &page_mask);
+	hva = Bus_GetHVARead(*taddr);
+	if (hva) {
+		enter_hva_to_both_tlbe(&tlbe_read, stlb_read, sectlb_read, addr, *taddr,
+				       page_mask, hva);
+	} else {
+		enter_pa_to_tlbe_read(addr, *taddr);
+	}
+	return hva;
+}
+
 #define FLPD_TYPE_FAULT   (0)
 #define FLPD_TYPE_COARSE  (1)
 #define FLPD_TYPE_SECTION (2)
@@ -189,18 +406,11 @@ _MMU_Read32(uint32_t addr)
 {
 	uint32_t taddr;
 	uint8_t *hva;
-	/* HVA match is alredy done in inline part !!! */
+	/* HVA match is already done in inline part */
 	if (likely(TLB_MATCH(tlbe_read, addr))) {
-		taddr = tlbe_read.pa | ((addr) & 0x3ff);
-	} else {
-		taddr = MMU9_TranslateAddress(addr, MMU_ACCESS_DATA_READ);
-		hva = Bus_GetHVARead(taddr);
-		if (hva) {
-			enter_hva_to_both_tlbe_read(addr, hva);
-			return HMemRead32(hva);
-		} else {
-			enter_pa_to_tlbe_read(addr, taddr);
-		}
+		taddr = tlbe_read.pa | (addr & tlbe_read.mask);
+	} else if ((hva = read_miss(addr, &taddr))) {
+		return HMemRead32(hva);
 	}
 	return IO_Read32(taddr);
 }
@@ -210,18 +420,11 @@ _MMU_Read16(uint32_t addr)
 {
 	uint32_t taddr;
 	uint8_t *hva;
-	/* HVA case already done in inline part */
+	/* HVA match is already done in inline part */
 	if (likely(TLB_MATCH(tlbe_read, addr))) {
-		taddr = tlbe_read.pa | ((addr) & 0x3ff);
-	} else {
-		taddr = MMU9_TranslateAddress(addr, MMU_ACCESS_DATA_READ);
-		hva = Bus_GetHVARead(taddr);
-		if (hva) {
-			enter_hva_to_both_tlbe_read(addr, hva);
-			return HMemRead16(hva);
-		} else {
-			enter_pa_to_tlbe_read(addr, taddr);
-		}
+		taddr = tlbe_read.pa | (addr & tlbe_read.mask);
+	} else if ((hva = read_miss(addr, &taddr))) {
+		return HMemRead16(hva);
 	}
 	return IO_Read16(taddr);
 }
@@ -230,19 +433,12 @@ uint8_t
 _MMU_Read8(uint32_t addr)
 {
 	uint32_t taddr;
-	/* HVA part already done in inline part */
+	uint8_t *hva;
+	/* HVA match is already done in inline part */
 	if (likely(TLB_MATCH(tlbe_read, addr))) {
-		taddr = tlbe_read.pa | ((addr) & 0x3ff);
-	} else {
-		uint8_t *hva;
-		taddr = MMU9_TranslateAddress(addr, MMU_ACCESS_DATA_READ);
-		hva = Bus_GetHVARead(taddr);
-		if (hva) {
-			enter_hva_to_both_tlbe_read(addr, hva);
-			return HMemRead8(hva);
-		} else {
-			enter_pa_to_tlbe_read(addr, taddr);
-		}
+		taddr = tlbe_read.pa | (addr & tlbe_read.mask);
+	} else if ((hva = read_miss(addr, &taddr))) {
+		return HMemRead8(hva);
 	}
 	return IO_Read8(taddr);
 }
@@ -251,24 +447,27 @@ void
 MMU_Write32(uint32_t value, uint32_t addr)
 {
 	uint32_t taddr;
+	uint32_t page_mask;
 	uint8_t *hva;
+	STlbEntry *stlbe;
 	if (likely(TLB_MATCH(tlbe_write, addr))) {
 		if (TLBE_IS_HVA(tlbe_write)) {
-			hva = tlbe_write.hva + (addr & 0x3ff);
+			hva = tlbe_write.hva + (addr & tlbe_write.mask);
 			HMemWrite32(value, hva);
 			return;
 		} else {
-			taddr = tlbe_write.pa | ((addr) & 0x3ff);
+			taddr = tlbe_write.pa | (addr & tlbe_write.mask);
 		}
-	} else if ((hva = STLB_MATCH_HVA(stlb_write, addr))) {
-		enter_hva_to_tlbe_write(addr, hva);
+	} else if ((stlbe = STLB_LOOKUP(stlb_write, addr))) {
+		hva = tlbe_enter_stlbe(&tlbe_write, stlbe, addr);
 		HMemWrite32(value, hva);
 		return;
 	} else {
-		taddr = MMU9_TranslateAddress(addr, MMU_ACCESS_DATA_WRITE);
+		tlb_walks++;
+		taddr = MMU9_TranslatePage(addr, MMU_ACCESS_DATA_WRITE, &page_mask);
 		hva = Bus_GetHVAWrite(taddr);
 		if (hva) {
-			enter_hva_to_both_tlbe_write(addr, hva);
+			enter_hva_to_both_tlbe_write(addr, taddr, page_mask, hva);
 			HMemWrite32(value, hva);
 			return;
 		} else {
@@ -283,24 +482,27 @@ MMU_Write16(uint16_t value, uint32_t addr)
 {
 	uint8_t *hva;
 	uint32_t taddr;
+	uint32_t page_mask;
+	STlbEntry *stlbe;
 	addr = addr ^ mmu_word_addr_xor;
 	if (likely(TLB_MATCH(tlbe_write, addr))) {
 		if (TLBE_IS_HVA(tlbe_write)) {
-			hva = tlbe_write.hva + (addr & 0x3ff);
+			hva = tlbe_write.hva + (addr & tlbe_write.mask);
 			HMemWrite16(value, hva);
 			return;
 		} else {
-			taddr = tlbe_write.pa | ((addr) & 0x3ff);
+			taddr = tlbe_write.pa | (addr & tlbe_write.mask);
 		}
-	} else if ((hva = STLB_MATCH_HVA(stlb_write, addr))) {
-		enter_hva_to_tlbe_write(addr, hva);
+	} else if ((stlbe = STLB_LOOKUP(stlb_write, addr))) {
+		hva = tlbe_enter_stlbe(&tlbe_write, stlbe, addr);
 		HMemWrite16(value, hva);
 		return;
 	} else {
-		taddr = MMU9_TranslateAddress(addr, MMU_ACCESS_DATA_WRITE);
+		tlb_walks++;
+		taddr = MMU9_TranslatePage(addr, MMU_ACCESS_DATA_WRITE, &page_mask);
 		hva = Bus_GetHVAWrite(taddr);
 		if (hva) {
-			enter_hva_to_both_tlbe_write(addr, hva);
+			enter_hva_to_both_tlbe_write(addr, taddr, page_mask, hva);
 			HMemWrite16(value, hva);
 			return;
 		} else {
@@ -314,25 +516,28 @@ void
 MMU_Write8(uint8_t value, uint32_t addr)
 {
 	uint8_t *hva;
-	uint32_t taddr = addr;
+	uint32_t taddr;
+	uint32_t page_mask;
+	STlbEntry *stlbe;
 	addr = addr ^ mmu_byte_addr_xor;
 	if (likely(TLB_MATCH(tlbe_write, addr))) {
 		if (TLBE_IS_HVA(tlbe_write)) {
-			hva = tlbe_write.hva + (addr & 0x3ff);
+			hva = tlbe_write.hva + (addr & tlbe_write.mask);
 			HMemWrite8(value, hva);
 			return;
 		} else {
-			taddr = tlbe_write.pa | ((addr) & 0x3ff);
+			taddr = tlbe_write.pa | (addr & tlbe_write.mask);
 		}
-	} else if ((hva = STLB_MATCH_HVA(stlb_write, addr))) {
-		enter_hva_to_tlbe_write(addr, hva);
+	} else if ((stlbe = STLB_LOOKUP(stlb_write, addr))) {
+		hva = tlbe_enter_stlbe(&tlbe_write, stlbe, addr);
 		HMemWrite8(value, hva);
 		return;
 	} else {
-		taddr = MMU9_TranslateAddress(addr, MMU_ACCESS_DATA_WRITE);
+		tlb_walks++;
+		taddr = MMU9_TranslatePage(addr, MMU_ACCESS_DATA_WRITE, &page_mask);
 		hva = Bus_GetHVAWrite(taddr);
 		if (hva) {
-			enter_hva_to_both_tlbe_write(addr, hva);
+			enter_hva_to_both_tlbe_write(addr, taddr, page_mask, hva);
 			HMemWrite8(value, hva);
 			return;
 		} else {
@@ -342,8 +547,34 @@ MMU_Write8(uint8_t value, uint32_t addr)
 	IO_Write8(value, taddr);
 }
 
+/*
+ * -------------------------------------------------------------------
+ * Allocate the second level TLB. The number of sets is read from
+ * the configuration of the MMU and rounded up to a power of two.
+ * The CPU calls this too, because a board without MMU fetches
+ * through the TLB as well. Only the first call allocates.
+ * -------------------------------------------------------------------
+ */
 void
-MMU_ArmInit(void)
+MMU_ArmInit(const char *name)
 {
+	uint32_t sets = TLB_SETS_DEFAULT;
+	if (stlb_ifetch) {
+		return;
+	}
+	Config_ReadUInt32(&sets, name, "tlb_sets");
+	stlb_sets = 1;
+	while ((stlb_sets < sets) && (stlb_sets < 0x100000)) {
+		stlb_sets <<= 1;
+	}
+	stlb_set_mask = stlb_sets - 1;
+	stlb_ifetch = sg_calloc(sizeof(STlbEntry) * stlb_sets * STLB_WAYS);
+	stlb_read = sg_calloc(sizeof(STlbEntry) * stlb_sets * STLB_WAYS);
+	stlb_write = sg_calloc(sizeof(STlbEntry) * stlb_sets * STLB_WAYS);
 	stlb_init();
+	invalidate_tlb();
+	DbgExport_U64(stlb_hits, "%s.tlb.hits", name);
+	DbgExport_U64(sectlb_hits, "%s.tlb.section_hits", name);
+	DbgExport_U64(tlb_walks, "%s.tlb.walks", name);
+	fprintf(stderr, "- TLB with %u sets of %u ways\n", stlb_sets, STLB_WAYS);
 }
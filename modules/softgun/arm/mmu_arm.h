@@ -7,7 +7,8 @@
  *
  * ----------------------------------------------------
  */
-
+#ifndef _MMU_ARM_H
+#define _MMU_ARM_H
 #include <bus.h>
 #include <sys/time.h>
 #include <time.h>
@@ -32,97 +33,94 @@
 typedef struct TlbEntry {
 	uint32_t cpu_mode;
 	uint32_t va;		// ARM Virtual Address
+	uint32_t mask;		// Offset mask of the page
 	uint32_t pa;		// ARM Physical Address
 	uint8_t *hva;		// Host Virtual address
 } TlbEntry;
 
-extern TlbEntry tlbe_ifetch;
-extern TlbEntry tlbe_read;
+extern __MACHINE_LOCAL__ TlbEntry tlbe_ifetch;
+extern __MACHINE_LOCAL__ TlbEntry tlbe_read;
 
 extern uint32_t mmu_enabled;
 
 #define TLBE_IS_HVA(tlbe) ((tlbe).hva!=NULL)
 #define TLBE_IS_PA(tlbe) ((tlbe).hva==NULL)
 
-#define TLB_MATCH(tlbe,addr) ((((addr)&0xfffffc00)==(tlbe).va) && ((tlbe).cpu_mode==ARM_SIGNALING_MODE))
-#define TLB_MATCH_HVA(tlbe,addr) ((((addr)&0xfffffc00)==(tlbe).va) && ((tlbe).cpu_mode==ARM_SIGNALING_MODE) && TLBE_IS_HVA(tlbe))
+#define TLB_MATCH(tlbe,addr) ((((addr)&~(tlbe).mask)==(tlbe).va) && ((tlbe).cpu_mode==ARM_SIGNALING_MODE))
+#define TLB_MATCH_HVA(tlbe,addr) (TLB_MATCH(tlbe,addr) && TLBE_IS_HVA(tlbe))
 
 /* 
- * -----------------------------------------------
+ * -----------------------------------------------------------------
  * The second Level TLB cache
- * -----------------------------------------------
+ *	Set associative with STLB_WAYS entries per set. The set is
+ *	selected by the 4k page number. An entry maps up to 4k, less
+ *	for tiny pages, small pages with differing subpage permissions
+ *	or host memory mapped in smaller blocks.
+ *	The number of sets is configurable ("tlb_sets" in the
+ *	section of the MMU).
+ * -----------------------------------------------------------------
  */
-#define STLB_SIZE (128)
-#define STLB_INDEX(addr) (((addr)>>10) & (STLB_SIZE-1))
+#define STLB_WAYS	(4)
+#define STLB_SET(addr)	(((addr) >> 12) & stlb_set_mask)
 
 typedef struct STlbEntry {
 	uint32_t version;
 	uint32_t cpu_mode;
 	uint32_t va;		// ARM Virtual Address
+	uint32_t mask;		// Offset mask of the page
 	uint8_t *hva;		// Host Virtual address
 } STlbEntry;
 
-extern STlbEntry stlb_ifetch[STLB_SIZE];
-extern STlbEntry stlb_read[STLB_SIZE];
-extern STlbEntry stlb_write[STLB_SIZE];
+extern __MACHINE_LOCAL__ STlbEntry *stlb_ifetch;
+extern __MACHINE_LOCAL__ STlbEntry *stlb_read;
+extern __MACHINE_LOCAL__ STlbEntry *stlb_write;
+extern __MACHINE_LOCAL__ uint32_t stlb_set_mask;
+extern __MACHINE_LOCAL__ uint64_t stlb_hits;
 
 /* Invalidating the second level TLB is done by incrementing the stlb_version */
-extern uint32_t stlb_version;
+extern __MACHINE_LOCAL__ uint32_t stlb_version;
 
-static inline uint8_t *
-STLB_MATCH_HVA(STlbEntry * stlb, uint32_t addr)
+static inline STlbEntry *
+STLB_LOOKUP(STlbEntry * stlb, uint32_t addr)
 {
-	STlbEntry *stlbe = stlb + STLB_INDEX(addr);
-	if (likely((stlbe->version == stlb_version) &&
-		   (((addr) & 0xfffffc00) == stlbe->va) &&
-		   (stlbe->cpu_mode == ARM_SIGNALING_MODE))) {
-
-		return stlbe->hva + (addr & 0x3ff);
-	} else {
-		return NULL;
+	STlbEntry *stlbe = stlb + STLB_SET(addr) * STLB_WAYS;
+	int i;
+	for (i = 0; i < STLB_WAYS; i++, stlbe++) {
+		if (likely((stlbe->version == stlb_version) &&
+			   ((addr & ~stlbe->mask) == stlbe->va) &&
+			   (stlbe->cpu_mode == ARM_SIGNALING_MODE))) {
+			stlb_hits++;
+			return stlbe;
+		}
 	}
+	return NULL;
 }
 
-#define MMU_ARM926EJS	(0xa0310000)
-#define MMU_ARM920T	(0xa0320000)
-#define MMUV_NS9750	(0x2)
-#define MMUV_IMX21	(0x3)
-
-ArmCoprocessor *MMU_Create(const char *name, int endian, uint32_t type);
-uint32_t MMU9_TranslateAddress(uint32_t addr, uint32_t access_type);
 /*
  * ---------------------------------------------------------------
- * Enter the Virtual address of the Host System to into
- * the tlb (HVA)
+ * Move a second level entry to the first level TLB
+ * and return the HVA of addr.
  * ---------------------------------------------------------------
  */
-static inline void
-mmu_enter_hva_to_tlbe_ifetch(uint32_t va, uint8_t * hva)
+static inline uint8_t *
+tlbe_enter_stlbe(TlbEntry * tlbe, STlbEntry * stlbe, uint32_t addr)
 {
-	tlbe_ifetch.va = va & 0xfffffc00;
-	tlbe_ifetch.hva = hva - (va & 0x3ff);
-	tlbe_ifetch.cpu_mode = ARM_SIGNALING_MODE;
+	tlbe->va = stlbe->va;
+	tlbe->mask = stlbe->mask;
+	tlbe->hva = stlbe->hva;
+	tlbe->cpu_mode = stlbe->cpu_mode;
+	return stlbe->hva + (addr & stlbe->mask);
 }
 
-static inline void
-enter_hva_to_tlbe_read(uint32_t va, uint8_t * hva)
-{
-	tlbe_read.va = va & 0xfffffc00;
-	tlbe_read.hva = hva - (va & 0x3ff);
-	tlbe_read.cpu_mode = ARM_SIGNALING_MODE;
-}
+#define MMU_ARM926EJS	(0xa0310000)
+#define MMU_ARM920T	(0xa0320000)
+#define MMUV_NS9750	(0x2)
+#define MMUV_IMX21	(0x3)
 
-static inline void
-mmu_enter_hva_to_both_tlbe_ifetch(uint32_t va, uint8_t * hva)
-{
-	STlbEntry *stlbe;
-	int index = STLB_INDEX(va);
-	stlbe = stlb_ifetch + index;
-	tlbe_ifetch.hva = stlbe->hva = hva - (va & 0x3ff);
-	tlbe_ifetch.va = stlbe->va = va & 0xfffffc00;
-	tlbe_ifetch.cpu_mode = stlbe->cpu_mode = ARM_SIGNALING_MODE;
-	stlbe->version = stlb_version;
-}
+ArmCoprocessor *MMU_Create(const char *name, int endian, uint32_t type);
+uint32_t MMU9_TranslateAddress(uint32_t addr, uint32_t access_type);
+uint32_t MMU9_TranslatePage(uint32_t addr, uint32_t access_type, uint32_t * page_mask);
+uint8_t *_MMU_IFetchHVA(uint32_t addr, uint32_t * taddr);	/* TLB miss */
 
 /*
  * ------------------------------------------------------------------
@@ -138,17 +136,16 @@ MMU_IFetch(uint32_t addr)
 {
 	uint32_t taddr;
 	uint8_t *hva;
+	STlbEntry *stlbe;
 	if (likely(TLB_MATCH(tlbe_ifetch, addr))) {
-		hva = tlbe_ifetch.hva + (addr & 0x3ff);
+		hva = tlbe_ifetch.hva + (addr & tlbe_ifetch.mask);
 		return HMemRead32(hva);
-	} else if ((hva = STLB_MATCH_HVA(stlb_ifetch, addr))) {
-		mmu_enter_hva_to_tlbe_ifetch(addr, hva);
+	} else if ((stlbe = STLB_LOOKUP(stlb_ifetch, addr))) {
+		hva = tlbe_enter_stlbe(&tlbe_ifetch, stlbe, addr);
 		return HMemRead32(hva);
 	} else {
-		taddr = MMU9_TranslateAddress(addr, MMU_ACCESS_IFETCH | MMU_ACCESS_DATA_READ);
-		hva = Bus_GetHVARead(taddr);
+		hva = _MMU_IFetchHVA(addr, &taddr);
 		if (likely(hva)) {
-			mmu_enter_hva_to_both_tlbe_ifetch(addr, hva);
 			return HMemRead32(hva);
 		} else {
 			/* Instruction from IO (For example io-mapped flash) */
@@ -162,22 +159,21 @@ MMU_IFetch(uint32_t addr)
  * 16 Bit instruction code fetch for Thumb mode
  * -----------------------------------------------------------
  */
-static inline uint16_t
+static __DISPATCH_INLINE__ uint16_t
 MMU_IFetch16(uint32_t addr)
 {
 	uint32_t taddr;
 	uint8_t *hva;
+	STlbEntry *stlbe;
 	if (likely(TLB_MATCH(tlbe_ifetch, addr))) {
-		hva = tlbe_ifetch.hva + (addr & 0x3ff);
+		hva = tlbe_ifetch.hva + (addr & tlbe_ifetch.mask);
 		return HMemRead16(hva);
-	} else if ((hva = STLB_MATCH_HVA(stlb_ifetch, addr))) {
-		mmu_enter_hva_to_tlbe_ifetch(addr, hva);
+	} else if ((stlbe = STLB_LOOKUP(stlb_ifetch, addr))) {
+		hva = tlbe_enter_stlbe(&tlbe_ifetch, stlbe, addr);
 		return HMemRead16(hva);
 	} else {
-		taddr = MMU9_TranslateAddress(addr, MMU_ACCESS_IFETCH | MMU_ACCESS_DATA_READ);
-		hva = Bus_GetHVARead(taddr);
+		hva = _MMU_IFetchHVA(addr, &taddr);
 		if (likely(hva)) {
-			mmu_enter_hva_to_both_tlbe_ifetch(addr, hva);
 			return HMemRead16(hva);
 		} else {
 			/* Instruction from IO (For example io-mapped flash) */
@@ -186,19 +182,41 @@ MMU_IFetch16(uint32_t addr)
 	}
 }
 
+/*
+ * -----------------------------------------------------------------
+ * MMU_IFetchHVA
+ *	Translate an instruction address to a Host Virtual Address.
+ *	Returns NULL if the instruction is fetched from IO.
+ * -----------------------------------------------------------------
+ */
+static inline uint8_t *
+MMU_IFetchHVA(uint32_t addr)
+{
+	uint32_t taddr;
+	STlbEntry *stlbe;
+	if (likely(TLB_MATCH(tlbe_ifetch, addr))) {
+		return tlbe_ifetch.hva + (addr & tlbe_ifetch.mask);
+	} else if ((stlbe = STLB_LOOKUP(stlb_ifetch, addr))) {
+		return tlbe_enter_stlbe(&tlbe_ifetch, stlbe, addr);
+	} else {
+		return _MMU_IFetchHVA(addr, &taddr);
+	}
+}
+
 uint32_t _MMU_Read32(uint32_t addr);	/* second part of above */
-extern uint32_t mmu_byte_addr_xor;
-extern uint32_t mmu_word_addr_xor;
+extern __MACHINE_LOCAL__ uint32_t mmu_byte_addr_xor;
+extern __MACHINE_LOCAL__ uint32_t mmu_word_addr_xor;
 
 static inline uint32_t
 MMU_Read32(uint32_t addr)
 {
 	uint8_t *hva;
+	STlbEntry *stlbe;
 	if (likely(TLB_MATCH_HVA(tlbe_read, addr))) {
-		hva = tlbe_read.hva + (addr & 0x3ff);
+		hva = tlbe_read.hva + (addr & tlbe_read.mask);
 		return HMemRead32(hva);
-	} else if ((hva = STLB_MATCH_HVA(stlb_read, addr))) {
-		enter_hva_to_tlbe_read(addr, hva);
+	} else if ((stlbe = STLB_LOOKUP(stlb_read, addr))) {
+		hva = tlbe_enter_stlbe(&tlbe_read, stlbe, addr);
 		return HMemRead32(hva);
 	} else {
 		return _MMU_Read32(addr);
@@ -210,12 +228,13 @@ static inline uint16_t
 MMU_Read16(uint32_t addr)
 {
 	uint8_t *hva;
+	STlbEntry *stlbe;
 	addr ^= mmu_word_addr_xor;
 	if (likely(TLB_MATCH_HVA(tlbe_read, addr))) {
-		hva = tlbe_read.hva + (addr & 0x3ff);
+		hva = tlbe_read.hva + (addr & tlbe_read.mask);
 		return HMemRead16(hva);
-	} else if ((hva = STLB_MATCH_HVA(stlb_read, addr))) {
-		enter_hva_to_tlbe_read(addr, hva);
+	} else if ((stlbe = STLB_LOOKUP(stlb_read, addr))) {
+		hva = tlbe_enter_stlbe(&tlbe_read, stlbe, addr);
 		return HMemRead16(hva);
 	} else {
 		return _MMU_Read16(addr);
@@ -227,12 +246,13 @@ static inline uint8_t
 MMU_Read8(uint32_t addr)
 {
 	uint8_t *hva;
+	STlbEntry *stlbe;
 	addr ^= mmu_byte_addr_xor;
 	if (likely(TLB_MATCH_HVA(tlbe_read, addr))) {
-		hva = tlbe_read.hva + (addr & 0x3ff);
+		hva = tlbe_read.hva + (addr & tlbe_read.mask);
 		return HMemRead8(hva);
-	} else if ((hva = STLB_MATCH_HVA(stlb_read, addr))) {
-		enter_hva_to_tlbe_read(addr, hva);
+	} else if ((stlbe = STLB_LOOKUP(stlb_read, addr))) {
+		hva = tlbe_enter_stlbe(&tlbe_read, stlbe, addr);
 		return HMemRead8(hva);
 	} else {
 		return _MMU_Read8(addr);
@@ -244,6 +264,9 @@ void MMU_Write16(uint16_t value, uint32_t addr);
 void MMU_Write8(uint8_t value, uint32_t addr);
 void MMU_AlignmentException(uint32_t far);
 void MMU_InvalidateTlb(void);
+void MMU_InvalidateTlbMva(uint32_t va);
+void MMU_InvalidateWriteHva(uint8_t * hva_page);
 void MMU_SetDebugMode(int val);
 int MMU_Byteorder();
-void MMU_ArmInit(void);
+void MMU_ArmInit(const char *name);
+#endif
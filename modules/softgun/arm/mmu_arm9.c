@@ -34,6 +34,7 @@
  */
 #include <stdio.h>
 #include <stdlib.h>
+#include <stddef.h>
 #include <string.h>
 #include <unistd.h>
 #include <time.h>
@@ -43,9 +44,11 @@
 #include "arm9cpu.h"
 #include "cycletimer.h"
 #include "mmu_arm9.h"
+#include "bbcache_arm.h"
 #include "bus.h"
 #include "compiler_extensions.h"
 #include "sgstring.h"
+#include "snapshot.h"
 
 #include "byteorder.h"
 
@@ -67,9 +70,6 @@ typedef struct SystemCopro {
 	uint32_t mtlblck;
 	uint32_t mpid;
 
-	int64_t saved_cycles;	/* Halt Instruction */
-	CycleCounter_t last_halt_cycles;
-	struct timespec last_halt;
 	SigNode *endianNode;
 	int debugmode;
 
@@ -80,11 +80,11 @@ typedef struct SystemCopro {
 
 } SystemCopro;
 
-static uint32_t translation_enabled = 0;
-static uint32_t ttbl_base = 0;
-static uint32_t sys_rom_protection = 0;
-static uint32_t domain_access_reg;
-static SystemCopro *gmmu;
+static __MACHINE_LOCAL__ uint32_t translation_enabled = 0;
+static __MACHINE_LOCAL__ uint32_t ttbl_base = 0;
+static __MACHINE_LOCAL__ uint32_t sys_rom_protection = 0;
+static __MACHINE_LOCAL__ uint32_t domain_access_reg;
+static __MACHINE_LOCAL__ SystemCopro *gmmu;
 
 #ifdef DEBUG
 #define dbgprintf(...) { if(unlikely(debugflags & DEBUG_MMU)) { fprintf(stderr,__VA_ARGS__); } }
@@ -165,8 +165,8 @@ static uint8_t permissionTable[64] = {
 	0, 0, 0, 1
 };
 
-uint32_t mmu_word_addr_xor;
-uint32_t mmu_byte_addr_xor;
+__MACHINE_LOCAL__ uint32_t mmu_word_addr_xor;
+__MACHINE_LOCAL__ uint32_t mmu_byte_addr_xor;
 
 void
 MMU_SetDebugMode(int val)
@@ -177,7 +177,8 @@ MMU_SetDebugMode(int val)
 int
 MMU_Byteorder()
 {
-	if (gmmu->ctrl & MCTRL_BE) {
+	/* Boards without the ARM9 system coprocessor are little endian */
+	if (gmmu && (gmmu->ctrl & MCTRL_BE)) {
 		return BYTE_ORDER_BIG;
 	} else {
 		return BYTE_ORDER_LITTLE;
@@ -502,18 +503,35 @@ check_cachebuff(uint32_t pgd, uint32_t vaddr, uint32_t access_type)
 }
 
 /*
- * -------------------------------------------
- * Static inline version of Page table walk 
- * -------------------------------------------
+ * ------------------------------------------------------------
+ * Large and small pages have four subpages with separate
+ * access permissions in AP0 - AP3.
+ * ------------------------------------------------------------
+ */
+static inline bool
+same_subpage_ap(uint32_t slpd)
+{
+	uint32_t ap = (slpd >> 4) & 0xff;
+	return ap == ((ap & 3) * 0x55);
+}
+
+/*
+ * ---------------------------------------------------------------
+ * Page table walk. Returns the translated address and the offset
+ * mask of the largest region which is translated with the same
+ * permissions (the page, or the 1k subpage when the access
+ * permissions of the subpages differ).
+ * ---------------------------------------------------------------
  */
 uint32_t
-MMU9_TranslateAddress(uint32_t addr, uint32_t access_type)
+MMU9_TranslatePage(uint32_t addr, uint32_t access_type, uint32_t * page_mask)
 {
 	uint32_t domain_shift;
 	uint32_t taddr;		// translated address
 	uint32_t flpdP;
 	uint32_t flpd;
 	if (unlikely(!translation_enabled)) {
+		*page_mask = 0xfffff;
 		return addr;
 	}
 	flpdP = ttbl_base | ((addr & 0xfff00000) >> (20 - 2));
@@ -549,6 +567,7 @@ MMU9_TranslateAddress(uint32_t addr, uint32_t access_type)
 									  (flpd >> 5) & 0xf);
 					}
 					taddr = (slpd & 0xffff0000) | (addr & 0xffff);
+					*page_mask = same_subpage_ap(slpd) ? 0xffff : 0x3fff;
 					return taddr;
 
 					/* small page 4k */
@@ -561,6 +580,7 @@ MMU9_TranslateAddress(uint32_t addr, uint32_t access_type)
 									  (flpd >> 5) & 0xf);
 					}
 					taddr = (slpd & 0xfffff000) | (addr & 0xfff);
+					*page_mask = same_subpage_ap(slpd) ? 0xfff : 0x3ff;
 					return taddr;
 
 				case SLPD_TYPE_TINY:
@@ -580,6 +600,7 @@ MMU9_TranslateAddress(uint32_t addr, uint32_t access_type)
 								 (flpd >> 5) & 0xf);
 			    }
 			    taddr = sec_index | (flpd & 0xfff00000);
+			    *page_mask = 0xfffff;
 			    return taddr;
 		    }
 	    case FLPD_TYPE_FINE:
@@ -607,6 +628,7 @@ MMU9_TranslateAddress(uint32_t addr, uint32_t access_type)
 									  (flpd >> 5) & 0xf);
 					}
 					taddr = (slpd & 0xffff0000) | (addr & 0xffff);
+					*page_mask = same_subpage_ap(slpd) ? 0xffff : 0x3fff;
 					return taddr;
 
 				case SLPD_TYPE_SMALL:
@@ -619,6 +641,7 @@ MMU9_TranslateAddress(uint32_t addr, uint32_t access_type)
 									  (flpd >> 5) & 0xf);
 					}
 					taddr = (slpd & 0xfffff000) | (addr & 0xfff);
+					*page_mask = same_subpage_ap(slpd) ? 0xfff : 0x3ff;
 					return taddr;
 
 				case SLPD_TYPE_TINY:
@@ -631,6 +654,7 @@ MMU9_TranslateAddress(uint32_t addr, uint32_t access_type)
 									  (flpd >> 5) & 0xf);
 					}
 					taddr = (slpd & 0xfffffc00) | (addr & 0x3ff);
+					*page_mask = 0x3ff;
 					return taddr;
 			    }
 
@@ -643,6 +667,13 @@ MMU9_TranslateAddress(uint32_t addr, uint32_t access_type)
 	exit(376);
 }
 
+uint32_t
+MMU9_TranslateAddress(uint32_t addr, uint32_t access_type)
+{
+	uint32_t page_mask;
+	return MMU9_TranslatePage(addr, access_type, &page_mask);
+}
+
 #if 0
 uint32_t
 MMU9_TranslateAddress(uint32_t addr, uint32_t access_type)
@@ -875,65 +906,33 @@ mcctrl_read(void *clientData, uint32_t icode)
 static void
 mcctrl_write(void *clientData, uint32_t icode, uint32_t value)
 {
-	SystemCopro *mmu = (SystemCopro *) clientData;
 	uint32_t crm = icode & 0xf;
 	uint32_t opcode_2 = (icode >> 5) & 0x7;
 	/* Wait for Interrupt instruction (halt) */
 	if ((crm == 0) && (opcode_2 == 4)) {
-		uint64_t nsecs;
-		struct timespec *last_halt, tv_now;
-		last_halt = &mmu->last_halt;
-		clock_gettime(CLOCK_MONOTONIC, &tv_now);
-		nsecs =
-		    tv_now.tv_nsec - last_halt->tv_nsec + (int64_t) 1000000000 *(tv_now.tv_sec -
-										 last_halt->tv_sec);
-		mmu->saved_cycles = mmu->saved_cycles
-		    /* Subtract the  cycles which should have simulated since the last halt */
-		    - (CycleTimerRate_Get() / 1000000) * (nsecs / 1000) +
-		    /* Add the cycles which really have been simulated since last halt */
-		    (CycleCounter_Get() - mmu->last_halt_cycles);
-
-		*last_halt = tv_now;
-
-		/* 
-		 * Catch up a maximum of one half of a second if emulator is 
-		 * slower than real system 
+		/*
+		 * Jump over the idle cycles up to the next timer. The throttle
+		 * timer then finds the CPU ahead of real time and sleeps. The
+		 * batch ends here, so the GlobalClock is synced before the
+		 * guest executes the next wait for interrupt.
+		 * Leave halt even if an IRQ arrives when irqs are disabled in CPSR.
 		 */
-		if (mmu->saved_cycles < -(int64_t) (CycleTimerRate_Get() / 2)) {
-			mmu->saved_cycles = -(int64_t) (CycleTimerRate_Get() >> 1);
-		} else if (mmu->saved_cycles > (int64_t) CycleTimerRate_Get()) {
-			mmu->saved_cycles = CycleTimerRate_Get();
-		}
-		/* Jump over CPU cycles if not enough saved for sleeping 1 timeslice */
-		while (mmu->saved_cycles < (CycleTimerRate_Get() / 100)
-		       && (firstCycleTimerTimeout != ~(uint64_t) 0)) {
-
-			/* leave halt even if an IRQ arrives when irqs are disabled in CPSR */
-			if (gcpu.signals_raw & (ARM_SIG_IRQ | ARM_SIG_FIQ)) {
-				mmu->last_halt_cycles = CycleCounter_Get();
-				return;
-			}
-			mmu->saved_cycles += firstCycleTimerTimeout - CycleCounter_Get();
-			CycleCounter = firstCycleTimerTimeout;
-			CycleTimers_Check();
-		}
-		mmu->last_halt_cycles = CycleCounter_Get();
-		/* Jump over time (sleep) if we have saved enough CPU cycles for sleeping 1 timeslice */
-		while (mmu->saved_cycles >= (CycleTimerRate_Get() / 100)) {
-			struct timespec tout;
-			tout.tv_nsec = 10000000;	/* 10 ms */
-			tout.tv_sec = 0;
-			if (gcpu.signals_raw & (ARM_SIG_IRQ | ARM_SIG_FIQ)) {
-				return;
+		if (!(gcpu.signals_raw & (ARM_SIG_IRQ | ARM_SIG_FIQ))
+		    && (firstCycleTimerTimeout != ~(uint64_t) 0)
+		    && (firstCycleTimerTimeout > CycleCounter_Get())) {
+			uint64_t idle = firstCycleTimerTimeout - CycleCounter_Get();
+			if (idle > CycleTimerRate_Get()) {
+				idle = CycleTimerRate_Get();
 			}
-			// FIXME: FIO_WaitEventTimeout(&tout);
-			clock_gettime(CLOCK_MONOTONIC, &tv_now);
-			nsecs =
-			    tv_now.tv_nsec - last_halt->tv_nsec +
-			    (int64_t) 1000000000 *(tv_now.tv_sec - last_halt->tv_sec);
-			mmu->saved_cycles -= (CycleTimerRate_Get() / 1000000) * (nsecs / 1000);
-			*last_halt = tv_now;
+			CycleCounter += idle;
 		}
+		gcpu.batch_cycles = 0;
+	} else if ((crm == 5) && (opcode_2 <= 2)) {
+		/* Invalidate instruction cache (all, line by MVA, line by set/way) */
+		BBCache_Flush();
+	} else if ((crm == 7) && (opcode_2 == 0)) {
+		/* Invalidate both caches */
+		BBCache_Flush();
 	} else {
 		dbgprintf("Ignore Cache settings\n");
 	}
@@ -951,9 +950,15 @@ mtlbctrl_read(void *clientData, uint32_t icode)
 static void
 mtlbctrl_write(void *clientData, uint32_t icode, uint32_t value)
 {
-	//fprintf(stderr,"inv op2 %08x crm %08x,data %08x\n",opcode_2,crm,data);
-	MMU_InvalidateTlb();
-	dbgprintf("Invalidate TLB\n");
+	uint32_t opcode_2 = (icode >> 5) & 0x7;
+	if (opcode_2 == 1) {
+		/* Invalidate single entry */
+		MMU_InvalidateTlbMva(value);
+		dbgprintf("Invalidate TLB entry %08x\n", value);
+	} else {
+		MMU_InvalidateTlb();
+		dbgprintf("Invalidate TLB\n");
+	}
 	return;
 
 }
@@ -1093,6 +1098,23 @@ static ArmCoprocessor copro = {
 	.stc = NULL
 };
 
+/*
+ * ---------------------------------------------------------
+ * Apply the CP15 registers restored from a snapshot
+ * ---------------------------------------------------------
+ */
+static void
+mmu_restored(void *clientData)
+{
+	SystemCopro *mmu = (SystemCopro *) clientData;
+	uint32_t ctrl = mmu->ctrl;
+	mmu->ctrl = ~ctrl & MCTRL_BE;
+	ctrl_write(mmu, 0, ctrl);
+	ttbl_base = mmu->mtbase;
+	domain_access_reg = mmu->mdac;
+	MMU_InvalidateTlb();
+}
+
 ArmCoprocessor *
 MMU9_Create(const char *name, int endian, uint32_t mmu_type)
 {
@@ -1115,7 +1137,10 @@ MMU9_Create(const char *name, int endian, uint32_t mmu_type)
 	}
 	update_byteorder(mmu);
 	copro.owner = mmu;
-	MMU_ArmInit();
+	MMU_ArmInit(name);
+	/* The CP15 registers from id to mpid contain no pointers */
+	Snapshot_RegisterState("mmu.cp15", mmu, offsetof(SystemCopro, endianNode),
+			       mmu_restored, mmu);
 	switch (type) {
 	    case MMU_ARM926EJS:
 		    CrnHandler_New(mmu, SYSCPR_ID, arm926ejs_id_read, id_write, mmu);
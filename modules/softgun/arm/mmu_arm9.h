@@ -54,23 +54,8 @@
 #define MMU_ACCESS_DATA_READ  (0)
 #define MMU_ACCESS_DATA_WRITE (32)
 
-/*
- * ---------------------------------------------------------
- * Translation Lookaside buffer
- *      caches Physical address for IO
- *      accesses and Host Virtual Address for faster
- *      memory access
- * ---------------------------------------------------------
- */
-
 extern uint32_t mmu_enabled;
 
-#define TLBE_IS_HVA(tlbe) ((tlbe).hva!=NULL)
-#define TLBE_IS_PA(tlbe) ((tlbe).hva==NULL)
-
-#define TLB_MATCH(tlbe,addr) ((((addr)&0xfffffc00)==(tlbe).va) && ((tlbe).cpu_mode==ARM_SIGNALING_MODE))
-#define TLB_MATCH_HVA(tlbe,addr) ((((addr)&0xfffffc00)==(tlbe).va) && ((tlbe).cpu_mode==ARM_SIGNALING_MODE) && TLBE_IS_HVA(tlbe))
-
 #define MMU_ARM926EJS	(0xa0310000)
 #define MMU_ARM920T	(0xa0320000)
 #define MMUV_NS9750	(0x2)
@@ -42,6 +42,9 @@
 #include "sgstring.h"
 
 ThumbInstructionProc **thumbIProcTab = NULL;
+#ifdef LEIGUN_THREADED_DISPATCH
+Dispatch_Map thumbDispatch;
+#endif
 ThumbInstruction **thumbInstructionTab = NULL;
 
 static ThumbInstruction instrlist[] = {
@@ -160,6 +163,9 @@ ThumbDecoder_New()
 			thumbInstructionTab[icode] = cursor;
 		}
 	}
+#ifdef LEIGUN_THREADED_DISPATCH
+	Dispatch_MapInit(&thumbDispatch, thumbIProcTab, 65536);
+#endif
 }
 
 #ifdef TEST
@@ -1,9 +1,15 @@
 #include <stdint.h>
+#ifdef LEIGUN_THREADED_DISPATCH
+#include "dispatch.h"
+#endif
 
 typedef void ThumbInstructionProc(void);
 typedef struct ThumbInstruction ThumbInstruction;
 extern ThumbInstructionProc **thumbIProcTab;
 extern ThumbInstruction **thumbInstructionTab;
+#ifdef LEIGUN_THREADED_DISPATCH
+extern Dispatch_Map thumbDispatch;
+#endif
 
 #define THUMB_INSTR_INDEX(icode) ((uint16_t)(icode))
 
@@ -33,6 +33,7 @@
  *************************************************************************************************
  */
 
+#include <stdio.h>
 #include <stdint.h>
 #include "sgstring.h"
 #include "signode.h"
@@ -34,6 +34,7 @@
  *************************************************************************************************
  */
 
+#include <stdio.h>
 #include <stdint.h>
 #include <inttypes.h>
 #include <string.h>
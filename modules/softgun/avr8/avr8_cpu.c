@@ -71,6 +71,7 @@
 #include "instructions_avr8.h"
 
 // Leigun Core Headers
+#include "asyncmanager.h"
 #include "compiler_extensions.h"
 #include "configfile.h"
 #include "cycletimer.h"
@@ -218,13 +219,13 @@ AVR8_Variant avr8_variants[] = {
 	 }
 };
 
-AVR8_Cpu gavr8;
+__MACHINE_LOCAL__ AVR8_Cpu gavr8;
 
-CycleTimer exit_timer;
+__MACHINE_LOCAL__ CycleTimer exit_timer;
 
-static uint16_t pcbuf[1024];
-static int pcbuf_wp = 0;
-static int pcbuf_rp = 0;
+static __MACHINE_LOCAL__ uint16_t pcbuf[1024];
+static __MACHINE_LOCAL__ int pcbuf_wp = 0;
+static __MACHINE_LOCAL__ int pcbuf_rp = 0;
 
 
 //==============================================================================
@@ -243,7 +244,7 @@ static void debugger_get_bkpt_ins(void *clientData, uint8_t * ins, uint64_t addr
 static void Do_Debug(void);
 #endif
 static void AVR8_Interrupt(void *irqData);
-static inline void CheckSignals(void);
+static __DISPATCH_INLINE__ void CheckSignals(void);
 static inline void logPC(void);
 static uint8_t avr8_read_unknown(void *clientData, uint32_t address);
 static void avr8_write_unknown(void *clientData, uint8_t value, uint32_t address);
@@ -526,7 +527,7 @@ AVR8_Interrupt(void *irqData)
 	SET_REG_PC(irqvect << 1);
 }
 
-static inline void
+static __DISPATCH_INLINE__ void
 CheckSignals(void)
 {
   if (likely(!gavr8.cpu_signals)) {
@@ -837,6 +838,27 @@ create(void)
 	return dev;
 }
 
+#ifdef LEIGUN_THREADED_DISPATCH
+/*
+ * ------------------------------------------------------------------
+ * Handler of a dispatch slot for the threaded main loop. Slot 0
+ * calls through the decoder table.
+ * ------------------------------------------------------------------
+ */
+#define AVR8_HANDLER(n) \
+	DISPATCH_LABEL(n): \
+	if ((n) == 0) { \
+		AVR8_InstructionProcFind(ICODE)(); \
+	} else { \
+		avr8Dispatch.proc[n](); \
+	} \
+	CheckSignals(); \
+	CycleTimers_Check(); \
+	ICODE = AVR8_ReadAppMem(GET_REG_PC); \
+	SET_REG_PC(GET_REG_PC + 1); \
+	goto *target[ICODE];
+#endif
+
 /*
  *******************************************************************
  * AVR8 CPU main loop
@@ -847,7 +869,12 @@ run(GlobalClock_LocalClock_t *clk, void *data)
 {
 	AVR8_Cpu *avr = ((Device_MPU_t *)data)->self;
 	uint32_t addr = 0;
+#ifdef LEIGUN_THREADED_DISPATCH
+	static const void *const labels[DISPATCH_SLOTS] = DISPATCH_LABELS;
+	const void **target = Dispatch_MapTargets(&avr8Dispatch, labels);
+#else
 	AVR8_InstructionProc *iproc;
+#endif
 	avr->lclk = clk;
 	if (Config_ReadUInt32(&addr, "global", "start_address") < 0) {
 		addr = 0;
@@ -856,13 +883,18 @@ run(GlobalClock_LocalClock_t *clk, void *data)
 	setjmp(avr->restart_idec_jump);
 #ifndef NO_DEBUGGER
 	while (avr->dbg_state == AVRDBG_STOPPED) {
-		struct timespec tout;
-		tout.tv_nsec = 0;
-		tout.tv_sec = 10000;
-		// FIXME: FIO_WaitEventTimeout(&tout);
-		sleep(1);
+		/* The debugger is served by the callbacks of the machine */
+		AsyncManager_WaitMachine(1000);
 	}
 #endif
+#ifdef LEIGUN_THREADED_DISPATCH
+	CheckSignals();
+	CycleTimers_Check();
+	ICODE = AVR8_ReadAppMem(GET_REG_PC);
+	SET_REG_PC(GET_REG_PC + 1);
+	goto *target[ICODE];
+	DISPATCH_HANDLERS(AVR8_HANDLER)
+#else
 	while (1) {
 		CheckSignals();
 		CycleTimers_Check();
@@ -872,6 +904,7 @@ run(GlobalClock_LocalClock_t *clk, void *data)
 		iproc = AVR8_InstructionProcFind(ICODE);
 		iproc();
 	}
+#endif
 }
 
 
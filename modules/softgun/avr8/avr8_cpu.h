@@ -128,7 +128,7 @@ typedef struct AVR8_Cpu {
 void AVR8_DumpPcBuf(void);
 void AVR8_DumpRegisters(void);
 
-extern AVR8_Cpu gavr8;
+extern __MACHINE_LOCAL__ AVR8_Cpu gavr8;
 static inline uint8_t
 AVR8_ReadReg(unsigned int reg)
 {
@@ -223,7 +223,7 @@ AVR8_WriteMem16(uint16_t value, int addr)
  * located). The AVR is a Havard architecture
  * ------------------------------------------------------------------------
  */
-static inline uint16_t
+static __DISPATCH_INLINE__ uint16_t
 AVR8_ReadAppMem(uint32_t word_addr)
 {
 	return gavr8.appmem[word_addr & gavr8.appmem_word_mask];
@@ -42,8 +42,11 @@
 #include "idecode_avr8.h"
 #include "sgstring.h"
 
-AVR8_InstructionProc **avr8_iProcTab = NULL;
-AVR8_Instruction **avr8_instrTab = NULL;
+__MACHINE_LOCAL__ AVR8_InstructionProc **avr8_iProcTab = NULL;
+#ifdef LEIGUN_THREADED_DISPATCH
+__MACHINE_LOCAL__ Dispatch_Map avr8Dispatch;
+#endif
+__MACHINE_LOCAL__ AVR8_Instruction **avr8_instrTab = NULL;
 
 /*
  **********************************************************
@@ -980,6 +983,9 @@ AVR8_IDecoderNew(uint32_t cpuVariant)
             avr8_iProcTab[icode] = avr8_undef;
         }
     }
+#ifdef LEIGUN_THREADED_DISPATCH
+    Dispatch_MapInit(&avr8Dispatch, avr8_iProcTab, 0x10000);
+#endif
     fprintf(stderr, "AVR8 instruction decoder with %d Instructions created\n", num_instr);
 }
 
@@ -1,6 +1,11 @@
 #ifndef _IDECODE_AVR8_H
 #define _IDECODE_AVR8_H
 //include <instructions_avr8.h>
+#include <stdint.h>
+#include "compiler_extensions.h"
+#ifdef LEIGUN_THREADED_DISPATCH
+#include "dispatch.h"
+#endif
 
 #define AVR8_VARIANT_PC16   (1)
 #define AVR8_VARIANT_PC24   (2)
@@ -17,8 +22,11 @@ typedef struct AVR8_Instruction {
     uint32_t cpuVariant;
 } AVR8_Instruction;
 
-extern AVR8_InstructionProc **avr8_iProcTab;
-extern AVR8_Instruction **avr8_instrTab;
+extern __MACHINE_LOCAL__ AVR8_InstructionProc **avr8_iProcTab;
+extern __MACHINE_LOCAL__ AVR8_Instruction **avr8_instrTab;
+#ifdef LEIGUN_THREADED_DISPATCH
+extern __MACHINE_LOCAL__ Dispatch_Map avr8Dispatch;
+#endif
 void AVR8_IDecoderNew(uint32_t cpuVariant);
 
 static inline AVR8_InstructionProc *
@@ -34,6 +34,7 @@
  *************************************************************************************************
  */
 
+#include <stdio.h>
 #include <stdint.h>
 #include <string.h>
 #include "avr8_io.h"
@@ -43,6 +43,7 @@
 // Leigun Core Headers
 #include "bus.h"
 #include "sram.h"
+#include "snapshot.h"
 #include "leigun/leigun.h"
 #include "leigun/device.h"
 
@@ -113,6 +114,8 @@ static Device_Board_t *create(void) {
                        MEM_FLAG_WRITABLE | MEM_FLAG_READABLE);
     Mem_AreaAddMapping(flash, 0x00100000, 1024 * 1024,
                        MEM_FLAG_WRITABLE | MEM_FLAG_READABLE);
+    // The EFC has no registers yet, the CPU, the RAM and the flash are all
+    Snapshot_BoardComplete();
 
     return &board->base;
 }
@@ -103,13 +103,15 @@
 //==============================================================================
 //= Variables
 //==============================================================================
-CFCpu g_CFCpu;
+__MACHINE_LOCAL__ CFCpu g_CFCpu;
+static __MACHINE_LOCAL__ int64_t batchCycles;	/* Cycles left until the next event */
 
 
 //==============================================================================
 //= Function declarations(static)
 //==============================================================================
 static inline void CheckSignals(void);
+static void horizon_cut(void *clientData);
 static void dump_instruction(void);
 
 static Device_MPU_t *create(void);
@@ -131,6 +133,12 @@ CheckSignals(void)
 #endif
 }
 
+static void
+horizon_cut(void *clientData)
+{
+	batchCycles = 0;
+}
+
 static void
 dump_instruction(void)
 {
@@ -153,6 +161,7 @@ create(void)
 	cf_init_condition_tab();
 	GlobalClock_Registor(&run, dev, cpu_clock);
 	CycleTimers_Init(instancename, cpu_clock);
+	CycleTimers_SetHorizonProc(horizon_cut, &g_CFCpu);
 	fprintf(stderr, "Initialized Coldfire CPU with %d HZ\n", cpu_clock);
 	CF_SetRegPC(0);
 	CF_SetRegD(HWCONFIG_D0_MFC5282, 0);
@@ -161,30 +170,94 @@ create(void)
 	return dev;
 }
 
+#ifdef LEIGUN_THREADED_DISPATCH
+/*
+ * Handler of a dispatch slot for the threaded main loop, the end of
+ * the batch goes back to the sync with the GlobalClock.
+ */
+#define CF_HANDLER(n) \
+	DISPATCH_LABEL(n): \
+	if ((n) == 0) { \
+		InststructionProcFind(ICODE)(); \
+	} else { \
+		cfDispatch.proc[n](); \
+	} \
+	CycleCounter += 2; \
+	batchCycles -= 2; \
+	CheckSignals(); \
+	if (unlikely(batchCycles <= 0)) { \
+		goto sync; \
+	} \
+	pc = CF_GetRegPC(); \
+	ICODE = CF_MemRead16(pc); \
+	dump_instruction(); \
+	CF_SetRegPC(pc + 2); \
+	goto *target[ICODE];
+
+static void
+run(GlobalClock_LocalClock_t *clk, void *data)
+{
+	static const void *const labels[DISPATCH_SLOTS] = DISPATCH_LABELS;
+	const void **target = Dispatch_MapTargets(&cfDispatch, labels);
+	uint32_t pc, sp;
+	uint64_t rest;
+	CycleCounter_t synced_cycles;
+	sp = CF_MemRead32(0);
+	pc = CF_MemRead32(4);
+	CF_SetRegA(sp, 7);
+	CF_SetRegPC(pc);
+	fprintf(stderr, "Starting Coldfire CPU at 0x%08x\n", pc);
+	synced_cycles = CycleCounter;
+ sync:
+	do {
+		/* Sync with the GlobalClock only at the end of a batch */
+		rest = GlobalClock_Advance(clk, CycleCounter - synced_cycles);
+		synced_cycles = CycleCounter;
+		CycleTimers_Check();
+		batchCycles = CycleTimers_Horizon(rest);
+	} while (batchCycles <= 0);
+	pc = CF_GetRegPC();
+	ICODE = CF_MemRead16(pc);
+	dump_instruction();
+	CF_SetRegPC(pc + 2);
+	goto *target[ICODE];
+	DISPATCH_HANDLERS(CF_HANDLER)
+}
+#else
 static void
 run(GlobalClock_LocalClock_t *clk, void *data)
 {
 	Device_MPU_t *dev = data;
 	InstructionProc *iproc;
 	uint32_t pc, sp;
+	uint64_t rest;
+	CycleCounter_t synced_cycles;
 	sp = CF_MemRead32(0);
 	pc = CF_MemRead32(4);
 	CF_SetRegA(sp, 7);
 	CF_SetRegPC(pc);
 	fprintf(stderr, "Starting Coldfire CPU at 0x%08x\n", pc);
+	synced_cycles = CycleCounter;
 	while (1) {
-		pc = CF_GetRegPC();
-		ICODE = CF_MemRead16(pc);
-		iproc = InststructionProcFind(ICODE);
-		dump_instruction();
-		CF_SetRegPC(pc + 2);
-		iproc();
-		GlobalClock_ConsumeCycle(clk, 2);
-		CycleCounter += 2;	/* Should be moved to iprocs */
+		/* Sync with the GlobalClock only at the end of a batch */
+		rest = GlobalClock_Advance(clk, CycleCounter - synced_cycles);
+		synced_cycles = CycleCounter;
 		CycleTimers_Check();
-		CheckSignals();
+		batchCycles = CycleTimers_Horizon(rest);
+		while (batchCycles > 0) {
+			pc = CF_GetRegPC();
+			ICODE = CF_MemRead16(pc);
+			iproc = InststructionProcFind(ICODE);
+			dump_instruction();
+			CF_SetRegPC(pc + 2);
+			iproc();
+			CycleCounter += 2;	/* Should be moved to iprocs */
+			batchCycles -= 2;
+			CheckSignals();
+		}
 	}
 }
+#endif
 
 
 //==============================================================================
@@ -1,4 +1,5 @@
 #include <stdint.h>
+#include "compiler_extensions.h"
 #include "coldfire/mem_cf.h"
 
 #define CR_REG_CACR	(2)
@@ -168,7 +169,7 @@ typedef struct {
 #define HWCONFIG_D0_MFC5282	(0xcf206080)
 #define HWCONFIG_D1_MFC5282	(0x13b01080)
 
-extern CFCpu g_CFCpu;
+extern __MACHINE_LOCAL__ CFCpu g_CFCpu;
 
 #define CF_REG_CCR (g_CFCpu.reg_CCR)
 #define CF_REG_MACSR (g_CFCpu.reg_macSR)
@@ -19,12 +19,15 @@
 #include "instructions_cf.h"
 #include "sgstring.h"
 
-InstructionProc **iProcTab;
+__MACHINE_LOCAL__ InstructionProc **cf_iProcTab;
+#ifdef LEIGUN_THREADED_DISPATCH
+__MACHINE_LOCAL__ Dispatch_Map cfDispatch;
+#endif
 typedef struct IDecoder {
 	Instruction *instr[0x10000];
 } IDecoder;
 
-static IDecoder *s_idec;
+static __MACHINE_LOCAL__ IDecoder *s_idec;
 
 static Instruction instrlist[] = {
 	{0xf1c0, 0xd080, "add", cf_add},
@@ -155,14 +158,14 @@ CF_IDecoderNew()
 	int nr_instructions = sizeof(instrlist) / sizeof(Instruction);
 	IDecoder *idec = sg_new(IDecoder);
 	s_idec = idec;
-	iProcTab = sg_calloc(0x10000 * sizeof(InstructionProc *));
+	cf_iProcTab = sg_calloc(0x10000 * sizeof(InstructionProc *));
 	for (i = 0; i < 0x10000; i++) {
 		for (j = 0; j < nr_instructions; j++) {
 			Instruction *instr = &instrlist[j];
 			if ((i & instr->mask) == instr->icode) {
 				if (!idec->instr[i]) {
 					idec->instr[i] = instr;
-					iProcTab[i] = instr->proc;
+					cf_iProcTab[i] = instr->proc;
 				} else {
 					uint16_t mask = idec->instr[i]->mask & instr->mask;
 					if (idec->instr[i]->mask == instr->mask) {
@@ -178,7 +181,7 @@ CF_IDecoderNew()
 						 */
 					} else if (mask == idec->instr[i]->mask) {
 						idec->instr[i] = instr;
-						iProcTab[i] = instr->proc;
+						cf_iProcTab[i] = instr->proc;
 					} else {
 						fprintf(stderr,
 							"Can not decide %s(%04x) %s(%04x) \n",
@@ -190,9 +193,12 @@ CF_IDecoderNew()
 		}
 		if (idec->instr[i] == NULL) {
 			idec->instr[i] = &instr_undefined;
-			iProcTab[i] = cf_undefined;
+			cf_iProcTab[i] = cf_undefined;
 		}
 	}
+#ifdef LEIGUN_THREADED_DISPATCH
+	Dispatch_MapInit(&cfDispatch, cf_iProcTab, 0x10000);
+#endif
 	fprintf(stderr, "Coldfire Instruction decoder created\n");
 }
 
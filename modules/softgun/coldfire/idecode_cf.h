@@ -1,7 +1,14 @@
 #include <stdint.h>
+#include "compiler_extensions.h"
+#ifdef LEIGUN_THREADED_DISPATCH
+#include "dispatch.h"
+#endif
 
 typedef void InstructionProc(void);
-extern InstructionProc **iProcTab;
+extern __MACHINE_LOCAL__ InstructionProc **cf_iProcTab;
+#ifdef LEIGUN_THREADED_DISPATCH
+extern __MACHINE_LOCAL__ Dispatch_Map cfDispatch;
+#endif
 
 typedef struct Instruction {
 	uint16_t mask;
@@ -15,7 +22,7 @@ void CF_IDecoderNew();
 static inline InstructionProc *
 InststructionProcFind(uint16_t icode)
 {
-	return iProcTab[icode];
+	return cf_iProcTab[icode];
 }
 
 Instruction *CF_InstructionFind(uint16_t icode);
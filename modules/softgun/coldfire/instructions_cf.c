@@ -794,7 +794,7 @@ cf_aslr(void)
 #define CC_VC	 (0x8)
 #define CC_VS	 (0x9)
 
-static uint8_t condition_tab[256];
+static __MACHINE_LOCAL__ uint8_t condition_tab[256];
 
 /*
  ************************************************************************************
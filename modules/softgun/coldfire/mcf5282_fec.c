@@ -40,7 +40,7 @@
 #include <string.h>
 #include <stdint.h>
 #include <errno.h>
-#include <linux-tap.h>
+#include <netbackend.h>
 #include <bus.h>
 #include <phy.h>
 #include <signode.h>
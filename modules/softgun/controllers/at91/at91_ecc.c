@@ -44,6 +44,7 @@
 #include "sgstring.h"
 #include "sglib.h"
 #include "at91_ecc.h"
+#include "compiler_extensions.h"
 
 #define REG_ECC_CR(base)	((base) + 0x00)
 #define REG_ECC_MR(base)	((base) + 0x04)
@@ -72,9 +73,9 @@ struct AT91Ecc {
 	uint16_t calcPar;
 };
 
-static uint8_t *precalc_col8_tab = NULL;
-static uint8_t *precalc_col8_ntab = NULL;
-static uint8_t *precalc_bytepar = NULL;
+static __MACHINE_LOCAL__ uint8_t *precalc_col8_tab = NULL;
+static __MACHINE_LOCAL__ uint8_t *precalc_col8_ntab = NULL;
+static __MACHINE_LOCAL__ uint8_t *precalc_bytepar = NULL;
 
 #define BIT(x,n) (!!(((x) >> (n)) & 1))
 
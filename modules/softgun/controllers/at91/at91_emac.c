@@ -50,9 +50,7 @@
 #include "signode.h"
 #include "cycletimer.h"
 #include "sgstring.h"
-#include "linux-tap.h"
-
-#include "asyncmanager.h"
+#include "netbackend.h"
 
 #if 1
 #define dbgprintf(...) { fprintf(stderr,__VA_ARGS__); }
@@ -217,8 +215,7 @@
 #define MAX_PHYS	(32)
 typedef struct AT91Emac {
 	BusDevice bdev;
-	int ether_fd;
-	PollHandle_t *input_fh;
+	NetBackend *backend;
 	int receiver_is_enabled;
 	PHY_Device *phy[MAX_PHYS];
 	CycleTimer rcvDelayTimer;
@@ -361,14 +358,14 @@ dma_write_packet(AT91Emac * emac, uint8_t * buf, int count, uint32_t matchflags)
 }
 
 static void
-input_event(PollHandle_t *handle, int status, int events, void *clientdata)
+input_event(void *clientdata)
 {
 	AT91Emac *emac = clientdata;
 	int result;
 	uint8_t buf[1522];
 	uint32_t matchflags;
 	while (emac->receiver_is_enabled) {
-		result = read(emac->ether_fd, buf, 1522);
+		result = NetBackend_Receive(emac->backend, buf, 1522);
 		if (result > 0) {
 			matchflags = match_address(emac, buf);
 			if (!matchflags && !(emac->cfg & CFG_CAF)) {
@@ -401,9 +398,9 @@ input_event(PollHandle_t *handle, int status, int events, void *clientdata)
 static void
 enable_receiver(AT91Emac * emac)
 {
-	if (!emac->receiver_is_enabled && (emac->ether_fd >= 0)) {
+	if (!emac->receiver_is_enabled && emac->backend) {
 		dbgprintf("AT91Emac: enable receiver\n");
-		AsyncManager_PollStart(emac->input_fh, ASYNCMANAGER_EVENT_READABLE, &input_event, emac);
+		NetBackend_RxStart(emac->backend, input_event, emac);
 		emac->receiver_is_enabled = 1;
 	}
 }
@@ -413,7 +410,7 @@ disable_receiver(AT91Emac * emac)
 {
 	if (emac->receiver_is_enabled) {
 		dbgprintf("AT91Emac: disable receiver\n");
-		AsyncManager_PollStop(emac->input_fh);
+		NetBackend_RxStop(emac->backend);
 		emac->receiver_is_enabled = 0;
 	}
 }
@@ -431,7 +428,7 @@ transmit_packet(AT91Emac * emac)
 		memset(buf + len, 0x00, 60 - len);
 		len = 60;
 	}
-	if (write(emac->ether_fd, buf, len) == len) {
+	if (NetBackend_Send(emac->backend, buf, len) == len) {
 		emac->fra++;
 	}
 	emac->isr |= ISR_TCOM | ISR_TIDLE;
@@ -1236,8 +1233,7 @@ BusDevice *
 AT91Emac_New(const char *name)
 {
 	AT91Emac *emac = sg_new(AT91Emac);
-	emac->ether_fd = Net_CreateInterface(name);
-	emac->input_fh = AsyncManager_PollInit(emac->ether_fd);
+	emac->backend = NetBackend_New(name);
 	emac->irqNode = SigNode_New("%s.irq", name);
 	if (!emac->irqNode) {
 		fprintf(stderr, "AT91Emac: Can't create interrupt request line\n");
@@ -51,9 +51,7 @@
 #include "cycletimer.h"
 #include "sgstring.h"
 #include "crc32.h"
-#include "linux-tap.h"
-
-#include "asyncmanager.h"
+#include "netbackend.h"
 
 
 #if 0
@@ -247,8 +245,7 @@
 #define MAX_PHYS	(32)
 typedef struct AT91Emacb {
 	BusDevice bdev;
-	int ether_fd;
-	PollHandle_t *input_fh;
+	NetBackend *backend;
 	int receiver_is_enabled;
 	PHY_Device *phy[MAX_PHYS];
 	CycleTimer rcvDelayTimer;
@@ -343,6 +340,7 @@ transmit_pkt(AT91Emacb * emac)
 	uint32_t i;
 	uint8_t pkt[2048];
 	uint32_t pktsize = 0;
+	int result;
 	for (i = 0; i < 128; i++) {
 		descr_addr = emac->regTBQP | emac->tbdscr_offs;
 		tba = Bus_Read32(descr_addr);
@@ -379,7 +377,8 @@ transmit_pkt(AT91Emacb * emac)
 				memset(pkt + pktsize, 0x00, 60 - pktsize);
 				pktsize = 60;
 			}
-			if (write(emac->ether_fd, pkt, pktsize) == pktsize) {
+			result = NetBackend_Send(emac->backend, pkt, pktsize);
+			if ((result >= 0) && ((uint32_t)result == pktsize)) {
 				//emac->fra++;
 				emac->regTSR |= TSR_COMP;
 				emac->regISR |= ISR_TCOMP;
@@ -597,7 +596,7 @@ dma_write_packet(AT91Emacb * emac, uint8_t * pkt, unsigned int count, uint32_t m
  **************************************************************
  */
 static void
-input_event(PollHandle_t *handle, int status, int events, void *clientdata)
+input_event(void *clientdata)
 {
 	AT91Emacb *emac = clientdata;
 	int result;
@@ -607,7 +606,7 @@ input_event(PollHandle_t *handle, int status, int events, void *clientdata)
 	uint32_t crc;
 	uint32_t matchflags, match;
 	while (emac->receiver_is_enabled) {
-		result = read(emac->ether_fd, buf, 1532);
+		result = NetBackend_Receive(emac->backend, buf, 1532);
 		if (result > 0) {
 			if (result < 60) {
 				/* PAD with 0 */
@@ -652,9 +651,9 @@ input_event(PollHandle_t *handle, int status, int events, void *clientdata)
 static void
 enable_receiver(AT91Emacb * emac)
 {
-	if (!emac->receiver_is_enabled && (emac->ether_fd >= 0)) {
+	if (!emac->receiver_is_enabled && emac->backend) {
 		dbgprintf("AT91Emacb: enable receiver\n");
-		AsyncManager_PollStart(emac->input_fh, ASYNCMANAGER_EVENT_READABLE, &input_event, emac);
+		NetBackend_RxStart(emac->backend, input_event, emac);
 		emac->receiver_is_enabled = 1;
 	}
 }
@@ -664,7 +663,7 @@ disable_receiver(AT91Emacb * emac)
 {
 	if (emac->receiver_is_enabled) {
 		dbgprintf("AT91Emacb: disable receiver\n");
-		AsyncManager_PollStop(emac->input_fh);
+		NetBackend_RxStop(emac->backend);
 		emac->receiver_is_enabled = 0;
 	}
 }
@@ -1637,8 +1636,7 @@ BusDevice *
 AT91Emacb_New(const char *name)
 {
 	AT91Emacb *emac = sg_new(AT91Emacb);
-	emac->ether_fd = Net_CreateInterface(name);
-	emac->input_fh = AsyncManager_PollInit(emac->ether_fd);
+	emac->backend = NetBackend_New(name);
 	emac->irqNode = SigNode_New("%s.irq", name);
 	if (!emac->irqNode) {
 		fprintf(stderr, "AT91Emacb: Can't create interrupt request line\n");
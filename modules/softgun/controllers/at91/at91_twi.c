@@ -46,6 +46,7 @@
 #include "clock.h"
 #include "at91_twi.h"
 #include "senseless.h"
+#include "configfile.h"
 
 #if 0
 #define dbgprintf(...) { fprintf(stderr,__VA_ARGS__); }
@@ -152,6 +153,12 @@
 #define INSTR_READ_ACK          (0x0c000000)
 #define INSTR_RXDATA_AVAIL      (0x0d000000)
 #define INSTR_WAIT_BUS_FREE     (0x0e000000)
+/* Transaction level bus operations */
+#define INSTR_BUS_START		(0x0f000000)
+#define INSTR_BUS_WRITE		(0x10000000)
+#define INSTR_BUS_READ		(0x11000000)
+#define INSTR_BUS_ACK		(0x12000000)
+#define INSTR_BUS_STOP		(0x13000000)
 
 #define RET_DONE		(0)
 #define RET_DO_NEXT		(1)
@@ -205,6 +212,8 @@ typedef struct AT91Twi {
 	uint16_t ip;
 	uint32_t icount;
 	uint32_t code[CODE_MEM_SIZE];
+	/* Transaction level port, NULL when the bus is emulated bitwise */
+	I2C_Bus *bus;
 
 	/* Slave functionality */
 	I2C_SerDes *serdes;
@@ -221,6 +230,7 @@ typedef struct AT91Twi {
 #define T_SUDAT(twi) ((twi)->i2c_timing.t_sudat)
 #define T_SUSTO(twi) ((twi)->i2c_timing.t_susto)
 #define T_BUF(twi) ((twi)->i2c_timing.t_buf)
+#define T_BIT(twi) (T_LOW(twi) + T_HIGH(twi))
 
 static void
 update_interrupt(AT91Twi * twi)
@@ -243,6 +253,11 @@ update_interrupt(AT91Twi * twi)
 static void
 mscript_check_ack(AT91Twi * twi)
 {
+	if (twi->bus) {
+		ADD_CODE(twi, INSTR_NDELAY | T_BIT(twi));
+		ADD_CODE(twi, INSTR_CHECK_ACK);
+		return;
+	}
 	/* check ack of previous */
 	ADD_CODE(twi, INSTR_SDA_H);
 	ADD_CODE(twi, INSTR_NDELAY | (T_LOW(twi) - T_HDDAT(twi)));
@@ -267,6 +282,13 @@ static void
 mscript_write_byte(AT91Twi * twi, uint8_t data)
 {
 	int i;
+	if (twi->bus) {
+		ADD_CODE(twi, INSTR_BUS_WRITE | data);
+		ADD_CODE(twi, INSTR_NDELAY | (8 * T_BIT(twi)));
+		mscript_check_ack(twi);
+		ADD_CODE(twi, INSTR_NDELAY | (T_LOW(twi) - T_HDDAT(twi)));
+		return;
+	}
 	for (i = 7; i >= 0; i--) {
 		int bit = (data >> i) & 1;
 		if (bit) {
@@ -299,6 +321,11 @@ mscript_write_byte(AT91Twi * twi, uint8_t data)
 static void
 mscript_do_ack(AT91Twi * twi, int ack)
 {
+	if (twi->bus) {
+		ADD_CODE(twi, INSTR_BUS_ACK | ack);
+		ADD_CODE(twi, INSTR_NDELAY | T_BIT(twi));
+		return;
+	}
 	if (ack == ACK) {
 		ADD_CODE(twi, INSTR_SDA_L);
 	} else {
@@ -328,6 +355,12 @@ static void
 mscript_read_byte(AT91Twi * twi)
 {
 	int i;
+	if (twi->bus) {
+		ADD_CODE(twi, INSTR_BUS_READ);
+		ADD_CODE(twi, INSTR_NDELAY | (8 * T_BIT(twi)));
+		ADD_CODE(twi, INSTR_RXDATA_AVAIL);
+		return;
+	}
 	ADD_CODE(twi, INSTR_SDA_H);
 	for (i = 7; i >= 0; i--) {
 		ADD_CODE(twi, INSTR_NDELAY | (T_LOW(twi) - T_HDDAT(twi)));
@@ -353,6 +386,12 @@ static void
 mscript_stop(AT91Twi * twi)
 {
 	dbgprintf("Append stop\n");
+	if (twi->bus) {
+		ADD_CODE(twi, INSTR_BUS_STOP);
+		ADD_CODE(twi, INSTR_NDELAY | (T_LOW(twi) - T_HDDAT(twi) + T_SUSTO(twi) + T_BUF(twi)));
+		ADD_CODE(twi, INSTR_INTERRUPT | SR_TXCOMP);
+		return;
+	}
 	ADD_CODE(twi, INSTR_SDA_L);
 	ADD_CODE(twi, INSTR_NDELAY | (T_LOW(twi) - T_HDDAT(twi)));
 	ADD_CODE(twi, INSTR_SCL_H);
@@ -378,6 +417,15 @@ mscript_stop(AT91Twi * twi)
 static void
 mscript_start(AT91Twi * twi, int startmode)
 {
+	if (twi->bus) {
+		uint32_t nsecs = T_HDSTA(twi) + T_HDDAT(twi);
+		if (startmode == STARTMODE_REPSTART) {
+			nsecs += T_LOW(twi) - T_HDDAT(twi) + T_HIGH(twi);
+		}
+		ADD_CODE(twi, INSTR_BUS_START);
+		ADD_CODE(twi, INSTR_NDELAY | nsecs);
+		return;
+	}
 	/* For repeated start do not assume SDA and SCL state */
 	if (startmode == STARTMODE_REPSTART) {
 		ADD_CODE(twi, INSTR_SDA_H);
@@ -554,6 +602,39 @@ execute_instruction(AT91Twi * twi)
 		    /* Wait bus free currently not implemented */
 		    break;
 
+	    case INSTR_BUS_START:
+		    dbgprintf("BUS_START %08x\n", icode);
+		    I2C_BusStart(twi->bus);
+		    break;
+
+	    case INSTR_BUS_WRITE:
+		    dbgprintf("BUS_WRITE %08x\n", icode);
+		    if (I2C_BusWrite(twi->bus, icode & 0xff) == I2C_ACK) {
+			    twi->ack = ACK;
+		    } else {
+			    twi->ack = NACK;
+		    }
+		    break;
+
+	    case INSTR_BUS_READ:
+		    {
+			    uint8_t data;
+			    I2C_BusRead(twi->bus, &data);
+			    twi->rxdata = data;
+			    dbgprintf("BUS_READ %02x\n", data);
+		    }
+		    break;
+
+	    case INSTR_BUS_ACK:
+		    dbgprintf("BUS_ACK %08x\n", icode);
+		    I2C_BusAck(twi->bus, ((icode & 0xff) == ACK) ? I2C_ACK : I2C_NACK);
+		    break;
+
+	    case INSTR_BUS_STOP:
+		    dbgprintf("BUS_STOP %08x\n", icode);
+		    I2C_BusStop(twi->bus);
+		    break;
+
 	    default:
 		    fprintf(stderr, "AT91Twi: I2C: Unknode icode %08x\n", icode);
 		    return RET_EMU_ERROR;
@@ -1084,6 +1165,7 @@ AT91Twi_New(const char *name, uint32_t features)
 	char *sdaname = (char *)alloca(strlen(name) + 50);
 	char *sclname = (char *)alloca(strlen(name) + 50);
 	I2C_Slave *i2c_slave;
+	uint32_t transaction_level = 0;
 	AT91Twi *twi = sg_new(AT91Twi);
 
 	twi->name = sg_strdup(name);
@@ -1096,6 +1178,11 @@ AT91Twi_New(const char *name, uint32_t features)
 		fprintf(stderr, "AT91Twi: Can not create signal lines\n");
 		exit(1);
 	}
+	/* Skip the SDA/SCL emulation and talk to the slaves bytewise */
+	Config_ReadUInt32(&transaction_level, name, "transaction_level");
+	if (transaction_level) {
+		twi->bus = I2C_BusNew(twi->sda);
+	}
 
 	if (features & TWI_FEATURE_SLAVE) {
 		/* Create the slave */
@@ -38,6 +38,7 @@
 #include <sgstring.h>
 #include <diskimage.h>
 #include <configfile.h>
+#include <snapshot.h>
 #include <ctype.h>
 #include <at91sam_efc.h>
 
@@ -126,6 +127,10 @@ AT91SAM7_EfcNew(BusDevice ** flash, BusDevice ** efcdev, const char *efcname, co
 			exit(42);
 		}
 		efc->host_mem = DiskImage_Mmap(efc->disk_image);
+		/* A restored snapshot overwrites the image with the saved contents */
+		Snapshot_RegisterState(flashname, efc->host_mem, efc->size, NULL, NULL);
+	} else {
+		efc->host_mem = Snapshot_AllocRam(flashname, efc->size, 0xff);
 	}
 	efc->efcdev.first_mapping = NULL;
 	efc->efcdev.Map = AT91Efc_Map;
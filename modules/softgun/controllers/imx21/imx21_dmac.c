@@ -380,6 +380,50 @@ dma_write(DMAChan * chan, int dmod, int dsiz)
 	}
 }
 
+/*
+ * ---------------------------------------------------------------
+ * Linear memory to memory transfer
+ *	Accessing memory has no side effects, so the request line
+ *	can not change during the transfer and the remaining count
+ *	is copied block by block instead of element by element.
+ *	The copy stops at the first address which is not memory and
+ *	leaves the rest to the element wise transfer.
+ * ---------------------------------------------------------------
+ */
+static void
+dma_linear_burst(DMAChan * chan, uint32_t elsize)
+{
+	uint8_t *src, *dst;
+	uint32_t sspan, dspan, len;
+	uint32_t dist = chan->dar - chan->sar;
+	/* The element wise transfer copies complete elements only */
+	uint32_t end = chan->ccnr + ((chan->cntr - chan->ccnr + elsize - 1) & ~(elsize - 1));
+	while (chan->ccnr < end) {
+		src = Bus_GetHVASpanRead(chan->sar + chan->ccnr, &sspan);
+		dst = Bus_GetHVASpanWrite(chan->dar + chan->ccnr, &dspan);
+		if (!src || !dst) {
+			return;
+		}
+		len = end - chan->ccnr;
+		if (len > sspan) {
+			len = sspan;
+		}
+		if (len > dspan) {
+			len = dspan;
+		}
+		/* 
+		 * Keep the result of the forward copy when the destination
+		 * overlaps the end of the source.
+		 */
+		if (dist && (dist < len)) {
+			len = dist;
+		}
+		memmove(dst, src, len);
+		Bus_HostWritten(dst, chan->dar + chan->ccnr, len);
+		chan->ccnr += len;
+	}
+}
+
 static void
 do_dma(DMAChan * chan)
 {
@@ -424,6 +468,12 @@ do_dma(DMAChan * chan)
 		fprintf(stderr, "i.MX21 DMAC: downwards DMA direction not implemented\n");
 		return;
 	}
+	if ((smod == CCR_SMOD_LINEAR) && (dmod == CCR_DMOD_LINEAR) && (ssiz == dsiz)
+	    && (chan->ccnr < chan->cntr)
+	    && ((SigNode_Val(chan->currReqLine) == SIG_LOW) || !(chan->ccr & CCR_REN))) {
+		dma_linear_burst(chan, ssiz >> 3);
+	}
+	/* FIFOs and IO: element by element, the peripheral may drop the request */
 	while ((chan->ccnr < chan->cntr)
 	       && ((SigNode_Val(chan->currReqLine) == SIG_LOW) || !(chan->ccr & CCR_REN))) {
 		chan->xferbuf_wp = 0;
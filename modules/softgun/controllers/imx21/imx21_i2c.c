@@ -48,6 +48,7 @@
 #include <sys/fcntl.h>
 #include "bus.h"
 #include "signode.h"
+#include "i2c_serdes.h"
 #include "imx21_i2c.h"
 #include "configfile.h"
 #include "cycletimer.h"
@@ -90,6 +91,12 @@
 #define INSTR_READ_ACK          (0x0c000000)
 #define INSTR_RXDATA_AVAIL      (0x0d000000)
 #define INSTR_WAIT_BUS_FREE     (0x0e000000)
+/* Transaction level bus operations */
+#define INSTR_BUS_START         (0x0f000000)
+#define INSTR_BUS_WRITE         (0x10000000)
+#define INSTR_BUS_READ          (0x11000000)
+#define INSTR_BUS_ACK           (0x12000000)
+#define INSTR_BUS_STOP          (0x13000000)
 
 /* The timings */
 #define T_HDSTA(i2c) ((i2c)->i2c_timing.t_hdsta)
@@ -101,6 +108,7 @@
 #define T_SUDAT(i2c) ((i2c)->i2c_timing.t_sudat)
 #define T_SUSTO(i2c) ((i2c)->i2c_timing.t_susto)
 #define T_BUF(i2c) ((i2c)->i2c_timing.t_buf)
+#define T_BIT(i2c) (T_LOW(i2c) + T_HIGH(i2c))
 
 typedef struct I2C_Timing {
 	int speed;
@@ -141,6 +149,8 @@ typedef struct IMX21I2c {
 	uint16_t icount;
 	uint32_t code[CODE_MEM_SIZE];
 	int wait_bus_free;
+	/* Transaction level port, NULL when the bus is emulated bitwise */
+	I2C_Bus *bus;
 } IMX21I2c;
 
 #define RET_DONE		(0)
@@ -331,6 +341,42 @@ execute_instruction(IMX21I2c * i2c)
 		    }
 		    break;
 
+	    case INSTR_BUS_START:
+		    dbgprintf("BUS_START %08x\n", icode);
+		    /* The own start condition is not seen by the SDA trace */
+		    i2c->i2sr |= I2SR_IBB;
+		    I2C_BusStart(i2c->bus);
+		    break;
+
+	    case INSTR_BUS_WRITE:
+		    dbgprintf("BUS_WRITE %08x\n", icode);
+		    if (I2C_BusWrite(i2c->bus, icode & 0xff) == I2C_ACK) {
+			    i2c->ack = ACK;
+		    } else {
+			    i2c->ack = NACK;
+		    }
+		    break;
+
+	    case INSTR_BUS_READ:
+		    {
+			    uint8_t data;
+			    I2C_BusRead(i2c->bus, &data);
+			    i2c->rxdata = data;
+			    dbgprintf("BUS_READ %02x\n", data);
+		    }
+		    break;
+
+	    case INSTR_BUS_ACK:
+		    dbgprintf("BUS_ACK %08x\n", icode);
+		    I2C_BusAck(i2c->bus, ((icode & 0xff) == ACK) ? I2C_ACK : I2C_NACK);
+		    break;
+
+	    case INSTR_BUS_STOP:
+		    dbgprintf("BUS_STOP %08x\n", icode);
+		    I2C_BusStop(i2c->bus);
+		    i2c->i2sr &= ~I2SR_IBB;
+		    break;
+
 	    default:
 		    fprintf(stderr, "i.MX21 I2C: Unknode instruction code %08x\n", icode);
 		    return RET_INTERP_ERROR;
@@ -388,6 +434,11 @@ reset_interpreter(IMX21I2c * i2c)
 static void
 mscript_do_ack(IMX21I2c * i2c, int ack)
 {
+	if (i2c->bus) {
+		i2c->code[i2c->icount++] = INSTR_BUS_ACK | ack;
+		i2c->code[i2c->icount++] = INSTR_NDELAY | T_BIT(i2c);
+		return;
+	}
 	if (ack == ACK) {
 		i2c->code[i2c->icount++] = INSTR_SDA_L;
 	} else {
@@ -408,6 +459,18 @@ mscript_do_ack(IMX21I2c * i2c, int ack)
 void
 mscript_start(IMX21I2c * i2c)
 {
+	if (i2c->bus) {
+		if (i2c->mstate != MSTATE_IDLE) {
+			i2c->code[i2c->icount++] =
+			    INSTR_NDELAY | (T_LOW(i2c) - T_HDDAT(i2c) + T_HIGH(i2c));
+		} else {
+			i2c->code[i2c->icount++] = INSTR_WAIT_BUS_FREE;
+			i2c->code[i2c->icount++] = INSTR_NDELAY | 50;
+		}
+		i2c->code[i2c->icount++] = INSTR_BUS_START;
+		i2c->code[i2c->icount++] = INSTR_NDELAY | (T_HDSTA(i2c) + T_HDDAT(i2c));
+		return;
+	}
 	/* Repstart */
 	if (i2c->mstate != MSTATE_IDLE) {
 		i2c->code[i2c->icount++] = INSTR_SDA_H;
@@ -441,6 +504,12 @@ mscript_start(IMX21I2c * i2c)
 static void
 mscript_stop(IMX21I2c * i2c)
 {
+	if (i2c->bus) {
+		i2c->code[i2c->icount++] = INSTR_BUS_STOP;
+		i2c->code[i2c->icount++] =
+		    INSTR_NDELAY | (T_LOW(i2c) - T_HDDAT(i2c) + T_SUSTO(i2c) + T_BUF(i2c));
+		return;
+	}
 	i2c->code[i2c->icount++] = INSTR_SDA_L;
 	i2c->code[i2c->icount++] = INSTR_NDELAY | (T_LOW(i2c) - T_HDDAT(i2c));
 	i2c->code[i2c->icount++] = INSTR_SCL_H;
@@ -461,6 +530,11 @@ mscript_stop(IMX21I2c * i2c)
 static void
 mscript_check_ack(IMX21I2c * i2c)
 {
+	if (i2c->bus) {
+		i2c->code[i2c->icount++] = INSTR_NDELAY | T_BIT(i2c);
+		i2c->code[i2c->icount++] = INSTR_CHECK_ACK;
+		return;
+	}
 	/* check ack of previous */
 	i2c->code[i2c->icount++] = INSTR_SDA_H;
 	i2c->code[i2c->icount++] = INSTR_NDELAY | (T_LOW(i2c) - T_HDDAT(i2c));
@@ -485,6 +559,13 @@ static void
 mscript_read_byte(IMX21I2c * i2c)
 {
 	int i;
+	if (i2c->bus) {
+		i2c->code[i2c->icount++] = INSTR_BUS_READ;
+		i2c->code[i2c->icount++] = INSTR_NDELAY | (8 * T_BIT(i2c));
+		i2c->code[i2c->icount++] = INSTR_RXDATA_AVAIL;
+		i2c->code[i2c->icount++] = INSTR_INTERRUPT;
+		return;
+	}
 	i2c->code[i2c->icount++] = INSTR_SDA_H;
 	for (i = 7; i >= 0; i--) {
 		i2c->code[i2c->icount++] = INSTR_NDELAY | (T_LOW(i2c) - T_HDDAT(i2c));
@@ -511,6 +592,12 @@ static void
 mscript_write_byte(IMX21I2c * i2c, uint8_t data)
 {
 	int i;
+	if (i2c->bus) {
+		i2c->code[i2c->icount++] = INSTR_BUS_WRITE | data;
+		i2c->code[i2c->icount++] = INSTR_NDELAY | (8 * T_BIT(i2c));
+		mscript_check_ack(i2c);
+		return;
+	}
 	for (i = 7; i >= 0; i--) {
 		int bit = (data >> i) & 1;
 		if (bit) {
@@ -714,6 +801,7 @@ BusDevice *
 IMX21_I2cNew(const char *name)
 {
 	I2C_Timing *timing;
+	uint32_t transaction_level = 0;
 	IMX21I2c *i2c = sg_new(IMX21I2c);
 	timing = &i2c->i2c_timing;
 	i2c->irqNode = SigNode_New("%s.irq", name);
@@ -728,6 +816,11 @@ IMX21_I2cNew(const char *name)
 		exit(342);
 	}
 	i2c->sdaTrace = SigNode_Trace(i2c->sdaNode, sda_trace_proc, i2c);
+	/* Skip the SDA/SCL emulation and talk to the slaves bytewise */
+	Config_ReadUInt32(&transaction_level, name, "transaction_level");
+	if (transaction_level) {
+		i2c->bus = I2C_BusNew(i2c->sdaNode);
+	}
 	/* Currently fixed to low speed */
 	timing->t_hdsta = 4000;
 	timing->t_low = 4700;
@@ -547,6 +547,7 @@ typedef struct RootHubPort {
 #define HCMD_WAIT_DATA_IN		(0x0d000000)
 #define	HCMD_DO				(0x0e000000)
 #define	HCMD_WHILE			(0x0f000000)
+#define	HCMD_TRANSFER			(0x10000000)
 #define 	COND_ETD_NOT_DONE	(0x07)
 
 typedef struct IMXUsbHost {
@@ -587,6 +588,13 @@ typedef struct IMXUsbHost {
 	int code_wp;
 	UsbPacket usbpkt;	/* Assembly and receive buffer */
 
+	/* Transaction level mode: whole ETDs are handed to the devices */
+	int transfer_level;
+	UsbTransfer xfer;
+	int xfer_cc;
+	uint8_t *xfer_buf;
+	uint32_t xfer_bufsize;
+
 	int token;
 	RootHubPort port[3];
 	SigNode *intUsbHost;
@@ -1900,6 +1908,111 @@ hscript_add(IMXUsbHost * host, uint32_t icode)
 	}
 }
 
+/*
+ * -------------------------------------------------------------
+ * The transaction level mode is used for control and bulk ETDs
+ * which have their data in main memory (DMA enabled). All others
+ * go through the packet level microcode.
+ * -------------------------------------------------------------
+ */
+static int
+etd_transfer_level_possible(IMXUsbHost * host, Etd * etd)
+{
+	uint32_t format = etd->hwControl & HETD_FORMAT_MASK;
+	if (!host->transfer_level) {
+		return 0;
+	}
+	if ((format != HETD_FORMAT_CONTROL) && (format != HETD_FORMAT_BULK)) {
+		return 0;
+	}
+	if (!(host->otg->dma_etddmaen & (1 << etd->nr))) {
+		return 0;
+	}
+	return 1;
+}
+
+/*
+ * ------------------------------------------------------------------------------
+ * etd_do_transfer
+ *	Exchange all data of an ETD with the device in one step. Returns the
+ *	time in nanoseconds the transfer would occupy the bus, the ETD is
+ *	completed when it has elapsed.
+ * ------------------------------------------------------------------------------
+ */
+static uint32_t
+etd_do_transfer(IMXUsbHost * host, Etd * etd, int toggle)
+{
+	IMXOtg *otg = host->otg;
+	UsbTransfer *xfer = &host->xfer;
+	uint32_t addr = otg->dma_etdsmsa[etd->nr] + etd->dmabufptr;
+	uint32_t totbyecnt = etd->dword3 & 0x1fffff;
+	uint32_t bittime;
+	int result = USB_RET_NODEV;
+	int i;
+
+	memset(xfer, 0, sizeof(*xfer));
+	switch (etd->bufstat & CBITD_DIRPID_MASK) {
+	    case CBITD_DIRPID_SETUP:
+		    xfer->pid = USB_PID_SETUP;
+		    break;
+	    case CBITD_DIRPID_OUT:
+		    xfer->pid = USB_PID_OUT;
+		    break;
+	    default:
+		    xfer->pid = USB_PID_IN;
+		    break;
+	}
+	if (totbyecnt > host->xfer_bufsize) {
+		host->xfer_buf = sg_realloc(host->xfer_buf, totbyecnt);
+		host->xfer_bufsize = totbyecnt;
+	}
+	xfer->addr = etd->hwControl & HETD_ADDRESS_MASK;
+	xfer->epnum = (etd->hwControl >> 7) & 0xf;
+	xfer->maxpacket = (etd->hwControl & HETD_MAXPKTSIZ_MASK) >> HETD_MAXPKTSIZ_SHIFT;
+	xfer->data = host->xfer_buf;
+	xfer->len = totbyecnt;
+	xfer->toggle = toggle;
+	if (xfer->pid != USB_PID_IN) {
+		Bus_Read(xfer->data, addr, totbyecnt);
+	}
+	for (i = 0; (i < 3) && (result == USB_RET_NODEV); i++) {
+		UsbDevice *usbdev = host->port[i].usbdev;
+		if (usbdev) {
+			result = UsbDev_Transfer(usbdev, xfer);
+		}
+	}
+	if (xfer->pid == USB_PID_IN) {
+		Bus_Write(addr, xfer->data, xfer->actual);
+	}
+	etd->dmabufptr += xfer->actual;
+	etd->dword3 = (etd->dword3 & ~0x1fffff) | ((totbyecnt - xfer->actual) & 0x1fffff);
+	if (xfer->toggle) {
+		etd->hwControl |= HETD_TOGCRY;
+	} else {
+		etd->hwControl &= ~HETD_TOGCRY;
+	}
+	switch (result) {
+	    case 0:
+		    host->xfer_cc = CC_NOERROR;
+		    break;
+	    case USB_RET_NAK:
+		    host->xfer_cc = CC_NAK;
+		    break;
+	    case USB_RET_STALL:
+		    host->xfer_cc = CC_STALL;
+		    break;
+	    default:
+		    host->xfer_cc = CC_DEVNOTRESP;
+		    break;
+	}
+	/* 
+	 * Token, data and handshake packet with sync and crc cost about 13 bytes
+	 * besides the payload. 83 ns per bit at full speed, 667 ns at low speed.
+	 */
+	bittime = (etd->hwControl & HETD_SPEED_LOW) ? 667 : 83;
+	return (xfer->actual + 13 * (xfer->packets ? xfer->packets : 1)) * 8 * bittime;
+}
+
 /*
  * -------------------------------------------------------------
  * Assemble code for sending a packet from one ETD
@@ -1946,6 +2059,11 @@ etd_processor_emit_code(IMXUsbHost * host, int etdnum)
 				break;
 		    }
 	}
+	if (etd_transfer_level_possible(host, etd)) {
+		hscript_add(host, HCMD_TRANSFER + toggle);
+		hscript_add(host, HCMD_END);
+		return 0;
+	}
 	switch (etd->bufstat & CBITD_DIRPID_MASK) {
 	    case CBITD_DIRPID_SETUP:
 		    hscript_add(host, HCMD_SET_ADDR + (etd->hwControl & 0x7f));
@@ -2176,6 +2294,25 @@ host_complete_etd(IMXUsbHost * host, Etd * etd, int cc)
 }
 
 static void etd_processor_do_cmds(void *cd);
+/*
+ * ------------------------------------------------------------------------------
+ * Called when the bus time of a transaction level transfer has elapsed.
+ * Completion and done interrupt follow the same rules as in packet level mode.
+ * ------------------------------------------------------------------------------
+ */
+static void
+etd_transfer_done(void *cd)
+{
+	IMXUsbHost *host = (IMXUsbHost *) cd;
+	Etd *etd = host->currentEtd;
+	if (!etd) {
+		fprintf(stderr, "No currentEtd in line %d\n", __LINE__);
+		return;
+	}
+	host_complete_etd(host, etd, host->xfer_cc);
+	etd_processor_do_cmds(host);
+}
+
 /*
  * ------------------------------------------------------------------------------
  * ------------------------------------------------------------------------------
@@ -2447,6 +2584,13 @@ etd_processor_do_cmds(void *cd)
 			    }
 			    break;
 
+		    case HCMD_TRANSFER:
+			    host->code_ip++;
+			    ndelay = etd_do_transfer(host, etd, cmd & 1);
+			    CycleTimer_Add(&host->ndelayTimer, NanosecondsToCycles(ndelay),
+					   etd_transfer_done, host);
+			    return;
+
 		    case HCMD_WHILE:
 			    host->code_ip++;
 			    if (host->stackptr > 0) {
@@ -4114,6 +4258,7 @@ IMX21Otg_New(const char *name)
 	IMXOtg *otg = sg_new(IMXOtg);
 	IMXUsbHost *host;
 	I2C_Slave *i2c_slave;
+	uint32_t transfer_level;
 	int i;
 	char *trans_name = alloca(strlen(name) + 50);
 	host = &otg->host;
@@ -4126,6 +4271,10 @@ IMX21Otg_New(const char *name)
 	host->data_mem = otg->data_mem;	/* memory is shared with Function */
 	host->otg = otg;
 	CycleTimer_Init(&host->pktDelayTimer, host_send_packet, host);
+	/* transfer_level: 1 skips the packet emulation for DMA driven control/bulk ETDs */
+	if (Config_ReadUInt32(&transfer_level, name, "transfer_level") >= 0) {
+		host->transfer_level = transfer_level;
+	}
 	for (i = 0; i < 32; i++) {
 		host->etd[i].nr = i;
 	}
@@ -49,6 +49,7 @@
 #include "bus.h"
 #include "configfile.h"
 #include "sgstring.h"
+#include "compiler_extensions.h"
 
 #define GPIO_MODE(bbus,n) (((bbus)->gpiocfg[(n)>>3] >> (((n)&7)<<2)) & 0xf)
 
@@ -160,7 +161,7 @@ struct BBus {
 	uint32_t wakeup;
 };
 
-static BBus *bbus;
+static __MACHINE_LOCAL__ BBus *bbus;
 
 static char *ns9750_reset_nodes[32] = {
 	"rst_dma",
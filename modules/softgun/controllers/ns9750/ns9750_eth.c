@@ -55,10 +55,8 @@
 #include "cycletimer.h"
 #include "clock.h"
 #include "sgstring.h"
-#include "linux-tap.h"
+#include "netbackend.h"
 #include "ns9750_timer.h"
-
-#include "asyncmanager.h"
 #include "byteorder.h"
 
 
@@ -93,8 +91,7 @@ typedef struct TBDescriptor {
 typedef struct NS9750eth {
 	BusDevice bdev;
 	PHY_Device *phy[MAX_PHYS];
-	int ether_fd;
-	PollHandle_t *input_fh;
+	NetBackend *backend;
 	int receiver_is_enabled;
 	int rxint_posted;
 	int txint_posted;
@@ -632,9 +629,9 @@ fill_rxfifo(NS9750eth * eth)
 		dbgprintf("Dropping paket because rxfifo is full !\n");
 		eth->eintr |= IR_RXOVFL_DATA;
 		update_rx_interrupt(eth);
-		return read(eth->ether_fd, buf, 2048);
+		return NetBackend_Receive(eth->backend, buf, 2048);
 	}
-	result = read(eth->ether_fd, eth->rxfifo, 2048 - 4);	// leave room for FCS
+	result = NetBackend_Receive(eth->backend, eth->rxfifo, 2048 - 4);	// leave room for FCS
 	if (result > 0) {
 		eth->rxfifo_count = result;
 	}
@@ -783,7 +780,7 @@ match_address(NS9750eth * eth)
  * --------------------------------------------------
  */
 static void
-input_event(PollHandle_t *handle, int status, int events, void *clientdata)
+input_event(void *clientdata)
 {
 	NS9750eth *eth = clientdata;
 	int result;
@@ -836,14 +833,14 @@ update_receiver_state(NS9750eth * eth)
 		enable = 0;
 	}
 	if (enable) {
-		if (!eth->receiver_is_enabled && (eth->ether_fd >= 0)) {
+		if (!eth->receiver_is_enabled && eth->backend) {
 			dbgprintf("ns9750 eth: enable receiver\n");
-			AsyncManager_PollStart(eth->input_fh, ASYNCMANAGER_EVENT_READABLE, &input_event, eth);
+			NetBackend_RxStart(eth->backend, input_event, eth);
 			eth->receiver_is_enabled = 1;
 		}
 	} else {
 		if (eth->receiver_is_enabled) {
-			AsyncManager_PollStop(eth->input_fh);
+			NetBackend_RxStop(eth->backend);
 			eth->receiver_is_enabled = 0;
 		}
 	}
@@ -967,25 +964,17 @@ transmit_frame(NS9750eth * eth)
 			dbgprintf("New TB off %08x\n", eth->txoff);
 		}
 		if (tbd.flags & TB_LAST) {
-			int count = 0;
+			int result;
 			int len = eth->txfifo_count;
 			dbgprintf("Send the packet\n");
 			do {
-				int result;
-				result =
-				    write(eth->ether_fd, ((char *)eth->txfifo) + count,
-					  len - count);
-				if (result > 0) {
-					count += result;
-				} else {
-					if (errno != EAGAIN) {
-						eth->etsr &= ~ETSR_TXOK;
-						dbgprintf
-						    ("NS9750eth: error writing to Linux TAP fd\n");
-						return RET_ERROR;
-					}
-				}
-			} while (count < len);
+				result = NetBackend_Send(eth->backend, eth->txfifo, len);
+			} while ((result < 0) && (errno == EAGAIN));
+			if (result < 0) {
+				eth->etsr &= ~ETSR_TXOK;
+				dbgprintf("NS9750eth: error sending to the network backend\n");
+				return RET_ERROR;
+			}
 			eth->etsr |= ETSR_TXOK;	// should check for multicast and broadcast also here 
 			update_tx_statistics(eth, len, 0 /* type */ );
 			break;
@@ -2651,8 +2640,7 @@ BusDevice *
 NS9750_EthInit(const char *devname)
 {
 	NS9750eth *eth = sg_new(NS9750eth);
-	eth->ether_fd = Net_CreateInterface(devname);
-	eth->input_fh = AsyncManager_PollInit(eth->ether_fd);
+	eth->backend = NetBackend_New(devname);
 
 	eth->bdev.first_mapping = NULL;
 	eth->bdev.Map = NS9750Eth_Map;
@@ -45,6 +45,7 @@
 #include "signode.h"
 #include "sgstring.h"
 #include "byteorder.h"
+#include "compiler_extensions.h"
 
 #if 0
 #define dbgprintf(...) { fprintf(stderr,__VA_ARGS__); }
@@ -53,7 +54,7 @@
 #endif
 
 /* temporary hack */
-static int gcpu_endian = 0;
+static __MACHINE_LOCAL__ int gcpu_endian = 0;
 
 typedef struct PCI_Bridge {
 	uint16_t device_id;
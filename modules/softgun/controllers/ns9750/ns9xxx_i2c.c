@@ -54,6 +54,7 @@
 #include "ns9xxx_i2c.h"
 #include "ns9750_timer.h"	/* should be removed, required for irq */
 #include "sgstring.h"
+#include "configfile.h"
 
 #if 0
 #define dbgprintf(...) { fprintf(stderr,__VA_ARGS__); }
@@ -129,6 +130,12 @@
 #define INSTR_READ_ACK		(0x0c000000)
 #define INSTR_RXDATA_AVAIL	(0x0d000000)
 #define INSTR_WAIT_BUS_FREE	(0x0e000000)
+/* Transaction level bus operations */
+#define INSTR_BUS_START		(0x0f000000)
+#define INSTR_BUS_WRITE		(0x10000000)
+#define INSTR_BUS_READ		(0x11000000)
+#define INSTR_BUS_ACK		(0x12000000)
+#define INSTR_BUS_STOP		(0x13000000)
 
 #define RET_DONE			(0)
 #define RET_DO_NEXT		(1)
@@ -143,6 +150,7 @@
 #define T_SUDAT(i2c) ((i2c)->i2c_timing.t_sudat)
 #define T_SUSTO(i2c) ((i2c)->i2c_timing.t_susto)
 #define T_BUF(i2c) ((i2c)->i2c_timing.t_buf)
+#define T_BIT(i2c) (T_LOW(i2c) + T_HIGH(i2c))
 #ifdef DONT_EMULATE_BUGS
 #define T_BUF_BAD(i2c)  T_BUF(i2c)
 #else
@@ -213,6 +221,8 @@ typedef struct NS_I2C {
 	uint16_t ip;
 	uint16_t icount;
 	uint32_t code[CODE_MEM_SIZE];
+	/* Transaction level port, NULL when the bus is emulated bitwise */
+	I2C_Bus *bus;
 } NS_I2C;
 
 /*
@@ -531,6 +541,42 @@ execute_instruction(NS_I2C * i2c)
 		    }
 		    break;
 
+	    case INSTR_BUS_START:
+		    dbgprintf("BUS_START %08x\n", icode);
+		    /* The own start condition is not seen by the SDA trace */
+		    i2c->strdr |= STRDR_BSTS;
+		    I2C_BusStart(i2c->bus);
+		    break;
+
+	    case INSTR_BUS_WRITE:
+		    dbgprintf("BUS_WRITE %08x\n", icode);
+		    if (I2C_BusWrite(i2c->bus, icode & 0xff) == I2C_ACK) {
+			    i2c->ack = ACK;
+		    } else {
+			    i2c->ack = NACK;
+		    }
+		    break;
+
+	    case INSTR_BUS_READ:
+		    {
+			    uint8_t data;
+			    I2C_BusRead(i2c->bus, &data);
+			    i2c->rxdata = data;
+			    dbgprintf("BUS_READ %02x\n", data);
+		    }
+		    break;
+
+	    case INSTR_BUS_ACK:
+		    dbgprintf("BUS_ACK %08x\n", icode);
+		    I2C_BusAck(i2c->bus, ((icode & 0xff) == ACK) ? I2C_ACK : I2C_NACK);
+		    break;
+
+	    case INSTR_BUS_STOP:
+		    dbgprintf("BUS_STOP %08x\n", icode);
+		    I2C_BusStop(i2c->bus);
+		    i2c->strdr &= ~STRDR_BSTS;
+		    break;
+
 	    default:
 		    fprintf(stderr, "NS9xxx I2C: Unknode instruction code %08x\n", icode);
 		    return RET_EMU_ERROR;
@@ -588,6 +634,11 @@ reset_interpreter(NS_I2C * i2c)
 static void
 mscript_check_ack(NS_I2C * i2c)
 {
+	if (i2c->bus) {
+		i2c->code[i2c->icount++] = INSTR_NDELAY | T_BIT(i2c);
+		i2c->code[i2c->icount++] = INSTR_CHECK_ACK | M_NO_ACK_IRQ;
+		return;
+	}
 	/* check ack of previous */
 	i2c->code[i2c->icount++] = INSTR_SDA_H;
 	i2c->code[i2c->icount++] = INSTR_NDELAY | (T_LOW(i2c) - T_HDDAT(i2c));
@@ -612,6 +663,12 @@ static void
 mscript_write_byte(NS_I2C * i2c, uint8_t data)
 {
 	int i;
+	if (i2c->bus) {
+		i2c->code[i2c->icount++] = INSTR_BUS_WRITE | data;
+		i2c->code[i2c->icount++] = INSTR_NDELAY | (8 * T_BIT(i2c));
+		mscript_check_ack(i2c);
+		return;
+	}
 	for (i = 7; i >= 0; i--) {
 		int bit = (data >> i) & 1;
 		if (bit) {
@@ -643,6 +700,11 @@ mscript_write_byte(NS_I2C * i2c, uint8_t data)
 static void
 mscript_do_ack(NS_I2C * i2c, int ack)
 {
+	if (i2c->bus) {
+		i2c->code[i2c->icount++] = INSTR_BUS_ACK | ack;
+		i2c->code[i2c->icount++] = INSTR_NDELAY | T_BIT(i2c);
+		return;
+	}
 	if (ack == ACK) {
 		i2c->code[i2c->icount++] = INSTR_SDA_L;
 	} else {
@@ -672,6 +734,13 @@ static void
 mscript_read_byte(NS_I2C * i2c)
 {
 	int i;
+	if (i2c->bus) {
+		i2c->code[i2c->icount++] = INSTR_BUS_READ;
+		i2c->code[i2c->icount++] = INSTR_NDELAY | (8 * T_BIT(i2c));
+		i2c->code[i2c->icount++] = INSTR_RXDATA_AVAIL;
+		i2c->code[i2c->icount++] = INSTR_INTERRUPT | M_RX_DATA_IRQ;
+		return;
+	}
 	i2c->code[i2c->icount++] = INSTR_SDA_H;
 	for (i = 7; i >= 0; i--) {
 		i2c->code[i2c->icount++] = INSTR_NDELAY | (T_LOW(i2c) - T_HDDAT(i2c));
@@ -697,6 +766,12 @@ mscript_read_byte(NS_I2C * i2c)
 static void
 mscript_stop(NS_I2C * i2c)
 {
+	if (i2c->bus) {
+		i2c->code[i2c->icount++] = INSTR_BUS_STOP;
+		i2c->code[i2c->icount++] =
+		    INSTR_NDELAY | (T_LOW(i2c) - T_HDDAT(i2c) + T_SUSTO(i2c) + T_BUF(i2c));
+		return;
+	}
 	i2c->code[i2c->icount++] = INSTR_SDA_L;
 	i2c->code[i2c->icount++] = INSTR_NDELAY | (T_LOW(i2c) - T_HDDAT(i2c));
 	i2c->code[i2c->icount++] = INSTR_SCL_H;
@@ -721,6 +796,18 @@ mscript_stop(NS_I2C * i2c)
 static void
 mscript_start(NS_I2C * i2c, int startmode)
 {
+	if (i2c->bus) {
+		if (startmode == STARTMODE_REPSTART) {
+			i2c->code[i2c->icount++] =
+			    INSTR_NDELAY | (T_LOW(i2c) - T_HDDAT(i2c) + T_HIGH(i2c));
+		} else {
+			i2c->code[i2c->icount++] = INSTR_WAIT_BUS_FREE;
+			i2c->code[i2c->icount++] = INSTR_NDELAY | 50;
+		}
+		i2c->code[i2c->icount++] = INSTR_BUS_START;
+		i2c->code[i2c->icount++] = INSTR_NDELAY | (T_HDSTA(i2c) + T_HDDAT(i2c));
+		return;
+	}
 	/* For repeated start do not assume SDA and SCL state */
 	if (startmode == STARTMODE_REPSTART) {
 		i2c->code[i2c->icount++] = INSTR_SDA_H;
@@ -1387,6 +1474,7 @@ NS9xxx_I2CNew(const char *name)
 	char *nodename1 = (char *)alloca(strlen(name) + 50);
 	char *nodename2 = (char *)alloca(strlen(name) + 50);
 	I2C_Slave *i2c_slave;
+	uint32_t transaction_level = 0;
 	NS_I2C *i2c = sg_new(NS_I2C);
 	i2c->ctdr = 0;
 	i2c->strdr = 0;
@@ -1429,6 +1517,11 @@ NS9xxx_I2CNew(const char *name)
 	i2c->sclTrace = SigNode_Trace(i2c->sclNode, scl_trace_proc, i2c);
 	i2c->sdaTrace = SigNode_Trace(i2c->sdaNode, sda_trace_proc, i2c);
 	i2c->resetTrace = SigNode_Trace(i2c->resetNode, reset_trace_proc, i2c);
+	/* Skip the SDA/SCL emulation and talk to the slaves bytewise */
+	Config_ReadUInt32(&transaction_level, name, "transaction_level");
+	if (transaction_level) {
+		i2c->bus = I2C_BusNew(i2c->sdaNode);
+	}
 	i2c->bdev.first_mapping = NULL;
 	i2c->bdev.Map = NSI2C_Map;
 	i2c->bdev.UnMap = NSI2C_UnMap;
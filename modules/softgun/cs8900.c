@@ -52,12 +52,10 @@
 // include user header
 #include "bus.h"
 #include "signode.h"
-#include "linux-tap.h"
+#include "netbackend.h"
 #include "m93c46.h"
 #include "sgstring.h"
 
-#include "asyncmanager.h"
-
 #define IO_RXTXDATA0(base)	((base) + 0x00)
 #define IO_RXTXDATA1(base)	((base) + 0x02)
 #define IO_TXCMD(base)		((base) + 0x04)
@@ -236,8 +234,7 @@
 
 typedef struct CS8900 {
 	BusDevice bdev;
-	int ether_fd;
-	PollHandle_t *handle;
+	NetBackend *backend;
 	int pktsrc_is_enabled;
 	int interrupt_posted;
 	M93C46 *eeprom;
@@ -375,12 +372,12 @@ update_receiver(CS8900 * cs)
  * ------------------------------------------------------------------
  */
 static void
-input_event(PollHandle_t *handle, int status, int events, void *cd)
+input_event(void *cd)
 {
 	CS8900 *cs = (CS8900 *) cd;
 	uint8_t *rxbuf = cs->memwin + 4;
 	int result;
-	result = read(cs->ether_fd, rxbuf, 1532);
+	result = NetBackend_Receive(cs->backend, rxbuf, 1532);
 	if (result > 0) {
 		uint16_t rxev;
 		int broad = is_broadcast(rxbuf);
@@ -438,7 +435,7 @@ clear_pktsrc(CS8900 * cs)
 	int count;
 	int i;
 	for (i = 0; i < 500; i++) {
-		count = read(cs->ether_fd, buf, 100);
+		count = NetBackend_Receive(cs->backend, buf, 100);
 		if (count <= 0) {
 			break;
 		}
@@ -448,8 +445,8 @@ clear_pktsrc(CS8900 * cs)
 static void
 enable_pktsrc(CS8900 * cs)
 {
-	if ((cs->pktsrc_is_enabled == 0) && (cs->ether_fd >= 0)) {
-		AsyncManager_PollStart(cs->handle, ASYNCMANAGER_EVENT_READABLE, &input_event, cs);
+	if ((cs->pktsrc_is_enabled == 0) && cs->backend) {
+		NetBackend_RxStart(cs->backend, input_event, cs);
 		cs->pktsrc_is_enabled = 1;
 	}
 }
@@ -458,7 +455,7 @@ static void
 disable_pktsrc(CS8900 * cs)
 {
 	if (cs->pktsrc_is_enabled) {
-		AsyncManager_PollStop(cs->handle);
+		NetBackend_RxStop(cs->backend);
 		cs->pktsrc_is_enabled = 0;
 	}
 }
@@ -480,9 +477,7 @@ transmit(CS8900 * cs)
 			cs->txlength, cs->tx_fifo_wp);
 		goto out;
 	}
-	//fcntl(cs->ether_fd,F_SETFL,0);
-	result = write(cs->ether_fd, cs->txbuf, cs->txlength);
-	//fcntl(cs->ether_fd,F_SETFL,O_NONBLOCK);
+	result = NetBackend_Send(cs->backend, cs->txbuf, cs->txlength);
 	cs->txevent |= TXEVENT_TXOK;
 	cs->bufevent |= BUFEVENT_RDY4TX;
 	update_interrupts(cs);
@@ -2021,9 +2016,7 @@ CS8900_New(const char *devname)
 		}
 	}
 	cs->txbuf = cs->memwin + 0x600;
-	cs->ether_fd = Net_CreateInterface(devname);
-	fcntl(cs->ether_fd, F_SETFL, O_NONBLOCK);
-	cs->handle = AsyncManager_PollInit(cs->ether_fd);
+	cs->backend = NetBackend_New(devname);
 	sprintf(eepromname, "%s.eeprom", devname);
 	cs->eeprom = m93c46_New(eepromname);
 	cs8900_reset(cs);
@@ -275,6 +275,7 @@ CanSocketInterface_New(CanChipOperations * cops, const char *name, void *clientD
 	if (ret < 0) {
 		fprintf(stderr, "Can not open TCP Listening Port %d for CAN-Emulator: ", port);
 		perror("");
+		CycleTimer_Unregister(&contr->rxTimer);
 		free(contr);
 		return NULL;
 	}
@@ -53,11 +53,10 @@
 #include "cycletimer.h"
 #include "configfile.h"
 #include "devices/phy/phy.h"
-#include "linux-tap.h"
+#include "netbackend.h"
 #include "m93c46.h"
 #include "sgstring.h"
 #include "signode.h"
-#include "asyncmanager.h"
 #include "initializer.h"
 
 
@@ -263,8 +262,7 @@ struct DM9000 {
 	SigNode *irqNode;
 	int interrupt_posted;
 	BusDevice bdev;
-	int ether_fd;
-	PollHandle_t *input_fh;
+	NetBackend *backend;
 	int receiver_is_enabled;
 
 	DMReadProc *read_reg[256];
@@ -539,13 +537,13 @@ match_address(DM9000 * dm, uint8_t * packet)
  * --------------------------------------------------------------
  */
 static void
-input_event(PollHandle_t *handle, int status, int events, void *clientdata)
+input_event(void *clientdata)
 {
 	DM9000 *dm = clientdata;
 	int result;
 	uint8_t buf[2048];
 	do {
-		result = read(dm->ether_fd, buf, 2048);
+		result = NetBackend_Receive(dm->backend, buf, 2048);
 		if (result > 0) {
 			if (!phy_is_enabled(dm)) {
 				continue;
@@ -584,7 +582,7 @@ clear_pktsrc(DM9000 * dm)
 	int count;
 	int i;
 	for (i = 0; i < 500; i++) {
-		count = read(dm->ether_fd, buf, 100);
+		count = NetBackend_Receive(dm->backend, buf, 100);
 		if (count <= 0) {
 			break;
 		}
@@ -600,9 +598,9 @@ clear_pktsrc(DM9000 * dm)
 static void
 enable_receiver(DM9000 * dm)
 {
-	if (!dm->receiver_is_enabled && (dm->ether_fd >= 0)) {
+	if (!dm->receiver_is_enabled && dm->backend) {
 		dbgprintf("DM9000: enable receiver\n");
-		AsyncManager_PollStart(dm->input_fh, ASYNCMANAGER_EVENT_READABLE, &input_event, dm);
+		NetBackend_RxStart(dm->backend, input_event, dm);
 		dm->receiver_is_enabled = 1;
 	}
 }
@@ -612,7 +610,7 @@ disable_receiver(DM9000 * dm)
 {
 	dbgprintf("DM9000: disable receiver\n");
 	if (dm->receiver_is_enabled) {
-		AsyncManager_PollStop(dm->input_fh);
+		NetBackend_RxStop(dm->backend);
 		dm->receiver_is_enabled = 0;
 	}
 }
@@ -694,27 +692,27 @@ transmit_packet(DM9000 * dm)
 {
 	int len = dm->txpll | (dm->txplh << 8);
 	int result;
-	int i;
 	uint8_t iomode;
-	char packet[1600];
 	if (len > 1600) {
 		dbgprintf("packet to big: %d bytes\n", len);
 		return;
 	}
 	if ((len + dm->txfifo_rp) > 3 * 1024) {
-		for (i = 0; i < len; i++) {
-			packet[i] = dm->sram[dm->txfifo_rp];
-			dm->txfifo_rp = (dm->txfifo_rp + 1) % (3 * 1024);
-		}
+		/* The packet wraps around the end of the TX-SRAM */
+		struct iovec iov[2];
+		iov[0].iov_base = &dm->sram[dm->txfifo_rp];
+		iov[0].iov_len = 3 * 1024 - dm->txfifo_rp;
+		iov[1].iov_base = &dm->sram[0];
+		iov[1].iov_len = len - iov[0].iov_len;
 		if (phy_is_enabled(dm)) {
-			result = write(dm->ether_fd, packet, len);
+			result = NetBackend_SendV(dm->backend, iov, 2);
 		}
 	} else {
 		if (phy_is_enabled(dm)) {
-			result = write(dm->ether_fd, &dm->sram[dm->txfifo_rp], len);
+			result = NetBackend_Send(dm->backend, &dm->sram[dm->txfifo_rp], len);
 		}
-		dm->txfifo_rp = (dm->txfifo_rp + len) % (3 * 1024);
 	}
+	dm->txfifo_rp = (dm->txfifo_rp + len) % (3 * 1024);
 	if (dm->tx_pktindex == 0) {
 		dm->tsr_i = 0;
 		dm->nsr |= NSR_TX1_END;
@@ -2048,8 +2046,7 @@ DM9000_New(const char *devname, int register_spacing)
 {
 	DM9000 *dm = sg_new(DM9000);
 	char *epromname = (char *)alloca(strlen(devname) + 20);
-	dm->ether_fd = Net_CreateInterface(devname);
-	dm->input_fh = AsyncManager_PollInit(dm->ether_fd);
+	dm->backend = NetBackend_New(devname);
 
 	dm->bdev.first_mapping = NULL;
 	dm->bdev.Map = DM9000_Map;
@@ -43,6 +43,7 @@
 #include <stdio.h>
 #include <stdlib.h>
 #include <string.h>
+#include <errno.h>
 #include <fcntl.h>
 #include <unistd.h>
 
@@ -51,11 +52,10 @@
 // include user header
 #include "cycletimer.h"
 #include "configfile.h"
-#include "linux-tap.h"
+#include "netbackend.h"
 #include "crc32.h"
 #include "signode.h"
 #include "sgstring.h"
-#include "asyncmanager.h"
 
 
 #define DROP 0
@@ -352,8 +352,7 @@
 struct Enc28j60 {
 	int state;
 	uint32_t chksum;
-	int ether_fd;
-	PollHandle_t *input_fh;
+	NetBackend *backend;
 	int rx_is_enabled;
 	CycleTimer miCmdTimer;
 	CycleTimer transmitTimer;
@@ -955,13 +954,13 @@ receive_pkt(Enc28j60 *enc, uint8_t *pktbuf, unsigned int pktlen)
  *******************************************************************************************
  */
 static void
-rx_event(PollHandle_t *handle, int status, int events, void *clientdata)
+rx_event(void *clientdata)
 {
 	uint8_t buf[2048];
 	Enc28j60 *enc = clientdata;
 	int result;
 	do {
-		result = read(enc->ether_fd, buf, 2048);
+		result = NetBackend_Receive(enc->backend, buf, 2048);
 		if (result <= 0) {
 			continue;
 		}
@@ -982,12 +981,12 @@ enable_rx(Enc28j60 * enc)
 	if (enc->rx_is_enabled) {
 		return;
 	}
-	if (enc->ether_fd < 0) {
-		dbgprintf("ENC28J60: ether fd < 0\n");
+	if (!enc->backend) {
+		dbgprintf("ENC28J60: no network backend\n");
 		return;
 	}
 	dbgprintf("ENC28J60: enable receiver\n");
-	AsyncManager_PollStart(enc->input_fh, ASYNCMANAGER_EVENT_READABLE, &rx_event, enc);
+	NetBackend_RxStart(enc->backend, rx_event, enc);
 	enc->rx_is_enabled = 1;
 }
 
@@ -1002,7 +1001,7 @@ disable_rx(Enc28j60 * enc)
 {
 	if (enc->rx_is_enabled) {
 		dbgprintf("ENC28J60: disable receiver\n");
-		AsyncManager_PollStop(enc->input_fh);
+		NetBackend_RxStop(enc->backend);
 		enc->rx_is_enabled = 0;
 	}
 }
@@ -1231,14 +1230,14 @@ do_transmit(void *eventData)
 		mod_tsv_bit(enc, TSV_BIT_TXLENCHKERR, true);
 	} else {
 		//fprintf(stderr,"Start tx size %d\n",pktlen);
-		if (enc->ether_fd > 0) {
+		if (enc->backend) {
 			if (enc->txdrop && ((rand() % 100) < enc->txdrop)) {
 				fprintf(stdout, "Drop TX packet\n");
 			} else {
                 if (!(enc->phyrPHCON1 & PHCON1_PLOOPBK) && !(enc->phyrPHCON2 & PHCON2_TXDIS)) {
-                    fcntl(enc->ether_fd, F_SETFL, 0);
-                    result = write(enc->ether_fd, pktbuf, pktlen);
-                    fcntl(enc->ether_fd, F_SETFL, O_NONBLOCK);
+                    do {
+                        result = NetBackend_Send(enc->backend, pktbuf, pktlen);
+                    } while ((result < 0) && (errno == EAGAIN));
                 }
 			}
 		}
@@ -2691,8 +2690,7 @@ Enc28j60_New(const char *name)
 	CycleTimer_Init(&enc->dmaTimer, do_dma, enc);
 	SigNode_Set(enc->sigIrq, SIG_PULLUP);
 	enc->CsNTrace = SigNode_Trace(enc->sigCsN, spi_cs_change, enc);
-	enc->ether_fd = Net_CreateInterface(name);
-	enc->input_fh = AsyncManager_PollInit(enc->ether_fd);
+	enc->backend = NetBackend_New(name);
 	enc_system_reset(enc);
 	test_hash_calculator();
 	return enc;
@@ -4,6 +4,7 @@
  *****************************************************************************
  */
 
+#include <stdio.h>
 #include "sglib.h"
 #include "sgstring.h"
 #include "signode.h"
@@ -39,10 +39,11 @@
 #include <stdlib.h>
 #include <string.h>
 #include "mmc_crc.h"
+#include "compiler_extensions.h"
 
-static uint16_t crctab[256];
-static uint8_t crc7tab[256];
-static int crctab_initialized = 0;
+static __MACHINE_LOCAL__ uint16_t crctab[256];
+static __MACHINE_LOCAL__ uint8_t crc7tab[256];
+static __MACHINE_LOCAL__ int crctab_initialized = 0;
 
 static void CRC16_CreateTab(void);
 static void CRC7_CreateTab(void);
@@ -84,6 +84,11 @@
 #define RST_STARTED 		(8)
 #define RST_DONE 		(9)
 
+#define IOBUF_SIZE		(4096)	/* Prefetch and write assembly buffers */
+#define RA_EMPTY		(0)
+#define RA_PENDING		(1)
+#define RA_VALID		(2)
+
 #ifndef O_LARGEFILE
 /* O_LARGEFILE does not exist and is not neededon FreeBSD, define
  * it so that it does not have any effect*/
@@ -1310,6 +1315,18 @@ struct MMCard {
 	CycleCounter_t reset_start_time;
 	CycleTimer transmissionTimer;
 	Listener *listener_head;
+	/* Prefetch of multiple block reads from an async diskimage */
+	int ra_async;
+	int ra_state;
+	int ra_stale;		/* Written while the prefetch was pending */
+	int ra_waiting;		/* The transmission waits for the prefetch */
+	uint64_t ra_addr;
+	int ra_len;
+	uint8_t ra_buf[IOBUF_SIZE];
+	/* Assembly of multiple block writes for DiskImage_WriteAsync */
+	uint64_t wb_addr;
+	int wb_len;
+	uint8_t wb_buf[IOBUF_SIZE];
 };
 
 /*
@@ -1630,6 +1647,170 @@ dump_cardtypes()
 	fprintf(stderr, "SDHC-Card: \"auto_sdhc\"\n");
 }
 
+static inline void MMCard_StartTransmission(MMCard * card);
+
+/*
+ * -----------------------------------------------------------------------
+ * Multiple block reads from an async diskimage prefetch the following
+ * blocks with DiskImage_ReadAsync. A transmission which finds the
+ * prefetch still pending waits for its completion instead of stalling
+ * the CPU in a synchronous read. Writes to the card drop the prefetch.
+ * -----------------------------------------------------------------------
+ */
+static void
+mmcard_ra_done(void *clientData, int result)
+{
+	MMCard *card = clientData;
+	if (card->ra_stale || (result < card->ra_len)) {
+		card->ra_state = RA_EMPTY;
+	} else {
+		card->ra_state = RA_VALID;
+	}
+	if (card->ra_waiting) {
+		card->ra_waiting = 0;
+		MMCard_StartTransmission(card);
+	}
+}
+
+static void
+mmcard_ra_start(MMCard * card, uint64_t address)
+{
+	int len;
+	if (!card->ra_async || (card->ra_state == RA_PENDING) || !card->blocklen
+	    || (card->blocklen > IOBUF_SIZE) || (address >= card->capacity)) {
+		return;
+	}
+	len = IOBUF_SIZE - (IOBUF_SIZE % card->blocklen);
+	if ((address + len) > card->capacity) {
+		len = card->capacity - address;
+	}
+	card->ra_addr = address;
+	card->ra_len = len;
+	card->ra_state = RA_PENDING;
+	card->ra_stale = 0;
+	DiskImage_ReadAsync(card->disk_image, address, card->ra_buf, len, mmcard_ra_done, card);
+}
+
+static void
+mmcard_ra_invalidate(MMCard * card)
+{
+	if (card->ra_state == RA_PENDING) {
+		card->ra_stale = 1;
+	} else {
+		card->ra_state = RA_EMPTY;
+	}
+}
+
+static inline int
+mmcard_ra_busy(MMCard * card)
+{
+	uint64_t address = card->address + card->transfer_count;
+	return (card->ra_state == RA_PENDING) && (address >= card->ra_addr)
+	    && (address < card->ra_addr + card->ra_len);
+}
+
+/*
+ * ------------------------------------------------------------------
+ * Multiple block writes are collected in wb_buf and handed to
+ * DiskImage_WriteAsync when it is full, the write ends or the next
+ * command arrives. A failed write is reported in the status of the
+ * next command.
+ * ------------------------------------------------------------------
+ */
+static void
+mmcard_wb_done(void *clientData, int result)
+{
+	MMCard *card = clientData;
+	if (result < 0) {
+		fprintf(stderr, "MMCard: Error writing to diskimage\n");
+		card->card_status |= STATUS_ERROR;
+	}
+}
+
+static void
+mmcard_wb_flush(MMCard * card)
+{
+	if (card->wb_len) {
+		DiskImage_WriteAsync(card->disk_image, card->wb_addr, card->wb_buf, card->wb_len,
+				     mmcard_wb_done, card);
+		card->wb_len = 0;
+	}
+}
+
+static void
+mmcard_wb_write(MMCard * card, uint64_t address, const uint8_t * buf, int count)
+{
+	int len;
+	if (card->wb_len && (card->wb_addr + card->wb_len != address)) {
+		mmcard_wb_flush(card);
+	}
+	while (count > 0) {
+		if (!card->wb_len) {
+			card->wb_addr = address;
+		}
+		len = IOBUF_SIZE - card->wb_len;
+		if (len > count) {
+			len = count;
+		}
+		memcpy(card->wb_buf + card->wb_len, buf, len);
+		card->wb_len += len;
+		if (card->wb_len == IOBUF_SIZE) {
+			mmcard_wb_flush(card);
+		}
+		address += len;
+		buf += len;
+		count -= len;
+	}
+}
+
+/*
+ * -----------------------------------------------------------------------
+ * Data phase of MMC_READ_MULTIPLE_BLOCK. With datap the data of a
+ * mapped diskimage is not copied, *datap points into the mapping or
+ * to buf.
+ * -----------------------------------------------------------------------
+ */
+static int
+mmcard_read_multiple(MMCard * card, uint8_t * buf, int count, const uint8_t ** datap)
+{
+	uint64_t address = card->address + card->transfer_count;
+	uint64_t next;
+	const uint8_t *data;
+	if ((address + count) > card->capacity) {
+		count = card->capacity - address;
+	}
+	if (card->block_count) {
+		if ((address & ~(card->blocklen - 1)) !=
+		    ((address + count) & ~(card->blocklen - 1))) {
+			card->block_count--;
+			if (!card->block_count) {
+				card->state = STATE_TRANSFER;
+			}
+		}
+	}
+	if (datap && (data = DiskImage_GetReadPtr(card->disk_image, address, count))) {
+		*datap = data;
+	} else {
+		if ((card->ra_state == RA_VALID) && (address >= card->ra_addr)
+		    && ((address + count) <= (card->ra_addr + card->ra_len))) {
+			memcpy(buf, card->ra_buf + (address - card->ra_addr), count);
+		} else if (DiskImage_Read(card->disk_image, address, buf, count) < count) {
+			fprintf(stderr, "MMCard: Error reading from diskimage\n");
+		}
+		if (datap) {
+			*datap = buf;
+		}
+	}
+	card->transfer_count += count;
+	next = address + count;
+	if ((card->ra_state == RA_EMPTY) || ((card->ra_state == RA_VALID)
+					     && ((next < card->ra_addr)
+						 || (next >= card->ra_addr + card->ra_len)))) {
+		mmcard_ra_start(card, next);
+	}
+	return count;
+}
+
 /*
  * ----------------------------------------------------------------
  * MMCard_Read:
@@ -1691,24 +1872,7 @@ MMCard_Read(MMCDev * dev, uint8_t * buf, int count)
 		}
 		return count;
 	} else if (card->cmd == MMC_READ_MULTIPLE_BLOCK) {
-		uint64_t address = card->address + card->transfer_count;
-		if ((address + count) > card->capacity) {
-			count = card->capacity - address;
-		}
-		if (card->block_count) {
-			if ((address & ~(card->blocklen - 1)) !=
-			    ((address + count) & ~(card->blocklen - 1))) {
-				card->block_count--;
-				if (!card->block_count) {
-					card->state = STATE_TRANSFER;
-				}
-			}
-		}
-		if (DiskImage_Read(card->disk_image, address, buf, count) < count) {
-			fprintf(stderr, "MMCard: Error reading from diskimage\n");
-		}
-		card->transfer_count += count;
-		return count;
+		return mmcard_read_multiple(card, buf, count, NULL);
 	} else if (card->cmd == MMC_READ_DAT_UNTIL_STOP) {
 		uint64_t address = card->address + card->transfer_count;
 		if ((address + count) > card->capacity) {
@@ -1759,6 +1923,7 @@ MMCard_DoTransmission(void *clientData)
 	MMCDev *mmcdev = (MMCDev *) clientData;
 	MMCard *card = container_of(mmcdev, MMCard, mmcdev);
 	Listener *li = card->listener_head;
+	const uint8_t *data = li ? li->buf : NULL;
 	int len;
 	int result;
 	uint64_t cycles;
@@ -1776,14 +1941,23 @@ MMCard_DoTransmission(void *clientData)
 		return;
 	}
 	len = li->maxpkt < sizeof(li->buf) ? li->maxpkt : sizeof(li->buf);
-	result = MMCard_Read(mmcdev, li->buf, len);
+	if (card->cmd == MMC_READ_MULTIPLE_BLOCK) {
+		if (mmcard_ra_busy(card)) {
+			/* Restarted by the completion of the prefetch */
+			card->ra_waiting = 1;
+			return;
+		}
+		result = mmcard_read_multiple(card, li->buf, len, &data);
+	} else {
+		result = MMCard_Read(mmcdev, li->buf, len);
+	}
 	if (result <= 0) {
 		return;
 	}
 //      fprintf(stderr,"MMCard: Do the transmission len %d, transfer cnt %d\n",result,card->transfer_count); // jk
 	//MMC_CRC16Init(&dataBlock.crc,0);
 	//MMC_CRC16(&dataBlock.crc,dataBlock.data,dataBlock.datalen);
-	li->dataSink(li->device, li->buf, result);
+	li->dataSink(li->device, data, result);
 	freq = Clock_Freq(card->clk);
 	if (!freq) {
 		freq = 1;
@@ -2657,6 +2831,7 @@ mmc_read_multiple_block(MMCard * card, uint32_t cmd, uint32_t arg, MMCResponse *
 	resp->data[3] = (card_status >> 8) & 0xff;
 	resp->data[4] = card_status & 0xff;
 	resp->data[5] = MMC_RespCRCByte(resp);
+	mmcard_ra_start(card, card->address);
 	MMCard_StartTransmission(card);
 	return MMC_ERR_NONE;
 }
@@ -2683,6 +2858,7 @@ spi_read_multiple_block(MMCard * card, uint32_t cmd, uint32_t arg, MMCResponse *
 	} else {
 		resp->data[0] = 0;
 	}
+	mmcard_ra_start(card, card->address);
 	MMCard_StartTransmission(card);
 	return MMC_ERR_NONE;
 }
@@ -3172,6 +3348,7 @@ mmc_erase(MMCard * card, uint32_t cmd, uint32_t arg, MMCResponse * resp)
 			cmd);
 	}
 	memset(buf, 0xff, sizeof(buf));
+	mmcard_ra_invalidate(card);
 	while (start < end) {
 		uint64_t count = end - start;
 		if (count > sizeof(buf)) {
@@ -3860,6 +4037,7 @@ MMCard_Write(MMCDev * dev, const uint8_t * buf, int count)
 		fprintf(stderr, "MMCard_Write: Card not in RCV: %d\n", card->state);
 		return 0;
 	}
+	mmcard_ra_invalidate(card);
 	if (card->cmd == MMC_WRITE_SINGLE_BLOCK) {
 		uint32_t address = card->address + card->transfer_count;
 		if (card->transfer_count + count > card->blocklen) {
@@ -3886,15 +4064,14 @@ MMCard_Write(MMCDev * dev, const uint8_t * buf, int count)
 		if ((address + count) > card->capacity) {
 			count = card->capacity - address;
 		}
-		if (DiskImage_Write(card->disk_image, address, buf, count) < count) {
-			fprintf(stderr, "MMCard: Error writing to diskimage\n");
-		}
+		mmcard_wb_write(card, address, buf, count);
 		card->transfer_count += count;
 		if ((address & ~(card->blocklen - 1)) !=
 		    ((address + count) & ~(card->blocklen - 1))) {
 			if (card->block_count) {
 				card->block_count--;
 				if (!card->block_count) {
+					mmcard_wb_flush(card);
 					card->state = STATE_TRANSFER;
 				}
 			}
@@ -4290,6 +4467,7 @@ MMCard_DoCmd(MMCDev * mmcdev, uint32_t cmd, uint32_t arg, MMCResponse * resp)
 	if (cmdProc == NULL) {
 		cmdProc = card->cmdProc[cmd];
 	}
+	mmcard_wb_flush(card);
 	if (cmdProc) {
 		card->cmdcount++;
 		result = cmdProc(card, cmd, arg, resp);
@@ -4542,6 +4720,8 @@ void
 MMCard_Delete(MMCDev * mmcdev)
 {
 	MMCard *card = container_of(mmcdev, MMCard, mmcdev);
+	CycleTimer_Unregister(&card->transmissionTimer);
+	mmcard_wb_flush(card);
 	DiskImage_Close(card->disk_image);
 	card->disk_image = NULL;
 	free(card);
@@ -4560,10 +4740,13 @@ MMCard_New(const char *name)
 	char *imgdirname;
 	char *filename;
 	char *producttype;
+	char *iomode;
 	uint32_t psn = hash_string(name);
 	int autotype = 0;
+	int diflags = DI_RDWR | DI_CREAT_FF | DI_SPARSE;
 	producttype = Config_ReadVar(name, "type");
 	filename = Config_ReadVar(name, "file");
+	iomode = Config_ReadVar(name, "iomode");
 
 	if (!producttype) {
 		fprintf(stderr, "MMC Card: No product type configured for \"%s\". Skipped.\n",
@@ -4626,8 +4809,21 @@ MMCard_New(const char *name)
 		if (autotype) {
 			init_auto_card_from_filesize(card, imagename);
 		}
-		card->disk_image =
-		    DiskImage_Open(imagename, card->capacity, DI_RDWR | DI_CREAT_FF | DI_SPARSE);
+		/* 
+		 * "async" (default) does readahead and write-behind on an IO
+		 * thread and prefetches multiple block reads, "mmap" maps the
+		 * image, "sync" reads and writes directly.
+		 */
+		if (!iomode || (strcmp(iomode, "async") == 0)) {
+			diflags |= DI_ASYNC;
+			card->ra_async = 1;
+		} else if (strcmp(iomode, "mmap") == 0) {
+			diflags |= DI_MMAP;
+		} else if (strcmp(iomode, "sync") != 0) {
+			fprintf(stderr, "MMCard \"%s\": Unknown iomode \"%s\"\n", name, iomode);
+			exit(1);
+		}
+		card->disk_image = DiskImage_Open(imagename, card->capacity, diflags);
 		if (!card->disk_image) {
 			fprintf(stderr, "Failed to open disk_image \"%s\"\n", imagename);
 			perror("msg");
@@ -59,6 +59,7 @@
 #include "configfile.h"
 #include "sglib.h"
 #include "asyncmanager.h"
+#include "spscring.h"
 
 #if 0
 #define dbgprintf(...) { fprintf(stderr,__VA_ARGS__); }
@@ -73,6 +74,8 @@
 #define RXBUF_LVL(pua) ((pua)->rxbuf_wp - (pua)->rxbuf_rp)
 #define RXBUF_ROOM(pua) (RXBUF_SIZE - RXBUF_LVL(pua)) 
 
+#define TXRING_SIZE 4096
+
 typedef struct FileUart {
 	SerialDevice serdev;
 	Utf8ToUnicodeCtxt utf8ToUnicodeCtxt;
@@ -80,7 +83,14 @@ typedef struct FileUart {
 	int outfd;
 	FILE *logfile;
   PollHandle_t *input_fh;
+	NotifyHandle_t *tx_notify;
+	NotifyHandle_t *close_notify;
+	PollHandle_t *output_fh;
 	int ifh_is_active;
+	/* Output side, owned by the AsyncManager thread */
+	int ofh_is_active;
+	int closed;
+	int close_fd;
 	uint32_t baudrate;
 	struct termios termios;
 	int tx_enabled;
@@ -95,6 +105,8 @@ typedef struct FileUart {
 	uint32_t rxbuf_wp;
 	uint32_t rxbuf_rp;
 	uint8_t rxbuf[RXBUF_SIZE];
+	/* Written by the CPU thread, drained by the AsyncManager thread */
+	SPSCRing txring;
 } FileUart;
 
 typedef struct NullUart {
@@ -113,14 +125,36 @@ file_disable_rx(SerialDevice * serial_device)
 	fuart->rxEnabled = false;
 }
 
+/*
+ * ---------------------------------------------------------------
+ * The output poll handle and the transmit ring belong to the
+ * AsyncManager thread, so the CPU thread only stops the input
+ * and leaves stopping the output and closing the file to it.
+ * ---------------------------------------------------------------
+ */
 static void
 file_close(SerialDevice * serial_device)
 {
 	FileUart *fuart = serial_device->owner;
 	file_disable_rx(serial_device);
 	AsyncManager_Close(AsyncManager_Poll2Handle(fuart->input_fh), NULL, NULL);
-	close(fuart->infd);
+	fuart->close_fd = fuart->infd;
 	fuart->infd = -1;
+	AsyncManager_Notify(fuart->close_notify);
+}
+
+static void
+file_close_output(NotifyHandle_t *handle, void *clientdata)
+{
+	FileUart *fuart = clientdata;
+	if (fuart->ofh_is_active) {
+		AsyncManager_PollStop(fuart->output_fh);
+		fuart->ofh_is_active = 0;
+	}
+	AsyncManager_Close(AsyncManager_Poll2Handle(fuart->output_fh), NULL, NULL);
+	SPSCRing_Consume(&fuart->txring, SPSCRing_Level(&fuart->txring));
+	fuart->closed = 1;
+	close(fuart->close_fd);
 }
 
 /*
@@ -247,65 +281,103 @@ file_uart_read(SerialDevice * serial_device, UartChar * buf, int maxlen)
 	return 0;
 }
 
+static void file_uart_writable(PollHandle_t *handle, int status, int events, void *clientdata);
+
+/**
+ ******************************************************************************
+ * Flush the transmit ring to the file. Runs in the AsyncManager thread
+ * and writes everything which was queued since the last notification
+ * with one syscall per contiguous part of the ring. When the file is
+ * full the rest is written by the writable event handler.
+ ******************************************************************************
+ */
+static void
+file_uart_flush(FileUart * fuart)
+{
+	const uint8_t *data;
+	uint32_t count;
+	ssize_t result;
+	while ((count = SPSCRing_Peek(&fuart->txring, &data)) > 0) {
+		result = write(fuart->outfd, data, count);
+		if (result > 0) {
+			SPSCRing_Consume(&fuart->txring, result);
+		} else if ((result < 0) && (errno == EAGAIN)) {
+			/* The fd is nonblocking because of the poll handles */
+			if (!fuart->ofh_is_active) {
+				AsyncManager_PollStart(fuart->output_fh, ASYNCMANAGER_EVENT_WRITABLE,
+						       &file_uart_writable, fuart);
+				fuart->ofh_is_active = 1;
+			}
+			return;
+		} else if ((result < 0) && (errno == EINTR)) {
+			continue;
+		} else {
+			fprintf(stderr, "Write error\n");
+			SPSCRing_Consume(&fuart->txring, SPSCRing_Level(&fuart->txring));
+			break;
+		}
+	}
+	if (fuart->ofh_is_active) {
+		AsyncManager_PollStop(fuart->output_fh);
+		fuart->ofh_is_active = 0;
+	}
+}
+
+static void
+file_uart_writable(PollHandle_t *handle, int status, int events, void *clientdata)
+{
+	file_uart_flush(clientdata);
+}
+
+static void
+file_uart_tx_flush(NotifyHandle_t *handle, void *clientdata)
+{
+	FileUart *fuart = clientdata;
+	/* Wait for the writable event if the file is already full */
+	if (!fuart->ofh_is_active && !fuart->closed) {
+		file_uart_flush(fuart);
+	}
+}
+
 /**
  ******************************************************************************
  * Write to file
+ *	The characters are queued in the transmit ring and written by the
+ *	AsyncManager thread. Only whole characters which fit into the ring
+ *	are taken, the caller retries the rest later.
  ******************************************************************************
  */
 static int
 file_uart_write(SerialDevice * serial_device, const UartChar * buf, int len)
 {
 	FileUart *fuart = serial_device->owner;
-	int char_count = 0;
 	uint8_t *data = alloca(len << 2);
+	uint32_t room = SPSCRing_Room(&fuart->txring);
+	uint32_t count = 0;
+	uint8_t utf8[4];
+	unsigned int n;
 	int i;
 	if (fuart->infd < 0) {
 		return 0;
 	}
-	if (fuart->force_utf8 || (fuart->charsize > 8)) {
-		int cnt;
-		for (cnt = 0, i = 0; i < len; i++) {
-			cnt = unicode_to_utf8(buf[i],fuart->utf8_charbuf);
-			cnt = write(fuart->outfd, fuart->utf8_charbuf, cnt);
-#warning needs a buffer or blocking io
-			if(cnt > 0) {
-				char_count++;
-			} else {
-				return char_count;
-			}
-			if ((cnt <= 0) && (errno != EAGAIN)) {
-				fprintf(stderr, "Write error\n");
-				file_close(serial_device);
-				return -1;
-			}
-		}
-	} else {
-		for (i = 0; i < len; i++) {
-			data[i] = buf[i];
-		}
-		char_count = write(fuart->outfd, data, 1);
-		if ((char_count <= 0) && (errno != EAGAIN)) {
-			fprintf(stderr, "Write error\n");
-			file_close(serial_device);
-			return -1;
+	for (i = 0; i < len; i++) {
+		if (fuart->force_utf8 || (fuart->charsize > 8)) {
+			n = unicode_to_utf8(buf[i], utf8);
+		} else {
+			utf8[0] = buf[i];
+			n = 1;
 		}
-	}
-#if 0
-	if (count > 0) {
-		if (fuart->logfile) {
-			if (fwrite(buf, sizeof(UartChar), count, fuart->logfile) != count) {
-				fprintf(stderr, "Writing to logfile failed\n");
-			}
+		if (count + n > room) {
+			break;
 		}
-		return count;
+		memcpy(data + count, utf8, n);
+		count += n;
 	}
-	if ((count <= 0) && (errno != EAGAIN)) {
-		fprintf(stderr, "Write error\n");
-		file_close(serial_device);
-		return -1;
+	if (count) {
+		SPSCRing_Write(&fuart->txring, data, count);
+		AsyncManager_Notify(fuart->tx_notify);
 	}
-#endif
-	return 0;
+	return i;
 }
 
 static void
@@ -632,6 +704,10 @@ FileUart_New(const char *uart_name)
 		return &fiua->serdev;
 	} else {
 		fiua->input_fh = AsyncManager_PollInit(fiua->infd);
+		fiua->output_fh = AsyncManager_PollInit(fiua->outfd);
+		SPSCRing_Init(&fiua->txring, TXRING_SIZE);
+		fiua->tx_notify = AsyncManager_NotifyInit(file_uart_tx_flush, fiua);
+		fiua->close_notify = AsyncManager_NotifyInit(file_close_output, fiua);
 		fprintf(stderr, "Uart \"%s\" Connected to %s\n", uart_name, filename);
 	}
 	fiua->baudrate = 115200;
@@ -55,6 +55,7 @@
 #include "sglib.h"
 #include "asyncmanager.h"
 #include "exithandler.h"
+#include "spscring.h"
 
 
 #define RXBUF_SIZE 128
@@ -64,11 +65,7 @@
 #define RXBUF_LVL(pua) ((pua)->rxbuf_wp - (pua)->rxbuf_rp)
 #define RXBUF_ROOM(pua) (RXBUF_SIZE - RXBUF_LVL(pua))
 
-#define TXBUF_SIZE 256
-#define TXBUF_RP(pua) ((pua)->txbuf_rp % TXBUF_SIZE)
-#define TXBUF_WP(pua) ((pua)->txbuf_wp % TXBUF_SIZE)
-#define TXBUF_LVL(pua) ((pua)->txbuf_wp - (pua)->txbuf_rp)
-#define TXBUF_ROOM(pua) (TXBUF_SIZE - TXBUF_LVL(pua))
+#define TXRING_SIZE 4096
 
 typedef struct PtmxUart {
     SerialDevice serdev;
@@ -85,6 +82,7 @@ typedef struct PtmxUart {
     int rfh_active;
     PollHandle_t *wfh;
     int wfh_active;
+    NotifyHandle_t *txnotify;
 
     UartChar rxChar;
     int rxchar_present;
@@ -100,9 +98,11 @@ typedef struct PtmxUart {
     unsigned int rxbuf_wp;
     unsigned int rxbuf_rp;
 
-    uint8_t txbuf[TXBUF_SIZE];  /* UTF8 format if charsize > 8 */
-    unsigned int txbuf_wp;
-    unsigned int txbuf_rp;
+    /*
+     * UTF8 format if charsize > 8. Filled by the CPU thread,
+     * written to the pty by the AsyncManager thread.
+     */
+    SPSCRing txring;
 
     CycleTimer rxBaudTimer;
 //      int txchar_present;
@@ -112,6 +112,7 @@ typedef struct PtmxUart {
 static void Ptmx_Reopen(PtmxUart * pua);
 static void Ptmx_RefillRxChar(PtmxUart * pua);
 static void Ptmx_Writehandler(PollHandle_t *handle, int status, int events, void *clientdata);
+static void Ptmx_TxPut(PtmxUart * pua, const uint8_t * data, unsigned int cnt);
 
 /**
  **********************************************************************
@@ -138,33 +139,16 @@ static void
 PCCmd(PtmxUart * pua, uint16_t cmd)
 {
     char *str = "WeichGewehr " __DATE__ " " __TIME__;
-    int i;
+    uint8_t reply[2] = { cmd >> 8, 0x40 };
     fprintf(stderr, "Got cmd %04x\n", cmd);
     switch (cmd) {
         case 0xc301:
-            pua->txbuf[TXBUF_WP(pua)] = cmd >> 8;
-            pua->txbuf_wp++;
-            pua->txbuf[TXBUF_WP(pua)] = 0x40;
-            pua->txbuf_wp++;
-            for (i = 0; i < strlen(str) + 1; i++) {
-                pua->txbuf[TXBUF_WP(pua)] = str[i];
-                pua->txbuf_wp++;
-            }
-            if (!pua->wfh_active) {
-                AsyncManager_PollStart(pua->wfh, ASYNCMANAGER_EVENT_WRITABLE, &Ptmx_Writehandler, pua);
-                pua->wfh_active = 1;
-            }
+            Ptmx_TxPut(pua, reply, 2);
+            Ptmx_TxPut(pua, (uint8_t *) str, strlen(str) + 1);
             break;
 
         case 0xcb00:           // CMD_MDB_BUS_RESET:
-            pua->txbuf[TXBUF_WP(pua)] = cmd >> 8;
-            pua->txbuf_wp++;
-            pua->txbuf[TXBUF_WP(pua)] = 0x40;
-            pua->txbuf_wp++;
-            if (!pua->wfh_active) {
-                AsyncManager_PollStart(pua->wfh, ASYNCMANAGER_EVENT_WRITABLE, &Ptmx_Writehandler, pua);
-                pua->wfh_active = 1;
-            }
+            Ptmx_TxPut(pua, reply, 2);
             break;
 
         default:
@@ -227,7 +211,6 @@ pc2x8_to_mdb9(PtmxUart * pua, uint32_t * mdbWord, uint8_t pcbyte)
         }
         *mdbWord = ((w & 0x1f00) >> 4) | (w & 0xf);
         pua->mdbPktChksum = 0;
-        pua->txbuf_wp = pua->txbuf_rp = 0;
 //        fprintf(stderr,"R <- %04x\n", *mdbWord);
         return 1;
     }
@@ -393,23 +376,30 @@ Ptmx_SerialCmd(SerialDevice * sd, UartCmd * cmd)
 
 /**
  *****************************************************************
- * \fn static int Ptmx_Writehandler(void *eventData,int flags)
- * Event handler called when ptmx device is ready for writing
+ * \fn static void Ptmx_Flush(PtmxUart *pua)
+ * Write the transmit ring to the pty in the AsyncManager thread.
+ * When the pty is full the rest is written by the writable
+ * event handler.
  *****************************************************************
  */
 static void
-Ptmx_Writehandler(PollHandle_t *handle, int status, int events, void *clientdata)
+Ptmx_Flush(PtmxUart * pua)
 {
+    const uint8_t *data;
+    unsigned int cnt;
     int count;
-    PtmxUart *pua = clientdata;
-    while (pua->txbuf_rp != pua->txbuf_wp) {
-        unsigned int cnt = TXBUF_LVL(pua);
-        if ((TXBUF_RP(pua) + cnt) > TXBUF_SIZE) {
-            cnt = TXBUF_SIZE - TXBUF_RP(pua);
+    while ((cnt = SPSCRing_Peek(&pua->txring, &data)) > 0) {
+        if (pua->fd < 0) {
+            SPSCRing_Consume(&pua->txring, cnt);
+            continue;
         }
-        count = write(pua->fd, &pua->txbuf[TXBUF_RP(pua)], cnt);
+        count = write(pua->fd, data, cnt);
         if (count < 0) {
             if (errno == EAGAIN) {
+                if (!pua->wfh_active) {
+                    AsyncManager_PollStart(pua->wfh, ASYNCMANAGER_EVENT_WRITABLE, &Ptmx_Writehandler, pua);
+                    pua->wfh_active = 1;
+                }
                 return;
             } else {
                 Ptmx_Reopen(pua);
@@ -417,51 +407,89 @@ Ptmx_Writehandler(PollHandle_t *handle, int status, int events, void *clientdata
             }
         } else if (count == 0) {
             fprintf(stderr, "Write of %u bytes to pty failed\n", cnt);
-            pua->txbuf_rp = pua->txbuf_wp;
+            SPSCRing_Consume(&pua->txring, SPSCRing_Level(&pua->txring));
         } else {
             //fprintf(stderr,"Write %u\n", cnt);
-            pua->txbuf_rp += cnt;
+            SPSCRing_Consume(&pua->txring, count);
         }
     }
-    AsyncManager_PollStop(pua->wfh);
-    pua->wfh_active = 0;
-    return;
+    if (pua->wfh_active) {
+        AsyncManager_PollStop(pua->wfh);
+        pua->wfh_active = 0;
+    }
+}
+
+/**
+ *****************************************************************
+ * \fn static int Ptmx_Writehandler(void *eventData,int flags)
+ * Event handler called when ptmx device is ready for writing
+ *****************************************************************
+ */
+static void
+Ptmx_Writehandler(PollHandle_t *handle, int status, int events, void *clientdata)
+{
+    Ptmx_Flush(clientdata);
+}
+
+static void
+Ptmx_TxNotify(NotifyHandle_t *handle, void *clientdata)
+{
+    PtmxUart *pua = clientdata;
+    /* Wait for the writable event if the pty is already full */
+    if (!pua->wfh_active) {
+        Ptmx_Flush(pua);
+    }
+}
+
+/**
+ *****************************************************************
+ * Queue bytes for the pty. Called from the CPU thread only.
+ *****************************************************************
+ */
+static void
+Ptmx_TxPut(PtmxUart * pua, const uint8_t * data, unsigned int cnt)
+{
+    if (SPSCRing_Write(&pua->txring, data, cnt) != cnt) {
+        fprintf(stderr, "PTMX: tx buffer overflow\n");
+    }
+    AsyncManager_Notify(pua->txnotify);
 }
 
 static int
 Ptmx_Write(SerialDevice * sd, const UartChar * buf, int count)
 {
     PtmxUart *pua = sd->owner;
+    uint8_t *data;
+    unsigned int cnt;
+    int i;
     if (count == 0) {
         return 0;
     }
-    //pua->txchar_present = 0;
-    if (TXBUF_ROOM(pua) < 3) {
+    /* Take only whole characters */
+    if (SPSCRing_Room(&pua->txring) < 3) {
         return 0;
     }
+    if (count > (int)(SPSCRing_Room(&pua->txring) / 3)) {
+        count = SPSCRing_Room(&pua->txring) / 3;
+    }
+    data = alloca(count * 3);
     /* Force UTF 8 for > 8 bit */
     if ((pua->charsize > 8) || pua->force_utf8 || pua->force_mdbtrans) {
-        uint8_t data[3];
-        int cnt;
-        int i;
-        if (pua->force_mdbtrans) {
-            cnt = mdb9_to_pc2x8(pua, (uint16_t) buf[0], data);
-        } else {
-            cnt = unicode_to_utf8((uint16_t) buf[0], data);
-        }
-        for (i = 0; i < cnt; i++) {
-            pua->txbuf[TXBUF_WP(pua)] = data[i];
-            pua->txbuf_wp++;
+        for (cnt = 0, i = 0; i < count; i++) {
+            if (pua->force_mdbtrans) {
+                cnt += mdb9_to_pc2x8(pua, (uint16_t) buf[i], data + cnt);
+            } else {
+                cnt += unicode_to_utf8((uint16_t) buf[i], data + cnt);
+            }
         }
     } else {
-        pua->txbuf[TXBUF_WP(pua)] = buf[0];
-        pua->txbuf_wp++;
-    }
-    if (!pua->wfh_active) {
-        AsyncManager_PollStart(pua->wfh, ASYNCMANAGER_EVENT_WRITABLE, &Ptmx_Writehandler, pua);
-        pua->wfh_active = 1;
+        for (i = 0; i < count; i++) {
+            data[i] = buf[i];
+        }
+        cnt = count;
     }
-    return 1;
+    Ptmx_TxPut(pua, data, cnt);
+    return count;
 }
 
 /**
@@ -605,6 +633,8 @@ PtmxUart_New(const char *name)
     pua->owner = Config_ReadVar(name, "owner");
     pua->mode = Config_ReadVar(name, "mode");
     pua->usecs_per_char = 330;
+    SPSCRing_Init(&pua->txring, TXRING_SIZE);
+    pua->txnotify = AsyncManager_NotifyInit(Ptmx_TxNotify, pua);
     CycleTimer_Init(&pua->rxBaudTimer, Ptmx_RxChar, pua);
     fprintf(stderr, "PTMX pseudo Terminal Uart backend for \"%s\" at \"%s\"\n", name,
             pua->linkname);
@@ -248,6 +248,38 @@ dump_printdata(UsbTransaction * ta)
 	fprintf(stderr, "\n");
 }
 
+/*
+ * ----------------------------------------------------------------------------------
+ * print_data
+ *	Send data to the Printer Language interpreter and/or to a real
+ *	printer device
+ * ----------------------------------------------------------------------------------
+ */
+static void
+print_data(DJet460 * dj, const uint8_t * data, int len)
+{
+	CycleTimer_Mod(&dj->lp_close_timer, MillisecondsToCycles(15000));
+	if ((dj->lp_devfd < 0) && dj->lp_devname) {
+		dj->lp_devfd = open(dj->lp_devname, O_RDWR);
+	}
+	if (dj->lp_devfd >= 0) {
+		int count;
+		int result;
+		for (count = 0; count < len; count += result) {
+			result = write(dj->lp_devfd, data + count, len - count);
+			if (result < 0) {
+				fprintf(stderr, "Write to lp fd failed\n");
+				close(dj->lp_devfd);
+				dj->lp_devfd = -1;
+				break;
+			}
+		}
+	}
+	if (dj->interp != NULL) {
+		Dj460Interp_Feed(dj->interp, (void *)data, len);
+	}
+}
+
 /*
  * ----------------------------------------------------------------------------------
  * data_out_endpoint
@@ -261,32 +293,9 @@ data_out_endpoint(UsbDevice * udev, UsbEndpoint * ep, UsbTransaction * ta, UsbPa
 {
 	DJet460 *dj = (DJet460 *) udev->owner;
 	dbgprintf("Bulk endpoint request\n");
-	CycleTimer_Mod(&dj->lp_close_timer, MillisecondsToCycles(15000));
 	switch (ta->token.pid) {
 	    case USB_PID_OUT:
-		    if ((dj->lp_devfd < 0) && dj->lp_devname) {
-			    dj->lp_devfd = open(dj->lp_devname, O_RDWR);
-		    }
-		    if (dj->lp_devfd >= 0) {
-			    int count;
-			    int result;
-			    for (count = 0; count < ta->data_len; count += result) {
-				    result =
-					write(dj->lp_devfd, ta->data + count, ta->data_len - count);
-				    if (result < 0) {
-					    fprintf(stderr, "Write to lp fd failed\n");
-					    close(dj->lp_devfd);
-					    dj->lp_devfd = -1;
-					    break;
-				    }
-			    }
-
-		    } else {
-
-		    }
-		    if (dj->interp != NULL) {
-			    Dj460Interp_Feed(dj->interp, (void *)ta->data, ta->data_len);
-		    }
+		    print_data(dj, ta->data, ta->data_len);
 		    reply->pid = USB_PID_ACK;
 		    break;
 	    default:
@@ -296,6 +305,31 @@ data_out_endpoint(UsbDevice * udev, UsbEndpoint * ep, UsbTransaction * ta, UsbPa
 	return USBTA_OK;
 }
 
+/*
+ * ----------------------------------------------------------------------------------
+ * data_out_transfer
+ *	Takes a whole bulk transfer when the host uses the transaction level
+ *	interface
+ * ----------------------------------------------------------------------------------
+ */
+static int
+data_out_transfer(UsbDevice * udev, UsbEndpoint * ep, UsbTransfer * xfer)
+{
+	DJet460 *dj = (DJet460 *) udev->owner;
+	int packets;
+	if (xfer->pid != USB_PID_OUT) {
+		fprintf(stderr, "DJ460 bulk out: got unexpected transfer pid %d\n", xfer->pid);
+		return USB_RET_STALL;
+	}
+	print_data(dj, xfer->data, xfer->len);
+	packets = xfer->len ? (xfer->len + xfer->maxpacket - 1) / xfer->maxpacket : 1;
+	xfer->actual = xfer->len;
+	xfer->packets += packets;
+	xfer->toggle ^= packets & 1;
+	ep->toggle ^= packets & 1;
+	return 0;
+}
+
 /*
  * ----------------------------------------------------------------------------
  * data_in_endpoint
@@ -653,6 +687,7 @@ DJet460_New(const char *name, UsbDevice ** udevRet /*, ParportPrinter *pprn */ )
 	DJet460 *dj = sg_new(DJet460);
 	UsbDevice *udev;
 	UsbEndpoint *ep0;
+	UsbEndpoint *ep;
 	int i;
 	dj->lp_devname = Config_ReadVar(name, "lpdevice");
 	dj->lp_devfd = -1;
@@ -672,7 +707,8 @@ DJet460_New(const char *name, UsbDevice ** udevRet /*, ParportPrinter *pprn */ )
 
 	/* Register the endpoints */
 	ep0 = UsbDev_RegisterEndpoint(udev, 0x00, EPNT_TYPE_CONTROL, 8, UsbDev_CtrlEp);
-	UsbDev_RegisterEndpoint(udev, 0x01, EPNT_TYPE_BULK, 64, data_out_endpoint);
+	ep = UsbDev_RegisterEndpoint(udev, 0x01, EPNT_TYPE_BULK, 64, data_out_endpoint);
+	UsbDev_RegisterTransferProc(ep, data_out_transfer);
 	UsbDev_RegisterEndpoint(udev, 0x81, EPNT_TYPE_BULK, 64, data_in_endpoint);
 	UsbDev_RegisterEndpoint(udev, 0x82, EPNT_TYPE_INT, 8, interrupt_endpoint);
 
@@ -109,6 +109,8 @@ print_timestamp(char *str)
 #endif
 }
 
+#define GSESS_REPLY_SIZE	(1024)
+
 static int gsess_reply(GdbSession *, const char *format, ...);	//  __attribute__ ((format (printf, 2, 3)));;
 
 static void
@@ -127,14 +129,18 @@ static int
 gsess_reply(GdbSession * gsess, const char *format, ...)
 {
 	va_list ap;
-	char *reply = malloc(1024);
+	char *reply = malloc(GSESS_REPLY_SIZE);
 	uint8_t chksum = 0;
 	int count;
 	int i;
 	count = sprintf(reply, "$");
 	va_start(ap, format);
-	count += vsnprintf(reply + count, sizeof(reply) - count - 4, format, ap);
+	count += vsnprintf(reply + count, GSESS_REPLY_SIZE - count - 4, format, ap);
 	va_end(ap);
+	/* Truncated, leave room for the checksum */
+	if (count > GSESS_REPLY_SIZE - 5) {
+		count = GSESS_REPLY_SIZE - 5;
+	}
 	dbgprintf("Reply \"%s\"\n", reply);
 	for (i = 1; i < count; i++) {
 		chksum += reply[i];
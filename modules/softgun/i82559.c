@@ -48,7 +48,7 @@
 #include <errno.h>
 #include <stdio.h>
 #include "pci.h"
-#include "linux-tap.h"
+#include "netbackend.h"
 #include "cycletimer.h"
 #include "signode.h"
 #include "i82559.h"
@@ -80,7 +80,7 @@ typedef struct I82559 {
 	PCI_Function *bridge;
 	uint32_t bus_irq;
 
-	int ether_fd;
+	NetBackend *backend;
 	uint16_t pci_device_id;
 	uint16_t pci_vendor_id;
 	uint16_t pci_command;
@@ -777,8 +777,7 @@ PCI_Function *
 I82559_New(const char *devname, PCI_Function * bridge, int dev_nr, int bus_irq)
 {
 	I82559 *ixx = sg_new(I82559);
-	ixx->ether_fd = Net_CreateInterface(devname);
-	fcntl(ixx->ether_fd, F_SETFL, O_NONBLOCK);
+	ixx->backend = NetBackend_New(devname);
 
 	ixx->pci_device_id = PCI_DEVICE_ID_82559;
 	ixx->pci_vendor_id = PCI_VENDOR_ID_INTEL;
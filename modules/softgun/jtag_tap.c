@@ -31,6 +31,7 @@
  *
  *************************************************************************************************
  */
+#include <stdio.h>
 #include <errno.h>
 #include <stdint.h>
 #include <string.h>
@@ -81,7 +81,7 @@
 //==============================================================================
 //= Variables
 //==============================================================================
-MCS51Cpu g_mcs51;
+__MACHINE_LOCAL__ MCS51Cpu g_mcs51;
 
 
 //==============================================================================
@@ -95,7 +95,7 @@ MCS51Cpu g_mcs51;
 static void MCS51_UpdateIPL(void);
 static inline void MCS51_PushIpl(void);
 static void MCS51_Interrupt(void);
-static inline void CheckSignals(void);
+static __DISPATCH_INLINE__ void CheckSignals(void);
 static int load_to_bus(void *clientData, uint32_t addr, uint8_t * buf, unsigned int count, int flags);
 static uint8_t acc_read(void *eventData, uint8_t addr);
 static void acc_write(void *eventData, uint8_t addr, uint8_t value);
@@ -175,7 +175,7 @@ MCS51_Interrupt(void)
 	SET_REG_PC(addr);
 }
 
-static inline void
+static __DISPATCH_INLINE__ void
 CheckSignals(void)
 {
 	if (g_mcs51.signals & MCS51_SIG_IRQ) {
@@ -366,17 +366,50 @@ create(void)
 }
 
 
+#ifdef LEIGUN_THREADED_DISPATCH
+/*
+ * Handler of a dispatch slot for the threaded main loop. The cycles
+ * are a property of the instruction, not of the proc.
+ */
+#define MCS51_HANDLER(n) \
+	DISPATCH_LABEL(n): \
+	if ((n) == 0) { \
+		instr->iproc(); \
+	} else { \
+		mcs51Dispatch.proc[n](); \
+	} \
+	GlobalClock_ConsumeCycle(clk, 2); \
+	CycleCounter += instr->cycles; \
+	CycleTimers_Check(); \
+	CheckSignals(); \
+	ICODE = MCS51_ReadPgmMem(GET_REG_PC); \
+	SET_REG_PC(GET_REG_PC + 1); \
+	instr = MCS51_InstructionFind(ICODE); \
+	goto *target[ICODE];
+#endif
+
 static void
 run(GlobalClock_LocalClock_t *clk, void *data)
 {
 	Device_MPU_t *dev = data;
 	uint32_t addr = 0;
 	MCS51_Instruction *instr;
+#ifdef LEIGUN_THREADED_DISPATCH
+	static const void *const labels[DISPATCH_SLOTS] = DISPATCH_LABELS;
+	const void **target = Dispatch_MapTargets(&mcs51Dispatch, labels);
+#endif
 	if (Config_ReadUInt32(&addr, "global", "start_address") < 0) {
 		addr = 0;
 	}
 	SET_REG_PC(addr);
 
+#ifdef LEIGUN_THREADED_DISPATCH
+	ICODE = MCS51_ReadPgmMem(GET_REG_PC);
+	SET_REG_PC(GET_REG_PC + 1);
+	instr = MCS51_InstructionFind(ICODE);
+	goto *target[ICODE];
+	DISPATCH_HANDLERS(MCS51_HANDLER)
+#else
 	while (1) {
 		ICODE = MCS51_ReadPgmMem(GET_REG_PC);
 		//logPC();
@@ -392,6 +425,7 @@ run(GlobalClock_LocalClock_t *clk, void *data)
 		CycleTimers_Check();
 		CheckSignals();
 	}
+#endif
 }
 
 
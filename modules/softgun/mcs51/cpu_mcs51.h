@@ -75,7 +75,7 @@ typedef struct MCS51Cpu {
 #define SET_REG_PC(val) ((g_mcs51.pc) = (val))
 #define PSW (g_mcs51.psw)
 
-extern MCS51Cpu g_mcs51;
+extern __MACHINE_LOCAL__ MCS51Cpu g_mcs51;
 
 static inline void
 MCS51_SetPSW(uint8_t val)
@@ -9,8 +9,11 @@
 #include "instructions_mcs51.h"
 #include "sgstring.h"
 
-MCS51_InstructionProc **mcs51_iProcTab = NULL;
-MCS51_Instruction **mcs51_instrTab = NULL;
+__MACHINE_LOCAL__ MCS51_InstructionProc **mcs51_iProcTab = NULL;
+#ifdef LEIGUN_THREADED_DISPATCH
+__MACHINE_LOCAL__ Dispatch_Map mcs51Dispatch;
+#endif
+__MACHINE_LOCAL__ MCS51_Instruction **mcs51_instrTab = NULL;
 
 static MCS51_Instruction instrlist[] = {
 	{
@@ -930,6 +933,9 @@ MCS51_IDecoderNew(unsigned int cycles_multiplicator)
 			mcs51_iProcTab[icode] = mcs51_undef;
 		}
 	}
+#ifdef LEIGUN_THREADED_DISPATCH
+	Dispatch_MapInit(&mcs51Dispatch, mcs51_iProcTab, 0x100);
+#endif
 	for (j = num_instr - 1; j >= 0; j--) {
 		MCS51_Instruction *instr = &instrlist[j];
 		instr->cycles *= cycles_multiplicator;
@@ -1,4 +1,8 @@
 #include <stdint.h>
+#include "compiler_extensions.h"
+#ifdef LEIGUN_THREADED_DISPATCH
+#include "dispatch.h"
+#endif
 typedef void MCS51_InstructionProc(void);
 
 typedef struct MCS51_Instruction {
@@ -10,8 +14,11 @@ typedef struct MCS51_Instruction {
 	int len;
 } MCS51_Instruction;
 
-extern MCS51_InstructionProc **mcs51_iProcTab;
-extern MCS51_Instruction **mcs51_instrTab;
+extern __MACHINE_LOCAL__ MCS51_InstructionProc **mcs51_iProcTab;
+extern __MACHINE_LOCAL__ MCS51_Instruction **mcs51_instrTab;
+#ifdef LEIGUN_THREADED_DISPATCH
+extern __MACHINE_LOCAL__ Dispatch_Map mcs51Dispatch;
+#endif
 
 static inline MCS51_InstructionProc *
 MCS51_InstructionProcFind(uint16_t icode)
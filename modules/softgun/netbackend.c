@@ -0,0 +1,830 @@
+//===-- softgun/netbackend.c --------------------------------------*- C -*-===//
+//
+//              The Leigun Embedded System Simulator Platform
+//
+// Licensed under the Apache License, Version 2.0 (the "License");
+// you may not use this file except in compliance with the License.
+// You may obtain a copy of the License at
+//
+//     http://www.apache.org/licenses/LICENSE-2.0
+//
+// Unless required by applicable law or agreed to in writing, software
+// distributed under the License is distributed on an "AS IS" BASIS,
+// WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+// See the License for the specific language governing permissions and
+// limitations under the License.
+//
+//===----------------------------------------------------------------------===//
+///
+/// @file
+/// Ethernet frame transport used by the network interface emulators
+///
+/// Backends, selected with "backend" in the section of the device:
+///   tap:    (default) a TAP interface of the host, needs sg_tunctl
+///           (see linux-tap.c)
+///   switch: a virtual switch between simulator instances. Every port
+///           binds a unix datagram socket <device>-<pid>.<instance> in the
+///           directory given with "switch" (default /tmp/leigun-switch).
+///           Unicast frames go to the port which sent the destination
+///           MAC last, all other frames are flooded with one sendmmsg.
+///           Frames are received in batches with recvmmsg. Sends do not
+///           block, a port which can not take a frame loses it. Needs no
+///           privileges.
+///   pcap:   replays the frames of the file "pcap_replay" as fast as the
+///           device takes them, sent frames are dropped
+///
+/// With "pcap_capture" all sent and received frames of any backend are
+/// written to a pcap file.
+///
+//===----------------------------------------------------------------------===//
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <stddef.h>
+#include <stdint.h>
+#include <string.h>
+#include <errno.h>
+#include <fcntl.h>
+#include <unistd.h>
+#include <dirent.h>
+#include <pthread.h>
+#include <time.h>
+#include <sys/time.h>
+#include <sys/stat.h>
+#include <sys/socket.h>
+#include <sys/un.h>
+#include "netbackend.h"
+#include "linux-tap.h"
+#include "asyncmanager.h"
+#include "configfile.h"
+#include "exithandler.h"
+#include "byteorder.h"
+#include "sgstring.h"
+#include "cycletimer.h"
+
+#define NB_MAXFRAME	(2048)
+#define NB_MAXIOV	(8)
+
+#define VSW_BATCH	(16)
+#define VSW_MAXPEERS	(32)
+#define VSW_MACHASH	(64)
+#define VSW_SCAN_MS	(1000)
+
+#define PCAP_MAGIC	(0xa1b2c3d4)
+#define PCAP_MAGIC_NS	(0xa1b23c4d)
+#define PCAP_LINKTYPE_ETHERNET	(1)
+
+typedef struct NetBackendOps {
+	ssize_t(*recv) (NetBackend * nb, void *buf, size_t maxlen);
+	ssize_t(*sendv) (NetBackend * nb, const struct iovec * iov, int iovcnt);
+	/* Frames received from the host but not yet fetched */
+	int (*pending) (NetBackend * nb);
+} NetBackendOps;
+
+typedef struct PcapFileHeader {
+	uint32_t magic;
+	uint16_t version_major;
+	uint16_t version_minor;
+	int32_t thiszone;
+	uint32_t sigfigs;
+	uint32_t snaplen;
+	uint32_t linktype;
+} PcapFileHeader;
+
+typedef struct PcapRecordHeader {
+	uint32_t ts_sec;
+	uint32_t ts_usec;
+	uint32_t incl_len;
+	uint32_t orig_len;
+} PcapRecordHeader;
+
+typedef struct PcapWriter {
+	FILE *file;
+	pthread_mutex_t lock;
+} PcapWriter;
+
+struct NetBackend {
+	const char *name;
+	const NetBackendOps *ops;
+	int fd;			/* Readable when frames arrive, -1 if there is none */
+	PollHandle_t *pollHandle;
+	CycleTimer kickTimer;
+	NetBackend_RxProc *rxProc;
+	void *rxClientData;
+	int rxActive;
+	PcapWriter *capture;
+};
+
+typedef struct VSwitchPeer {
+	struct sockaddr_un addr;
+	socklen_t addrlen;
+} VSwitchPeer;
+
+typedef struct VSwitchMac {
+	uint8_t mac[6];
+	uint8_t valid;
+	VSwitchPeer peer;
+} VSwitchMac;
+
+typedef struct VSwitchBackend {
+	NetBackend nb;
+	pthread_mutex_t lock;
+	char *dir;
+	VSwitchPeer self;
+	VSwitchPeer peers[VSW_MAXPEERS];
+	unsigned int nr_peers;
+	uint64_t nextScan;
+	VSwitchMac macTable[VSW_MACHASH];
+	struct mmsghdr txmsg[VSW_MAXPEERS];
+	struct iovec txiov[NB_MAXIOV];
+	struct mmsghdr rxmsg[VSW_BATCH];
+	struct iovec rxiov[VSW_BATCH];
+	struct sockaddr_un rxfrom[VSW_BATCH];
+	uint8_t rxbuf[VSW_BATCH][NB_MAXFRAME];
+	unsigned int rx_rp;
+	unsigned int rx_cnt;
+	uint64_t nr_dropped;
+} VSwitchBackend;
+
+typedef struct PcapReplayBackend {
+	NetBackend nb;
+	pthread_mutex_t lock;
+	FILE *file;
+	int swap;
+	int eof;
+} PcapReplayBackend;
+
+static size_t
+iov_length(const struct iovec *iov, int iovcnt)
+{
+	size_t len = 0;
+	int i;
+	for (i = 0; i < iovcnt; i++) {
+		len += iov[i].iov_len;
+	}
+	return len;
+}
+
+static void
+iov_peek(uint8_t * dst, const struct iovec *iov, int iovcnt, size_t count)
+{
+	size_t part;
+	int i;
+	for (i = 0; (i < iovcnt) && count; i++) {
+		part = iov[i].iov_len < count ? iov[i].iov_len : count;
+		memcpy(dst, iov[i].iov_base, part);
+		dst += part;
+		count -= part;
+	}
+}
+
+/*
+ * ---------------------------------------------------------------
+ * Capture of all frames of a backend in pcap format
+ * ---------------------------------------------------------------
+ */
+static void
+pcap_flush(void *data)
+{
+	PcapWriter *pw = data;
+	pthread_mutex_lock(&pw->lock);
+	fflush(pw->file);
+	pthread_mutex_unlock(&pw->lock);
+}
+
+static PcapWriter *
+PcapWriter_New(const char *filename)
+{
+	PcapWriter *pw;
+	PcapFileHeader hdr;
+	FILE *file = fopen(filename, "wb");
+	if (!file) {
+		fprintf(stderr, "Can not open pcap capture file \"%s\": %s\n", filename,
+			strerror(errno));
+		return NULL;
+	}
+	hdr.magic = PCAP_MAGIC;
+	hdr.version_major = 2;
+	hdr.version_minor = 4;
+	hdr.thiszone = 0;
+	hdr.sigfigs = 0;
+	hdr.snaplen = NB_MAXFRAME;
+	hdr.linktype = PCAP_LINKTYPE_ETHERNET;
+	fwrite(&hdr, sizeof(hdr), 1, file);
+	pw = sg_new(PcapWriter);
+	pw->file = file;
+	pthread_mutex_init(&pw->lock, NULL);
+	ExitHandler_Register(pcap_flush, pw);
+	return pw;
+}
+
+static void
+PcapWriter_Write(PcapWriter * pw, const struct iovec *iov, int iovcnt)
+{
+	PcapRecordHeader rec;
+	struct timeval tv;
+	int i;
+	gettimeofday(&tv, NULL);
+	rec.ts_sec = tv.tv_sec;
+	rec.ts_usec = tv.tv_usec;
+	rec.incl_len = rec.orig_len = iov_length(iov, iovcnt);
+	pthread_mutex_lock(&pw->lock);
+	fwrite(&rec, sizeof(rec), 1, pw->file);
+	for (i = 0; i < iovcnt; i++) {
+		fwrite(iov[i].iov_base, 1, iov[i].iov_len, pw->file);
+	}
+	pthread_mutex_unlock(&pw->lock);
+}
+
+/*
+ * ---------------------------------------------------------------
+ * TAP backend. A TAP fd returns exactly one frame per read, so
+ * there is nothing to batch on the receive side, a poll wakeup is
+ * drained by the device reading until EAGAIN.
+ * ---------------------------------------------------------------
+ */
+static ssize_t
+tap_recv(NetBackend * nb, void *buf, size_t maxlen)
+{
+	return read(nb->fd, buf, maxlen);
+}
+
+static ssize_t
+tap_sendv(NetBackend * nb, const struct iovec *iov, int iovcnt)
+{
+	return writev(nb->fd, iov, iovcnt);
+}
+
+static const NetBackendOps tapOps = {
+	.recv = tap_recv,
+	.sendv = tap_sendv,
+};
+
+static NetBackend *
+Tap_New(const char *devname)
+{
+	NetBackend *nb;
+	int fd = Net_CreateInterface(devname);
+	if (fd < 0) {
+		return NULL;
+	}
+	fcntl(fd, F_SETFL, O_NONBLOCK);
+	nb = sg_new(NetBackend);
+	nb->ops = &tapOps;
+	nb->fd = fd;
+	return nb;
+}
+
+/*
+ * ---------------------------------------------------------------
+ * Virtual switch backend
+ * ---------------------------------------------------------------
+ */
+static uint64_t
+now_ms(void)
+{
+	struct timespec ts;
+	clock_gettime(CLOCK_MONOTONIC, &ts);
+	return (uint64_t) ts.tv_sec * 1000 + ts.tv_nsec / 1000000;
+}
+
+static inline unsigned int
+mac_hash(const uint8_t * mac)
+{
+	return (mac[3] ^ mac[4] ^ (mac[5] * 7)) & (VSW_MACHASH - 1);
+}
+
+static int
+vsw_find_peer(VSwitchBackend * vs, const struct sockaddr_un *addr)
+{
+	unsigned int i;
+	for (i = 0; i < vs->nr_peers; i++) {
+		if (!strcmp(vs->peers[i].addr.sun_path, addr->sun_path)) {
+			return i;
+		}
+	}
+	return -1;
+}
+
+static void
+vsw_add_peer(VSwitchBackend * vs, const struct sockaddr_un *addr, socklen_t addrlen)
+{
+	if (!strcmp(addr->sun_path, vs->self.addr.sun_path) || (vsw_find_peer(vs, addr) >= 0)) {
+		return;
+	}
+	if (vs->nr_peers == VSW_MAXPEERS) {
+		fprintf(stderr, "%s: Virtual switch port limit of %d reached\n", vs->nb.name,
+			VSW_MAXPEERS);
+		return;
+	}
+	vs->peers[vs->nr_peers].addr = *addr;
+	vs->peers[vs->nr_peers].addrlen = addrlen;
+	vs->nr_peers++;
+}
+
+/*
+ * A port whose socket file exists but is not bound belongs to an
+ * instance which was killed without cleanup.
+ */
+static void
+vsw_remove_peer(VSwitchBackend * vs, unsigned int idx, int stale)
+{
+	unsigned int i;
+	if (stale) {
+		unlink(vs->peers[idx].addr.sun_path);
+	}
+	for (i = 0; i < VSW_MACHASH; i++) {
+		if (vs->macTable[i].valid
+		    && !strcmp(vs->macTable[i].peer.addr.sun_path, vs->peers[idx].addr.sun_path)) {
+			vs->macTable[i].valid = 0;
+		}
+	}
+	vs->peers[idx] = vs->peers[--vs->nr_peers];
+}
+
+static void
+vsw_scan(VSwitchBackend * vs)
+{
+	DIR *dir;
+	struct dirent *de;
+	struct sockaddr_un addr;
+	int len;
+	vs->nextScan = now_ms() + VSW_SCAN_MS;
+	dir = opendir(vs->dir);
+	if (!dir) {
+		return;
+	}
+	addr.sun_family = AF_UNIX;
+	while ((de = readdir(dir)) != NULL) {
+		if ((de->d_name[0] == '.') || ((de->d_type != DT_SOCK) && (de->d_type != DT_UNKNOWN))) {
+			continue;
+		}
+		len = snprintf(addr.sun_path, sizeof(addr.sun_path), "%s/%s", vs->dir, de->d_name);
+		if (len >= (int)sizeof(addr.sun_path)) {
+			continue;
+		}
+		vsw_add_peer(vs, &addr, offsetof(struct sockaddr_un, sun_path) + len + 1);
+	}
+	closedir(dir);
+}
+
+/*
+ * New ports announce themselves with an empty datagram, so every
+ * port is known to the others before it sends the first frame.
+ */
+static void
+vsw_learn(VSwitchBackend * vs, const uint8_t * frame, unsigned int len,
+	  const struct sockaddr_un *from, socklen_t fromlen)
+{
+	VSwitchMac *entry;
+	const uint8_t *src = frame + 6;
+	if (fromlen <= offsetof(struct sockaddr_un, sun_path)) {
+		return;
+	}
+	vsw_add_peer(vs, from, fromlen);
+	if ((len < 12) || (src[0] & 1)) {
+		return;
+	}
+	entry = &vs->macTable[mac_hash(src)];
+	memcpy(entry->mac, src, 6);
+	entry->peer.addr = *from;
+	entry->peer.addrlen = fromlen;
+	entry->valid = 1;
+}
+
+static ssize_t
+vsw_recv(NetBackend * nb, void *buf, size_t maxlen)
+{
+	VSwitchBackend *vs = (VSwitchBackend *) nb;
+	unsigned int i;
+	size_t len;
+	int n;
+	pthread_mutex_lock(&vs->lock);
+	do {
+		if (vs->rx_rp == vs->rx_cnt) {
+			for (i = 0; i < VSW_BATCH; i++) {
+				vs->rxmsg[i].msg_hdr.msg_namelen = sizeof(vs->rxfrom[i]);
+			}
+			n = recvmmsg(nb->fd, vs->rxmsg, VSW_BATCH, MSG_DONTWAIT, NULL);
+			if (n <= 0) {
+				pthread_mutex_unlock(&vs->lock);
+				if (n == 0) {
+					errno = EAGAIN;
+				}
+				return -1;
+			}
+			vs->rx_rp = 0;
+			vs->rx_cnt = n;
+			for (i = 0; i < vs->rx_cnt; i++) {
+				vsw_learn(vs, vs->rxbuf[i], vs->rxmsg[i].msg_len, &vs->rxfrom[i],
+					  vs->rxmsg[i].msg_hdr.msg_namelen);
+			}
+		}
+		i = vs->rx_rp++;
+	} while (vs->rxmsg[i].msg_len == 0);
+	len = vs->rxmsg[i].msg_len;
+	if (len > maxlen) {
+		len = maxlen;
+	}
+	memcpy(buf, vs->rxbuf[i], len);
+	pthread_mutex_unlock(&vs->lock);
+	return len;
+}
+
+static int
+vsw_pending(NetBackend * nb)
+{
+	VSwitchBackend *vs = (VSwitchBackend *) nb;
+	int pending;
+	pthread_mutex_lock(&vs->lock);
+	pending = vs->rx_rp != vs->rx_cnt;
+	pthread_mutex_unlock(&vs->lock);
+	return pending;
+}
+
+/*
+ * The kernel queues only a few datagrams per unix socket
+ * (net.unix.max_dgram_qlen). Sends never block, like on a real switch
+ * the frame is dropped for a port which can not take it.
+ */
+static int
+vsw_send_failed(VSwitchBackend * vs, unsigned int idx)
+{
+	if ((errno == ECONNREFUSED) || (errno == ENOENT)) {
+		vsw_remove_peer(vs, idx, errno == ECONNREFUSED);
+		return 1;
+	}
+	vs->nr_dropped++;
+	return 0;
+}
+
+static ssize_t
+vsw_sendv(NetBackend * nb, const struct iovec *iov, int iovcnt)
+{
+	VSwitchBackend *vs = (VSwitchBackend *) nb;
+	size_t len = iov_length(iov, iovcnt);
+	uint8_t dst[6];
+	VSwitchMac *entry;
+	struct msghdr *hdr;
+	unsigned int i;
+	int idx, n;
+	if ((len < 6) || (iovcnt > NB_MAXIOV)) {
+		errno = EINVAL;
+		return -1;
+	}
+	iov_peek(dst, iov, iovcnt, 6);
+	pthread_mutex_lock(&vs->lock);
+	/* The message header takes a non const iovec */
+	memcpy(vs->txiov, iov, iovcnt * sizeof(struct iovec));
+	if (now_ms() >= vs->nextScan) {
+		vsw_scan(vs);
+	}
+	entry = &vs->macTable[mac_hash(dst)];
+	if (!(dst[0] & 1) && entry->valid && !memcmp(entry->mac, dst, 6)) {
+		struct msghdr msg = {
+			.msg_name = &entry->peer.addr,
+			.msg_namelen = entry->peer.addrlen,
+			.msg_iov = vs->txiov,
+			.msg_iovlen = iovcnt,
+		};
+		if (sendmsg(nb->fd, &msg, MSG_DONTWAIT) < 0) {
+			idx = vsw_find_peer(vs, &entry->peer.addr);
+			if (idx >= 0) {
+				vsw_send_failed(vs, idx);
+			} else {
+				entry->valid = 0;
+			}
+		}
+		pthread_mutex_unlock(&vs->lock);
+		return len;
+	}
+	for (i = 0; i < vs->nr_peers; i++) {
+		hdr = &vs->txmsg[i].msg_hdr;
+		hdr->msg_name = &vs->peers[i].addr;
+		hdr->msg_namelen = vs->peers[i].addrlen;
+		hdr->msg_iov = vs->txiov;
+		hdr->msg_iovlen = iovcnt;
+	}
+	i = 0;
+	while (i < vs->nr_peers) {
+		n = sendmmsg(nb->fd, &vs->txmsg[i], vs->nr_peers - i, MSG_DONTWAIT);
+		if (n > 0) {
+			i += n;
+		} else if (vsw_send_failed(vs, i)) {
+			/* The last peer moved to slot i */
+			hdr = &vs->txmsg[i].msg_hdr;
+			hdr->msg_name = &vs->peers[i].addr;
+			hdr->msg_namelen = vs->peers[i].addrlen;
+		} else {
+			i++;
+		}
+	}
+	pthread_mutex_unlock(&vs->lock);
+	return len;
+}
+
+static const NetBackendOps vswitchOps = {
+	.recv = vsw_recv,
+	.sendv = vsw_sendv,
+	.pending = vsw_pending,
+};
+
+static void
+vsw_exit(void *data)
+{
+	VSwitchBackend *vs = data;
+	unlink(vs->self.addr.sun_path);
+	if (vs->nr_dropped) {
+		fprintf(stderr, "%s: %llu frames dropped by the virtual switch\n", vs->nb.name,
+			(unsigned long long)vs->nr_dropped);
+	}
+}
+
+static NetBackend *
+VSwitch_New(const char *devname)
+{
+	VSwitchBackend *vs;
+	char *dir = Config_ReadVar(devname, "switch");
+	int bufsize = 1 << 20;
+	unsigned int i;
+	int len;
+	int fd;
+	if (!dir) {
+		dir = "/tmp/leigun-switch";
+	}
+	if ((mkdir(dir, 0777) < 0) && (errno != EEXIST)) {
+		fprintf(stderr, "%s: Can not create switch directory \"%s\": %s\n", devname, dir,
+			strerror(errno));
+		return NULL;
+	}
+	vs = sg_new(VSwitchBackend);
+	vs->self.addr.sun_family = AF_UNIX;
+	len = snprintf(vs->self.addr.sun_path, sizeof(vs->self.addr.sun_path), "%s/%s-%d.%u", dir,
+		       devname, (int)getpid(), Config_GetInstance());
+	if (len >= (int)sizeof(vs->self.addr.sun_path)) {
+		fprintf(stderr, "%s: Switch directory name \"%s\" is too long\n", devname, dir);
+		sg_free(vs);
+		return NULL;
+	}
+	vs->self.addrlen = offsetof(struct sockaddr_un, sun_path) + len + 1;
+	fd = socket(AF_UNIX, SOCK_DGRAM, 0);
+	if (fd < 0) {
+		perror("Can not create virtual switch socket");
+		sg_free(vs);
+		return NULL;
+	}
+	unlink(vs->self.addr.sun_path);
+	if (bind(fd, (struct sockaddr *)&vs->self.addr, vs->self.addrlen) < 0) {
+		fprintf(stderr, "%s: Can not bind \"%s\": %s\n", devname, vs->self.addr.sun_path,
+			strerror(errno));
+		close(fd);
+		sg_free(vs);
+		return NULL;
+	}
+	setsockopt(fd, SOL_SOCKET, SO_SNDBUF, &bufsize, sizeof(bufsize));
+	setsockopt(fd, SOL_SOCKET, SO_RCVBUF, &bufsize, sizeof(bufsize));
+	pthread_mutex_init(&vs->lock, NULL);
+	vs->dir = sg_strdup(dir);
+	for (i = 0; i < VSW_BATCH; i++) {
+		vs->rxiov[i].iov_base = vs->rxbuf[i];
+		vs->rxiov[i].iov_len = NB_MAXFRAME;
+		vs->rxmsg[i].msg_hdr.msg_iov = &vs->rxiov[i];
+		vs->rxmsg[i].msg_hdr.msg_iovlen = 1;
+		vs->rxmsg[i].msg_hdr.msg_name = &vs->rxfrom[i];
+	}
+	vs->nb.ops = &vswitchOps;
+	vs->nb.fd = fd;
+	vs->nb.name = devname;
+	vsw_scan(vs);
+	for (i = 0; i < vs->nr_peers; i++) {
+		sendto(fd, NULL, 0, MSG_DONTWAIT, (struct sockaddr *)&vs->peers[i].addr,
+		       vs->peers[i].addrlen);
+	}
+	ExitHandler_Register(vsw_exit, vs);
+	fprintf(stderr, "%s: Port \"%s\" of virtual switch with %u other ports\n", devname,
+		vs->self.addr.sun_path, vs->nr_peers);
+	return &vs->nb;
+}
+
+/*
+ * ---------------------------------------------------------------
+ * pcap replay backend
+ * ---------------------------------------------------------------
+ */
+static ssize_t
+pcap_recv(NetBackend * nb, void *buf, size_t maxlen)
+{
+	PcapReplayBackend *pb = (PcapReplayBackend *) nb;
+	PcapRecordHeader rec;
+	uint32_t len;
+	size_t count;
+	pthread_mutex_lock(&pb->lock);
+	if (pb->eof || (fread(&rec, sizeof(rec), 1, pb->file) != 1)) {
+		goto eof;
+	}
+	len = pb->swap ? BYTE_Swap32(rec.incl_len) : rec.incl_len;
+	count = len < maxlen ? len : maxlen;
+	if (fread(buf, 1, count, pb->file) != count) {
+		goto eof;
+	}
+	if (count < len) {
+		fseek(pb->file, len - count, SEEK_CUR);
+	}
+	pthread_mutex_unlock(&pb->lock);
+	return count;
+ eof:
+	if (!pb->eof) {
+		fprintf(stderr, "%s: pcap replay finished\n", nb->name);
+		pb->eof = 1;
+	}
+	pthread_mutex_unlock(&pb->lock);
+	errno = EAGAIN;
+	return -1;
+}
+
+static ssize_t
+pcap_sendv(NetBackend * nb, const struct iovec *iov, int iovcnt)
+{
+	return iov_length(iov, iovcnt);
+}
+
+static int
+pcap_pending(NetBackend * nb)
+{
+	PcapReplayBackend *pb = (PcapReplayBackend *) nb;
+	return pb->file && !pb->eof;
+}
+
+static const NetBackendOps pcapOps = {
+	.recv = pcap_recv,
+	.sendv = pcap_sendv,
+	.pending = pcap_pending,
+};
+
+static NetBackend *
+PcapReplay_New(const char *devname)
+{
+	PcapReplayBackend *pb;
+	PcapFileHeader hdr;
+	char *filename = Config_ReadVar(devname, "pcap_replay");
+	pb = sg_new(PcapReplayBackend);
+	pb->nb.ops = &pcapOps;
+	pb->nb.fd = -1;
+	pb->nb.name = devname;
+	pthread_mutex_init(&pb->lock, NULL);
+	if (!filename) {
+		return &pb->nb;
+	}
+	pb->file = fopen(filename, "rb");
+	if (!pb->file) {
+		fprintf(stderr, "%s: Can not open pcap file \"%s\": %s\n", devname, filename,
+			strerror(errno));
+		return &pb->nb;
+	}
+	if (fread(&hdr, sizeof(hdr), 1, pb->file) != 1) {
+		hdr.magic = 0;
+	}
+	if ((hdr.magic == BYTE_Swap32(PCAP_MAGIC)) || (hdr.magic == BYTE_Swap32(PCAP_MAGIC_NS))) {
+		pb->swap = 1;
+		hdr.linktype = BYTE_Swap32(hdr.linktype);
+	} else if ((hdr.magic != PCAP_MAGIC) && (hdr.magic != PCAP_MAGIC_NS)) {
+		fprintf(stderr, "%s: \"%s\" is not a pcap file\n", devname, filename);
+		pb->eof = 1;
+	}
+	if (!pb->eof && (hdr.linktype != PCAP_LINKTYPE_ETHERNET)) {
+		fprintf(stderr, "%s: \"%s\" has link type %u, not ethernet\n", devname, filename,
+			hdr.linktype);
+		pb->eof = 1;
+	}
+	return &pb->nb;
+}
+
+/*
+ * ---------------------------------------------------------------
+ * Deliver frames on the thread of the machine. Frames already
+ * buffered by the backend do not wake the poll, so the proc is
+ * called again from a timer as long as there are some left.
+ * ---------------------------------------------------------------
+ */
+static void
+deliver(NetBackend * nb)
+{
+	if (!nb->rxActive) {
+		return;
+	}
+	nb->rxProc(nb->rxClientData);
+	if (nb->rxActive && nb->ops->pending && nb->ops->pending(nb)) {
+		CycleTimer_Mod(&nb->kickTimer, 0);
+	}
+}
+
+static void
+poll_event(PollHandle_t * handle, int status, int events, void *clientdata)
+{
+	deliver(clientdata);
+}
+
+static void
+kick_event(void *clientData)
+{
+	deliver(clientData);
+}
+
+void
+NetBackend_RxStart(NetBackend * nb, NetBackend_RxProc * proc, void *clientData)
+{
+	if (!nb) {
+		return;
+	}
+	nb->rxProc = proc;
+	nb->rxClientData = clientData;
+	nb->rxActive = 1;
+	if (nb->pollHandle) {
+		AsyncManager_PollStart(nb->pollHandle, ASYNCMANAGER_EVENT_READABLE, &poll_event, nb);
+	}
+	if (nb->ops->pending && nb->ops->pending(nb)) {
+		CycleTimer_Mod(&nb->kickTimer, 0);
+	}
+}
+
+void
+NetBackend_RxStop(NetBackend * nb)
+{
+	if (!nb) {
+		return;
+	}
+	nb->rxActive = 0;
+	if (nb->pollHandle) {
+		AsyncManager_PollStop(nb->pollHandle);
+	}
+	if (CycleTimer_IsActive(&nb->kickTimer)) {
+		CycleTimer_Remove(&nb->kickTimer);
+	}
+}
+
+int
+NetBackend_Receive(NetBackend * nb, void *buf, unsigned int maxlen)
+{
+	ssize_t len;
+	if (!nb) {
+		errno = ENODEV;
+		return -1;
+	}
+	len = nb->ops->recv(nb, buf, maxlen);
+	if ((len > 0) && nb->capture) {
+		struct iovec iov = { buf, len };
+		PcapWriter_Write(nb->capture, &iov, 1);
+	}
+	return len;
+}
+
+int
+NetBackend_SendV(NetBackend * nb, const struct iovec *iov, int iovcnt)
+{
+	if (!nb) {
+		errno = ENODEV;
+		return -1;
+	}
+	if (nb->capture) {
+		PcapWriter_Write(nb->capture, iov, iovcnt);
+	}
+	return nb->ops->sendv(nb, iov, iovcnt);
+}
+
+int
+NetBackend_Send(NetBackend * nb, void *frame, unsigned int len)
+{
+	struct iovec iov = { frame, len };
+	return NetBackend_SendV(nb, &iov, 1);
+}
+
+NetBackend *
+NetBackend_New(const char *devname)
+{
+	NetBackend *nb;
+	char *type = Config_ReadVar(devname, "backend");
+	char *capture;
+	if (!type || !strcmp(type, "tap")) {
+		nb = Tap_New(devname);
+	} else if (!strcmp(type, "switch")) {
+		nb = VSwitch_New(devname);
+	} else if (!strcmp(type, "pcap")) {
+		nb = PcapReplay_New(devname);
+	} else {
+		fprintf(stderr, "%s: Unknown network backend \"%s\"\n", devname, type);
+		return NULL;
+	}
+	if (!nb) {
+		return NULL;
+	}
+	nb->name = devname;
+	capture = Config_ReadVar(devname, "pcap_capture");
+	if (capture) {
+		nb->capture = PcapWriter_New(capture);
+	}
+	if (nb->fd >= 0) {
+		nb->pollHandle = AsyncManager_PollInit(nb->fd);
+	}
+	CycleTimer_Init(&nb->kickTimer, kick_event, nb);
+	return nb;
+}
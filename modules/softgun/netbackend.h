@@ -0,0 +1,55 @@
+//===-- softgun/netbackend.h --------------------------------------*- C -*-===//
+//
+//              The Leigun Embedded System Simulator Platform
+//
+// Licensed under the Apache License, Version 2.0 (the "License");
+// you may not use this file except in compliance with the License.
+// You may obtain a copy of the License at
+//
+//     http://www.apache.org/licenses/LICENSE-2.0
+//
+// Unless required by applicable law or agreed to in writing, software
+// distributed under the License is distributed on an "AS IS" BASIS,
+// WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+// See the License for the specific language governing permissions and
+// limitations under the License.
+//
+//===----------------------------------------------------------------------===//
+///
+/// @file
+/// Ethernet frame transport used by the network interface emulators
+///
+//===----------------------------------------------------------------------===//
+#ifndef _NETBACKEND_H
+#define _NETBACKEND_H
+#include <sys/uio.h>
+
+typedef struct NetBackend NetBackend;
+
+/*
+ * Called on the thread of the machine while the receiver is started and
+ * frames are available. The proc fetches them with NetBackend_Receive
+ * until it returns -1 or the proc has no room left.
+ */
+typedef void NetBackend_RxProc(void *clientData);
+
+/*
+ * Create the backend configured in the section of the device,
+ * NULL if the device is not connected. All functions accept the NULL
+ * backend, it never receives and fails to send.
+ */
+NetBackend *NetBackend_New(const char *devname);
+
+void NetBackend_RxStart(NetBackend * nb, NetBackend_RxProc * proc, void *clientData);
+void NetBackend_RxStop(NetBackend * nb);
+
+/* Fetch one frame, -1 with errno EAGAIN if there is none */
+int NetBackend_Receive(NetBackend * nb, void *buf, unsigned int maxlen);
+
+/*
+ * Send one frame, the gathered form allows to send header and payload at once.
+ * The frame is not modified, it is only non const because struct iovec is.
+ */
+int NetBackend_Send(NetBackend * nb, void *frame, unsigned int len);
+int NetBackend_SendV(NetBackend * nb, const struct iovec *iov, int iovcnt);
+#endif
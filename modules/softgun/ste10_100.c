@@ -60,10 +60,9 @@
 // include user header
 #include "signode.h"
 #include "m93c46.h"
-#include "linux-tap.h"
+#include "netbackend.h"
 #include "cycletimer.h"
 #include "sgstring.h"
-#include "asyncmanager.h"
 
 
 #if 0
@@ -212,8 +211,7 @@ typedef struct STE10_100 {
 	int bus_irq;		// irqline of parent
 	int dev_nr;
 
-	int ether_fd;		// file descriptor for the data
-	PollHandle_t *input_fh;
+	NetBackend *backend;
 	int receiver_is_enabled;
 	SigNode *irqNode[4];
 	int interrupt_posted;
@@ -436,7 +434,7 @@ disable_receiver(STE10_100 * ste)
 {
 	dbgprintf("ste10/100: disable receiver\n");
 	if (ste->receiver_is_enabled) {
-		AsyncManager_PollStop(ste->input_fh);
+		NetBackend_RxStop(ste->backend);
 		ste->receiver_is_enabled = 0;
 	}
 	SR(ste) = (SR(ste) & ~SR_RS_MASK) | SR_RS_STOP;
@@ -461,9 +459,9 @@ fill_rxfifo(STE10_100 * ste)
 	char buf[2048];
 	if (ste->rxfifo_count) {
 		dbgprintf("Paket loss, rxfifo is full !\n");
-		return read(ste->ether_fd, buf, 2048);
+		return NetBackend_Receive(ste->backend, buf, 2048);
 	}
-	result = read(ste->ether_fd, ste->rx_fifo, 2048);
+	result = NetBackend_Receive(ste->backend, ste->rx_fifo, 2048);
 	if (result > 0) {
 		ste->rxfifo_count = result;
 	}
@@ -608,7 +606,7 @@ receive(STE10_100 * ste)
 }
 
 static void
-input_event(PollHandle_t *handle, int status, int events, void *clientdata)
+input_event(void *clientdata)
 {
 	STE10_100 *ste = clientdata;
 	int result;
@@ -624,9 +622,9 @@ input_event(PollHandle_t *handle, int status, int events, void *clientdata)
 static void
 enable_receiver(STE10_100 * ste)
 {
-	if (!ste->receiver_is_enabled && (ste->ether_fd >= 0)) {
+	if (!ste->receiver_is_enabled && ste->backend) {
 		dbgprintf("ste10/100: enable receiver\n");
-		AsyncManager_PollStart(ste->input_fh, ASYNCMANAGER_EVENT_READABLE, &input_event, ste);
+		NetBackend_RxStart(ste->backend, input_event, ste);
 		ste->receiver_is_enabled = 1;
 	}
 }
@@ -643,9 +641,8 @@ static void
 transmit(STE10_100 * ste)
 {
 	int j;
-	int count;
 	uint32_t chain;
-	uint8_t data[2048];
+	uint8_t data[2 * 2048];
 	uint32_t buf1, buf2;
 	uint32_t tdes0, tdes1, tdes2, tdes3;
 	uint32_t len1, len2;
@@ -679,40 +676,24 @@ transmit(STE10_100 * ste)
 		dbgprintf("Transmit called\n");
 		dbgprintf("buffer1 address %08x, len %d\n", tdes2, len1);
 		dbgprintf("buffer2 address %08x, len %d\n", tdes3, len2);
+		/* Both buffers make up one frame */
 		if (len1) {
-			dbgprintf("\n");
 			pci_data_read(ste, buf1, data, len1);
-			count = 0;
-			do {
-				int result;
-				result = write(ste->ether_fd, data + count, len1 - count);
-				if (result > 0) {
-					count += result;
-				} else {
-					if (errno != EAGAIN) {
-						fprintf(stderr,
-							"Transmit error writing to TAP fd\n");
-						return;
-					}
-				}
-			} while (count < len1);
 		}
 		if (len2 && !chain) {
-			pci_data_read(ste, buf2, data, len2);
-			count = 0;
+			pci_data_read(ste, buf2, data + len1, len2);
+		} else {
+			len2 = 0;
+		}
+		if (len1 + len2) {
+			int result;
 			do {
-				int result;
-				result = write(ste->ether_fd, data + count, len2 - count);
-				if (result > 0) {
-					count += result;
-				} else {
-					if (errno != EAGAIN) {
-						fprintf(stderr,
-							"Transmit error writing to TAP fd\n");
-						return;
-					}
-				}
-			} while (count < len2);
+				result = NetBackend_Send(ste->backend, data, len1 + len2);
+			} while ((result < 0) && (errno == EAGAIN));
+			if (result < 0) {
+				fprintf(stderr, "Transmit error sending to the network backend\n");
+				return;
+			}
 		}
 		tdes0 = tdes0 & ~TDES0_OWN;
 		pci_descriptor_write32(ste, tdes0, ste->int_txbufp);
@@ -2009,8 +1990,7 @@ STE_New(const char *devname, PCI_Function * bridge, int dev_nr, int bus_irq)
 	SigNode_Set(ste->eecs, SIG_LOW);
 	SigNode_Set(ste->edi, SIG_LOW);
 	SigNode_Set(ste->eck, SIG_LOW);
-	ste->ether_fd = Net_CreateInterface(devname);
-	ste->input_fh = AsyncManager_PollInit(ste->ether_fd);
+	ste->backend = NetBackend_New(devname);
 	STE_Reset(ste);
 	XCR(ste) = 0x1000;
 	XSR(ste) = 0x780d;
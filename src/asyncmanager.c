@@ -39,7 +39,9 @@
 // System headers
 #include <assert.h>
 #include <stdbool.h>
+#include <stdint.h>
 #include <stdlib.h>
+#include <string.h>
 
 
 //==============================================================================
@@ -59,9 +61,21 @@ enum req_type {
 enum sreq_type {
     SREQ_WRITE,
     SREQ_POLL_INIT,
+    SREQ_NOTIFY_INIT,
     SREQ_NUM,
 };
 
+enum ev_type {
+    EV_POLL,
+    EV_READ,
+    EV_CONNECTION,
+    EV_WRITE,
+    EV_CLOSE,
+};
+
+#define REQ_POOL_SIZE (256)
+#define WRITE_REQ_NBUFS (4)
+
 
 //==============================================================================
 //= Types
@@ -74,13 +88,34 @@ enum sreq_type {
 //      |     `-- uv_tcp_t    <- TcpStreamHandle_t
 //      |                         `-- TcpServerStreamHandle_t
 //      |                         `-- TcpClientStreamHandle_t
-//      `-- uv_poll_t       <- PollHandle_t
+//      |-- uv_poll_t       <- PollHandle_t
+//      `-- uv_async_t      <- NotifyHandle_t
+//
+// Every handle has its owner right behind the libuv handle.
+struct handle_owner {
+    AsyncManager_Machine_t *machine; // runs the callbacks, NULL: loop thread
+    bool active;  // polling or reading was started and not stopped
+    bool closing; // closed by the machine, drop its queued callbacks
+};
+
+struct NotifyHandle_t {
+    union {
+        union uv_any_handle any;
+        uv_handle_t handle;
+        uv_async_t async;
+    } uv; // button(inheritance)
+    struct handle_owner owner;
+    AsyncManager_notify_cb notify_cb;
+    void *notify_clientdata;
+};
+
 struct PollHandle_t {
     union {
         union uv_any_handle any;
         uv_handle_t handle;
         uv_poll_t poll;
     } uv; // button(inheritance)
+    struct handle_owner owner;
     AsyncManager_poll_cb poll_cb;
     void *poll_clientdata;
     int events;
@@ -94,6 +129,7 @@ struct TcpServerStreamHandle_t {
             uv_stream_t stream;
             uv_tcp_t tcp;
         } uv; // button(inheritance)
+        struct handle_owner owner;
         AsyncManager_read_cb read_cb;
         void *read_clientdata;
     };
@@ -113,6 +149,7 @@ struct TcpClientStreamHandle_t {
             uv_stream_t stream;
             uv_tcp_t tcp;
         } uv; // button(inheritance)
+        struct handle_owner owner;
         AsyncManager_read_cb read_cb;
         void *read_clientdata;
     };
@@ -129,6 +166,7 @@ struct TcpStreamHandle_t {
                 uv_stream_t stream;
                 uv_tcp_t tcp;
             } uv; // button(inheritance)
+            struct handle_owner owner;
             AsyncManager_read_cb read_cb;
             void *read_clientdata;
         };
@@ -146,6 +184,7 @@ struct StreamHandle_t {
                 uv_handle_t handle;
                 uv_stream_t stream;
             } uv; // button(inheritance)
+            struct handle_owner owner;
             AsyncManager_read_cb read_cb;
             void *read_clientdata;
         };
@@ -155,12 +194,16 @@ struct StreamHandle_t {
 
 struct Handle_t {
     union {
-        union {
-            union uv_any_handle any;
-            uv_handle_t handle;
-        } uv; // button(inheritance)
+        struct {
+            union {
+                union uv_any_handle any;
+                uv_handle_t handle;
+            } uv; // button(inheritance)
+            struct handle_owner owner;
+        };
         StreamHandle_t stream;
         PollHandle_t poll;
+        NotifyHandle_t notify;
     };
 };
 
@@ -169,45 +212,93 @@ struct Handle_t {
 struct write_req_t {
     uv_write_t super; // button(inheritance)
     StreamHandle_t *stream;
-    uv_buf_t buf;
+    uv_buf_t *bufs;
+    unsigned int nbufs;
+    uv_buf_t bufsml[WRITE_REQ_NBUFS];
     AsyncManager_write_cb write_cb;
     void *write_clientdata;
+    AsyncManager_Machine_t *machine; // runs write_cb
 };
 
 struct close_req_t {
     Handle_t *handle;
     AsyncManager_close_cb close_cb;
     void *close_clientdata;
+    AsyncManager_Machine_t *machine; // runs close_cb and frees the handle
 };
 
-struct req_data {
-    uv_async_t async; // button(inheritance)
-    enum req_type type;
-    uv_sem_t bsem;
+// Node of the request queue. Asynchronous requests are taken from the
+// request pool, synchronous ones live on the stack of the waiting caller.
+struct req_node {
+    struct req_node *next;
+    bool sync;
+    int type; // enum req_type or enum sreq_type
     void *data;
+    uv_sem_t *done; // sync only
+    int status;
+    void *respdata;
 };
 
-struct sreq_data {
-    uv_async_t async; // button(inheritance)
-    enum sreq_type type;
-    uv_sem_t bsem;
-    uv_sem_t respsem;
-    void *reqdata;
+// Callback of a handle owned by a machine. Queued by the loop thread and
+// run by the thread of the machine.
+struct event_node {
+    struct req_node node; // node.type is enum ev_type
+    Handle_t *handle;
     int status;
-    void *respdata;
+    int events;
+    ssize_t nread;
+    char *buf;
+    struct write_req_t *wr;
+    struct close_req_t *cr;
+    StreamHandle_t *client;
+    int port;
+    char host[INET_ADDRSTRLEN + 1];
+};
+
+// Intrusive multi producer, single consumer queue (Vyukov). Producers
+// append with one atomic exchange, a single thread consumes.
+struct req_queue {
+    struct req_node *head; // last pushed, producers
+    struct req_node *tail; // next to pop, consumer
+    struct req_node stub;
+};
+
+// Free list of fixed size objects. head holds a tag in the upper and
+// index + 1 of the first free object in the lower 32 bits, the tag is
+// incremented on every change to avoid ABA. Objects are allocated from
+// the heap when the pool is exhausted.
+struct obj_pool {
+    uint64_t head;
+    uint32_t next[REQ_POOL_SIZE];
+    size_t objsize;
+    char *objs;
 };
 
 // -----------------------------------------------------
 struct AsyncManager {
     uv_loop_t *loop;
     uv_thread_t tid;
-    struct req_data *req[REQ_NUM];
-    struct sreq_data *sreq[SREQ_NUM];
+    struct req_queue queue;
+    int wakeup; // async send pending
+    uv_async_t async;
+    struct obj_pool req_pool;
+    struct obj_pool write_pool;
+    struct obj_pool event_pool;
     uv_idle_t idle;
     bool quit;
 };
 typedef struct AsyncManager AsyncManager;
 
+// The callbacks of handles started by the thread of a machine are queued
+// here, they may touch the machine local state.
+struct AsyncManager_Machine_s {
+    struct req_queue queue;
+    int pending; // callbacks queued since the last run
+    int waiting; // the machine sleeps in AsyncManager_WaitMachine()
+    uv_mutex_t mutex;
+    uv_cond_t cond;
+};
+
 
 //==============================================================================
 //= Function declarations(static)
@@ -221,23 +312,35 @@ typedef struct AsyncManager AsyncManager;
 
 
 // -----------------------------------------------------
-static struct req_data *new_req_data(enum req_type reqno);
-static struct sreq_data *new_sreq_data(enum sreq_type reqno);
+static int pool_init(struct obj_pool *pool, size_t objsize);
+static void *pool_get(struct obj_pool *pool);
+static void pool_put(struct obj_pool *pool, void *obj);
+static void queue_init(struct req_queue *q);
+static void queue_push(struct req_queue *q, struct req_node *node);
+static struct req_node *queue_pop(struct req_queue *q);
 
 static void AsyncManager_onIdle(uv_idle_t *handle);
 static void server_thread(void *arg);
 static int send_req(enum req_type type, void *data);
 static int send_sreq(enum sreq_type type, void *data, void *result);
-static void on_wakeup_req(uv_async_t *handle);
-static void on_wakeup_sreq(uv_async_t *handle);
+static void wakeup(void);
+static void on_wakeup(uv_async_t *handle);
+static int dispatch_req(int type, void *data);
+static int dispatch_sreq(int type, void *data, void **result);
 
 static void free_data(uv_handle_t *handle);
 static void AsyncManager_onExit(void *);
 
+// -----------------------------------------------------
+static struct event_node *new_event(enum ev_type type, Handle_t *handle);
+static void post_event(AsyncManager_Machine_t *m, struct event_node *ev);
+static void run_event(struct event_node *ev);
+
 // -----------------------------------------------------
 static void on_connection(uv_stream_t *server, int status);
 static int listen_tcp(TcpServerStreamHandle_t *svr);
 
+static void release_write_req(struct write_req_t *wr);
 static void on_writed(uv_write_t *req, int status);
 static int write_stream(struct write_req_t *wr);
 static int writesync_stream(struct write_req_t *wr, int *err);
@@ -258,59 +361,115 @@ static void on_poll(uv_poll_t *handle, int status, int events);
 static int poll_start(PollHandle_t *handle);
 static int poll_stop(PollHandle_t *handle);
 
+// -----------------------------------------------------
+static int notify_init(NotifyHandle_t *handle, NotifyHandle_t **result);
+static void on_notify(uv_async_t *handle);
+
 
 //==============================================================================
 //= Variables
 //==============================================================================
 static AsyncManager g_singleton;
+// Set on the thread of a machine by AsyncManager_EnterMachine()
+static __thread AsyncManager_Machine_t *g_machine;
 
 
 //==============================================================================
 //= Function definitions(static)
 //==============================================================================
 // -----------------------------------------------------
-static struct req_data *new_req_data(enum req_type reqno) {
-    int ret;
-    struct req_data *req = LEIGUN_NEW(req);
-    ret = (req) ? 0 : UV_EAI_MEMORY;
-    UV_ERRCHECK(ret, return NULL);
-    req->type = reqno;
-    ret = uv_sem_init(&req->bsem, 1);
-    UV_ERRCHECK(ret, goto REQ_ALLOCED);
-    ret = uv_async_init(g_singleton.loop, &req->async, &on_wakeup_req);
-    UV_ERRCHECK(ret, goto REQ_SEM_INITED);
-    req->async.data = req;
-    return req;
-
-REQ_SEM_INITED:
-    uv_sem_destroy(&req->bsem);
-REQ_ALLOCED:
-    free(req);
-    return NULL;
+static int pool_init(struct obj_pool *pool, size_t objsize) {
+    uint32_t i;
+    pool->objs = LEIGUN_NEW_BUF(REQ_POOL_SIZE * objsize);
+    if (!pool->objs) {
+        return UV_EAI_MEMORY;
+    }
+    pool->objsize = objsize;
+    for (i = 0; i < REQ_POOL_SIZE - 1; ++i) {
+        pool->next[i] = i + 2;
+    }
+    pool->next[REQ_POOL_SIZE - 1] = 0;
+    pool->head = 1;
+    return 0;
 }
 
+static void *pool_get(struct obj_pool *pool) {
+    uint64_t head = __atomic_load_n(&pool->head, __ATOMIC_ACQUIRE);
+    uint64_t newhead;
+    uint32_t idx;
+    void *obj;
+    do {
+        idx = (uint32_t)head;
+        if (idx == 0) {
+            return LEIGUN_NEW_BUF(pool->objsize);
+        }
+        // a stale next is harmless, the tag lets the exchange fail then
+        newhead = (((head >> 32) + 1) << 32) |
+                  __atomic_load_n(&pool->next[idx - 1], __ATOMIC_RELAXED);
+    } while (!__atomic_compare_exchange_n(&pool->head, &head, newhead, true,
+                                          __ATOMIC_ACQ_REL, __ATOMIC_ACQUIRE));
+    obj = pool->objs + (idx - 1) * pool->objsize;
+    memset(obj, 0, pool->objsize);
+    return obj;
+}
 
-static struct sreq_data *new_sreq_data(enum sreq_type reqno) {
-    int ret;
-    struct sreq_data *req = LEIGUN_NEW(req);
-    ret = (req) ? 0 : UV_EAI_MEMORY;
-    UV_ERRCHECK(ret, return NULL);
-    req->type = reqno;
-    ret = uv_sem_init(&req->bsem, 1);
-    UV_ERRCHECK(ret, goto REQ_ALLOCED);
-    ret = uv_sem_init(&req->respsem, 0);
-    UV_ERRCHECK(ret, goto REQ_BSEM_INITED);
-    ret = uv_async_init(g_singleton.loop, &req->async, &on_wakeup_sreq);
-    UV_ERRCHECK(ret, goto REQ_RESPSEM_INITED);
-    req->async.data = req;
-    return req;
-
-REQ_RESPSEM_INITED:
-    uv_sem_destroy(&req->respsem);
-REQ_BSEM_INITED:
-    uv_sem_destroy(&req->bsem);
-REQ_ALLOCED:
-    free(req);
+static void pool_put(struct obj_pool *pool, void *obj) {
+    char *p = obj;
+    uint64_t head, newhead;
+    uint32_t idx;
+    if ((p < pool->objs) || (p >= pool->objs + REQ_POOL_SIZE * pool->objsize)) {
+        free(obj);
+        return;
+    }
+    idx = (p - pool->objs) / pool->objsize;
+    head = __atomic_load_n(&pool->head, __ATOMIC_ACQUIRE);
+    do {
+        __atomic_store_n(&pool->next[idx], (uint32_t)head, __ATOMIC_RELAXED);
+        newhead = (((head >> 32) + 1) << 32) | (idx + 1);
+    } while (!__atomic_compare_exchange_n(&pool->head, &head, newhead, true,
+                                          __ATOMIC_ACQ_REL, __ATOMIC_ACQUIRE));
+}
+
+// -----------------------------------------------------
+static void queue_init(struct req_queue *q) {
+    q->stub.next = NULL;
+    q->head = &q->stub;
+    q->tail = &q->stub;
+}
+
+static void queue_push(struct req_queue *q, struct req_node *node) {
+    struct req_node *prev;
+    __atomic_store_n(&node->next, NULL, __ATOMIC_RELAXED);
+    prev = __atomic_exchange_n(&q->head, node, __ATOMIC_ACQ_REL);
+    __atomic_store_n(&prev->next, node, __ATOMIC_RELEASE);
+}
+
+// Returns NULL when empty or when a producer is between exchange and link,
+// that producer wakes the consumer again after linking.
+static struct req_node *queue_pop(struct req_queue *q) {
+    struct req_node *tail = q->tail;
+    struct req_node *next = __atomic_load_n(&tail->next, __ATOMIC_ACQUIRE);
+    if (tail == &q->stub) {
+        if (!next) {
+            return NULL;
+        }
+        q->tail = next;
+        tail = next;
+        next = __atomic_load_n(&tail->next, __ATOMIC_ACQUIRE);
+    }
+    if (next) {
+        q->tail = next;
+        return tail;
+    }
+    if (tail != __atomic_load_n(&q->head, __ATOMIC_ACQUIRE)) {
+        return NULL;
+    }
+    queue_push(q, &q->stub);
+    next = __atomic_load_n(&tail->next, __ATOMIC_ACQUIRE);
+    if (next) {
+        q->tail = next;
+        return tail;
+    }
     return NULL;
 }
 
@@ -331,78 +490,105 @@ static void server_thread(void *arg) {
     uv_loop_close(g_singleton.loop);
 }
 
+// Only the first request queued after the loop started draining sends
+// the async, uv_async_send costs a syscall.
+static void wakeup(void) {
+    int ret;
+    if (__atomic_exchange_n(&g_singleton.wakeup, 1, __ATOMIC_SEQ_CST)) {
+        return;
+    }
+    ret = uv_async_send(&g_singleton.async);
+    UV_ERRCHECK(ret, );
+}
+
 static int send_req(enum req_type type, void *data) {
-    uv_sem_wait(&g_singleton.req[type]->bsem);
+    struct req_node *req = pool_get(&g_singleton.req_pool);
+    int ret = (req) ? 0 : UV_EAI_MEMORY;
+    UV_ERRCHECK(ret, return ret);
     LOG_Verbose("AM", "%s(%d)", __func__, type);
-    g_singleton.req[type]->data = data;
-    return uv_async_send(&g_singleton.req[type]->async);
+    req->type = type;
+    req->data = data;
+    queue_push(&g_singleton.queue, req);
+    wakeup();
+    return 0;
 }
 
 static int send_sreq(enum sreq_type type, void *data, void *result) {
+    struct req_node req;
+    uv_sem_t done;
     int ret;
-    uv_sem_wait(&g_singleton.sreq[type]->bsem);
     LOG_Verbose("AM", "%s(%d)", __func__, type);
-    g_singleton.sreq[type]->reqdata = data;
-    ret = uv_async_send(&g_singleton.sreq[type]->async);
-    UV_ERRCHECK(ret, goto END);
-    uv_sem_wait(&g_singleton.sreq[type]->respsem);
-    ret = g_singleton.sreq[type]->status;
-    (*(void **)result) = g_singleton.sreq[type]->respdata;
+    ret = uv_sem_init(&done, 0);
+    UV_ERRCHECK(ret, return ret);
+    req.sync = true;
+    req.type = type;
+    req.data = data;
+    req.done = &done;
+    req.respdata = NULL;
+    queue_push(&g_singleton.queue, &req);
+    wakeup();
+    uv_sem_wait(&done);
+    uv_sem_destroy(&done);
+    ret = req.status;
+    (*(void **)result) = req.respdata;
     UV_ERRCHECK(ret, );
-END:
-    uv_sem_post(&g_singleton.sreq[type]->bsem);
     return ret;
 }
 
-static void on_wakeup_req(uv_async_t *handle) {
-    struct req_data *req = handle->data;
-    int err = 0;
-    switch (req->type) {
+static int dispatch_req(int type, void *data) {
+    switch ((enum req_type)type) {
     case REQ_LISTEN:
-        err = listen_tcp(req->data);
-        break;
+        return listen_tcp(data);
     case REQ_CLOSE:
-        err = close_handle(req->data);
-        break;
+        return close_handle(data);
     case REQ_WRITE:
-        err = write_stream(req->data);
-        break;
+        return write_stream(data);
     case REQ_READ_START:
-        err = read_start(req->data);
-        break;
+        return read_start(data);
     case REQ_READ_STOP:
-        err = read_stop(req->data);
-        break;
+        return read_stop(data);
     case REQ_POLL_START:
-        err = poll_start(req->data);
-        break;
+        return poll_start(data);
     case REQ_POLL_STOP:
-        err = poll_stop(req->data);
-        break;
+        return poll_stop(data);
     case REQ_NUM:
-        assert(!"on_wakeup_req received unknown type");
-        /* NOTREACHED */
         break;
     }
-    UV_ERRCHECK(err, );
-    uv_sem_post(&req->bsem);
+    assert(!"dispatch_req received unknown type");
+    return UV_EINVAL;
 }
 
-static void on_wakeup_sreq(uv_async_t *handle) {
-    struct sreq_data *req = handle->data;
-    switch (req->type) {
+static int dispatch_sreq(int type, void *data, void **result) {
+    switch ((enum sreq_type)type) {
     case SREQ_WRITE:
-        req->status = writesync_stream(req->reqdata, (void *)&req->respdata);
-        break;
+        return writesync_stream(data, (void *)result);
     case SREQ_POLL_INIT:
-        req->status = poll_init(req->reqdata, (void *)&req->respdata);
-        break;
+        return poll_init(data, (void *)result);
+    case SREQ_NOTIFY_INIT:
+        return notify_init(data, (void *)result);
     case SREQ_NUM:
-        assert(!"on_wakeup_sreq received unknown type");
-        /* NOTREACHED */
         break;
     }
-    uv_sem_post(&req->respsem);
+    assert(!"dispatch_sreq received unknown type");
+    return UV_EINVAL;
+}
+
+// Works off everything queued, in order of arrival.
+static void on_wakeup(uv_async_t *handle) {
+    struct req_node *req;
+    int err;
+    __atomic_store_n(&g_singleton.wakeup, 0, __ATOMIC_SEQ_CST);
+    while ((req = queue_pop(&g_singleton.queue)) != NULL) {
+        if (req->sync) {
+            // the waiter owns req, it is gone after the post
+            req->status = dispatch_sreq(req->type, req->data, &req->respdata);
+            uv_sem_post(req->done);
+        } else {
+            err = dispatch_req(req->type, req->data);
+            UV_ERRCHECK(err, );
+            pool_put(&g_singleton.req_pool, req);
+        }
+    }
 }
 
 static void free_data(uv_handle_t *handle) {
@@ -417,6 +603,89 @@ static void AsyncManager_onExit(void *data) {
 }
 
 
+// -----------------------------------------------------
+static struct event_node *new_event(enum ev_type type, Handle_t *handle) {
+    struct event_node *ev = pool_get(&g_singleton.event_pool);
+    if (!ev) {
+        LOG_Error("AM", "No memory for the callback of handle %p", handle);
+        exit(1);
+    }
+    ev->node.type = type;
+    ev->handle = handle;
+    return ev;
+}
+
+// The waiting flag is checked after pending is set, and the machine sets
+// it before it checks pending under the mutex, so no wakeup is lost.
+static void post_event(AsyncManager_Machine_t *m, struct event_node *ev) {
+    queue_push(&m->queue, &ev->node);
+    __atomic_store_n(&m->pending, 1, __ATOMIC_SEQ_CST);
+    if (__atomic_load_n(&m->waiting, __ATOMIC_SEQ_CST)) {
+        uv_mutex_lock(&m->mutex);
+        uv_cond_signal(&m->cond);
+        uv_mutex_unlock(&m->mutex);
+    }
+}
+
+// Runs on the thread of the machine. Callbacks queued before the machine
+// stopped or closed the handle are dropped, as libuv would not call them.
+static void run_event(struct event_node *ev) {
+    Handle_t *handle = ev->handle;
+    switch ((enum ev_type)ev->node.type) {
+    case EV_POLL:
+        if (handle->owner.closing || !handle->owner.active) {
+            break;
+        }
+        if (handle->poll.poll_cb) {
+            handle->poll.poll_cb(&handle->poll, ev->status, ev->events,
+                                 handle->poll.poll_clientdata);
+        }
+        // polling was paused until the callback had run
+        if (!handle->owner.closing && handle->owner.active) {
+            send_req(REQ_POLL_START, &handle->poll);
+        }
+        break;
+    case EV_READ:
+        if (!handle->owner.closing && handle->owner.active &&
+            handle->stream.read_cb) {
+            handle->stream.read_cb(&handle->stream, ev->buf,
+                                   ((ev->nread == UV_EOF) ? 0 : ev->nread),
+                                   handle->stream.read_clientdata);
+        }
+        free(ev->buf);
+        if ((ev->nread < 0) && !handle->owner.closing) {
+            AsyncManager_Close(handle, NULL, NULL);
+        }
+        break;
+    case EV_CONNECTION: {
+        TcpServerStreamHandle_t *svr = &handle->stream.tcp.server;
+        if (!svr->owner.closing && svr->connection_cb) {
+            svr->connection_cb(ev->status, ev->client,
+                               (ev->host[0] ? ev->host : NULL), ev->port,
+                               svr->connection_clientdata);
+        } else if (ev->client) {
+            AsyncManager_Close((Handle_t *)ev->client, NULL, NULL);
+        }
+        break;
+    }
+    case EV_WRITE:
+        // also for a closing stream, the callback may own the buffers
+        ev->wr->write_cb(ev->status, ev->wr->stream,
+                         ev->wr->write_clientdata);
+        release_write_req(ev->wr);
+        break;
+    case EV_CLOSE:
+        if (ev->cr->close_cb) {
+            ev->cr->close_cb(handle, ev->cr->close_clientdata);
+        }
+        free(ev->cr);
+        free(handle);
+        break;
+    }
+    pool_put(&g_singleton.event_pool, ev);
+}
+
+
 static void on_connection(uv_stream_t *server, int status) {
     int err = status;
     TcpClientStreamHandle_t *client = NULL;
@@ -459,6 +728,17 @@ FREE_EMIT:
     free(client);
     client = NULL;
 EMIT:
+    if (svr->owner.machine) {
+        struct event_node *ev = new_event(EV_CONNECTION, (Handle_t *)svr);
+        ev->status = err;
+        ev->client = (StreamHandle_t *)client;
+        ev->port = port;
+        if (host) {
+            strcpy(ev->host, host);
+        }
+        post_event(svr->owner.machine, ev);
+        return;
+    }
     if (svr->connection_cb) {
         svr->connection_cb(err, (StreamHandle_t *)client, host, port,
                            svr->connection_clientdata);
@@ -477,24 +757,42 @@ static int listen_tcp(TcpServerStreamHandle_t *svr) {
     return 0;
 }
 
+static void release_write_req(struct write_req_t *wr) {
+    if (wr->bufs != wr->bufsml) {
+        free(wr->bufs);
+    }
+    pool_put(&g_singleton.write_pool, wr);
+}
+
 static void on_writed(uv_write_t *req, int status) {
     struct write_req_t *wr = req->data;
     LOG_Verbose("AM", "%s(req:%p, handle:%p)", __func__, req, req->handle);
     UV_ERRCHECK(status, );
+    if (wr->write_cb && wr->machine) {
+        struct event_node *ev = new_event(EV_WRITE, (Handle_t *)wr->stream);
+        ev->status = status;
+        ev->wr = wr;
+        post_event(wr->machine, ev);
+        return;
+    }
     if (wr->write_cb) {
         wr->write_cb(status, wr->stream, wr->write_clientdata);
     }
-    free(wr);
+    release_write_req(wr);
 }
 
 static int write_stream(struct write_req_t *wr) {
+    int ret;
     wr->super.data = wr;
     LOG_Verbose("AM", "%s(req:%p, handle:%p)", __func__, wr,
                 &wr->stream->uv.stream);
-    return uv_write(&wr->super, &wr->stream->uv.stream, &wr->buf, 1,
-                    &on_writed);
+    ret = uv_write(&wr->super, &wr->stream->uv.stream, wr->bufs, wr->nbufs,
+                   &on_writed);
+    UV_ERRCHECK(ret, release_write_req(wr));
+    return ret;
 }
 
+// wr is owned by the caller
 static int writesync_stream(struct write_req_t *wr, int *err) {
     int ret;
     LOG_Verbose("AM", "%s", __func__);
@@ -502,19 +800,24 @@ static int writesync_stream(struct write_req_t *wr, int *err) {
     UV_ERRCHECK(ret, );
     wr->super.data = wr;
     do {
-        ret = uv_try_write(&wr->stream->uv.stream, &wr->buf, 1);
+        ret = uv_try_write(&wr->stream->uv.stream, wr->bufs, wr->nbufs);
     } while (ret == UV_EAGAIN);
     UV_ERRCHECK(ret, );
     ret = uv_stream_set_blocking(&wr->stream->uv.stream, 0);
     UV_ERRCHECK(ret, );
     *err = ret;
-    free(wr);
     return ret;
 }
 
 static void on_closed(uv_handle_t *handle) {
-    if (handle->data) {
-        struct close_req_t *cr = handle->data;
+    struct close_req_t *cr = handle->data;
+    if (cr && cr->machine) {
+        struct event_node *ev = new_event(EV_CLOSE, cr->handle);
+        ev->cr = cr;
+        post_event(cr->machine, ev);
+        return;
+    }
+    if (cr) {
         if (cr->close_cb) {
             cr->close_cb(cr->handle, cr->close_clientdata);
         }
@@ -544,6 +847,18 @@ static void on_read(uv_stream_t *stream, ssize_t nread, const uv_buf_t *buf) {
     UV_ERRCHECK((int)nread, );
     if (nread == 0) {
         // EAGAIN or EWOULDBLOCK
+        free(buf->base);
+        return;
+    }
+    if (handle->owner.machine) {
+        struct event_node *ev = new_event(EV_READ, (Handle_t *)handle);
+        ev->nread = nread;
+        ev->buf = buf->base;
+        if (nread < 0) {
+            // closed by the machine after the callback
+            uv_read_stop(stream);
+        }
+        post_event(handle->owner.machine, ev);
         return;
     }
     if (handle->read_cb) {
@@ -584,9 +899,19 @@ static int poll_init(int *fd, PollHandle_t **handle) {
 static void on_poll(uv_poll_t *handle, int status, int events) {
     PollHandle_t *handle_ = handle->data;
     int events_ = 0;
+    events_ |= (events & UV_READABLE) ? ASYNCMANAGER_EVENT_READABLE : 0;
+    events_ |= (events & UV_WRITABLE) ? ASYNCMANAGER_EVENT_WRITABLE : 0;
+    if (handle_->owner.machine) {
+        // the poll is level triggered, pause it until the machine has
+        // run the callback
+        struct event_node *ev = new_event(EV_POLL, (Handle_t *)handle_);
+        uv_poll_stop(handle);
+        ev->status = status;
+        ev->events = events_;
+        post_event(handle_->owner.machine, ev);
+        return;
+    }
     if (handle_->poll_cb) {
-        events_ |= (events & UV_READABLE) ? ASYNCMANAGER_EVENT_READABLE : 0;
-        events_ |= (events & UV_WRITABLE) ? ASYNCMANAGER_EVENT_WRITABLE : 0;
         handle_->poll_cb(handle_, status, events_, handle_->poll_clientdata);
     }
 }
@@ -599,6 +924,21 @@ static int poll_stop(PollHandle_t *handle) {
     return uv_poll_stop(&handle->uv.poll);
 }
 
+static int notify_init(NotifyHandle_t *handle, NotifyHandle_t **result) {
+    int ret;
+    *result = NULL;
+    ret = uv_async_init(g_singleton.loop, &handle->uv.async, &on_notify);
+    UV_ERRCHECK(ret, return ret);
+    handle->uv.async.data = handle;
+    *result = handle;
+    return ret;
+}
+
+static void on_notify(uv_async_t *handle) {
+    NotifyHandle_t *handle_ = handle->data;
+    handle_->notify_cb(handle_, handle_->notify_clientdata);
+}
+
 
 //==============================================================================
 //= Function definitions(global)
@@ -618,7 +958,6 @@ static int poll_stop(PollHandle_t *handle) {
 //===----------------------------------------------------------------------===//
 int AsyncManager_Init(void) {
     int err = 0;
-    int reqno;
     uv_barrier_t blocker;
     LOG_Info("AM", "AsyncManager init");
     // prepare server loop
@@ -629,25 +968,22 @@ int AsyncManager_Init(void) {
     UV_ERRCHECK(err, return err);
     err = uv_idle_start(&g_singleton.idle, &AsyncManager_onIdle);
     UV_ERRCHECK(err, return err);
-    // prepare async event notifier
-    for (reqno = 0; reqno < REQ_NUM; ++reqno) {
-        g_singleton.req[reqno] = new_req_data((enum req_type)reqno);
-        if (!g_singleton.req[reqno]) {
-            goto ERR_REQ_INIT;
-        }
-    }
-    for (reqno = 0; reqno < SREQ_NUM; ++reqno) {
-        g_singleton.sreq[reqno] = new_sreq_data((enum sreq_type)reqno);
-        if (!g_singleton.sreq[reqno]) {
-            goto ERR_SREQ_INIT;
-        }
-    }
+    // prepare request queue and pools
+    err = pool_init(&g_singleton.req_pool, sizeof(struct req_node));
+    UV_ERRCHECK(err, return err);
+    err = pool_init(&g_singleton.write_pool, sizeof(struct write_req_t));
+    UV_ERRCHECK(err, goto ERR_POOL_INIT);
+    err = pool_init(&g_singleton.event_pool, sizeof(struct event_node));
+    UV_ERRCHECK(err, goto ERR_POOL_INIT);
+    queue_init(&g_singleton.queue);
+    err = uv_async_init(g_singleton.loop, &g_singleton.async, &on_wakeup);
+    UV_ERRCHECK(err, goto ERR_POOL_INIT);
     // start server loop in the new thread
     err = uv_barrier_init(&blocker, 2);
-    UV_ERRCHECK(err, goto ERR_SREQ_INITED);
+    UV_ERRCHECK(err, goto ERR_ASYNC_INITED);
     g_singleton.loop->data = &blocker;
     err = uv_thread_create(&g_singleton.tid, &server_thread, g_singleton.loop);
-    UV_ERRCHECK(err, goto ERR_SREQ_INITED);
+    UV_ERRCHECK(err, goto ERR_ASYNC_INITED);
     uv_barrier_wait(&blocker);
     uv_barrier_destroy(&blocker);
     // register resource release
@@ -655,20 +991,12 @@ int AsyncManager_Init(void) {
     return 0;
 
 // error handlers
-ERR_SREQ_INITED:
-ERR_SREQ_INIT:
-    for (reqno = 0; (reqno < SREQ_NUM) && g_singleton.sreq[reqno]; ++reqno) {
-        uv_close((uv_handle_t *)&g_singleton.sreq[reqno]->async, NULL);
-        uv_sem_destroy(&g_singleton.sreq[reqno]->bsem);
-        uv_sem_destroy(&g_singleton.sreq[reqno]->respsem);
-        free(g_singleton.sreq[reqno]);
-    }
-ERR_REQ_INIT:
-    for (reqno = 0; (reqno < REQ_NUM) && g_singleton.req[reqno]; ++reqno) {
-        uv_close((uv_handle_t *)&g_singleton.req[reqno]->async, NULL);
-        uv_sem_destroy(&g_singleton.req[reqno]->bsem);
-        free(g_singleton.req[reqno]);
-    }
+ERR_ASYNC_INITED:
+    uv_close((uv_handle_t *)&g_singleton.async, NULL);
+ERR_POOL_INIT:
+    free(g_singleton.event_pool.objs);
+    free(g_singleton.write_pool.objs);
+    free(g_singleton.req_pool.objs);
     while (uv_loop_close(g_singleton.loop)) {
         ;
     }
@@ -688,6 +1016,11 @@ int AsyncManager_Close(Handle_t *handle, AsyncManager_close_cb close_cb,
     cr->handle = handle;
     cr->close_cb = close_cb;
     cr->close_clientdata = clientdata;
+    // a handle of a machine is freed by it, after its queued callbacks
+    cr->machine = g_machine ? g_machine : handle->owner.machine;
+    if (g_machine) {
+        handle->owner.closing = true;
+    }
     // check context == libuv
     uv_thread_t tid = uv_thread_self();
     if (uv_thread_equal(&g_singleton.tid, &tid)) {
@@ -714,23 +1047,50 @@ int AsyncManager_BufferSizeRecv(Handle_t *handle, int *value) {
 int AsyncManager_Write(StreamHandle_t *handle, const void *base,
                        unsigned int len, AsyncManager_write_cb write_cb,
                        void *clientdata) {
+    struct iovec iov = {.iov_base = (void *)base, .iov_len = len};
+    return AsyncManager_WriteV(handle, &iov, 1, write_cb, clientdata);
+}
+
+
+//===----------------------------------------------------------------------===//
+/// Write the buffers described by iov in one request. Only the iovec array
+/// is copied, the buffers have to stay valid until write_cb is called.
+///
+/// @return same as libuv. imply an error if negative.
+//===----------------------------------------------------------------------===//
+int AsyncManager_WriteV(StreamHandle_t *handle, const struct iovec *iov,
+                        unsigned int iovcnt, AsyncManager_write_cb write_cb,
+                        void *clientdata) {
     int ret;
-    LOG_Debug("AM", "%s(handle:%p, base:%p, len:%d)", __func__, handle, base,
-              len);
+    unsigned int i;
+    LOG_Debug("AM", "%s(handle:%p, iov:%p, iovcnt:%u)", __func__, handle,
+              (const void *)iov, iovcnt);
     // create write request
-    struct write_req_t *wr = LEIGUN_NEW(wr);
+    struct write_req_t *wr = pool_get(&g_singleton.write_pool);
     ret = (wr) ? 0 : UV_EAI_MEMORY;
     UV_ERRCHECK(ret, return ret);
+    wr->bufs = wr->bufsml;
+    if (iovcnt > WRITE_REQ_NBUFS) {
+        wr->bufs = LEIGUN_NEW_ARRAY(iovcnt, uv_buf_t);
+        ret = (wr->bufs) ? 0 : UV_EAI_MEMORY;
+        UV_ERRCHECK(ret, wr->bufs = wr->bufsml; release_write_req(wr);
+                    return ret);
+    }
+    for (i = 0; i < iovcnt; ++i) {
+        wr->bufs[i] = uv_buf_init(iov[i].iov_base, iov[i].iov_len);
+    }
+    wr->nbufs = iovcnt;
     wr->stream = handle;
-    wr->buf = uv_buf_init((char *)base, len);
     wr->write_cb = write_cb;
     wr->write_clientdata = clientdata;
+    wr->machine = g_machine;
     // check context == libuv
     uv_thread_t tid = uv_thread_self();
     if (uv_thread_equal(&g_singleton.tid, &tid)) {
         ret = write_stream(wr);
     } else {
         ret = send_req(REQ_WRITE, wr);
+        UV_ERRCHECK(ret, release_write_req(wr));
     }
     return ret;
 }
@@ -740,20 +1100,22 @@ int AsyncManager_WriteSync(StreamHandle_t *handle, const void *base,
                            unsigned int len) {
     int ret;
     int err;
+    void *resp;
+    struct write_req_t wr;
     LOG_Debug("AM", "%s(handle:%p, base:%p, len:%d)", __func__, handle, base,
               len);
-    // create write request
-    struct write_req_t *wr = LEIGUN_NEW(wr);
-    ret = (wr) ? 0 : UV_EAI_MEMORY;
-    UV_ERRCHECK(ret, return ret);
-    wr->stream = handle;
-    wr->buf = uv_buf_init((char *)base, len);
+    // the caller waits, so the request lives on its stack
+    wr.stream = handle;
+    wr.bufsml[0] = uv_buf_init((char *)base, len);
+    wr.bufs = wr.bufsml;
+    wr.nbufs = 1;
     // check context == libuv
     uv_thread_t tid = uv_thread_self();
     if (uv_thread_equal(&g_singleton.tid, &tid)) {
-        ret = writesync_stream(wr, &err);
+        ret = writesync_stream(&wr, &err);
     } else {
-        ret = send_sreq(SREQ_WRITE, wr, &err);
+        ret = send_sreq(SREQ_WRITE, &wr, &resp);
+        err = ret;
     }
     UV_ERRCHECK(ret, return ret);
     return err;
@@ -767,6 +1129,8 @@ int AsyncManager_ReadStart(StreamHandle_t *handle, AsyncManager_read_cb read_cb,
     // create read start request -> in TcpHandle
     handle->read_cb = read_cb;
     handle->read_clientdata = clientdata;
+    handle->owner.machine = g_machine;
+    handle->owner.active = true;
     // check context == libuv
     uv_thread_t tid = uv_thread_self();
     if (uv_thread_equal(&g_singleton.tid, &tid)) {
@@ -781,6 +1145,7 @@ int AsyncManager_ReadStart(StreamHandle_t *handle, AsyncManager_read_cb read_cb,
 int AsyncManager_ReadStop(StreamHandle_t *handle) {
     int ret;
     LOG_Info("AM", "%s(%p)", __func__, handle);
+    handle->owner.active = false;
     // create read stop request -> NONE
     // check context == libuv
     uv_thread_t tid = uv_thread_self();
@@ -807,6 +1172,8 @@ int AsyncManager_InitTcpServer(const char *ip, int port, int backlog,
     svr->nodelay = nodelay;
     svr->connection_cb = cb;
     svr->connection_clientdata = clientdata;
+    svr->owner.machine = g_machine;
+    svr->owner.active = true;
     uv_thread_t tid = uv_thread_self();
     if (uv_thread_equal(&g_singleton.tid, &tid)) {
         err = listen_tcp(svr);
@@ -839,6 +1206,8 @@ int AsyncManager_PollStart(PollHandle_t *handle, int events,
     // create read start request -> in PollHandle
     handle->poll_cb = cb;
     handle->poll_clientdata = clientdata;
+    handle->owner.machine = g_machine;
+    handle->owner.active = true;
     handle->events = 0;
     handle->events |= (events & ASYNCMANAGER_EVENT_READABLE) ? UV_READABLE : 0;
     handle->events |= (events & ASYNCMANAGER_EVENT_WRITABLE) ? UV_WRITABLE : 0;
@@ -852,9 +1221,47 @@ int AsyncManager_PollStart(PollHandle_t *handle, int events,
     return ret;
 }
 
+//===----------------------------------------------------------------------===//
+/// Create a handle whose callback runs on the AsyncManager thread after
+/// AsyncManager_Notify, also when it was created by a machine. It moves work
+/// off the machine thread and must not touch the machine local state.
+/// Notifications sent before the callback ran are
+/// coalesced into one call, so a producer can notify for every item and
+/// the callback works off everything queued in one batch.
+///
+/// @return the handle, NULL on error.
+//===----------------------------------------------------------------------===//
+NotifyHandle_t *AsyncManager_NotifyInit(AsyncManager_notify_cb cb,
+                                        void *clientdata) {
+    int ret;
+    NotifyHandle_t *handle = LEIGUN_NEW(handle);
+    NotifyHandle_t *result = NULL;
+    LOG_Info("AM", "%s[%d] %s", __FILE__, __LINE__, __func__);
+    if (!handle) {
+        return NULL;
+    }
+    handle->notify_cb = cb;
+    handle->notify_clientdata = clientdata;
+    // check context == libuv
+    uv_thread_t tid = uv_thread_self();
+    if (uv_thread_equal(&g_singleton.tid, &tid)) {
+        ret = notify_init(handle, &result);
+    } else {
+        ret = send_sreq(SREQ_NOTIFY_INIT, handle, &result);
+    }
+    UV_ERRCHECK(ret, free(handle); return NULL);
+    return result;
+}
+
+/// Wake the callback of the handle. Callable from any thread.
+int AsyncManager_Notify(NotifyHandle_t *handle) {
+    return uv_async_send(&handle->uv.async);
+}
+
 int AsyncManager_PollStop(PollHandle_t *handle) {
     int ret;
     LOG_Info("AM", "%s[%d] %s", __FILE__, __LINE__, __func__);
+    handle->owner.active = false;
     // create read start request -> already PollHandle
     // check context == libuv
     uv_thread_t tid = uv_thread_self();
@@ -865,3 +1272,59 @@ int AsyncManager_PollStop(PollHandle_t *handle) {
     }
     return ret;
 }
+
+
+//===----------------------------------------------------------------------===//
+/// Make the calling thread the thread of a machine. The callbacks of the
+/// handles which it starts (polling, reading, listening, writing, closing)
+/// are no longer run by the AsyncManager thread but queued for the machine,
+/// which runs them in AsyncManager_RunMachine() with its machine local state.
+/// The callbacks of notify handles stay on the AsyncManager thread.
+///
+/// @return the machine, NULL on error.
+//===----------------------------------------------------------------------===//
+AsyncManager_Machine_t *AsyncManager_EnterMachine(void) {
+    AsyncManager_Machine_t *m = LEIGUN_NEW(m);
+    if (!m) {
+        return NULL;
+    }
+    queue_init(&m->queue);
+    if ((uv_mutex_init(&m->mutex) < 0) || (uv_cond_init(&m->cond) < 0)) {
+        free(m);
+        return NULL;
+    }
+    g_machine = m;
+    return m;
+}
+
+
+/// Run the callbacks queued for the machine of the calling thread.
+void AsyncManager_RunMachine(void) {
+    AsyncManager_Machine_t *m = g_machine;
+    struct req_node *node;
+    if (!m || !__atomic_exchange_n(&m->pending, 0, __ATOMIC_SEQ_CST)) {
+        return;
+    }
+    // a producer between push and link sets pending again after linking
+    while ((node = queue_pop(&m->queue)) != NULL) {
+        run_event((struct event_node *)node);
+    }
+}
+
+
+/// Wait until callbacks are queued for the machine of the calling thread or
+/// timeout_ms passed, then run them. Used while the machine is stopped.
+void AsyncManager_WaitMachine(unsigned int timeout_ms) {
+    AsyncManager_Machine_t *m = g_machine;
+    if (!m) {
+        return;
+    }
+    uv_mutex_lock(&m->mutex);
+    __atomic_store_n(&m->waiting, 1, __ATOMIC_SEQ_CST);
+    if (!__atomic_load_n(&m->pending, __ATOMIC_SEQ_CST)) {
+        uv_cond_timedwait(&m->cond, &m->mutex, timeout_ms * (uint64_t)1000000);
+    }
+    __atomic_store_n(&m->waiting, 0, __ATOMIC_SEQ_CST);
+    uv_mutex_unlock(&m->mutex);
+    AsyncManager_RunMachine();
+}
@@ -34,6 +34,7 @@ extern "C" {
 
 // System headers
 #include <stddef.h> // for size_t
+#include <sys/uio.h> // for struct iovec
 
 
 //==============================================================================
@@ -50,10 +51,13 @@ enum {
 //==============================================================================
 //   Handle_t
 //      |-- StreamHandle_t
-//      `-- PollHandle_t
+//      |-- PollHandle_t
+//      `-- NotifyHandle_t
 typedef struct Handle_t Handle_t;
 typedef struct StreamHandle_t StreamHandle_t;
 typedef struct PollHandle_t PollHandle_t;
+typedef struct NotifyHandle_t NotifyHandle_t;
+typedef struct AsyncManager_Machine_s AsyncManager_Machine_t;
 
 // Collbacks(Handle)
 typedef void (*AsyncManager_close_cb)(Handle_t *handle, void *clientdata);
@@ -71,12 +75,23 @@ typedef void (*AsyncManager_read_cb)(StreamHandle_t *handle, const void *buf,
 typedef void (*AsyncManager_poll_cb)(PollHandle_t *handle, int status,
                                      int events, void *clientdata);
 
+// Collbacks(NotifyHandle)
+typedef void (*AsyncManager_notify_cb)(NotifyHandle_t *handle,
+                                       void *clientdata);
+
 
 //==============================================================================
 //= Functions
 //==============================================================================
 int AsyncManager_Init(void);
 
+/// @name Machine
+/// @{
+AsyncManager_Machine_t *AsyncManager_EnterMachine(void);
+void AsyncManager_RunMachine(void);
+void AsyncManager_WaitMachine(unsigned int timeout_ms);
+/// @}
+
 /// @name Conversions to Handle_t
 /// @{
 static inline Handle_t *AsyncManager_Stream2Handle(StreamHandle_t *stream) {
@@ -85,6 +100,9 @@ static inline Handle_t *AsyncManager_Stream2Handle(StreamHandle_t *stream) {
 static inline Handle_t *AsyncManager_Poll2Handle(PollHandle_t *poll) {
     return (Handle_t *)poll;
 }
+static inline Handle_t *AsyncManager_Notify2Handle(NotifyHandle_t *notify) {
+    return (Handle_t *)notify;
+}
 /// @}
 
 /// @name Handle
@@ -100,6 +118,9 @@ int AsyncManager_BufferSizeRecv(Handle_t *handle, int *value);
 int AsyncManager_Write(StreamHandle_t *handle, const void *base,
                        unsigned int len, AsyncManager_write_cb write_cb,
                        void *clientdata);
+int AsyncManager_WriteV(StreamHandle_t *handle, const struct iovec *iov,
+                        unsigned int iovcnt, AsyncManager_write_cb write_cb,
+                        void *clientdata);
 int AsyncManager_WriteSync(StreamHandle_t *handle, const void *base,
                            unsigned int len);
 int AsyncManager_ReadStart(StreamHandle_t *handle, AsyncManager_read_cb read_cb,
@@ -123,6 +144,13 @@ int AsyncManager_PollStart(PollHandle_t *handle, int events,
 int AsyncManager_PollStop(PollHandle_t *handle);
 /// @}
 
+/// @name Notify
+/// @{
+NotifyHandle_t *AsyncManager_NotifyInit(AsyncManager_notify_cb cb,
+                                        void *clientdata);
+int AsyncManager_Notify(NotifyHandle_t *handle);
+/// @}
+
 
 #ifdef __cplusplus
 }
@@ -32,7 +32,7 @@
 #include "logging.h"
 
 // External headers
-#include <uv.h> // for mutex
+#include <uv.h> // for mutex, cond
 
 // System headers
 #include <inttypes.h> // for PRId64
@@ -45,6 +45,9 @@
 //= Constants(also Enumerations)
 //==============================================================================
 static const char *MOD_NAME = "GlobalClock";
+// Polls of the other clocks before a thread goes to sleep
+#define GLOBALCLOCK_SPIN (100)
+#define GLOBALCLOCK_DEFAULT_LOOKAHEAD (1)
 
 
 //==============================================================================
@@ -60,6 +63,10 @@ struct GlobalClock_LocalClock_s {
     uint_fast16_t period_cnt_reminder;
     uint64_t rest_cnt;
     uint_fast16_t rest_fraction;
+    uint64_t quantum;  // periods granted to this clock (owner only)
+    uint64_t done;     // periods completed, read by the other threads
+    uint64_t stall_ns; // time spent waiting for the other clocks
+    bool machine;      // run by the machine thread which registered it
 };
 
 
@@ -71,10 +78,19 @@ static struct {
     uint32_t list_num;
     uv_mutex_t list_mutex;
     uint32_t period_ms;
-    uv_barrier_t barrier;
+    uint32_t lookahead;
+    uv_mutex_t wait_mutex;
+    uv_cond_t wait_cond;
+    uint32_t waiters;
+    GlobalClock_Stats_cb stats_cb;
+    void *stats_arg;
     bool running;
 } GlobalClock_clock;
 
+// Set on the threads of the machines and the clock such a thread registered
+static __thread bool GlobalClock_isMachine;
+static __thread GlobalClock_LocalClock_t *GlobalClock_machineClock;
+
 
 //==============================================================================
 //= Function declarations(static)
@@ -83,6 +99,11 @@ static void GlobalClock_thread(void *arg);
 static void GlobalClock_createThread(GlobalClock_LocalClock_t *clk);
 static void GlobalClock_setFrequency(GlobalClock_LocalClock_t *clk,
                                      uint64_t hz);
+static uint64_t GlobalClock_minDone(void);
+static void GlobalClock_waitDone(uint64_t target);
+static void GlobalClock_wakeWaiters(void);
+static void GlobalClock_waitPeriod(GlobalClock_LocalClock_t *clk);
+static void GlobalClock_reportStats(void);
 
 //==============================================================================
 //= Function definitions(static)
@@ -93,6 +114,9 @@ static void GlobalClock_thread(void *arg) {
 }
 
 static void GlobalClock_createThread(GlobalClock_LocalClock_t *clk) {
+    if (clk->machine) {
+        return;
+    }
     uv_thread_create(&clk->tid, &GlobalClock_thread, clk);
 }
 
@@ -107,6 +131,99 @@ static void GlobalClock_setFrequency(GlobalClock_LocalClock_t *clk,
 }
 
 
+// The list is not modified after GlobalClock_Start(), so it is walked
+// without the list mutex.
+static uint64_t GlobalClock_minDone(void) {
+    List_Element_t *e;
+    uint64_t min = UINT64_MAX;
+    for (e = GlobalClock_clock.list.head; e; e = e->next) {
+        GlobalClock_LocalClock_t *clk = (GlobalClock_LocalClock_t *)e;
+        uint64_t done = __atomic_load_n(&clk->done, __ATOMIC_SEQ_CST);
+        if (done < min) {
+            min = done;
+        }
+    }
+    return min;
+}
+
+
+// Wait until every clock has completed target periods. The waiter count
+// is raised before the last check, so a clock publishing its progress
+// afterwards sees it and wakes us up.
+static void GlobalClock_waitDone(uint64_t target) {
+    int spin;
+    for (spin = 0; spin < GLOBALCLOCK_SPIN; spin++) {
+        if (GlobalClock_minDone() >= target) {
+            return;
+        }
+    }
+    __atomic_add_fetch(&GlobalClock_clock.waiters, 1, __ATOMIC_SEQ_CST);
+    uv_mutex_lock(&GlobalClock_clock.wait_mutex);
+    while (GlobalClock_minDone() < target) {
+        uv_cond_wait(&GlobalClock_clock.wait_cond,
+                     &GlobalClock_clock.wait_mutex);
+    }
+    uv_mutex_unlock(&GlobalClock_clock.wait_mutex);
+    __atomic_sub_fetch(&GlobalClock_clock.waiters, 1, __ATOMIC_SEQ_CST);
+}
+
+
+static void GlobalClock_wakeWaiters(void) {
+    if (__atomic_load_n(&GlobalClock_clock.waiters, __ATOMIC_SEQ_CST) == 0) {
+        return;
+    }
+    uv_mutex_lock(&GlobalClock_clock.wait_mutex);
+    uv_cond_broadcast(&GlobalClock_clock.wait_cond);
+    uv_mutex_unlock(&GlobalClock_clock.wait_mutex);
+}
+
+
+// The period of the clock is used up. Publish it and take the next one as
+// soon as no other clock is more than lookahead periods behind. With a
+// lookahead of 0 all clocks run in lockstep.
+static void GlobalClock_waitPeriod(GlobalClock_LocalClock_t *clk) {
+    uint32_t lookahead = GlobalClock_clock.lookahead;
+    __atomic_store_n(&clk->done, clk->quantum, __ATOMIC_SEQ_CST);
+    GlobalClock_wakeWaiters();
+    if ((clk->quantum > lookahead) &&
+        (GlobalClock_minDone() < clk->quantum - lookahead)) {
+        uint64_t start = uv_hrtime();
+        LOG_Verbose(MOD_NAME, "Wait %08zX:%p", (uintptr_t)clk->proc, clk->data);
+        GlobalClock_waitDone(clk->quantum - lookahead);
+        __atomic_add_fetch(&clk->stall_ns, uv_hrtime() - start,
+                           __ATOMIC_RELAXED);
+    }
+    clk->quantum++;
+    clk->rest_cnt += clk->period_cnt;
+    clk->rest_fraction += clk->period_cnt_reminder;
+    if (clk->rest_fraction >= 1000) {
+        LOG_Verbose(MOD_NAME, "Add fraction %08zX:%p", (uintptr_t)clk->proc,
+                    clk->data);
+        clk->rest_cnt++;
+        clk->rest_fraction -= 1000;
+    }
+}
+
+
+static void GlobalClock_reportStats(void) {
+    List_Element_t *e;
+    GlobalClock_Stats_t stats;
+    for (e = GlobalClock_clock.list.head; e; e = e->next) {
+        GlobalClock_LocalClock_t *clk = (GlobalClock_LocalClock_t *)e;
+        stats.data = clk->data;
+        stats.hz = clk->hz;
+        stats.done = __atomic_load_n(&clk->done, __ATOMIC_SEQ_CST);
+        stats.stall_ns = __atomic_load_n(&clk->stall_ns, __ATOMIC_RELAXED);
+        if (GlobalClock_clock.stats_cb) {
+            GlobalClock_clock.stats_cb(&stats, GlobalClock_clock.stats_arg);
+        } else {
+            LOG_Debug(MOD_NAME, "%p: periods %" PRIu64 "\tstall[ms]: %.3lf",
+                      stats.data, stats.done, stats.stall_ns * 1e-6);
+        }
+    }
+}
+
+
 //==============================================================================
 //= Function definitions(global)
 //==============================================================================
@@ -120,7 +237,22 @@ int GlobalClock_Init(uint32_t period_ms) {
                   uv_strerror(err));
         return err;
     }
+    err = uv_mutex_init(&GlobalClock_clock.wait_mutex);
+    if (err < 0) {
+        LOG_Error(MOD_NAME, "uv_mutex_init failed. %s %s", uv_err_name(err),
+                  uv_strerror(err));
+        return err;
+    }
+    err = uv_cond_init(&GlobalClock_clock.wait_cond);
+    if (err < 0) {
+        LOG_Error(MOD_NAME, "uv_cond_init failed. %s %s", uv_err_name(err),
+                  uv_strerror(err));
+        return err;
+    }
     GlobalClock_clock.period_ms = period_ms;
+    GlobalClock_clock.lookahead = GLOBALCLOCK_DEFAULT_LOOKAHEAD;
+    GlobalClock_clock.waiters = 0;
+    GlobalClock_clock.stats_cb = NULL;
     GlobalClock_clock.running = false;
     GlobalClock_clock.list_num = 0;
     return 0;
@@ -131,41 +263,55 @@ int GlobalClock_Start(void) {
     int err = 0;
     uint64_t prev;
     uint64_t now;
+    uint64_t period;
     LOG_Info(MOD_NAME, "Start global clock");
     if (GlobalClock_clock.list_num == 0) {
         LOG_Warn(MOD_NAME, "no have registered proc");
         err = UV_ENOENT;
         goto END;
     }
+    uv_mutex_lock(&GlobalClock_clock.wait_mutex);
     GlobalClock_clock.running = true;
-    err = uv_barrier_init(&GlobalClock_clock.barrier,
-                          GlobalClock_clock.list_num + 1);
-    if (err < 0) {
-        LOG_Error(MOD_NAME, "uv_barrier_init failed. %s %s", uv_err_name(err),
-                  uv_strerror(err));
-        err = 0;
-        goto END;
-    }
+    uv_cond_broadcast(&GlobalClock_clock.wait_cond);
+    uv_mutex_unlock(&GlobalClock_clock.wait_mutex);
     uv_mutex_lock(&GlobalClock_clock.list_mutex);
     List_Map(&GlobalClock_clock.list, (List_Proc_cb)&GlobalClock_createThread);
     uv_mutex_unlock(&GlobalClock_clock.list_mutex);
     prev = uv_hrtime();
-    for (;;) {
-        uv_barrier_wait(&GlobalClock_clock.barrier);
+    for (period = 1;; period++) {
+        GlobalClock_waitDone(period);
         now = uv_hrtime();
         LOG_Debug(MOD_NAME, "exp[ms]: %" PRId32 "\treal[ms]: %.3lf",
                   GlobalClock_clock.period_ms, (now - prev) * 1e-6);
         prev = now;
+        GlobalClock_reportStats();
     }
 END:
     return err;
 }
 
 
+int GlobalClock_SetLookahead(uint32_t periods) {
+    if (GlobalClock_clock.running) {
+        LOG_Error(MOD_NAME, "GlobalClock already running");
+        return UV_EALREADY;
+    }
+    LOG_Info(MOD_NAME, "Lookahead %" PRIu32 " periods", periods);
+    GlobalClock_clock.lookahead = periods;
+    return 0;
+}
+
+
+void GlobalClock_SetStatsHook(GlobalClock_Stats_cb proc, void *arg) {
+    GlobalClock_clock.stats_arg = arg;
+    GlobalClock_clock.stats_cb = proc;
+}
+
+
 int GlobalClock_Registor(GlobalClock_Proc_cb proc, void *data, uint64_t hz) {
     LOG_Debug(MOD_NAME, "Register %08zX:%p", (uintptr_t)proc, data);
     if (GlobalClock_clock.running) {
-        LOG_Error(MOD_NAME, "GlobalClock alreay running");
+        LOG_Error(MOD_NAME, "GlobalClock already running");
         return UV_EALREADY;
     }
     GlobalClock_LocalClock_t *clk = LEIGUN_NEW(clk);
@@ -177,6 +323,18 @@ int GlobalClock_Registor(GlobalClock_Proc_cb proc, void *data, uint64_t hz) {
     clk->proc = proc;
     clk->data = data;
     clk->rest_cnt = 0;
+    clk->quantum = 0;
+    clk->done = 0;
+    clk->stall_ns = 0;
+    clk->machine = GlobalClock_isMachine;
+    if (clk->machine) {
+        if (GlobalClock_machineClock) {
+            LOG_Error(MOD_NAME, "Only one clock per machine thread");
+            free(clk);
+            return UV_EEXIST;
+        }
+        GlobalClock_machineClock = clk;
+    }
     GlobalClock_setFrequency(clk, hz);
     uv_mutex_lock(&GlobalClock_clock.list_mutex);
     List_Push(&GlobalClock_clock.list, &clk->liste);
@@ -186,6 +344,34 @@ int GlobalClock_Registor(GlobalClock_Proc_cb proc, void *data, uint64_t hz) {
 }
 
 
+// Make the calling thread the thread of a machine. A clock registered by it
+// is not run on a thread of its own but by GlobalClock_RunMachine(), so the
+// proc sees the machine local state created by this thread.
+void GlobalClock_EnterMachine(void) {
+    GlobalClock_isMachine = true;
+}
+
+
+// Wait for GlobalClock_Start() and run the clock of the calling machine
+// thread. Does not return while the machine is running.
+int GlobalClock_RunMachine(void) {
+    GlobalClock_LocalClock_t *clk = GlobalClock_machineClock;
+    if (!clk) {
+        LOG_Error(MOD_NAME, "No clock registered by this machine");
+        return UV_ENOENT;
+    }
+    uv_mutex_lock(&GlobalClock_clock.wait_mutex);
+    while (!GlobalClock_clock.running) {
+        uv_cond_wait(&GlobalClock_clock.wait_cond,
+                     &GlobalClock_clock.wait_mutex);
+    }
+    uv_mutex_unlock(&GlobalClock_clock.wait_mutex);
+    clk->tid = uv_thread_self();
+    clk->proc(clk, clk->data);
+    return 0;
+}
+
+
 void GlobalClock_ChangeFrequency(GlobalClock_LocalClock_t *clk, uint64_t hz) {
     if (clk->hz == hz) {
         return;
@@ -200,16 +386,23 @@ void GlobalClock_ChangeFrequency(GlobalClock_LocalClock_t *clk, uint64_t hz) {
 
 void GlobalClock_ConsumeCycle(GlobalClock_LocalClock_t *clk, uint32_t cnt) {
     while (clk->rest_cnt < cnt) {
-        LOG_Verbose(MOD_NAME, "Wait %08zX:%p", (uintptr_t)clk->proc, clk->data);
-        uv_barrier_wait(&GlobalClock_clock.barrier);
-        clk->rest_cnt += clk->period_cnt;
-        clk->rest_fraction += clk->period_cnt_reminder;
-        if (clk->rest_fraction >= 1000) {
-            LOG_Verbose(MOD_NAME, "Add fraction %08zX:%p", (uintptr_t)clk->proc,
-                        clk->data);
-            clk->rest_cnt++;
-            clk->rest_fraction -= 1000;
-        }
+        GlobalClock_waitPeriod(clk);
     }
     clk->rest_cnt -= cnt;
 }
+
+
+// Consume cnt cycles and return the number of cycles which can be run
+// before the next synchronization. Waits for the next period when the
+// current one is used up, so the result is never zero. cnt is a delta of
+// the 64 bit CycleCounter_t of the caller.
+uint64_t GlobalClock_Advance(GlobalClock_LocalClock_t *clk, uint64_t cnt) {
+    while (clk->rest_cnt < cnt) {
+        GlobalClock_waitPeriod(clk);
+    }
+    clk->rest_cnt -= cnt;
+    while (clk->rest_cnt == 0) {
+        GlobalClock_waitPeriod(clk);
+    }
+    return clk->rest_cnt;
+}
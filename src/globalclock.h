@@ -45,6 +45,15 @@ extern "C" {
 typedef struct GlobalClock_LocalClock_s GlobalClock_LocalClock_t;
 typedef void (*GlobalClock_Proc_cb)(GlobalClock_LocalClock_t *clk, void *data);
 
+typedef struct GlobalClock_Stats_s {
+    void *data;        // data given to GlobalClock_Registor()
+    uint64_t hz;
+    uint64_t done;     // periods completed
+    uint64_t stall_ns; // total time spent waiting for the other clocks
+} GlobalClock_Stats_t;
+typedef void (*GlobalClock_Stats_cb)(const GlobalClock_Stats_t *stats,
+                                     void *arg);
+
 
 //==============================================================================
 //= Variables
@@ -61,10 +70,15 @@ typedef void (*GlobalClock_Proc_cb)(GlobalClock_LocalClock_t *clk, void *data);
 //==============================================================================
 int GlobalClock_Init(uint32_t period_ms);
 int GlobalClock_Start(void);
+int GlobalClock_SetLookahead(uint32_t periods);
+void GlobalClock_SetStatsHook(GlobalClock_Stats_cb proc, void *arg);
 
 int GlobalClock_Registor(GlobalClock_Proc_cb proc, void *data, uint64_t hz);
+void GlobalClock_EnterMachine(void);
+int GlobalClock_RunMachine(void);
 void GlobalClock_ChangeFrequency(GlobalClock_LocalClock_t *clk, uint64_t hz);
 void GlobalClock_ConsumeCycle(GlobalClock_LocalClock_t *clk, uint32_t cnt);
+uint64_t GlobalClock_Advance(GlobalClock_LocalClock_t *clk, uint64_t cnt);
 
 #ifdef __cplusplus
 }
@@ -30,6 +30,7 @@
 #include "device.h"
 #include "leigun.h"
 #include "logging.h"
+#include "snapshot.h"
 
 // External headers
 #include <uv.h>
@@ -90,6 +91,7 @@ static Device_MemMapped_t *SRAM_create(const Device_DrvMemMapped_t *drv,
     SRAM_t *dev = LEIGUN_NEW(dev);
     dev->mmd.self = dev;
     dev->mmd.drv = drv;
+    dev->name = name;
     dev->size = 0;
     dev->host_mem = NULL;
     return &dev->mmd;
@@ -99,12 +101,7 @@ static Device_MemMapped_t *SRAM_create(const Device_DrvMemMapped_t *drv,
 static int SRAM_prepare(void *self) {
     SRAM_t *dev = self;
     LOG_Debug(DEVICE_NAME, "prepare(%s, %zd)", dev->name, dev->size);
-    dev->host_mem = LEIGUN_NEW_BUF(dev->size);
-    if (!dev->host_mem) {
-        LOG_Error(DEVICE_NAME, "malloc failed %s", strerror(errno));
-        return UV_EAI_MEMORY;
-    }
-    memset(dev->host_mem, 0xCD, dev->size);
+    dev->host_mem = Snapshot_AllocRam(dev->name, dev->size, 0xCD);
     return 0;
 }
 
@@ -112,7 +109,7 @@ static int SRAM_prepare(void *self) {
 static int SRAM_release(void *self) {
     SRAM_t *dev = self;
     LOG_Debug(DEVICE_NAME, "release(%s)", dev->name);
-    free(dev->host_mem);
+    Snapshot_FreeRam(dev->host_mem);
     dev->host_mem = NULL;
     return 0;
 }
@@ -4,9 +4,9 @@
  * Alsa sound backend for softgun 
  *
  * State:
- * 	Working with Uzebox emulator. Problems with the rare samplerate
- *	of 15700 Hz on some PC's. Has a feedback loop for controlling
- *	the speed of the CPU. 
+ * 	Working with Uzebox emulator. Gets 10 ms periods of S16_LE
+ *	samples from the mixing stage in sound.c which resamples the
+ *	rare samplerate of 15700 Hz and controls the speed of the CPU.
  *
  * Copyright 2009 Jochen Karrer. All rights reserved.
  * 
@@ -39,12 +39,8 @@
 
 #ifdef __linux__
 #include <alsa/asoundlib.h>
-#include <poll.h>
-#include <pthread.h>
 #include "sound.h"
 #include "sgstring.h"
-#include "signode.h"
-#include "cycletimer.h"
 
 #if 0
 #define dbgprintf(...) fprintf(stderr,__VA_ARGS__)
@@ -52,34 +48,21 @@
 #define dbgprintf(...)
 #endif
 
-#define BUFFERSIZE (6*1024)
-#define BUF_WP(as)	((as)->outBuffer_wp % BUFFERSIZE)
-#define BUF_RP(as)	((as)->outBuffer_rp % BUFFERSIZE)
-#define BUF_CNT(as) 	((as)->outBuffer_wp - (as)->outBuffer_rp)
-
 typedef struct AlsaSound {
 	SoundDevice sdev;
-	CycleTimer buffer_check_timer;
 	int bytes_per_frame;
 	int alsa_sound_fmt;
 	unsigned int samplerate;
 	snd_pcm_t *outHandle;
 	snd_pcm_hw_params_t *hwpar;
 	snd_pcm_sw_params_t *swpar;
-	uint8_t outBuffer[BUFFERSIZE];
-	uint64_t outBuffer_wp;
-	uint64_t outBuffer_rp;
-	unsigned int outBufferSize;
-	pthread_t write_thread;
-	pthread_mutex_t write_mutex;
-	int speed_up;
-	int speed_down;
 } AlsaSound;
 
 /*
  *************************************************************************
  * SetSoundFormat
- * 	Set samplerate, sample format and number of channels
+ * 	Set samplerate, sample format and number of channels.
+ *	The rate really used by the card is written back to fmt.
  *************************************************************************
  */
 static int
@@ -89,7 +72,7 @@ AlsaSound_SetSoundFormat(SoundDevice * sdev, SoundFormat * fmt)
 	int dir;
 	int rc;
 	int periods;
-	int periodsize;
+	snd_pcm_uframes_t periodsize;
 	switch (fmt->sg_snd_format) {
 	    case SG_SND_PCM_FORMAT_S16_LE:
 		    asdev->alsa_sound_fmt = SND_PCM_FORMAT_S16_LE;
@@ -115,6 +98,7 @@ AlsaSound_SetSoundFormat(SoundDevice * sdev, SoundFormat * fmt)
 		    fprintf(stderr, "Unknown sound format %d\n", fmt->sg_snd_format);
 		    return -1;
 	}
+	snd_pcm_drop(asdev->outHandle);
 	snd_pcm_hw_params_alloca(&asdev->hwpar);
 	/* Fill in default values */
 	snd_pcm_hw_params_any(asdev->outHandle, asdev->hwpar);
@@ -130,15 +114,12 @@ AlsaSound_SetSoundFormat(SoundDevice * sdev, SoundFormat * fmt)
 		fprintf(stderr, "Error setting periods.\n");
 		exit(1);
 	}
-	periodsize = 512;
-#if 1
-	/* latency = periodsize * periods / (rate * bytes_per_frame)     */
-	if (snd_pcm_hw_params_set_buffer_size
-	    (asdev->outHandle, asdev->hwpar, (periodsize * periods) / asdev->bytes_per_frame)) {
+	/* The mixing stage delivers blocks of 10 ms */
+	periodsize = (asdev->samplerate + 99) / 100;
+	if (snd_pcm_hw_params_set_buffer_size(asdev->outHandle, asdev->hwpar, periodsize * periods)) {
 		fprintf(stderr, "Error setting buffersize.\n");
 		return (-1);
 	}
-#endif
 	/* Write the parameters to the driver */
 	rc = snd_pcm_hw_params(asdev->outHandle, asdev->hwpar);
 	if (rc < 0) {
@@ -151,115 +132,45 @@ AlsaSound_SetSoundFormat(SoundDevice * sdev, SoundFormat * fmt)
 		snd_pcm_hw_params_get_period_size(asdev->hwpar, &frames, &dir);
 		fprintf(stderr, "frames per period is %lu\n", frames);
 	}
-
-	/* Reset the buffers */
-	asdev->outBuffer_rp = asdev->outBuffer_wp = 0;
-
 	snd_pcm_sw_params_alloca(&asdev->swpar);
 	snd_pcm_sw_params_current(asdev->outHandle, asdev->swpar);
-	rc = snd_pcm_sw_params_set_avail_min(asdev->outHandle, asdev->swpar, 512);
-	snd_pcm_sw_params_set_start_threshold(asdev->outHandle, asdev->swpar, 2048);
+	rc = snd_pcm_sw_params_set_avail_min(asdev->outHandle, asdev->swpar, periodsize);
+	snd_pcm_sw_params_set_start_threshold(asdev->outHandle, asdev->swpar, 2 * periodsize);
 	snd_pcm_sw_params(asdev->outHandle, asdev->swpar);
+	fmt->samplerate = asdev->samplerate;
+	sdev->soundFormat = *fmt;
 	return 0;
 }
 
-/*
- ****************************************************************
- * write_samples
- * 	The thread writing samples to the sound device
- ****************************************************************
- */
-
-#define MAX_FRAMES 1024
-static void *
-write_samples(void *clientData)
-{
-	AlsaSound *asdev = (AlsaSound *) clientData;
-	int rc;
-	int frames;
-	unsigned int rp;
-	unsigned int maxframes;
-	while (1) {
-		usleep(30000);
-		while (BUF_CNT(asdev) > 256) {
-			rp = BUF_RP(asdev);
-			frames = BUF_CNT(asdev) / asdev->bytes_per_frame;
-			maxframes = (asdev->outBufferSize - rp) / asdev->bytes_per_frame;
-			if (frames > maxframes) {
-				frames = maxframes;
-			}
-			if (frames > MAX_FRAMES) {
-				frames = MAX_FRAMES;
-			}
-			rc = snd_pcm_writei(asdev->outHandle, asdev->outBuffer + rp, frames);
-			dbgprintf("%05lu: wp %d - rp %d  frames: %d\n", BUF_CNT(asdev), wp, rp,
-				  frames);
-			if (rc == -EPIPE) {
-				snd_pcm_prepare(asdev->outHandle);
-				asdev->outBuffer_rp = asdev->outBuffer_wp = 0;
-				fprintf(stderr, "Alsasound EPIPE\n");
-			} else if (rc < 0) {
-				fprintf(stderr, "error from writei: %s\n", snd_strerror(rc));
-				asdev->outBuffer_rp = asdev->outBuffer_wp = 0;
-			} else {
-				asdev->outBuffer_rp =
-				    asdev->outBuffer_rp + frames * asdev->bytes_per_frame;
-			}
-		}
-	}
-	return NULL;
-}
-
-static void
-alsa_check_buffer_fill(void *clientData)
-{
-	uint32_t count;
-	AlsaSound *asdev = (AlsaSound *) clientData;
-	SoundDevice *sdev = &asdev->sdev;
-	count = BUF_CNT(asdev);
-	if ((count > (3 * BUFFERSIZE / 4)) && !asdev->speed_down) {
-		asdev->speed_down = 1;
-		SigNode_Set(sdev->speedDown, SIG_HIGH);
-		dbgprintf("Speed down\n");
-	} else if ((count < (BUFFERSIZE / 2)) && asdev->speed_down) {
-		SigNode_Set(sdev->speedDown, SIG_LOW);
-		dbgprintf("Speed Ok\n");
-		asdev->speed_down = 0;
-	} else if ((count > (BUFFERSIZE / 2)) && asdev->speed_up) {
-		SigNode_Set(sdev->speedUp, SIG_LOW);
-		dbgprintf("Speed Ok\n");
-		asdev->speed_up = 0;
-	} else if ((count < (BUFFERSIZE / 4)) && !asdev->speed_up) {
-		asdev->speed_up = 1;
-		SigNode_Set(sdev->speedUp, SIG_HIGH);
-		dbgprintf("Speed up\n");
-	}
-	if (count > (BUFFERSIZE / 4)) {
-		pthread_mutex_unlock(&asdev->write_mutex);
-	}
-	CycleTimer_Mod(&asdev->buffer_check_timer, CycleTimerRate_Get() >> 1);
-}
-
 /*
  *******************************************************************************
  * PlaySamples
- *	Take the samples and put them to the circular buffer for the
- *	thread witch sends them to the sound device
+ *	Called from the thread of the mixing stage with one period.
+ *	Blocks until the card has room, so the mixing stage runs at the
+ *	speed of the card.
  *******************************************************************************
  */
 static int
 AlsaSound_PlaySamples(SoundDevice * sdev, void *data, uint32_t len)
 {
 	AlsaSound *asdev = sdev->owner;
-	uint32_t count;
-	int i;
-	count = asdev->outBuffer_wp - asdev->outBuffer_rp;
-	if ((count + len) >= sizeof(asdev->outBuffer)) {
-		return len;
-	}
-	for (i = 0; i < len; i++) {
-		asdev->outBuffer[BUF_WP(asdev)] = ((uint8_t *) data)[i];
-		asdev->outBuffer_wp = asdev->outBuffer_wp + 1;
+	uint8_t *samples = data;
+	snd_pcm_sframes_t frames = len / asdev->bytes_per_frame;
+	snd_pcm_sframes_t rc;
+	while (frames > 0) {
+		rc = snd_pcm_writei(asdev->outHandle, samples, frames);
+		if (rc < 0) {
+			dbgprintf("Alsasound %s\n", snd_strerror(rc));
+			/* Restart after an underrun */
+			rc = snd_pcm_recover(asdev->outHandle, rc, 1);
+			if (rc < 0) {
+				fprintf(stderr, "error from writei: %s\n", snd_strerror(rc));
+				return -1;
+			}
+			continue;
+		}
+		samples += rc * asdev->bytes_per_frame;
+		frames -= rc;
 	}
 	return len;
 }
@@ -280,8 +191,8 @@ AlsaSound_New(const char *name)
 	SoundDevice *sdev = &asdev->sdev;
 	sdev->setSoundFormat = AlsaSound_SetSoundFormat;
 	sdev->playSamples = AlsaSound_PlaySamples;
+	sdev->realTime = 1;
 	sdev->owner = asdev;
-	asdev->outBufferSize = sizeof(asdev->outBuffer);
 	/* Open PCM device for playback. */
 	rc = snd_pcm_open(&asdev->outHandle, "default", SND_PCM_STREAM_PLAYBACK, 0);
 	if (rc < 0) {
@@ -290,17 +201,6 @@ AlsaSound_New(const char *name)
 		sg_free(asdev);
 		return NULL;
 	}
-	pthread_mutex_init(&asdev->write_mutex, NULL);
-
-	pthread_create(&asdev->write_thread, NULL, write_samples, (void *)asdev);
-	CycleTimer_Init(&asdev->buffer_check_timer, alsa_check_buffer_fill, asdev);
-	CycleTimer_Mod(&asdev->buffer_check_timer, CycleTimerRate_Get() >> 1);
-	sdev->speedUp = SigNode_New("%s.speedUp", name);
-	sdev->speedDown = SigNode_New("%s.speedDown", name);
-	if (!sdev->speedUp || !sdev->speedDown) {
-		fprintf(stderr, "Can not create sound speed control lines\n");
-		exit(1);
-	}
 	fprintf(stderr, "Created ALSA sound device \"%s\"\n", name);
 
 	return sdev;
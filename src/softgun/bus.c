@@ -47,14 +47,14 @@
 #include "sgstring.h"
 #include "loader.h"
 
-Bus *MainBus;
+__MACHINE_LOCAL__ Bus *MainBus;
 /*
  * ------------------------------------
  * Hash for single IO-Ports
  * ------------------------------------
  */
 
-IOHandler **iohandlerHash;
+__MACHINE_LOCAL__ IOHandler **iohandlerHash;
 
 /*
  * ------------------------------------
@@ -62,7 +62,7 @@ IOHandler **iohandlerHash;
  * ------------------------------------
  */
 
-IOHandler **iohandlerMap;
+__MACHINE_LOCAL__ IOHandler **iohandlerMap;
 
 /*
  * ------------------------------------
@@ -70,8 +70,29 @@ IOHandler **iohandlerMap;
  * ------------------------------------
  */
 
-IOHandler ***iohandlerFlvlMap;
-static unsigned int ioh_flvl_use_count[IOH_FLVL_SZ] = { 0, };
+__MACHINE_LOCAL__ IOHandler ***iohandlerFlvlMap;
+static __MACHINE_LOCAL__ unsigned int *ioh_flvl_use_count;
+
+/*
+ * ---------------------------------------------------------------------
+ * Flat dispatch map
+ *	One entry per 4k page. The entry is a page with one handler
+ *	per byte address or, if the whole page goes to the same
+ *	handler (or to none), the handler tagged with IOPAGE_UNIFORM.
+ *	Entries are built from the hash and the maps above on the first
+ *	access and are dropped when a handler of the page changes. 
+ *	Pages with handlers which pass oversized accesses on to the next
+ *	handler also store the handlers of the three following bytes.
+ * ---------------------------------------------------------------------
+ */
+#define IOH_FLG_OSZ_NEXT	(IOH_FLG_OSZR_NEXT | IOH_FLG_OSZW_NEXT)
+
+typedef struct IOPage {
+	IOHandler *slot[IOPAGE_SIZE];
+	IOHandler *(*next)[3];	/* handler of address + 1 + index */
+} IOPage;
+
+static __MACHINE_LOCAL__ uintptr_t *ioPageMap;
 
 /*
  * -------------------------------------------
@@ -79,8 +100,8 @@ static unsigned int ioh_flvl_use_count[IOH_FLVL_SZ] = { 0, };
  * -------------------------------------------
  */
 
-uint8_t **mem_map_read;
-uint8_t **mem_map_write;
+__MACHINE_LOCAL__ uint8_t **mem_map_read;
+__MACHINE_LOCAL__ uint8_t **mem_map_write;
 
 /* 
  * -----------------------------------------
@@ -88,8 +109,9 @@ uint8_t **mem_map_write;
  * -----------------------------------------
  */
 
-TwoLevelMMap twoLevelMMap;
-InvalidateCallback *InvalidateProc;
+__MACHINE_LOCAL__ TwoLevelMMap twoLevelMMap;
+__MACHINE_LOCAL__ InvalidateCallback *InvalidateProc;
+__MACHINE_LOCAL__ Bus_HostWriteProc *Bus_HostWriteHook;
 
 static inline uint8_t *
 twolevel_translate_r(uint32_t addr)
@@ -218,10 +240,13 @@ Bus_Write64(uint64_t value, uint32_t addr)
 	uint8_t *base = mem_map_write[index];
 	if (likely(base)) {
 		HMemWrite64(value, (base + (addr & (MEM_MAP_BLOCKMASK))));
+		Bus_HostWritten(base + (addr & MEM_MAP_BLOCKMASK), addr, 8);
 	} else {
 		uint8_t *taddr = twolevel_translate_w(addr);
 		if (taddr) {
-			return HMemWrite64(value, taddr);
+			HMemWrite64(value, taddr);
+			Bus_HostWritten(taddr, addr, 8);
+			return;
 		}
 		//return IO_Write64(value,addr);
 		return;
@@ -235,10 +260,13 @@ Bus_Write32(uint32_t value, uint32_t addr)
 	uint8_t *base = mem_map_write[index];
 	if (likely(base)) {
 		HMemWrite32(value, (base + (addr & (MEM_MAP_BLOCKMASK))));
+		Bus_HostWritten(base + (addr & MEM_MAP_BLOCKMASK), addr, 4);
 	} else {
 		uint8_t *taddr = twolevel_translate_w(addr);
 		if (taddr) {
-			return HMemWrite32(value, taddr);
+			HMemWrite32(value, taddr);
+			Bus_HostWritten(taddr, addr, 4);
+			return;
 		}
 		return IO_Write32(value, addr);
 	}
@@ -251,10 +279,13 @@ Bus_Write16(uint16_t value, uint32_t addr)
 	uint8_t *base = mem_map_write[index];
 	if (likely(base)) {
 		HMemWrite16(value, (base + (addr & (MEM_MAP_BLOCKMASK))));
+		Bus_HostWritten(base + (addr & MEM_MAP_BLOCKMASK), addr, 2);
 	} else {
 		uint8_t *taddr = twolevel_translate_w(addr);
 		if (taddr) {
-			return HMemWrite16(value, taddr);
+			HMemWrite16(value, taddr);
+			Bus_HostWritten(taddr, addr, 2);
+			return;
 		}
 		return IO_Write16(value, addr);
 	}
@@ -267,60 +298,208 @@ Bus_Write8(uint8_t value, uint32_t addr)
 	uint8_t *base = mem_map_write[index];
 	if (likely(base)) {
 		HMemWrite8(value, (base + (addr & (MEM_MAP_BLOCKMASK))));
+		Bus_HostWritten(base + (addr & MEM_MAP_BLOCKMASK), addr, 1);
 	} else {
 		uint8_t *taddr = twolevel_translate_w(addr);
 		if (taddr) {
-			return HMemWrite8(value, taddr);
+			HMemWrite8(value, taddr);
+			Bus_HostWritten(taddr, addr, 1);
+			return;
 		}
 		return IO_Write8(value, addr);
 	}
 }
 
+/*
+ * -----------------------------------------------------------------
+ * Spans of host memory
+ *	Translate addr and return the number of bytes up to the end
+ *	of the memory block containing it. If addr is not backed by
+ *	memory NULL is returned and the span goes up to the end of the
+ *	smallest block, so the next span starts at the next block which
+ *	might be memory again.
+ * -----------------------------------------------------------------
+ */
+uint8_t *
+Bus_GetHVASpanRead(uint32_t addr, uint32_t * span)
+{
+	uint8_t *base = mem_map_read[addr >> MEM_MAP_SHIFT];
+	if (likely(base)) {
+		*span = MEM_MAP_BLOCKSIZE - (addr & MEM_MAP_BLOCKMASK);
+		return base + (addr & MEM_MAP_BLOCKMASK);
+	}
+	*span = twoLevelMMap.scnd_lvl_blocksize - (addr & twoLevelMMap.scnd_lvl_blockmask);
+	return twolevel_translate_r(addr);
+}
+
+uint8_t *
+Bus_GetHVASpanWrite(uint32_t addr, uint32_t * span)
+{
+	uint8_t *base = mem_map_write[addr >> MEM_MAP_SHIFT];
+	if (likely(base)) {
+		*span = MEM_MAP_BLOCKSIZE - (addr & MEM_MAP_BLOCKMASK);
+		return base + (addr & MEM_MAP_BLOCKMASK);
+	}
+	*span = twoLevelMMap.scnd_lvl_blocksize - (addr & twoLevelMMap.scnd_lvl_blockmask);
+	return twolevel_translate_w(addr);
+}
+
+/*
+ * -----------------------------------------------------------------
+ * Copy a span with the byte address xor 3 used by the Swap32
+ * transfers. hva is the host address of addr. The bytes of a word
+ * stay in their word and the memory blocks are word aligned, so
+ * addr ^ 3 is in the same block even if it is outside of the span.
+ * Complete words are swapped as a whole, the compiler vectorizes
+ * this loop.
+ * -----------------------------------------------------------------
+ */
+#define SWAP32_OFS(addr, i) ((int32_t)((((addr) + (i)) ^ 3) - (addr)))
+
+static void
+swap32_to_hva(uint8_t * hva, const uint8_t * buf, uint32_t addr, uint32_t count)
+{
+	uint32_t i = 0;
+	uint32_t word;
+	for (; (i < count) && ((addr + i) & 3); i++) {
+		hva[SWAP32_OFS(addr, i)] = buf[i];
+	}
+	for (; i + 4 <= count; i += 4) {
+		memcpy(&word, buf + i, 4);
+		word = BYTE_Swap32(word);
+		memcpy(hva + i, &word, 4);
+	}
+	for (; i < count; i++) {
+		hva[SWAP32_OFS(addr, i)] = buf[i];
+	}
+}
+
+static void
+swap32_from_hva(uint8_t * buf, const uint8_t * hva, uint32_t addr, uint32_t count)
+{
+	uint32_t i = 0;
+	uint32_t word;
+	for (; (i < count) && ((addr + i) & 3); i++) {
+		buf[i] = hva[SWAP32_OFS(addr, i)];
+	}
+	for (; i + 4 <= count; i += 4) {
+		memcpy(&word, hva + i, 4);
+		word = BYTE_Swap32(word);
+		memcpy(buf + i, &word, 4);
+	}
+	for (; i < count; i++) {
+		buf[i] = hva[SWAP32_OFS(addr, i)];
+	}
+}
+
 /*
  * --------------------------------------------
  * Generic Bus Access Functions for Transfer
  * of any block size. Mainly used for
- * non CPU bus masters.
+ * non CPU bus masters. Memory is copied span
+ * by span, only IO-Handlers are called byte
+ * by byte.
  * --------------------------------------------
  */
 
 void
 Bus_Write(uint32_t addr, uint8_t * buf, uint32_t count)
 {
+	uint8_t *hva;
+	uint32_t span;
 	while (count) {
-		Bus_Write8(*buf++, addr++);
-		count--;
+		hva = Bus_GetHVASpanWrite(addr, &span);
+		if (span > count) {
+			span = count;
+		}
+		if (hva) {
+			memcpy(hva, buf, span);
+			Bus_HostWritten(hva, addr, span);
+			addr += span;
+			buf += span;
+		} else {
+			uint32_t i;
+			for (i = 0; i < span; i++) {
+				IO_Write8(*buf++, addr++);
+			}
+		}
+		count -= span;
 	}
 }
 
 void
 Bus_WriteSwap32(uint32_t addr, uint8_t * buf, int count)
 {
-	while (count) {
-		Bus_Write8(*buf++, (addr ^ 3));
-		addr++;
-		count--;
+	uint8_t *hva;
+	uint32_t span;
+	while (count > 0) {
+		hva = Bus_GetHVASpanWrite(addr, &span);
+		if (span > (uint32_t) count) {
+			span = count;
+		}
+		if (hva) {
+			swap32_to_hva(hva, buf, addr, span);
+			/* The swapped bytes stay in the words of the span */
+			Bus_HostWritten(hva - (addr & 3), addr & ~3, ((addr & 3) + span + 3) & ~3);
+			addr += span;
+			buf += span;
+		} else {
+			uint32_t i;
+			for (i = 0; i < span; i++) {
+				IO_Write8(*buf++, addr ^ 3);
+				addr++;
+			}
+		}
+		count -= span;
 	}
 }
 
 void
 Bus_Read(uint8_t * buf, uint32_t addr, uint32_t count)
 {
+	uint8_t *hva;
+	uint32_t span;
 	while (count) {
-		*buf = Bus_Read8(addr++);
-		buf++;
-		count--;
+		hva = Bus_GetHVASpanRead(addr, &span);
+		if (span > count) {
+			span = count;
+		}
+		if (hva) {
+			memcpy(buf, hva, span);
+			addr += span;
+			buf += span;
+		} else {
+			uint32_t i;
+			for (i = 0; i < span; i++) {
+				*buf++ = IO_Read8(addr++);
+			}
+		}
+		count -= span;
 	}
 }
 
 void
 Bus_ReadSwap32(uint8_t * buf, uint32_t addr, int count)
 {
-	while (count) {
-		*buf = Bus_Read8(addr ^ 3);
-		addr++;
-		buf++;
-		count--;
+	uint8_t *hva;
+	uint32_t span;
+	while (count > 0) {
+		hva = Bus_GetHVASpanRead(addr, &span);
+		if (span > (uint32_t) count) {
+			span = count;
+		}
+		if (hva) {
+			swap32_from_hva(buf, hva, addr, span);
+			addr += span;
+			buf += span;
+		} else {
+			uint32_t i;
+			for (i = 0; i < span; i++) {
+				*buf++ = IO_Read8(addr ^ 3);
+				addr++;
+			}
+		}
+		count -= span;
 	}
 }
 
@@ -714,8 +893,8 @@ Mem_AreaUpdateMappings(BusDevice * bdev)
  */
 #define IOH_HASH(addr) ((addr) + ((addr)>>18))&IOH_HASH_MASK
 
-IOHandler *
-IOH_Find(uint32_t address)
+static IOHandler *
+ioh_lookup(uint32_t address)
 {
 	IOHandler *cursor;
 	IOHandler **slvl_map;
@@ -739,6 +918,113 @@ IOH_Find(uint32_t address)
 	return NULL;
 }
 
+/*
+ * -----------------------------------------------------------------
+ * Build the dispatch map entry for the page of an address
+ * -----------------------------------------------------------------
+ */
+static __attribute__ ((noinline)) IOHandler *
+iopage_build(uint32_t address)
+{
+	uint32_t base = address & ~IOPAGE_MASK;
+	IOHandler *first = ioh_lookup(base);
+	IOHandler *h;
+	IOPage *page;
+	uint32_t i, j;
+	for (i = 1; i < IOPAGE_SIZE; i++) {
+		if (ioh_lookup(base + i) != first) {
+			break;
+		}
+	}
+	if ((i == IOPAGE_SIZE) && !(first && (first->flags & IOH_FLG_OSZ_NEXT))) {
+		ioPageMap[base >> IOPAGE_SHIFT] = (uintptr_t) first | IOPAGE_UNIFORM;
+		return first;
+	}
+	page = sg_new(IOPage);
+	for (i = 0; i < IOPAGE_SIZE; i++) {
+		page->slot[i] = ioh_lookup(base + i);
+	}
+	for (i = 0; i < IOPAGE_SIZE; i++) {
+		h = page->slot[i];
+		if (!h || !(h->flags & IOH_FLG_OSZ_NEXT)) {
+			continue;
+		}
+		if (!page->next) {
+			page->next = sg_calloc(IOPAGE_SIZE * sizeof(*page->next));
+		}
+		for (j = 0; j < 3; j++) {
+			if (i + j + 1 < IOPAGE_SIZE) {
+				page->next[i][j] = page->slot[i + j + 1];
+			} else {
+				page->next[i][j] = ioh_lookup(base + i + j + 1);
+			}
+		}
+	}
+	ioPageMap[base >> IOPAGE_SHIFT] = (uintptr_t) page;
+	return page->slot[address & IOPAGE_MASK];
+}
+
+/*
+ * -----------------------------------------------------------------
+ * Drop the dispatch map entries of a modified address range. The
+ * page before the range is dropped too because its last slots
+ * may point to handlers of the first page.
+ * -----------------------------------------------------------------
+ */
+static void
+iopage_invalidate(uint32_t addr, uint32_t length)
+{
+	uint32_t first = addr >> IOPAGE_SHIFT;
+	uint32_t last = (addr + length - 1) >> IOPAGE_SHIFT;
+	uint32_t i;
+	if (first > 0) {
+		first--;
+	}
+	for (i = first; i <= last; i++) {
+		uintptr_t entry = ioPageMap[i];
+		if (entry && !(entry & IOPAGE_UNIFORM)) {
+			sg_free(((IOPage *) entry)->next);
+			free((IOPage *) entry);
+		}
+		ioPageMap[i] = 0;
+	}
+}
+
+/*
+ * -----------------------------------------------------------------
+ * Find the IO-Handler for an address: one load for pages with
+ * a single handler, two for pages with registers.
+ * -----------------------------------------------------------------
+ */
+static inline IOHandler *
+IOH_Find(uint32_t address)
+{
+	uintptr_t entry = ioPageMap[address >> IOPAGE_SHIFT];
+	if (likely(entry & IOPAGE_UNIFORM)) {
+		return (IOHandler *) (entry - IOPAGE_UNIFORM);
+	} else if (likely(entry)) {
+		return ((IOPage *) entry)->slot[address & IOPAGE_MASK];
+	}
+	return iopage_build(address);
+}
+
+/*
+ * -----------------------------------------------------------------
+ * Find the handler of address + ofs (1 to 3) for an oversized
+ * access. The page of address has to be built by IOH_Find before.
+ * -----------------------------------------------------------------
+ */
+static inline IOHandler *
+IOH_FindNext(uint32_t address, unsigned int ofs)
+{
+	uintptr_t entry = ioPageMap[address >> IOPAGE_SHIFT];
+	IOPage *page = (IOPage *) entry;
+	if (likely(entry && !(entry & IOPAGE_UNIFORM) && page->next)) {
+		return page->next[address & IOPAGE_MASK][ofs - 1];
+	}
+	return IOH_Find(address + ofs);
+}
+
 IOHandler *
 IOH_HashFind(uint32_t address)
 {
@@ -787,6 +1073,7 @@ IOH_New(uint32_t cpu_addr, IOReadProc * readproc, IOWriteProc * writeproc, void
 	h->flags = flags;
 	h->len = len;
 	iohandlerHash[hash] = h;
+	iopage_invalidate(cpu_addr, 1);
 }
 
 void
@@ -854,6 +1141,7 @@ IOH_MapBlock(uint32_t addr, IOHandler * h)
 		exit(5342);
 	}
 	iohandlerMap[index] = h;
+	iopage_invalidate(addr, IOH_MAP_BLOCKSIZE);
 }
 
 static inline void
@@ -871,6 +1159,7 @@ IOH_Map2LvlBlock(uint32_t addr, IOHandler * h)
 	if (!sl_map[sl_index]) {
 		sl_map[sl_index] = h;
 		ioh_flvl_use_count[fl_index]++;
+		iopage_invalidate(addr, IOH_SLVL_BLOCKSIZE);
 	} else {
 		fprintf(stderr, "There is already a handler for IO-Region 0x%08x\n", addr);
 		exit(3246);
@@ -929,6 +1218,7 @@ IOH_UnMapBlock(uint32_t addr)
 	if (handler) {
 		iohandlerMap[index] = NULL;
 		free(handler);
+		iopage_invalidate(addr, IOH_MAP_BLOCKSIZE);
 	}
 }
 
@@ -949,6 +1239,7 @@ IOH_UnMap2LvlBlock(uint32_t addr)
 	if (handler) {
 		sl_map[sl_index] = NULL;
 		free(handler);
+		iopage_invalidate(addr, IOH_SLVL_BLOCKSIZE);
 		ioh_flvl_use_count[fl_index]--;
 		if (ioh_flvl_use_count[fl_index] == 0) {
 			free(iohandlerFlvlMap[fl_index]);
@@ -997,6 +1288,7 @@ IOH_Delete(uint32_t address)
 			}
 			flags = cursor->flags;
 			free(cursor);
+			iopage_invalidate(address, 1);
 			return flags;
 		}
 	}
@@ -1074,7 +1366,7 @@ IO_Write32(uint32_t value, uint32_t addr)
 		}
 		h->writeproc(h->clientData, value, addr, 2);
 		if (h->flags & IOH_FLG_OSZW_NEXT) {
-			h = IOH_Find(addr + 2);
+			h = IOH_FindNext(addr, 2);
 			if (h && h->writeproc) {
 				h->writeproc(h->clientData, value >> 16, addr, 2);
 			}
@@ -1113,8 +1405,8 @@ IO_Write16(uint16_t value, uint32_t addr)
 		}
 		h->writeproc(h->clientData, value, addr, 1);
 		if (h->flags & IOH_FLG_OSZW_NEXT) {
-			h = IOH_Find(addr + 1);
-			if (h) {
+			h = IOH_FindNext(addr, 1);
+			if (h && h->writeproc) {
 				h->writeproc(h->clientData, value >> 8, addr + 1, 1);
 			}
 		}
@@ -1196,7 +1488,7 @@ IO_Read32(uint32_t addr)
 	} else if (h->len == 2) {
 		if (h->flags & IOH_FLG_OSZR_NEXT) {
 			value = h->readproc(h->clientData, addr, 2);
-			h = IOH_Find(addr + 2);
+			h = IOH_FindNext(addr, 2);
 			if (h && h->readproc) {
 				value |= h->readproc(h->clientData, addr + 2, 2) << 16;
 			}
@@ -1212,7 +1504,7 @@ IO_Read32(uint32_t addr)
 			int i;
 			value = 0;
 			for (i = 0; i < 4; i++) {
-				tmph = IOH_Find(addr + i);
+				tmph = i ? IOH_FindNext(addr, i) : h;
 				if (tmph && tmph->readproc) {
 					value |=
 					    tmph->readproc(tmph->clientData, addr + i,
@@ -1249,7 +1541,7 @@ IO_Read16(uint32_t addr)
 	} else if (h->len == 1) {
 		if (h->flags & IOH_FLG_OSZR_NEXT) {
 			value = h->readproc(h->clientData, addr, 1);
-			h = IOH_Find(addr + 1);
+			h = IOH_FindNext(addr, 1);
 			if (h && h->readproc) {
 				value = value | h->readproc(h->clientData, addr + 1, 1) << 8;
 				if (h->swap_endian) {
@@ -1319,7 +1611,7 @@ IO_Read8(uint32_t addr)
 	return value;
 }
 
-static struct Bus mainBus = {
+static __MACHINE_LOCAL__ struct Bus mainBus = {
 	.read32 = Bus_Read32,
 	.read16 = Bus_Read16,
 	.read8 = Bus_Read8,
@@ -1385,6 +1677,18 @@ Bus_GetMinBlockSize(void)
 	return twoLevelMMap.scnd_lvl_blocksize;
 }
 
+/*
+ * ----------------------------------------------------------------
+ * Register the proc which is told about writes of other bus
+ * masters to host memory, for example to drop translated code.
+ * ----------------------------------------------------------------
+ */
+void
+Bus_SetHostWriteProc(Bus_HostWriteProc * proc)
+{
+	Bus_HostWriteHook = proc;
+}
+
 void
 Bus_Init(InvalidateCallback * invalidate, uint32_t min_memblocksize)
 {
@@ -1419,6 +1723,8 @@ Bus_Init(InvalidateCallback * invalidate, uint32_t min_memblocksize)
 
 	iohandlerMap = sg_calloc(sizeof(IOHandler *) * IOH_MAP_ENTRIES);
 	iohandlerFlvlMap = sg_calloc(sizeof(IOHandler **) * IOH_FLVL_SZ);
+	ioh_flvl_use_count = sg_calloc(sizeof(unsigned int) * IOH_FLVL_SZ);
+	ioPageMap = sg_calloc(sizeof(uintptr_t) * IOPAGE_ENTRIES);
 	MainBus = &mainBus;
 	Loader_RegisterBus("bus", load_to_bus, NULL);
 	fprintf(stderr, "MemMap and IO-Handler Hash initialized\n");
@@ -23,7 +23,7 @@
 #define PG_FLAG_MASK (1)
 
 /* The one level map */
-extern uint8_t **mem_map_read, **mem_map_write;
+extern __MACHINE_LOCAL__ uint8_t **mem_map_read, **mem_map_write;
 
 #define IOH_FLG_BIG_ENDIAN	(1)
 #define IOH_FLG_LITTLE_ENDIAN	(2)
@@ -72,6 +72,17 @@ extern uint8_t **mem_map_read, **mem_map_write;
 #define IOH_SLVL_BLOCKMASK	(0x1ff)
 #define IOH_SLVL_BLOCKSIZE      (0x200)
 
+/*
+ * ------------------------------------------
+ * Flat 4k page dispatch map for IO-Handlers
+ * ------------------------------------------
+ */
+#define IOPAGE_SHIFT		(12)
+#define IOPAGE_SIZE		(1 << IOPAGE_SHIFT)
+#define IOPAGE_MASK		(IOPAGE_SIZE - 1)
+#define IOPAGE_ENTRIES		(1 << (32 - IOPAGE_SHIFT))
+#define IOPAGE_UNIFORM		(1)
+
 /*
  * ---------------------------
  * One level 32kB blocks 
@@ -106,7 +117,7 @@ typedef struct TwoLevelMMap {
 	uint32_t *flvl_map_write_use_count;
 } TwoLevelMMap;
 
-extern TwoLevelMMap twoLevelMMap;
+extern __MACHINE_LOCAL__ TwoLevelMMap twoLevelMMap;
 
 typedef uint32_t IOReadProc(void *clientData, uint32_t address, int rqlen);
 typedef void IOWriteProc(void *clientData, uint32_t value, uint32_t address, int rqlen);
@@ -120,7 +131,7 @@ typedef struct IOHandler {
 	uint8_t len;
 	uint32_t flags;
 } IOHandler;
-extern IOHandler **iohandlerHash;
+extern __MACHINE_LOCAL__ IOHandler **iohandlerHash;
 
 void IOH_New8f(uint32_t cpu_addr, IOReadProc * readproc, IOWriteProc * writeproc, void *clientData,
 	       uint32_t flags);
@@ -225,7 +236,7 @@ typedef struct Bus {
 	void (*writeblock) (uint32_t addr, uint8_t * buf, uint32_t count);
 } Bus;
 
-extern Bus *MainBus;
+extern __MACHINE_LOCAL__ Bus *MainBus;
 /*
  * -------------------------------------------------------------------------------
  * Called by the System Emulator to emulate its Memory Mapping through Chipselect 
@@ -406,6 +417,8 @@ void Bus_Write64(uint64_t value, uint32_t addr);
 void Bus_Write32(uint32_t value, uint32_t addr);
 void Bus_Write16(uint16_t value, uint32_t addr);
 void Bus_Write8(uint8_t value, uint32_t addr);
+uint8_t *Bus_GetHVASpanRead(uint32_t addr, uint32_t * span);
+uint8_t *Bus_GetHVASpanWrite(uint32_t addr, uint32_t * span);
 void Bus_Write(uint32_t addr, uint8_t * buf, uint32_t count);
 void Bus_Read(uint8_t * buf, uint32_t addr, uint32_t count);
 void Bus_WriteSwap32(uint32_t addr, uint8_t * buf, int count);
@@ -413,6 +426,22 @@ void Bus_ReadSwap32(uint8_t * buf, uint32_t addr, int count);
 
 typedef void InvalidateCallback(void);
 void Bus_Init(InvalidateCallback *, uint32_t min_blocksize);
+
+/*
+ * Called when a bus master other than the CPU wrote count bytes of
+ * host memory at hva, the bus address of hva is addr.
+ */
+typedef void Bus_HostWriteProc(uint8_t * hva, uint32_t addr, uint32_t count);
+extern __MACHINE_LOCAL__ Bus_HostWriteProc *Bus_HostWriteHook;
+void Bus_SetHostWriteProc(Bus_HostWriteProc * proc);
+
+static inline void
+Bus_HostWritten(uint8_t * hva, uint32_t addr, uint32_t count)
+{
+	if (unlikely(Bus_HostWriteHook)) {
+		Bus_HostWriteHook(hva, addr, count);
+	}
+}
 uint32_t Bus_GetMinBlockSize(void);
 int Mem_Load(char *filename, uint32_t addr);
 void Mem_TracePage(uint32_t pgaddr);
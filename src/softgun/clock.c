@@ -44,10 +44,10 @@
 #include "sgstring.h"
 //#include "interpreter.h"
 
-static Clock_t *systemMasterClock = NULL;
-static uint64_t systemMasterClock_Version = 1;
-static SHashTable clock_hash;
-ClockTrace_t *systemMasterClockTrace = NULL;
+static __MACHINE_LOCAL__ Clock_t *systemMasterClock = NULL;
+static __MACHINE_LOCAL__ uint64_t systemMasterClock_Version = 1;
+static __MACHINE_LOCAL__ SHashTable clock_hash;
+__MACHINE_LOCAL__ ClockTrace_t *systemMasterClockTrace = NULL;
 
 /**
  *****************************************************************
@@ -24,6 +24,38 @@
 #  define __NORETURN__
 #  define __attribute__(...)
 #endif
+
+/*
+ * ----------------------------------------------------------------
+ * The singletons of an emulated machine (CPU, bus maps, cycle
+ * timers, signal and clock registries) are marked __MACHINE_LOCAL__.
+ * Every machine is created and run by its own thread. With
+ * LEIGUN_MACHINE_LOCAL they are thread local, so several machines
+ * can share one process. The AsyncManager runs the callbacks of
+ * the devices on the thread of their machine.
+ * ----------------------------------------------------------------
+ */
+#if defined(LEIGUN_MACHINE_LOCAL) && defined(__GNUC__)
+#  define __MACHINE_LOCAL__ __thread
+#elif defined(LEIGUN_MACHINE_LOCAL) && defined(_MSC_VER)
+#  define __MACHINE_LOCAL__ __declspec(thread)
+#else
+#  define __MACHINE_LOCAL__
+#endif
+
+/*
+ * ----------------------------------------------------------------
+ * The threaded dispatch loops (LEIGUN_THREADED_DISPATCH) repeat
+ * the loop body for every dispatch slot. The compiler stops
+ * inlining in such large functions, so the helpers of the loop
+ * body are marked __DISPATCH_INLINE__.
+ * ----------------------------------------------------------------
+ */
+#if defined(LEIGUN_THREADED_DISPATCH) && defined(__GNUC__)
+#  define __DISPATCH_INLINE__ inline __attribute__((always_inline))
+#else
+#  define __DISPATCH_INLINE__ inline
+#endif
 #define clz32	__builtin_clz
 #define clz64	__builtin_clzll
 
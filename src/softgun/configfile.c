@@ -42,6 +42,7 @@
 #include <ctype.h>
 #include "configfile.h"
 #include "sgstring.h"
+#include "compiler_extensions.h"
 
 #if 0
 #define dbgprintf(...) { fprintf(stderr,__VA_ARGS__); }
@@ -66,6 +67,8 @@ typedef struct Configuration {
 } Configuration;
 
 static Configuration config;
+/* Index of the machine instance reading the config, -1 without instances */
+static __MACHINE_LOCAL__ int config_instance = -1;
 
 #define STATE_INSPACE (1)
 #define STATE_ESCAPE  (2)
@@ -118,10 +121,9 @@ split_args(char *script, char *argv[])
 	return argc;
 }
 
-char *
-Config_ReadVar(const char *section, const char *name)
+static char *
+find_var(Configuration * cfg, const char *section, const char *name)
 {
-	Configuration *cfg = &config;
 	ConfigVar *var;
 	for (var = cfg->firstVar; var; var = var->next) {
 		if (!strcmp(var->section, section) && !strcmp(var->name, name)) {
@@ -131,6 +133,42 @@ Config_ReadVar(const char *section, const char *name)
 	return NULL;
 }
 
+/*
+ * -------------------------------------------------------------------
+ * A variable in the section "<section>@<instance>" overrides the
+ * one in "<section>" for the machine instance set with
+ * Config_SetInstance, so parallel machines can get their own ports,
+ * images and network devices from one config file.
+ * -------------------------------------------------------------------
+ */
+char *
+Config_ReadVar(const char *section, const char *name)
+{
+	Configuration *cfg = &config;
+	char *value;
+	if (config_instance >= 0) {
+		char isection[MAX_LINELEN + 16];
+		snprintf(isection, sizeof(isection), "%s@%d", section, config_instance);
+		if ((value = find_var(cfg, isection, name))) {
+			return value;
+		}
+	}
+	return find_var(cfg, section, name);
+}
+
+void
+Config_SetInstance(unsigned int instance)
+{
+	config_instance = instance;
+}
+
+/* The instance of the calling machine, 0 if there are no instances */
+unsigned int
+Config_GetInstance(void)
+{
+	return config_instance >= 0 ? config_instance : 0;
+}
+
 bool
 Config_StrStrVar(const char *section, const char *name, const char *teststr)
 {
@@ -11,3 +11,6 @@ int Config_ReadUInt64(uint64_t * retval, const char *section, const char *name);
 int Config_ReadFloat32(float *result, const char *section, const char *name);
 /* Read a space or comma separated list */
 int Config_ReadList(const char *section, const char *name, char **argvp[]);
+/* Select the "<section>@<instance>" overrides for the calling machine */
+void Config_SetInstance(unsigned int instance);
+unsigned int Config_GetInstance(void);
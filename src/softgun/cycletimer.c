@@ -41,44 +41,147 @@
 
 #include <cycletimer.h>
 #include "clock.h"
-#include <xy_tree.h>
+#include "sgstring.h"
+#include <stdio.h>
 
 /*
  * ----------------------------------------------
- * We only have one global Cycle timer Tree
+ * We only have one global Cycle timer queue
  * If we emulate more than one CPU they should 
  * have the same frequency 
  * ----------------------------------------------
  */
 
-CycleTimer *firstCycleTimer = 0;
-xy_node *firstCycleTimerNode = 0;
-XY_Tree CycleTimerTree;
-uint64_t firstCycleTimerTimeout = ~(uint64_t) 0;
-uint64_t CycleCounter = 0;
-uint32_t CycleTimerRate;
-static Clock_t *ct_CpuClk;
+__MACHINE_LOCAL__ CycleTimer *firstCycleTimer = 0;
+__MACHINE_LOCAL__ uint64_t firstCycleTimerTimeout = ~(uint64_t) 0;
+__MACHINE_LOCAL__ uint64_t CycleCounter = 0;
+__MACHINE_LOCAL__ uint32_t CycleTimerRate;
+static __MACHINE_LOCAL__ Clock_t *ct_CpuClk;
+
+/*
+ * ---------------------------------------------------------------
+ * The active timers are kept in an implicit 4-ary min heap.
+ * Compared to a binary heap it halves the depth and keeps the
+ * four children of a node in one cache line. Timers with the same
+ * timeout expire in the order they were added.
+ * ---------------------------------------------------------------
+ */
+#define HEAP_ARITY	(4)
+#define HEAP_PARENT(i)	(((i) - 1) / HEAP_ARITY)
+#define HEAP_CHILD(i)	((i) * HEAP_ARITY + 1)
+
+static __MACHINE_LOCAL__ CycleTimer **ctHeap;
+static __MACHINE_LOCAL__ uint32_t ctHeapSize;
+static __MACHINE_LOCAL__ uint32_t ctHeapAlloc;
+static __MACHINE_LOCAL__ uint64_t ctSeq;
+static __MACHINE_LOCAL__ CycleTimer **ctRegistry;
+static __MACHINE_LOCAL__ uint32_t ctRegistrySize;
+static __MACHINE_LOCAL__ uint32_t ctRegistryAlloc;
+
+/*
+ * ---------------------------------------------------------------
+ * The end of the instruction batch the CPU currently executes.
+ * A timer which is added with an earlier timeout calls the
+ * horizon proc of the CPU to cut the batch short.
+ * ---------------------------------------------------------------
+ */
+static __MACHINE_LOCAL__ uint64_t ctHorizon = ~(uint64_t) 0;
+static __MACHINE_LOCAL__ CycleTimer_Proc *ctHorizonProc;
+static __MACHINE_LOCAL__ void *ctHorizonData;
 
 /*
  * -----------------------------------------------
- * returns true if time1 is later then time2
+ * returns true if timer t1 expires before t2
  * -----------------------------------------------
  */
-static int
-is_later(const void *t1, const void *t2)
+static inline int
+is_earlier(const CycleTimer * t1, const CycleTimer * t2)
+{
+	if (t1->timeout != t2->timeout) {
+		return t1->timeout < t2->timeout;
+	}
+	return t1->seq < t2->seq;
+}
+
+static inline void
+heap_set(uint32_t index, CycleTimer * timer)
+{
+	ctHeap[index] = timer;
+	timer->heap_index = index;
+}
+
+static void
+sift_up(uint32_t index, CycleTimer * timer)
+{
+	while (index > 0) {
+		uint32_t parent = HEAP_PARENT(index);
+		if (!is_earlier(timer, ctHeap[parent])) {
+			break;
+		}
+		heap_set(index, ctHeap[parent]);
+		index = parent;
+	}
+	heap_set(index, timer);
+}
+
+static void
+sift_down(uint32_t index, CycleTimer * timer)
 {
-	uint64_t *time1 = (uint64_t *) t1;
-	uint64_t *time2 = (uint64_t *) t2;
-	if (*time2 < *time1) {
-		return 1;
+	while (1) {
+		uint32_t child = HEAP_CHILD(index);
+		uint32_t last = child + HEAP_ARITY;
+		uint32_t min;
+		uint32_t i;
+		if (child >= ctHeapSize) {
+			break;
+		}
+		if (last > ctHeapSize) {
+			last = ctHeapSize;
+		}
+		min = child;
+		for (i = child + 1; i < last; i++) {
+			if (is_earlier(ctHeap[i], ctHeap[min])) {
+				min = i;
+			}
+		}
+		if (!is_earlier(ctHeap[min], timer)) {
+			break;
+		}
+		heap_set(index, ctHeap[min]);
+		index = min;
+	}
+	heap_set(index, timer);
+}
+
+static inline void
+update_first(void)
+{
+	if (ctHeapSize) {
+		firstCycleTimer = ctHeap[0];
+		firstCycleTimerTimeout = firstCycleTimer->timeout;
 	} else {
-		return 0;
+		firstCycleTimer = NULL;
+		firstCycleTimerTimeout = ~(uint64_t) 0;
+	}
+}
+
+static void
+heap_remove(CycleTimer * timer)
+{
+	uint32_t index = timer->heap_index;
+	CycleTimer *last = ctHeap[--ctHeapSize];
+	if (last != timer) {
+		if ((index > 0) && is_earlier(last, ctHeap[HEAP_PARENT(index)])) {
+			sift_up(index, last);
+		} else {
+			sift_down(index, last);
+		}
 	}
 }
 
 /*
  * ----------------------------------------------------------
- * Remove Timer from linked list
+ * Remove Timer from the queue
  * ----------------------------------------------------------
  */
 
@@ -87,23 +190,65 @@ CycleTimer_Remove(CycleTimer * timer)
 {
 	if (unlikely(!timer->isactive))
 		return;
-	XY_DeleteTreeNode(&CycleTimerTree, &timer->node);
+	heap_remove(timer);
 	timer->isactive = 0;
-	if (timer == XY_NodeValue(firstCycleTimerNode)) {
-		CycleTimer *timer;
-		firstCycleTimerNode = XY_NextTreeNode(&CycleTimerTree, firstCycleTimerNode);
-		if (firstCycleTimerNode) {
-			timer = XY_NodeValue(firstCycleTimerNode);
-			firstCycleTimerTimeout = timer->timeout;
-		} else {
-			firstCycleTimerTimeout = ~(uint64_t) 0;
-		}
+	if (timer == firstCycleTimer) {
+		update_first();
 	}
 }
 
+/*
+ * ----------------------------------------------------------------
+ * The registry of all timers in the order of their first
+ * CycleTimer_Init or CycleTimer_Add. A snapshot identifies a
+ * timer by its first proc and its position among the timers with
+ * the same proc. A device which is freed has to unregister its
+ * timers with CycleTimer_Unregister.
+ * ----------------------------------------------------------------
+ */
+void
+CycleTimer_Register(CycleTimer * timer)
+{
+	if (timer->reg_index && (timer->reg_index <= ctRegistrySize)
+	    && (ctRegistry[timer->reg_index - 1] == timer)) {
+		return;
+	}
+	if (ctRegistrySize == ctRegistryAlloc) {
+		ctRegistryAlloc = ctRegistryAlloc ? 2 * ctRegistryAlloc : 64;
+		ctRegistry = sg_realloc(ctRegistry, ctRegistryAlloc * sizeof(CycleTimer *));
+	}
+	ctRegistry[ctRegistrySize++] = timer;
+	timer->reg_index = ctRegistrySize;
+	timer->reg_proc = timer->proc;
+}
+
+void
+CycleTimer_Unregister(CycleTimer * timer)
+{
+	uint32_t i;
+	CycleTimer_Remove(timer);
+	if (!timer->reg_index || (timer->reg_index > ctRegistrySize)
+	    || (ctRegistry[timer->reg_index - 1] != timer)) {
+		return;
+	}
+	for (i = timer->reg_index; i < ctRegistrySize; i++) {
+		ctRegistry[i - 1] = ctRegistry[i];
+		ctRegistry[i - 1]->reg_index = i;
+	}
+	ctRegistrySize--;
+	timer->reg_index = 0;
+}
+
+uint32_t
+CycleTimers_GetRegistry(CycleTimer *** registry)
+{
+	*registry = ctRegistry;
+	return ctRegistrySize;
+}
+
 /*
  ***************************************************
- * Insert timer into the tree
+ * Insert timer into the queue
  ***************************************************
  */
 
@@ -116,18 +261,74 @@ CycleTimer_Add(CycleTimer * timer, uint64_t cycles, CycleTimer_Proc * proc, void
 	timer->proc = proc;
 	timer->isactive = 1;
 	timer->clientData = clientData;
+	if (unlikely(!timer->reg_index)) {
+		CycleTimer_Register(timer);
+	}
 	timer->timeout = CycleCounter + cycles;
-	XY_AddTreeNode(&CycleTimerTree, &timer->node, &timer->timeout, timer);
-	if (firstCycleTimerNode) {
-		CycleTimer *first_timer = XY_NodeValue(firstCycleTimerNode);
-		if (timer->timeout < first_timer->timeout) {
-			firstCycleTimerNode = &timer->node;
-			firstCycleTimerTimeout = timer->timeout;
-		}
-	} else {
-		firstCycleTimerNode = &timer->node;
+	timer->seq = ctSeq++;
+	if (unlikely(ctHeapSize == ctHeapAlloc)) {
+		ctHeapAlloc = ctHeapAlloc ? 2 * ctHeapAlloc : 64;
+		ctHeap = sg_realloc(ctHeap, ctHeapAlloc * sizeof(CycleTimer *));
+	}
+	sift_up(ctHeapSize++, timer);
+	if (ctHeap[0] == timer) {
+		firstCycleTimer = timer;
 		firstCycleTimerTimeout = timer->timeout;
+		if (unlikely(timer->timeout < ctHorizon)) {
+			ctHorizon = timer->timeout;
+			if (ctHorizonProc) {
+				ctHorizonProc(ctHorizonData);
+			}
+		}
+	}
+}
+
+/*
+ * --------------------------------------------------------------
+ * Called by CycleTimers_Check() when the first timer is due.
+ * Only one timer is fired per call.
+ * --------------------------------------------------------------
+ */
+void
+CycleTimers_Expire(void)
+{
+	CycleTimer *timer = firstCycleTimer;
+	CycleTimer_Proc *proc;
+	if (unlikely(!timer)) {
+		fprintf(stderr, "Bug in timer queue\n");
+		return;
+	}
+	heap_remove(timer);
+	update_first();
+	proc = timer->proc;
+	timer->isactive = 0;
+	if (likely(proc))
+		proc(timer->clientData);
+}
+
+/*
+ * --------------------------------------------------------------------
+ * Start a new instruction batch. The batch ends at the event horizon:
+ * the first timer timeout or limit cycles from now, whatever comes
+ * first. Returns the number of cycles in the batch, which is zero
+ * or negative when a timer is already due.
+ * --------------------------------------------------------------------
+ */
+int64_t
+CycleTimers_Horizon(uint64_t limit)
+{
+	ctHorizon = CycleCounter + limit;
+	if (firstCycleTimerTimeout < ctHorizon) {
+		ctHorizon = firstCycleTimerTimeout;
 	}
+	return (int64_t) (ctHorizon - CycleCounter);
+}
+
+void
+CycleTimers_SetHorizonProc(CycleTimer_Proc * proc, void *clientData)
+{
+	ctHorizonProc = proc;
+	ctHorizonData = clientData;
 }
 
 /*
@@ -147,7 +348,6 @@ CycleTimers_Init(const char *cpu_name, uint32_t freq_hz)
 	CycleTimerRate = freq_hz;
 	ct_CpuClk = Clock_New("%s.clk", cpu_name);
 	Clock_SetFreq(ct_CpuClk, freq_hz);
-	XY_InitTree(&CycleTimerTree, is_later, NULL, NULL, NULL);
 	Clock_Trace(ct_CpuClk, CpuClock_Trace, NULL);
 	Clock_MakeSystemMaster(ct_CpuClk);
 }
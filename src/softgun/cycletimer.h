@@ -17,7 +17,6 @@
 #define CYCLETIMER_H
 #include <stdint.h>
 #include <stdlib.h>
-#include <xy_tree.h>
 #include <compiler_extensions.h>
 
 typedef void CycleTimer_Proc(void *clientData);
@@ -25,26 +24,29 @@ typedef uint64_t CycleCounter_t;
 
 // All fields of CycleTimer are private !
 typedef struct CycleTimer {
-	xy_node node;
 	uint64_t timeout;	// absolute cycles of timeout
+	uint64_t seq;		// insertion order for timers with the same timeout
+	uint32_t heap_index;
 	CycleTimer_Proc *proc;
 	void *clientData;
 	int isactive;
+	uint32_t reg_index;	// position in the registry + 1, 0 if not registered
+	CycleTimer_Proc *reg_proc;	// proc at registration, identifies the timer
 } CycleTimer;
 
 /*
  * ----------------------------------------------
- * We only have one global Cycle timer Tree
- * If we emulate more than one CPU they should be
- * in sync
+ * Every machine has one Cycle timer queue.
+ * If we emulate more than one CPU in a machine
+ * they should be in sync
  * ----------------------------------------------
  */
-extern CycleTimer *firstCycleTimer;
-extern xy_node *firstCycleTimerNode;
-extern XY_Tree CycleTimerTree;
-extern uint64_t firstCycleTimerTimeout;
-extern uint64_t CycleCounter;
-extern uint32_t CycleTimerRate;
+extern __MACHINE_LOCAL__ CycleTimer *firstCycleTimer;
+extern __MACHINE_LOCAL__ uint64_t firstCycleTimerTimeout;
+extern __MACHINE_LOCAL__ uint64_t CycleCounter;
+extern __MACHINE_LOCAL__ uint32_t CycleTimerRate;
+
+void CycleTimers_Expire(void);
 
 /*
  * -------------------------------------------------
@@ -53,31 +55,11 @@ extern uint32_t CycleTimerRate;
  * -------------------------------------------------
  */
 
-static inline void
+static __DISPATCH_INLINE__ void
 CycleTimers_Check()
 {
 	if (unlikely(CycleCounter >= firstCycleTimerTimeout)) {
-		xy_node *node = firstCycleTimerNode;
-		if (node) {
-			CycleTimer *timer = (CycleTimer *) XY_NodeValue(node);
-			CycleTimer_Proc *proc;
-			firstCycleTimerNode = XY_NextTreeNode(&CycleTimerTree, firstCycleTimerNode);
-			if (firstCycleTimerNode) {
-				CycleTimer *next =
-				    (CycleTimer *) XY_NodeValue(firstCycleTimerNode);
-				firstCycleTimerTimeout = next->timeout;
-			} else {
-				// Never
-				firstCycleTimerTimeout = ~0ULL;
-			}
-			XY_DeleteTreeNode(&CycleTimerTree, node);
-			proc = timer->proc;
-			timer->isactive = 0;
-			if (likely(proc))
-				proc(timer->clientData);
-		} else {
-			fprintf(stderr, "Bug in timertree\n");
-		}
+		CycleTimers_Expire();
 	}
 }
 
@@ -133,12 +115,17 @@ NanosecondsToCycles(int64_t nsec)
 	return (nsec * (int64_t) (CycleTimerRate / 1000)) / 1000000;
 }
 
+void CycleTimer_Register(CycleTimer * timer);
+void CycleTimer_Unregister(CycleTimer * timer);
+uint32_t CycleTimers_GetRegistry(CycleTimer *** registry);
+
 static inline void
 CycleTimer_Init(CycleTimer * timer, CycleTimer_Proc * proc, void *clientData)
 {
 	timer->isactive = 0;
 	timer->proc = proc;
 	timer->clientData = clientData;
+	CycleTimer_Register(timer);
 }
 
 void
@@ -172,4 +159,16 @@ CycleTimer_GetRemaining(CycleTimer * timer)
 
 void CycleTimers_Init(const char *cpu_name, uint32_t cpu_clock);
 
+/*
+ * -----------------------------------------------------------------
+ * Event horizon for the CPU main loops: Instead of checking the
+ * timers after every instruction the CPU runs a batch of
+ * CycleTimers_Horizon() cycles and only then calls
+ * CycleTimers_Check(). The horizon proc is called when a timer
+ * expiring inside the running batch is added.
+ * -----------------------------------------------------------------
+ */
+int64_t CycleTimers_Horizon(uint64_t limit);
+void CycleTimers_SetHorizonProc(CycleTimer_Proc * proc, void *clientData);
+
 #endif
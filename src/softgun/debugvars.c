@@ -48,7 +48,7 @@ typedef struct DebugVarTable {
 	SHashTable varHash;
 } DebugVarTable;
 
-static DebugVarTable debugVarTable;
+static __MACHINE_LOCAL__ DebugVarTable debugVarTable;
 
 typedef struct DebugVar {
 	SHashEntry *hashEntry;
@@ -59,7 +59,11 @@
 #include <sys/stat.h>
 #include <sys/types.h>
 
+#include <uv.h>
 #include "sgstring.h"
+#include "cycletimer.h"
+#include "exithandler.h"
+#include "configfile.h"
 
 #ifndef O_LARGEFILE
  /* O_LARGEFILE is not defined or needed on FreeBSD,
@@ -67,6 +71,51 @@
 #define O_LARGEFILE 0
 #endif
 
+/*
+ * ------------------------------------------------------------------------
+ * DI_ASYNC images have an IO thread which works off a queue of
+ * requests in order. Sequential reads are served from two readahead
+ * windows, one is read by the emulator while the other one is
+ * filled. Writes return immediately and contiguous writes are
+ * coalesced into one request as long as the IO thread did not
+ * take it. A failed write-behind is reported by the next write.
+ * The async API queues reads and writes with a completion proc.
+ * ------------------------------------------------------------------------
+ */
+#define DI_RA_WINDOW	(256 * 1024)
+#define DI_WB_MAXCOUNT	(256 * 1024)
+#define DI_WB_MAXREQS	(64)
+#define DI_POLL_USEC	(20)
+
+#define DIREQ_READ	(0)
+#define DIREQ_WRITE	(1)
+#define DIREQ_FILL	(2)
+
+#define WIN_EMPTY	(0)
+#define WIN_FILLING	(1)
+#define WIN_VALID	(2)
+
+typedef struct DIWindow {
+	uint8_t *buf;
+	off_t ofs;
+	int len;
+	int state;
+	int stale;		/* Written while filling */
+} DIWindow;
+
+typedef struct DIRequest {
+	struct DIRequest *next;
+	int type;
+	off_t ofs;
+	int count;
+	int alloc;
+	uint8_t *data;		/* Caller buffer for reads, a copy for writes */
+	DIWindow *win;
+	DiskImage_DoneProc *proc;
+	void *clientData;
+	int result;
+} DIRequest;
+
 struct DiskImage {
 	int fd;
 	int flags;
@@ -76,6 +125,31 @@ struct DiskImage {
 #else
 	HANDLE hHandle;
 #endif
+	uv_thread_t io_thread;
+	uv_mutex_t mutex;
+	uv_mutex_t ovl_mutex;	/* Serializes the overlay IO of both threads */
+	uv_cond_t req_cond;
+	uv_cond_t done_cond;
+	DIRequest *req_head;
+	DIRequest *req_tail;
+	DIRequest *busy;
+	DIRequest *done_head;
+	DIRequest *done_tail;
+	int nr_writes;
+	int write_error;	/* A write-behind failed */
+	int terminate;
+	DIWindow win[2];
+	off_t seq_end;
+	/* Completion of the async API, only used by the emulator thread */
+	CycleTimer doneTimer;
+	int timerInitialized;
+	int nr_pending;
+	/* Copy-on-write overlay, fd is the delta */
+	int base_fd;
+	uint8_t *ovl_index;
+	off_t ovl_data;
+	uint8_t emptyval;
+	int ovl_persistent;
 };
 
 /*
@@ -184,14 +258,699 @@ blockdev_get_size(DiskImage * di)
 	return 0;
 }
 
+static int
+file_pread(int fd, off_t ofs, uint8_t * buf, int count)
+{
+	int result;
+	int cnt;
+#ifndef __unix__
+	if (lseek(fd, ofs, SEEK_SET) != ofs) {
+		return -EINVAL;
+	}
+#endif
+	for (cnt = 0; cnt < count;) {
+#ifdef __unix__
+		result = pread(fd, buf + cnt, count - cnt, ofs + cnt);
+#else
+		result = read(fd, buf + cnt, count - cnt);
+#endif
+		if (result <= 0) {
+			if (cnt) {
+				return cnt;
+			} else {
+				return result;
+			}
+		}
+		cnt += result;
+	}
+	return cnt;
+}
+
+static int
+file_pwrite(int fd, off_t ofs, const uint8_t * buf, int count)
+{
+	int result;
+	int cnt;
+#ifndef __unix__
+	if (lseek(fd, ofs, SEEK_SET) != ofs) {
+		return -EINVAL;
+	}
+#endif
+	for (cnt = 0; cnt < count;) {
+#ifdef __unix__
+		result = pwrite(fd, buf + cnt, count - cnt, ofs + cnt);
+#else
+		result = write(fd, buf + cnt, count - cnt);
+#endif
+		if (result <= 0) {
+			if (cnt) {
+				return cnt;
+			} else {
+				return result;
+			}
+		}
+		cnt += result;
+	}
+	return cnt;
+}
+
+/*
+ * ------------------------------------------------------------------------
+ * Copy-on-write overlays
+ *	With the global variable "overlay" set, writable images are not
+ *	modified. The image is opened read only with a shared lock and
+ *	all writes go to a delta file, so any number of emulator
+ *	instances can share it. "overlay = discard" uses an unlinked
+ *	temporary delta which vanishes at exit, any other value is the
+ *	directory for persistent delta files. A delta is named
+ *	<image>-<hash of the full image path>.<instance>.delta, so
+ *	images with the same name and parallel instances do not share
+ *	one.
+ *
+ *	Delta file: A header block, one index byte per block telling
+ *	whether the block is in the delta, the blocks at their image
+ *	offset. The file is sparse, creating it costs nothing.
+ *	A missing or short base image reads as the fill value.
+ * ------------------------------------------------------------------------
+ */
+#define OVL_MAGIC	"LGOVL001"
+#define OVL_BLOCKSIZE	(4096)
+
+typedef struct OvlHeader {
+	char magic[8];
+	uint32_t blocksize;
+	uint32_t reserved;
+	uint64_t size;
+} OvlHeader;
+
+static int
+base_read(DiskImage * di, off_t ofs, uint8_t * buf, int count)
+{
+	int result = 0;
+	if (di->base_fd >= 0) {
+		result = file_pread(di->base_fd, ofs, buf, count);
+		if (result < 0) {
+			return result;
+		}
+	}
+	memset(buf + result, di->emptyval, count - result);
+	return count;
+}
+
+static int
+ovl_read(DiskImage * di, off_t ofs, uint8_t * buf, int count)
+{
+	uint64_t blk, last;
+	uint8_t indelta;
+	int len, result;
+	int cnt = 0;
+	if ((uint64_t) (ofs + count) > di->size) {
+		count = (uint64_t) ofs < di->size ? di->size - ofs : 0;
+	}
+	while (cnt < count) {
+		blk = (ofs + cnt) / OVL_BLOCKSIZE;
+		indelta = di->ovl_index[blk];
+		last = (ofs + count - 1) / OVL_BLOCKSIZE;
+		while ((blk < last) && (di->ovl_index[blk + 1] == indelta)) {
+			blk++;
+		}
+		len = (blk + 1) * OVL_BLOCKSIZE - (ofs + cnt);
+		if (len > count - cnt) {
+			len = count - cnt;
+		}
+		if (indelta) {
+			result = file_pread(di->fd, di->ovl_data + ofs + cnt, buf + cnt, len);
+		} else {
+			result = base_read(di, ofs + cnt, buf + cnt, len);
+		}
+		if (result < len) {
+			return cnt ? cnt : result;
+		}
+		cnt += len;
+	}
+	return cnt;
+}
+
+static int
+ovl_write(DiskImage * di, off_t ofs, const uint8_t * buf, int count)
+{
+	uint8_t block[OVL_BLOCKSIZE];
+	uint64_t blk;
+	off_t bofs, end;
+	int len, blen, result;
+	int cnt = 0;
+	if ((uint64_t) (ofs + count) > di->size) {
+		count = (uint64_t) ofs < di->size ? di->size - ofs : 0;
+	}
+	while (cnt < count) {
+		blk = (ofs + cnt) / OVL_BLOCKSIZE;
+		bofs = blk * OVL_BLOCKSIZE;
+		end = bofs + OVL_BLOCKSIZE;
+		if ((uint64_t) end > di->size) {
+			end = di->size;
+		}
+		blen = end - bofs;
+		len = end - (ofs + cnt);
+		if (len > count - cnt) {
+			len = count - cnt;
+		}
+		if (!di->ovl_index[blk] && (len != blen)) {
+			/* Copy up the partially written block */
+			if (base_read(di, bofs, block, blen) < blen) {
+				return cnt ? cnt : -EIO;
+			}
+			memcpy(block + (ofs + cnt - bofs), buf + cnt, len);
+			result = file_pwrite(di->fd, di->ovl_data + bofs, block, blen);
+			len = result < blen ? -1 : len;
+		} else {
+			result = file_pwrite(di->fd, di->ovl_data + ofs + cnt, buf + cnt, len);
+			len = result < len ? -1 : len;
+		}
+		if (len < 0) {
+			return cnt ? cnt : -EIO;
+		}
+		if (!di->ovl_index[blk]) {
+			di->ovl_index[blk] = 1;
+			if (file_pwrite(di->fd, sizeof(OvlHeader) + blk, &di->ovl_index[blk], 1) != 1) {
+				fprintf(stderr, "DiskImage: Updating the overlay index failed\n");
+			}
+		}
+		cnt += len;
+	}
+	return cnt;
+}
+
+#ifdef __unix__
+static uint32_t
+path_hash(const char *s)
+{
+	uint32_t hash = 0;
+	while (*s) {
+		hash = *s + (hash << 6) + (hash << 16) - hash;
+		s++;
+	}
+	return hash;
+}
+
+static int
+overlay_open(DiskImage * di, const char *name, const char *overlay)
+{
+	OvlHeader hdr;
+	uint64_t nr_blocks = (di->size + OVL_BLOCKSIZE - 1) / OVL_BLOCKSIZE;
+	char *deltaname;
+	const char *base;
+	char *tmpdir;
+	char *path;
+	struct stat st;
+
+	di->emptyval = (di->flags & DI_CREAT_FF) ? 0xff : 0x00;
+	di->base_fd = open(name, O_RDONLY | O_LARGEFILE);
+	if (di->base_fd >= 0) {
+		if (flock(di->base_fd, LOCK_SH | LOCK_NB) < 0) {
+			fprintf(stderr, "Diskimage \"%s\" is locked for writing\n", name);
+			close(di->base_fd);
+			return -1;
+		}
+	} else if (!(di->flags & (DI_CREAT_FF | DI_CREAT_00))) {
+		fprintf(stderr, "Can't open image \"%s\" ", name);
+		perror("");
+		return -1;
+	}
+	if (strcmp(overlay, "discard") == 0) {
+		tmpdir = getenv("TMPDIR");
+		deltaname = alloca(strlen(tmpdir ? tmpdir : "/tmp") + 30);
+		sprintf(deltaname, "%s/leigun-delta-XXXXXX", tmpdir ? tmpdir : "/tmp");
+		di->fd = mkstemp(deltaname);
+		if (di->fd >= 0) {
+			unlink(deltaname);
+		}
+	} else {
+		base = strrchr(name, '/');
+		base = base ? base + 1 : name;
+		path = realpath(name, NULL);
+		deltaname = alloca(strlen(overlay) + strlen(base) + 40);
+		sprintf(deltaname, "%s/%s-%08x.%u.delta", overlay, base,
+			path_hash(path ? path : name), Config_GetInstance());
+		free(path);
+		di->fd = open(deltaname, O_RDWR | O_CREAT | O_LARGEFILE, 0644);
+	}
+	if (di->fd < 0) {
+		fprintf(stderr, "Can't open overlay for \"%s\" ", name);
+		perror("");
+		goto fail;
+	}
+	if (flock(di->fd, LOCK_EX | LOCK_NB) < 0) {
+		fprintf(stderr, "Can't get lock for overlay \"%s\"\n", deltaname);
+		goto fail;
+	}
+	di->ovl_index = sg_calloc(nr_blocks);
+	di->ovl_data = (sizeof(OvlHeader) + nr_blocks + OVL_BLOCKSIZE - 1) & ~(OVL_BLOCKSIZE - 1);
+	if ((fstat(di->fd, &st) == 0) && (st.st_size > 0)) {
+		if ((file_pread(di->fd, 0, (uint8_t *) & hdr, sizeof(hdr)) != sizeof(hdr))
+		    || memcmp(hdr.magic, OVL_MAGIC, 8) || (hdr.blocksize != OVL_BLOCKSIZE)
+		    || (hdr.size != di->size)) {
+			fprintf(stderr, "Overlay \"%s\" does not match image \"%s\"\n", deltaname,
+				name);
+			goto fail;
+		}
+		if (file_pread(di->fd, sizeof(OvlHeader), di->ovl_index, nr_blocks) != (int)nr_blocks) {
+			fprintf(stderr, "Can't read the index of overlay \"%s\"\n", deltaname);
+			goto fail;
+		}
+	} else {
+		memset(&hdr, 0, sizeof(hdr));
+		memcpy(hdr.magic, OVL_MAGIC, 8);
+		hdr.blocksize = OVL_BLOCKSIZE;
+		hdr.size = di->size;
+		if ((file_pwrite(di->fd, 0, (uint8_t *) & hdr, sizeof(hdr)) != sizeof(hdr))
+		    || (ftruncate(di->fd, di->ovl_data + di->size) < 0)) {
+			fprintf(stderr, "Can't create overlay \"%s\"\n", deltaname);
+			goto fail;
+		}
+	}
+	fprintf(stderr, "Diskimage \"%s\" with overlay \"%s\"\n", name,
+		strcmp(overlay, "discard") ? deltaname : "discard");
+	return 0;
+ fail:
+	if (di->fd >= 0) {
+		close(di->fd);
+	}
+	if (di->base_fd >= 0) {
+		close(di->base_fd);
+	}
+	sg_free(di->ovl_index);
+	return -1;
+}
+#endif
+
+/*
+ * ------------------------------------------------------------------------
+ * A mapped overlay image is a private copy of the base. The blocks
+ * which differ from the image are written to a persistent delta at
+ * exit.
+ * ------------------------------------------------------------------------
+ */
+static void
+overlay_sync_map(DiskImage * di)
+{
+	uint8_t block[OVL_BLOCKSIZE];
+	uint8_t *map = di->map;
+	uint64_t ofs;
+	int len;
+	for (ofs = 0; ofs < di->size; ofs += OVL_BLOCKSIZE) {
+		len = (di->size - ofs) < OVL_BLOCKSIZE ? (di->size - ofs) : OVL_BLOCKSIZE;
+		if ((ovl_read(di, ofs, block, len) == len) && !memcmp(block, map + ofs, len)) {
+			continue;
+		}
+		if (ovl_write(di, ofs, map + ofs, len) != len) {
+			fprintf(stderr, "DiskImage: Writing the overlay failed\n");
+			return;
+		}
+	}
+}
+
+/*
+ * ------------------------------------------------------------------------
+ * An overlay write updates the index and copies up whole blocks, so
+ * with an IO thread the overlay reads and writes are serialized.
+ * ------------------------------------------------------------------------
+ */
+static int
+di_pread(DiskImage * di, off_t ofs, uint8_t * buf, int count)
+{
+	int result;
+	if (!di->ovl_index) {
+		return file_pread(di->fd, ofs, buf, count);
+	} else if (!(di->flags & DI_ASYNC)) {
+		return ovl_read(di, ofs, buf, count);
+	}
+	uv_mutex_lock(&di->ovl_mutex);
+	result = ovl_read(di, ofs, buf, count);
+	uv_mutex_unlock(&di->ovl_mutex);
+	return result;
+}
+
+static int
+di_pwrite(DiskImage * di, off_t ofs, const uint8_t * buf, int count)
+{
+	int result;
+	if (!di->ovl_index) {
+		return file_pwrite(di->fd, ofs, buf, count);
+	} else if (!(di->flags & DI_ASYNC)) {
+		return ovl_write(di, ofs, buf, count);
+	}
+	uv_mutex_lock(&di->ovl_mutex);
+	result = ovl_write(di, ofs, buf, count);
+	uv_mutex_unlock(&di->ovl_mutex);
+	return result;
+}
+
+/*
+ * ------------------------------------------------------------------------
+ * Clip an access to a mapped image at the end of the image
+ * ------------------------------------------------------------------------
+ */
+static int
+map_clip(DiskImage * di, off_t ofs, int count)
+{
+	if ((ofs < 0) || ((uint64_t) ofs >= di->size)) {
+		return 0;
+	}
+	if ((uint64_t) (ofs + count) > di->size) {
+		return di->size - ofs;
+	}
+	return count;
+}
+
+static void
+io_thread(void *arg)
+{
+	DiskImage *di = arg;
+	DIRequest *req;
+	DIWindow *win;
+	uv_mutex_lock(&di->mutex);
+	while (1) {
+		while (!di->req_head && !di->terminate) {
+			uv_cond_wait(&di->req_cond, &di->mutex);
+		}
+		if (!di->req_head) {
+			break;
+		}
+		req = di->req_head;
+		di->req_head = req->next;
+		if (!di->req_head) {
+			di->req_tail = NULL;
+		}
+		req->next = NULL;
+		di->busy = req;
+		uv_mutex_unlock(&di->mutex);
+		if (req->type == DIREQ_WRITE) {
+			req->result = di_pwrite(di, req->ofs, req->data, req->count);
+		} else if (req->type == DIREQ_FILL) {
+			req->result = di_pread(di, req->ofs, req->win->buf, req->count);
+		} else {
+			req->result = di_pread(di, req->ofs, req->data, req->count);
+		}
+		uv_mutex_lock(&di->mutex);
+		di->busy = NULL;
+		if (req->type == DIREQ_FILL) {
+			win = req->win;
+			if (!win->stale && (req->result > 0)) {
+				win->len = req->result;
+				win->state = WIN_VALID;
+			} else {
+				win->state = WIN_EMPTY;
+			}
+			sg_free(req);
+		} else {
+			if (req->type == DIREQ_WRITE) {
+				di->nr_writes--;
+			}
+			if (req->proc) {
+				if (di->done_tail) {
+					di->done_tail->next = req;
+				} else {
+					di->done_head = req;
+				}
+				di->done_tail = req;
+			} else {
+				if (req->result < req->count) {
+					fprintf(stderr,
+						"DiskImage: Write-behind of %d bytes at %llu failed\n",
+						req->count, (unsigned long long)req->ofs);
+					di->write_error = 1;
+				}
+				sg_free(req->data);
+				sg_free(req);
+			}
+		}
+		uv_cond_broadcast(&di->done_cond);
+	}
+	uv_mutex_unlock(&di->mutex);
+}
+
+/*
+ * ------------------------------------------------------------------------
+ * Append a request to the queue of the IO thread. Called with the
+ * mutex locked.
+ * ------------------------------------------------------------------------
+ */
+static void
+queue_request(DiskImage * di, DIRequest * req)
+{
+	if (di->req_tail) {
+		di->req_tail->next = req;
+	} else {
+		di->req_head = req;
+	}
+	di->req_tail = req;
+	uv_cond_signal(&di->req_cond);
+}
+
+/*
+ * ------------------------------------------------------------------------
+ * Deliver the completions of the async API on the emulator thread.
+ * The timer polls as long as requests are pending.
+ * ------------------------------------------------------------------------
+ */
+static void
+deliver_done(void *clientData)
+{
+	DiskImage *di = clientData;
+	DIRequest *req, *list;
+	uv_mutex_lock(&di->mutex);
+	list = di->done_head;
+	di->done_head = di->done_tail = NULL;
+	uv_mutex_unlock(&di->mutex);
+	while ((req = list)) {
+		list = req->next;
+		di->nr_pending--;
+		req->proc(req->clientData, req->result);
+		if (req->type == DIREQ_WRITE) {
+			sg_free(req->data);
+		}
+		sg_free(req);
+	}
+	if (di->nr_pending && !CycleTimer_IsActive(&di->doneTimer)) {
+		CycleTimer_Mod(&di->doneTimer, MicrosecondsToCycles(DI_POLL_USEC));
+	}
+}
+
+static void
+start_done_timer(DiskImage * di)
+{
+	if (!di->timerInitialized) {
+		CycleTimer_Init(&di->doneTimer, deliver_done, di);
+		di->timerInitialized = 1;
+	}
+	di->nr_pending++;
+	if (!CycleTimer_IsActive(&di->doneTimer)) {
+		CycleTimer_Mod(&di->doneTimer, MicrosecondsToCycles(DI_POLL_USEC));
+	}
+}
+
+/*
+ * ------------------------------------------------------------------------
+ * A read continuing the previous one is sequential. When it passed
+ * half of its window, or missed the windows, the following window is
+ * queued for filling. Called with the mutex locked.
+ * ------------------------------------------------------------------------
+ */
+static void
+start_readahead(DiskImage * di, off_t ofs, int count, DIWindow * cur)
+{
+	DIRequest *req;
+	DIWindow *other;
+	off_t next;
+	int sequential = (ofs == di->seq_end);
+	di->seq_end = ofs + count;
+	if (!sequential) {
+		return;
+	}
+	if (cur) {
+		if ((ofs + count - cur->ofs) < (cur->len / 2)) {
+			return;
+		}
+		next = cur->ofs + cur->len;
+		other = (cur == &di->win[0]) ? &di->win[1] : &di->win[0];
+		if ((other->state != WIN_EMPTY) && (other->ofs == next)) {
+			return;
+		}
+	} else {
+		next = ofs + count;
+		other = (di->win[0].state != WIN_FILLING) ? &di->win[0] : &di->win[1];
+	}
+	if ((other->state == WIN_FILLING) || ((uint64_t) next >= di->size)) {
+		return;
+	}
+	if (!other->buf) {
+		other->buf = sg_calloc(DI_RA_WINDOW);
+	}
+	other->ofs = next;
+	other->len = (di->size - next) < DI_RA_WINDOW ? (di->size - next) : DI_RA_WINDOW;
+	other->state = WIN_FILLING;
+	other->stale = 0;
+	req = sg_new(DIRequest);
+	req->type = DIREQ_FILL;
+	req->ofs = next;
+	req->count = other->len;
+	req->win = other;
+	queue_request(di, req);
+}
+
+/*
+ * ------------------------------------------------------------------------
+ * Check if a queued or running write overlaps a range of the image.
+ * Called with the mutex locked.
+ * ------------------------------------------------------------------------
+ */
+static int
+write_pending(DiskImage * di, off_t ofs, int count)
+{
+	DIRequest *req = di->busy;
+	if (!di->nr_writes) {
+		return 0;
+	}
+	if (!req) {
+		req = di->req_head;
+	}
+	for (; req; req = (req == di->busy) ? di->req_head : req->next) {
+		if ((req->type == DIREQ_WRITE) && (req->ofs < ofs + count)
+		    && (ofs < req->ofs + req->count)) {
+			return 1;
+		}
+	}
+	return 0;
+}
+
+static int
+async_read(DiskImage * di, off_t ofs, uint8_t * buf, int count)
+{
+	DIWindow *win;
+	int i;
+	uv_mutex_lock(&di->mutex);
+ retry:
+	for (i = 0; i < 2; i++) {
+		win = &di->win[i];
+		if ((win->state == WIN_EMPTY) || (ofs < win->ofs)
+		    || (ofs + count > win->ofs + win->len)) {
+			continue;
+		}
+		if (win->state == WIN_FILLING) {
+			uv_cond_wait(&di->done_cond, &di->mutex);
+			goto retry;
+		}
+		memcpy(buf, win->buf + (ofs - win->ofs), count);
+		start_readahead(di, ofs, count, win);
+		uv_mutex_unlock(&di->mutex);
+		return count;
+	}
+	while (write_pending(di, ofs, count)) {
+		uv_cond_wait(&di->done_cond, &di->mutex);
+	}
+	start_readahead(di, ofs, count, NULL);
+	uv_mutex_unlock(&di->mutex);
+	return di_pread(di, ofs, buf, count);
+}
+
+static int
+async_write(DiskImage * di, off_t ofs, const uint8_t * buf, int count,
+	    DiskImage_DoneProc * proc, void *clientData)
+{
+	DIRequest *req;
+	DIWindow *win;
+	off_t start, end;
+	int i;
+	uv_mutex_lock(&di->mutex);
+	if (!proc && di->write_error) {
+		di->write_error = 0;
+		uv_mutex_unlock(&di->mutex);
+		return -1;
+	}
+	for (i = 0; i < 2; i++) {
+		win = &di->win[i];
+		start = ofs > win->ofs ? ofs : win->ofs;
+		end = (ofs + count) < (win->ofs + win->len) ? (ofs + count) : (win->ofs + win->len);
+		if ((win->state == WIN_EMPTY) || (start >= end)) {
+			continue;
+		}
+		if (win->state == WIN_FILLING) {
+			win->stale = 1;
+		} else {
+			memcpy(win->buf + (start - win->ofs), buf + (start - ofs), end - start);
+		}
+	}
+	req = di->req_tail;
+	if (!proc && req && (req->type == DIREQ_WRITE) && !req->proc
+	    && (req->ofs + req->count == ofs) && (req->count + count <= DI_WB_MAXCOUNT)) {
+		if (req->count + count > req->alloc) {
+			req->alloc = 2 * (req->count + count);
+			req->data = sg_realloc(req->data, req->alloc);
+		}
+		memcpy(req->data + req->count, buf, count);
+		req->count += count;
+	} else {
+		while (di->nr_writes >= DI_WB_MAXREQS) {
+			uv_cond_wait(&di->done_cond, &di->mutex);
+		}
+		req = sg_new(DIRequest);
+		req->type = DIREQ_WRITE;
+		req->ofs = ofs;
+		req->count = count;
+		req->alloc = count;
+		req->data = sg_calloc(count);
+		memcpy(req->data, buf, count);
+		req->proc = proc;
+		req->clientData = clientData;
+		di->nr_writes++;
+		queue_request(di, req);
+	}
+	uv_mutex_unlock(&di->mutex);
+	return count;
+}
+
+/*
+ * ------------------------------------------------------------------------
+ * Flush the write-behind queue and mapped overlays at exit
+ * ------------------------------------------------------------------------
+ */
+static void
+diskimage_exit(void *data)
+{
+	DiskImage *di = data;
+	if (di->flags & DI_ASYNC) {
+		uv_mutex_lock(&di->mutex);
+		while (di->nr_writes) {
+			uv_cond_wait(&di->done_cond, &di->mutex);
+		}
+		uv_mutex_unlock(&di->mutex);
+	}
+	if (di->map && di->ovl_persistent) {
+		overlay_sync_map(di);
+	}
+}
+
 DiskImage *
 DiskImage_Open(const char *name, uint64_t size, int flags)
 {
 	DiskImage *di;
 	struct stat stat;
+	char *overlay;
 	di = sg_new(DiskImage);
 	di->size = size;
 	di->flags = flags;
+	di->base_fd = -1;
+	overlay = Config_ReadVar("global", "overlay");
+#ifdef __unix__
+	if (overlay && (flags & DI_RDWR)) {
+		if (overlay_open(di, name, overlay) < 0) {
+			free(di);
+			return NULL;
+		}
+		di->ovl_persistent = (strcmp(overlay, "discard") != 0);
+		goto opened;
+	}
+#endif
 	if (flags & DI_RDWR) {
 		if (flags & (DI_CREAT_FF | DI_CREAT_00)) {
 			di->fd = open(name, O_RDWR | O_CREAT | O_LARGEFILE, 0644);
@@ -242,67 +1001,193 @@ DiskImage_Open(const char *name, uint64_t size, int flags)
 	} else {
 		fprintf(stderr, "Diskimage \"%s\" is of unknown type\n", name);
 	}
+ opened:
+	if (flags & DI_MMAP) {
+		di->flags &= ~DI_ASYNC;
+		if (!DiskImage_Mmap(di)) {
+			DiskImage_Close(di);
+			return NULL;
+		}
+	}
+#ifndef __unix__
+	/* No pread/pwrite, the IO thread would race for the file position */
+	di->flags &= ~DI_ASYNC;
+#endif
+	if (di->flags & DI_ASYNC) {
+		uv_mutex_init(&di->mutex);
+		uv_mutex_init(&di->ovl_mutex);
+		uv_cond_init(&di->req_cond);
+		uv_cond_init(&di->done_cond);
+		di->seq_end = -1;
+		uv_thread_create(&di->io_thread, io_thread, di);
+		ExitHandler_Register(diskimage_exit, di);
+	}
 	return di;
 }
 
 int
 DiskImage_Read(DiskImage * di, off_t ofs, uint8_t * buf, int count)
 {
-	int result;
-	int cnt;
-	if (lseek(di->fd, ofs, SEEK_SET) != ofs) {
-		return -EINVAL;
+	if (di->map) {
+		count = map_clip(di, ofs, count);
+		memcpy(buf, (uint8_t *) di->map + ofs, count);
+		return count;
+	} else if (di->flags & DI_ASYNC) {
+		return async_read(di, ofs, buf, count);
 	}
-	for (cnt = 0; cnt < count;) {
-		result = read(di->fd, buf + cnt, count);
-		if (result <= 0) {
-			if (cnt) {
-				return cnt;
-			} else {
-				return result;
-			}
-		}
-		cnt += result;
+	return di_pread(di, ofs, buf, count);
+}
+
+int
+DiskImage_Write(DiskImage * di, off_t ofs, const uint8_t * buf, int count)
+{
+	if (di->map) {
+		count = map_clip(di, ofs, count);
+		memcpy((uint8_t *) di->map + ofs, buf, count);
+		return count;
+	} else if (di->flags & DI_ASYNC) {
+		return async_write(di, ofs, buf, count, NULL, NULL);
 	}
-	return cnt;
+	return di_pwrite(di, ofs, buf, count);
+}
 
+/*
+ * ------------------------------------------------------------------------
+ * Async API: proc is called with the number of transferred bytes from
+ * a CycleTimer on the emulator thread. buf of a read must stay valid
+ * until then. Images without IO thread complete the request before
+ * returning.
+ * ------------------------------------------------------------------------
+ */
+int
+DiskImage_ReadAsync(DiskImage * di, off_t ofs, uint8_t * buf, int count,
+		    DiskImage_DoneProc * proc, void *clientData)
+{
+	DIRequest *req;
+	if (di->map || !(di->flags & DI_ASYNC)) {
+		proc(clientData, DiskImage_Read(di, ofs, buf, count));
+		return 0;
+	}
+	req = sg_new(DIRequest);
+	req->type = DIREQ_READ;
+	req->ofs = ofs;
+	req->count = count;
+	req->data = buf;
+	req->proc = proc;
+	req->clientData = clientData;
+	start_done_timer(di);
+	uv_mutex_lock(&di->mutex);
+	queue_request(di, req);
+	uv_mutex_unlock(&di->mutex);
+	return 0;
 }
 
 int
-DiskImage_Write(DiskImage * di, off_t ofs, const uint8_t * buf, int count)
+DiskImage_WriteAsync(DiskImage * di, off_t ofs, const uint8_t * buf, int count,
+		     DiskImage_DoneProc * proc, void *clientData)
 {
-	int result;
-	int cnt;
-	if (lseek(di->fd, ofs, SEEK_SET) != ofs) {
-		return -EINVAL;
+	if (di->map || !(di->flags & DI_ASYNC)) {
+		proc(clientData, DiskImage_Write(di, ofs, buf, count));
+		return 0;
 	}
-	for (cnt = 0; cnt < count;) {
-		result = write(di->fd, buf + cnt, count);
-		if (result <= 0) {
-			if (cnt) {
-				return cnt;
-			} else {
-				return result;
-			}
+	start_done_timer(di);
+	async_write(di, ofs, buf, count, proc, clientData);
+	return 0;
+}
+
+/*
+ * ------------------------------------------------------------------------
+ * Direct pointer into a DI_MMAP image, NULL if the image is not mapped
+ * or the range is outside of the image.
+ * ------------------------------------------------------------------------
+ */
+const uint8_t *
+DiskImage_GetReadPtr(DiskImage * di, off_t ofs, int count)
+{
+	if (!di->map || (map_clip(di, ofs, count) != count)) {
+		return NULL;
+	}
+	return (uint8_t *) di->map + ofs;
+}
+
+/*
+ * ------------------------------------------------------------------------
+ * Wait until all writes are in the file
+ * ------------------------------------------------------------------------
+ */
+void
+DiskImage_Flush(DiskImage * di)
+{
+	diskimage_exit(di);
+}
+
+#ifdef __unix__
+/*
+ * ------------------------------------------------------------------------
+ * The base image is mapped privately, so its pages are shared with the
+ * page cache until they are written. Only the blocks in the delta and
+ * the part behind the end of a short base image are filled in.
+ * ------------------------------------------------------------------------
+ */
+static void *
+overlay_mmap(DiskImage * di)
+{
+	uint8_t *map;
+	uint64_t ofs;
+	uint64_t baselen = 0;
+	struct stat st;
+	int len;
+	map = mmap(0, di->size, PROT_READ | PROT_WRITE, MAP_PRIVATE | MAP_ANONYMOUS, -1, 0);
+	if (map == MAP_FAILED) {
+		perror("mmap of overlay diskimage failed");
+		return NULL;
+	}
+	if ((di->base_fd >= 0) && (fstat(di->base_fd, &st) == 0) && (st.st_size > 0)) {
+		baselen = ((uint64_t) st.st_size < di->size) ? (uint64_t) st.st_size : di->size;
+		if (mmap(map, baselen, PROT_READ | PROT_WRITE, MAP_PRIVATE | MAP_FIXED,
+			 di->base_fd, 0) == MAP_FAILED) {
+			perror("mmap of overlay base image failed");
+			munmap(map, di->size);
+			return NULL;
 		}
-		cnt += result;
 	}
-	return cnt;
+	if (di->emptyval && (baselen < di->size)) {
+		memset(map + baselen, di->emptyval, di->size - baselen);
+	}
+	di->map = map;
+	for (ofs = 0; ofs < di->size; ofs += OVL_BLOCKSIZE) {
+		if (!di->ovl_index[ofs / OVL_BLOCKSIZE]) {
+			continue;
+		}
+		len = (di->size - ofs) < OVL_BLOCKSIZE ? (di->size - ofs) : OVL_BLOCKSIZE;
+		if (ovl_read(di, ofs, map + ofs, len) != len) {
+			fprintf(stderr, "Reading the overlay diskimage failed\n");
+			munmap(map, di->size);
+			di->map = NULL;
+			return NULL;
+		}
+	}
+	if (di->ovl_persistent && !(di->flags & DI_ASYNC)) {
+		ExitHandler_Register(diskimage_exit, di);
+	}
+	return di->map;
 }
+#endif
 
 void *
 DiskImage_Mmap(DiskImage * di)
 {
 #ifdef __unix__
-	if (di->flags & DI_RDWR) {
+	if (di->ovl_index) {
+		return overlay_mmap(di);
+	} else if (di->flags & DI_RDWR) {
 		di->map = mmap(0, di->size, PROT_READ | PROT_WRITE, MAP_SHARED, di->fd, 0);
 	} else {
 		di->map = mmap(0, di->size, PROT_READ, MAP_SHARED, di->fd, 0);
 	}
 	if (di->map == (void *)-1) {
 		perror("mmap of diskimage failed");
-		close(di->fd);
-		free(di);
+		di->map = NULL;
 		return NULL;
 	}
 #else
@@ -322,6 +1207,43 @@ DiskImage_Mmap(DiskImage * di)
 void
 DiskImage_Close(DiskImage * di)
 {
+	DIRequest *req;
+	int i;
+	if (di->map && di->ovl_persistent) {
+		overlay_sync_map(di);
+		if (!(di->flags & DI_ASYNC)) {
+			ExitHandler_Unregister(diskimage_exit, di);
+		}
+	}
+	if (di->flags & DI_ASYNC) {
+		ExitHandler_Unregister(diskimage_exit, di);
+		uv_mutex_lock(&di->mutex);
+		di->terminate = 1;
+		uv_cond_signal(&di->req_cond);
+		uv_mutex_unlock(&di->mutex);
+		uv_thread_join(&di->io_thread);
+		if (di->nr_pending) {
+			fprintf(stderr, "DiskImage: Closed with %d async requests pending\n",
+				di->nr_pending);
+		}
+		if (di->timerInitialized) {
+			CycleTimer_Unregister(&di->doneTimer);
+		}
+		while ((req = di->done_head)) {
+			di->done_head = req->next;
+			if (req->type == DIREQ_WRITE) {
+				sg_free(req->data);
+			}
+			sg_free(req);
+		}
+		for (i = 0; i < 2; i++) {
+			sg_free(di->win[i].buf);
+		}
+		uv_cond_destroy(&di->done_cond);
+		uv_cond_destroy(&di->req_cond);
+		uv_mutex_destroy(&di->ovl_mutex);
+		uv_mutex_destroy(&di->mutex);
+	}
 #ifdef __unix__
 	if (di->map) {
 		munmap(di->map, di->size);
@@ -334,5 +1256,9 @@ DiskImage_Close(DiskImage * di)
 	}
 #endif
 	close(di->fd);
+	if (di->base_fd >= 0) {
+		close(di->base_fd);
+	}
+	sg_free(di->ovl_index);
 	free(di);
 }
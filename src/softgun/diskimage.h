@@ -20,7 +20,10 @@
 #define DI_CREAT_FF	(1)
 #define	DI_CREAT_00	(2)
 #define DI_SPARSE	(4)
+#define DI_ASYNC	(32)	/* Readahead and write-behind on an IO thread */
+#define DI_MMAP		(64)	/* Access through a mapping of the file */
 typedef struct DiskImage DiskImage;
+typedef void DiskImage_DoneProc(void *clientData, int result);
 
 void DiskImage_Close(DiskImage * di);
 DiskImage *DiskImage_Open(const char *name, uint64_t size, int flags);
@@ -28,5 +31,11 @@ void *DiskImage_Mmap(DiskImage * di);
 
 int DiskImage_Read(DiskImage * di, off_t ofs, uint8_t * buf, int count);
 int DiskImage_Write(DiskImage * di, off_t ofs, const uint8_t * buf, int count);
+int DiskImage_ReadAsync(DiskImage * di, off_t ofs, uint8_t * buf, int count,
+			DiskImage_DoneProc * proc, void *clientData);
+int DiskImage_WriteAsync(DiskImage * di, off_t ofs, const uint8_t * buf, int count,
+			 DiskImage_DoneProc * proc, void *clientData);
+const uint8_t *DiskImage_GetReadPtr(DiskImage * di, off_t ofs, int count);
+void DiskImage_Flush(DiskImage * di);
 
 #endif
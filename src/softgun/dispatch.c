@@ -0,0 +1,74 @@
+/*
+ * ----------------------------------------------------------------------
+ * Slot assignment for the threaded instruction dispatch (dispatch.h)
+ * ----------------------------------------------------------------------
+ */
+#include <stdio.h>
+#include "dispatch.h"
+#include "sgstring.h"
+
+/*
+ * -----------------------------------------------------------------
+ * Give every distinct proc of the decoder table a slot. The tables
+ * repeat the same proc in long runs, so the last proc is checked
+ * before the search. Procs which do not fit are left to slot 0,
+ * which calls through the table.
+ * -----------------------------------------------------------------
+ */
+void
+Dispatch_MapInit(Dispatch_Map * map, Dispatch_Proc ** table, size_t entries)
+{
+	Dispatch_Proc *last = NULL;
+	unsigned int last_slot = 0;
+	unsigned int overflow = 0;
+	unsigned int slot;
+	size_t i;
+	map->slot = sg_calloc(sizeof(uint16_t) * entries);
+	map->nrEntries = entries;
+	map->proc[0] = NULL;
+	map->nrSlots = 1;
+	for (i = 0; i < entries; i++) {
+		Dispatch_Proc *proc = table[i];
+		if (proc == last) {
+			map->slot[i] = last_slot;
+			continue;
+		}
+		for (slot = 1; slot < map->nrSlots; slot++) {
+			if (map->proc[slot] == proc) {
+				break;
+			}
+		}
+		if (slot == map->nrSlots) {
+			if (map->nrSlots < DISPATCH_SLOTS) {
+				map->proc[map->nrSlots++] = proc;
+			} else {
+				slot = 0;
+				overflow++;
+			}
+		}
+		map->slot[i] = slot;
+		last = proc;
+		last_slot = slot;
+	}
+	if (overflow) {
+		fprintf(stderr, "Dispatch: %u table entries use the generic slot\n", overflow);
+	}
+}
+
+/*
+ * -----------------------------------------------------------------
+ * Build the table of label addresses for a main loop, indexed like
+ * the decoder table. The labels are local to the loop, so the loop
+ * builds it when it is entered the first time.
+ * -----------------------------------------------------------------
+ */
+const void **
+Dispatch_MapTargets(const Dispatch_Map * map, const void *const *labels)
+{
+	const void **target = sg_calloc(sizeof(void *) * map->nrEntries);
+	size_t i;
+	for (i = 0; i < map->nrEntries; i++) {
+		target[i] = labels[map->slot[i]];
+	}
+	return target;
+}
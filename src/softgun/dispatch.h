@@ -0,0 +1,65 @@
+/*
+ * ----------------------------------------------------------------------
+ * Threaded (computed goto) instruction dispatch for the CPU main loops
+ *
+ * Only used with LEIGUN_THREADED_DISPATCH (GCC and clang). The
+ * function pointer loops of the CPUs stay the reference.
+ *
+ * A Dispatch_Map gives every distinct proc of a decoder table a slot
+ * number. The main loop of a CPU expands DISPATCH_HANDLERS() to one
+ * label per slot, every label calls the proc of its slot, does the
+ * bookkeeping of the instruction, fetches the next one and jumps
+ * to its label with its own "goto *". Dispatch_MapTargets() turns
+ * the slots into a table of label addresses indexed like the decoder
+ * table, so the dispatch is a single load like the function pointer
+ * call. Slot 0 is the generic handler for tables with more procs
+ * than slots, it calls through the decoder table.
+ * ----------------------------------------------------------------------
+ */
+#ifndef DISPATCH_H
+#define DISPATCH_H
+#include <stdint.h>
+#include <stddef.h>
+
+#define DISPATCH_SLOTS	(512)
+
+typedef void Dispatch_Proc(void);
+
+typedef struct Dispatch_Map {
+	uint16_t *slot;		/* Slot of every index of the decoder table */
+	Dispatch_Proc *proc[DISPATCH_SLOTS];
+	unsigned int nrSlots;
+	size_t nrEntries;
+} Dispatch_Map;
+
+void Dispatch_MapInit(Dispatch_Map * map, Dispatch_Proc ** table, size_t entries);
+const void **Dispatch_MapTargets(const Dispatch_Map * map, const void *const *labels);
+
+/*
+ * The slots are numbered in octal, so the token pasting below
+ * gives the labels dispatch_slot_0000 to dispatch_slot_0777.
+ */
+#define DISPATCH_H8(H, p) \
+	H(p##0) H(p##1) H(p##2) H(p##3) H(p##4) H(p##5) H(p##6) H(p##7)
+#define DISPATCH_H64(H, p) \
+	DISPATCH_H8(H, p##0) DISPATCH_H8(H, p##1) DISPATCH_H8(H, p##2) \
+	DISPATCH_H8(H, p##3) DISPATCH_H8(H, p##4) DISPATCH_H8(H, p##5) \
+	DISPATCH_H8(H, p##6) DISPATCH_H8(H, p##7)
+#define DISPATCH_H512(H) \
+	DISPATCH_H64(H, 00) DISPATCH_H64(H, 01) DISPATCH_H64(H, 02) \
+	DISPATCH_H64(H, 03) DISPATCH_H64(H, 04) DISPATCH_H64(H, 05) \
+	DISPATCH_H64(H, 06) DISPATCH_H64(H, 07)
+
+#define DISPATCH_LABEL_ADDR(n)	&&dispatch_slot_##n,
+
+/* The label table, a static const array inside the main loop */
+#define DISPATCH_LABELS		{ DISPATCH_H512(DISPATCH_LABEL_ADDR) }
+
+/*
+ * H(n) has to start with DISPATCH_LABEL(n) and end with the
+ * goto to the label of the next instruction.
+ */
+#define DISPATCH_LABEL(n)	dispatch_slot_##n
+#define DISPATCH_HANDLERS(H)	DISPATCH_H512(H)
+
+#endif
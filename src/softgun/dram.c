@@ -50,6 +50,7 @@
 #include "configfile.h"
 #include "dram.h"
 #include "sgstring.h"
+#include "snapshot.h"
 
 /* all times in nanoseconds, all clocks in cycles */
 typedef struct DRamTiming {
@@ -400,6 +401,19 @@ find_dram_type(char *typestr)
 	return 0;
 }
 
+/*
+ * -------------------------------------------------------------
+ * After restoring a snapshot the DRAM has to be mapped in the
+ * mode (memory or IO) it had when the snapshot was taken
+ * -------------------------------------------------------------
+ */
+static void
+DRam_Restored(void *clientData)
+{
+	DRam *dram = clientData;
+	Mem_AreaUpdateMappings(&dram->bdev);
+}
+
 /*
  * --------------------
  * DRAM New
@@ -452,8 +466,7 @@ DRam_New(char *dram_name)
 		/* Skip DRAM initialisation */
 		dram->cycletype = SDRCYC_NORMAL;
 	}
-	dram->host_mem = sg_calloc(size);
-	memset(dram->host_mem, 0xff, size);
+	dram->host_mem = Snapshot_AllocRam(dram_name, size, 0xff);
 	dram->size = size;
 	dram->bdev.first_mapping = NULL;
 	dram->bdev.Map = DRam_Map;
@@ -461,6 +474,8 @@ DRam_New(char *dram_name)
 	dram->bdev.specialCycle = DRam_SpecialCycle;
 	dram->bdev.owner = dram;
 	dram->bdev.hw_flags = MEM_FLAG_WRITABLE | MEM_FLAG_READABLE;
+	Snapshot_RegisterState(dram_name, &dram->cycletype, sizeof(dram->cycletype),
+			       DRam_Restored, dram);
 	fprintf(stderr, "DRAM bank \"%s\" with  size %ukB\n", dram_name, size / 1024);
 	return &dram->bdev;
 }
@@ -39,6 +39,7 @@
 #include <stdio.h>
 #include <stdint.h>
 #include <stdlib.h>
+#include <string.h>
 #include <inttypes.h>
 #include <stdbool.h>
 #include "byteorder.h"
@@ -116,6 +117,24 @@ typedef struct elf32_shdr {
 #define PT_SHLIB    (5)
 #define PT_PHDR     (6)
 
+#define SHT_SYMTAB  (2)
+#define SHT_STRTAB  (3)
+#define SHT_DYNSYM  (11)
+
+#define SHN_UNDEF   (0)
+
+#define STT_FUNC    (2)
+#define ELF_ST_TYPE(info)   ((info) & 0xf)
+
+typedef struct {
+    Elf32_Word st_name;
+    Elf32_Addr st_value;
+    Elf32_Word st_size;
+    unsigned char st_info;
+    unsigned char st_other;
+    Elf32_Half st_shndx;
+} Elf32_Sym;
+
 typedef struct {
     Elf32_Word p_type;
     Elf32_Off p_offset;
@@ -157,6 +176,15 @@ typedef struct {
     Elf64_Xword sh_entsize;     /* Entry size if section holds table */
 } Elf64_Shdr;
 
+typedef struct {
+    Elf64_Word st_name;         /* Symbol name, index in string tbl */
+    unsigned char st_info;      /* Type and binding attributes */
+    unsigned char st_other;     /* No defined meaning, 0 */
+    Elf64_Half st_shndx;        /* Associated section index */
+    Elf64_Addr st_value;        /* Value of the symbol */
+    Elf64_Xword st_size;        /* Associated symbol size */
+} Elf64_Sym;
+
 typedef struct {
     Elf64_Word p_type;          /* Type of segment */
     Elf64_Word p_flags;         /* Segment attributes */
@@ -353,7 +381,7 @@ Elf64_PHeaderBigEndianToHost(Elf64_Phdr * elf64PHdr)
  * In place conversion of little endian section header to host byte order.
  **************************************************************************************
  */
-__UNUSED__ static void
+static void
 Elf32_SHeaderLittleEndianToHost(Elf32_Shdr *elf32Shdr) {
     elf32Shdr->sh_name = BYTE_LeToH32(elf32Shdr->sh_name);
     elf32Shdr->sh_type = BYTE_LeToH32(elf32Shdr->sh_type);
@@ -373,7 +401,7 @@ Elf32_SHeaderLittleEndianToHost(Elf32_Shdr *elf32Shdr) {
  * In place conversion of Big endian Section header to host byte order
  **************************************************************************************
  */
-__UNUSED__ static void
+static void
 Elf32_SHeaderBigEndianToHost(Elf32_Shdr *elf32Shdr) 
 {
     elf32Shdr->sh_name = BYTE_BeToH32(elf32Shdr->sh_name);
@@ -388,7 +416,7 @@ Elf32_SHeaderBigEndianToHost(Elf32_Shdr *elf32Shdr)
     elf32Shdr->sh_entsize = BYTE_BeToH32(elf32Shdr->sh_entsize);
 }
 
-__UNUSED__ static void
+static void
 Elf64_SHeaderLittleEndianToHost(Elf64_Shdr *elf64Shdr) 
 {
     elf64Shdr->sh_name = BYTE_LeToH32(elf64Shdr->sh_name);    
@@ -403,7 +431,7 @@ Elf64_SHeaderLittleEndianToHost(Elf64_Shdr *elf64Shdr)
     elf64Shdr->sh_entsize = BYTE_LeToH64(elf64Shdr->sh_entsize);
 }
 
-__UNUSED__ static void
+static void
 Elf64_SHeaderBigEndianToHost(Elf64_Shdr *elf64Shdr) 
 {
     elf64Shdr->sh_name = BYTE_BeToH32(elf64Shdr->sh_name);    
@@ -643,3 +671,208 @@ Elf_LoadFile(const char *filename, Elf_LoadCallback * cbProc, void *cbData)
     fclose(file);
     return totalCnt;
 }
+
+/**
+ *********************************************************************************************
+ * Read the data of a section into a malloced buffer.
+ * Returns NULL if the section can not be read.
+ *********************************************************************************************
+ */
+static void *
+Elf_ReadBlock(FILE *file, off_t offset, uint64_t size)
+{
+    void *buf;
+    if ((size == 0) || (size > (UINT64_C(1) << 30))) {
+        return NULL;
+    }
+    buf = malloc(size);
+    if (!buf) {
+        return NULL;
+    }
+    if ((fseeko(file, offset, SEEK_SET) != 0) || (fread(buf, 1, size, file) != size)) {
+        free(buf);
+        return NULL;
+    }
+    return buf;
+}
+
+static void
+Elf32_ReadSHeader(FILE * file, off_t offset, Elf32_Shdr * shdr, const Elf32_Ehdr * elf32Hdr)
+{
+    memset(shdr, 0, sizeof(*shdr));
+    if ((fseeko(file, offset, SEEK_SET) != 0) || (fread(shdr, 1, sizeof(*shdr), file) != sizeof(*shdr))) {
+        return;
+    }
+    if (elf32Hdr->e_ident[EI_DATA] == ELFDATA2LSB) {
+        Elf32_SHeaderLittleEndianToHost(shdr);
+    } else {
+        Elf32_SHeaderBigEndianToHost(shdr);
+    }
+}
+
+static void
+Elf64_ReadSHeader(FILE * file, off_t offset, Elf64_Shdr * shdr, const Elf64_Ehdr * elf64Hdr)
+{
+    memset(shdr, 0, sizeof(*shdr));
+    if ((fseeko(file, offset, SEEK_SET) != 0) || (fread(shdr, 1, sizeof(*shdr), file) != sizeof(*shdr))) {
+        return;
+    }
+    if (elf64Hdr->e_ident[EI_DATA] == ELFDATA2LSB) {
+        Elf64_SHeaderLittleEndianToHost(shdr);
+    } else {
+        Elf64_SHeaderBigEndianToHost(shdr);
+    }
+}
+
+/**
+ *********************************************************************************************
+ * Report the function symbols of the symbol tables of a 32 Bit ELF file.
+ *********************************************************************************************
+ */
+static int
+Elf32_ReadSymbols(FILE *file, Elf_SymbolCallback * cbProc, void *cbData)
+{
+    Elf32_Ehdr elf32Hdr;
+    Elf32_Shdr symHdr, strHdr;
+    Elf32_Sym *syms;
+    char *strtab;
+    uint32_t idx, i, nsyms;
+    bool le;
+    int count = 0;
+
+    Elf32_ReadHeader(file, &elf32Hdr);
+    le = (elf32Hdr.e_ident[EI_DATA] == ELFDATA2LSB);
+    for (idx = 0; idx < elf32Hdr.e_shnum; idx++) {
+        Elf32_ReadSHeader(file, elf32Hdr.e_shoff + idx * sizeof(Elf32_Shdr), &symHdr, &elf32Hdr);
+        if ((symHdr.sh_type != SHT_SYMTAB) && (symHdr.sh_type != SHT_DYNSYM)) {
+            continue;
+        }
+        if (symHdr.sh_link >= elf32Hdr.e_shnum) {
+            continue;
+        }
+        Elf32_ReadSHeader(file, elf32Hdr.e_shoff + symHdr.sh_link * sizeof(Elf32_Shdr), &strHdr, &elf32Hdr);
+        if (strHdr.sh_type != SHT_STRTAB) {
+            continue;
+        }
+        syms = Elf_ReadBlock(file, symHdr.sh_offset, symHdr.sh_size);
+        strtab = Elf_ReadBlock(file, strHdr.sh_offset, strHdr.sh_size);
+        if (!syms || !strtab) {
+            free(syms);
+            free(strtab);
+            return -1;
+        }
+        strtab[strHdr.sh_size - 1] = 0;
+        nsyms = symHdr.sh_size / sizeof(Elf32_Sym);
+        for (i = 0; i < nsyms; i++) {
+            Elf32_Sym *sym = &syms[i];
+            uint32_t name = le ? BYTE_LeToH32(sym->st_name) : BYTE_BeToH32(sym->st_name);
+            uint16_t shndx = le ? BYTE_LeToH16(sym->st_shndx) : BYTE_BeToH16(sym->st_shndx);
+            if ((ELF_ST_TYPE(sym->st_info) != STT_FUNC) || (shndx == SHN_UNDEF)) {
+                continue;
+            }
+            if (name >= strHdr.sh_size) {
+                continue;
+            }
+            cbProc(strtab + name,
+                   le ? BYTE_LeToH32(sym->st_value) : BYTE_BeToH32(sym->st_value),
+                   le ? BYTE_LeToH32(sym->st_size) : BYTE_BeToH32(sym->st_size), cbData);
+            count++;
+        }
+        free(syms);
+        free(strtab);
+    }
+    return count;
+}
+
+/**
+ *********************************************************************************************
+ * Report the function symbols of the symbol tables of a 64 Bit ELF file.
+ *********************************************************************************************
+ */
+static int
+Elf64_ReadSymbols(FILE *file, Elf_SymbolCallback * cbProc, void *cbData)
+{
+    Elf64_Ehdr elf64Hdr;
+    Elf64_Shdr symHdr, strHdr;
+    Elf64_Sym *syms;
+    char *strtab;
+    uint32_t idx;
+    uint64_t i, nsyms;
+    bool le;
+    int count = 0;
+
+    Elf64_ReadHeader(file, &elf64Hdr);
+    le = (elf64Hdr.e_ident[EI_DATA] == ELFDATA2LSB);
+    for (idx = 0; idx < elf64Hdr.e_shnum; idx++) {
+        Elf64_ReadSHeader(file, elf64Hdr.e_shoff + idx * sizeof(Elf64_Shdr), &symHdr, &elf64Hdr);
+        if ((symHdr.sh_type != SHT_SYMTAB) && (symHdr.sh_type != SHT_DYNSYM)) {
+            continue;
+        }
+        if (symHdr.sh_link >= elf64Hdr.e_shnum) {
+            continue;
+        }
+        Elf64_ReadSHeader(file, elf64Hdr.e_shoff + symHdr.sh_link * sizeof(Elf64_Shdr), &strHdr, &elf64Hdr);
+        if (strHdr.sh_type != SHT_STRTAB) {
+            continue;
+        }
+        syms = Elf_ReadBlock(file, symHdr.sh_offset, symHdr.sh_size);
+        strtab = Elf_ReadBlock(file, strHdr.sh_offset, strHdr.sh_size);
+        if (!syms || !strtab) {
+            free(syms);
+            free(strtab);
+            return -1;
+        }
+        strtab[strHdr.sh_size - 1] = 0;
+        nsyms = symHdr.sh_size / sizeof(Elf64_Sym);
+        for (i = 0; i < nsyms; i++) {
+            Elf64_Sym *sym = &syms[i];
+            uint32_t name = le ? BYTE_LeToH32(sym->st_name) : BYTE_BeToH32(sym->st_name);
+            uint16_t shndx = le ? BYTE_LeToH16(sym->st_shndx) : BYTE_BeToH16(sym->st_shndx);
+            if ((ELF_ST_TYPE(sym->st_info) != STT_FUNC) || (shndx == SHN_UNDEF)) {
+                continue;
+            }
+            if (name >= strHdr.sh_size) {
+                continue;
+            }
+            cbProc(strtab + name,
+                   le ? BYTE_LeToH64(sym->st_value) : BYTE_BeToH64(sym->st_value),
+                   le ? BYTE_LeToH64(sym->st_size) : BYTE_BeToH64(sym->st_size), cbData);
+            count++;
+        }
+        free(syms);
+        free(strtab);
+    }
+    return count;
+}
+
+/**
+ *********************************************************************************************
+ * \fn int Elf_ReadSymbols(const char *filename, Elf_SymbolCallback * cbProc, void *cbData)
+ * Report the name, address and size of all function symbols of an ELF file.
+ * Returns the number of symbols or -1 if the file can not be read.
+ *********************************************************************************************
+ */
+int
+Elf_ReadSymbols(const char *filename, Elf_SymbolCallback * cbProc, void *cbData)
+{
+    FILE *file;
+    Elf32_Ehdr elf32Hdr;
+    int count;
+
+    if (Elf_CheckElf(filename) == false) {
+        return -1;
+    }
+    if ((file = fopen(filename, "r")) == NULL) {
+        return -1;
+    }
+    Elf32_ReadHeader(file, &elf32Hdr);
+    if (elf32Hdr.e_ident[EI_CLASS] == ELFCLASS32) {
+        count = Elf32_ReadSymbols(file, cbProc, cbData);
+    } else if (elf32Hdr.e_ident[EI_CLASS] == ELFCLASS64) {
+        count = Elf64_ReadSymbols(file, cbProc, cbData);
+    } else {
+        count = -1;
+    }
+    fclose(file);
+    return count;
+}
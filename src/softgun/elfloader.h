@@ -3,4 +3,6 @@
 typedef int Elf_LoadCallback(uint64_t addr, uint8_t * buf, int64_t len, void *clientData);
 int64_t Elf_LoadFile(const char *filename, Elf_LoadCallback *cbProc, void *cbData);
 bool Elf_CheckElf(const char *filename);
+typedef void Elf_SymbolCallback(const char *name, uint64_t addr, uint64_t size, void *clientData);
+int Elf_ReadSymbols(const char *filename, Elf_SymbolCallback *cbProc, void *cbData);
 
@@ -147,8 +147,12 @@ struct I2C_SerDes {
 	CycleCounter_t scl_change_time;
 	CycleTimer sdaDelayTimer;
 	CycleTimer sclDelayTimer;
+	struct I2C_SerDes *next;
 };
 
+/* All SerDes, searched by the transaction level bus masters */
+static __MACHINE_LOCAL__ I2C_SerDes *serdes_list = NULL;
+
 static void
 invalidate_timing(I2C_Timing * timing)
 {
@@ -929,6 +933,8 @@ I2C_SerDesNew(const char *name)
 	SigName_Link(SigName(serdes->sda), SigName(serdes->sda_pullup));
 	serdes->oldpinstate = I2C_SDA | I2C_SCL;
 	serdes->name = sg_strdup(name);
+	serdes->next = serdes_list;
+	serdes_list = serdes;
 
 	fprintf(stderr, "I2C Serializer/Deserializer \"%s\" created\n", name);
 	return serdes;
@@ -965,3 +971,201 @@ I2C_SerDesDetachSlave(I2C_SerDes * serdes, I2C_Slave * slave)
 	}
 	return -1;
 }
+
+#define I2C_BUS_IDLE	(0)
+#define I2C_BUS_ADDR	(1)
+#define I2C_BUS_WRITE	(2)
+#define I2C_BUS_READ	(3)
+#define I2C_BUS_WAIT	(4)
+
+struct I2C_Bus {
+	SigNode *sda;
+	I2C_Slave *active_slave;
+	int state;
+	int stretch_warnings;
+};
+
+/*
+ * -------------------------------------------------------------
+ * Create the transaction level port of a bus master. The
+ * slaves are searched on every start condition, so it can
+ * be created before the SDA line is linked to the SerDes.
+ * -------------------------------------------------------------
+ */
+I2C_Bus *
+I2C_BusNew(SigNode * sda)
+{
+	I2C_Bus *bus = sg_new(I2C_Bus);
+	bus->sda = sda;
+	bus->state = I2C_BUS_IDLE;
+	return bus;
+}
+
+static I2C_Slave *
+I2C_BusFindSlave(I2C_Bus * bus, int address)
+{
+	I2C_SerDes *serdes;
+	I2C_Slave *slave;
+	for (serdes = serdes_list; serdes; serdes = serdes->next) {
+		if (!serdes->slave_list || !SigNode_Connected(serdes->sda, bus->sda)) {
+			continue;
+		}
+		for (slave = serdes->slave_list; slave; slave = slave->next) {
+			if ((address & slave->addr_mask) == slave->address) {
+				return slave;
+			}
+		}
+	}
+	return NULL;
+}
+
+/*
+ * ----------------------------------------------------------------
+ * Start or repeated start condition. Like on the bit level
+ * a repeated start drops the previously addressed slave without
+ * calling its stop operation. The next address byte selects the
+ * slave again.
+ * ----------------------------------------------------------------
+ */
+void
+I2C_BusStart(I2C_Bus * bus)
+{
+	bus->active_slave = NULL;
+	bus->state = I2C_BUS_ADDR;
+}
+
+static int
+I2C_BusStretched(I2C_Bus * bus)
+{
+	if (bus->stretch_warnings < 10) {
+		bus->stretch_warnings++;
+		fprintf(stderr, "I2C-Bus: SCL stretching slave on transaction level, sending NACK\n");
+	}
+	bus->state = I2C_BUS_WAIT;
+	return I2C_NACK;
+}
+
+/*
+ * ------------------------------------------------------------------
+ * Write the address byte after a start condition or a data
+ * byte to the addressed slave. Returns I2C_ACK or I2C_NACK.
+ * ------------------------------------------------------------------
+ */
+int
+I2C_BusWrite(I2C_Bus * bus, uint8_t data)
+{
+	I2C_Slave *slave;
+	int result;
+	switch (bus->state) {
+	    case I2C_BUS_ADDR:
+		    slave = I2C_BusFindSlave(bus, data >> 1);
+		    if (!slave) {
+			    bus->state = I2C_BUS_WAIT;
+			    return I2C_NACK;
+		    }
+		    if (data & 1) {
+			    result = slave->devops->start(slave->dev, data >> 1, I2C_READ);
+			    bus->state = I2C_BUS_READ;
+		    } else {
+			    result = slave->devops->start(slave->dev, data >> 1, I2C_WRITE);
+			    bus->state = I2C_BUS_WRITE;
+		    }
+		    if (result == I2C_ACK) {
+			    bus->active_slave = slave;
+		    } else if (result == I2C_STRETCH_SCL) {
+			    bus->active_slave = slave;
+			    result = I2C_BusStretched(bus);
+		    } else {
+			    bus->state = I2C_BUS_WAIT;
+		    }
+		    return result;
+
+	    case I2C_BUS_WRITE:
+		    slave = bus->active_slave;
+		    result = slave->devops->write(slave->dev, data);
+		    if (result == I2C_STRETCH_SCL) {
+			    result = I2C_BusStretched(bus);
+		    } else if ((result != I2C_ACK) && (result != I2C_NACK)) {
+			    fprintf(stderr, "Bug: Unknown I2C-Result %d\n", result);
+			    result = I2C_NACK;
+		    }
+		    return result;
+
+	    default:
+		    /* Nobody drives SDA low */
+		    return I2C_NACK;
+	}
+}
+
+/*
+ * ----------------------------------------------------------
+ * Read a byte from the addressed slave. The master has to
+ * answer with I2C_BusAck before reading the next byte.
+ * ----------------------------------------------------------
+ */
+void
+I2C_BusRead(I2C_Bus * bus, uint8_t * data)
+{
+	I2C_Slave *slave = bus->active_slave;
+	*data = 0xff;
+	if (bus->state != I2C_BUS_READ) {
+		return;
+	}
+	if (slave->devops->read(slave->dev, data) == I2C_STRETCH_SCL) {
+		*data = 0xff;
+		I2C_BusStretched(bus);
+	}
+}
+
+void
+I2C_BusAck(I2C_Bus * bus, int ack)
+{
+	I2C_Slave *slave = bus->active_slave;
+	if (bus->state != I2C_BUS_READ) {
+		return;
+	}
+	if (slave->devops->read_ack) {
+		slave->devops->read_ack(slave->dev, ack);
+	}
+	if (ack == I2C_NACK) {
+		bus->state = I2C_BUS_WAIT;
+	}
+}
+
+void
+I2C_BusStop(I2C_Bus * bus)
+{
+	I2C_Slave *slave = bus->active_slave;
+	if (slave) {
+		slave->devops->stop(slave->dev);
+	}
+	bus->active_slave = NULL;
+	bus->state = I2C_BUS_IDLE;
+}
+
+int
+I2C_BusTransfer(I2C_Bus * bus, uint8_t addr, int operation, uint8_t * data, unsigned int len)
+{
+	unsigned int i;
+	I2C_BusStart(bus);
+	if (operation == I2C_READ) {
+		if (I2C_BusWrite(bus, (addr << 1) | 1) != I2C_ACK) {
+			return -1;
+		}
+		for (i = 0; i < len; i++) {
+			I2C_BusRead(bus, &data[i]);
+			I2C_BusAck(bus, (i + 1 < len) ? I2C_ACK : I2C_NACK);
+		}
+	} else {
+		if (I2C_BusWrite(bus, addr << 1) != I2C_ACK) {
+			return -1;
+		}
+		for (i = 0; i < len; i++) {
+			if (I2C_BusWrite(bus, data[i]) != I2C_ACK) {
+				i++;
+				break;
+			}
+		}
+	}
+	return i;
+}
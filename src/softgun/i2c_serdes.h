@@ -11,6 +11,7 @@
  */
 
 #include <i2c.h>
+#include "signode.h"
 
 typedef struct I2C_SerDes I2C_SerDes;
 
@@ -19,3 +20,30 @@ int I2C_SerDesDetachSlave(I2C_SerDes * serdes, I2C_Slave * slave);
 I2C_SerDes *I2C_SerDesNew(const char *name);
 void SerDes_UnstretchScl(I2C_SerDes * serdes);
 void SerDes_Decouple(I2C_SerDes * serdes);
+
+/*
+ * ------------------------------------------------------------------
+ * Transaction level access for bus masters. It bypasses the
+ * SDA/SCL emulation and calls the slave operations of all
+ * SerDes connected to the SDA line of the master directly.
+ * A transaction is I2C_BusStart, the address byte and the data
+ * bytes written with I2C_BusWrite or read with I2C_BusRead each
+ * followed by I2C_BusAck, and I2C_BusStop. The bus takes no time,
+ * the master has to account the duration of the bytes.
+ * Slaves stretching SCL are not supported and answer with NACK.
+ * ------------------------------------------------------------------
+ */
+typedef struct I2C_Bus I2C_Bus;
+
+I2C_Bus *I2C_BusNew(SigNode * sda);
+void I2C_BusStart(I2C_Bus * bus);
+int I2C_BusWrite(I2C_Bus * bus, uint8_t data);
+void I2C_BusRead(I2C_Bus * bus, uint8_t * data);
+void I2C_BusAck(I2C_Bus * bus, int ack);
+void I2C_BusStop(I2C_Bus * bus);
+/*
+ * Start, address and data bytes of a transaction, returns the number of
+ * transfered bytes or -1 if the address was not acknowledged. The caller
+ * ends it with I2C_BusStop or continues with a repeated start.
+ */
+int I2C_BusTransfer(I2C_Bus * bus, uint8_t addr, int operation, uint8_t * data, unsigned int len);
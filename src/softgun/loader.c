@@ -50,11 +50,12 @@
 #include "srec.h"
 #include "loader.h"
 #include "elfloader.h"
+#include "profiler.h"
 
 /* Should be a linked list with many namepaces, but for now one is enough */
 
-LoadProc *firstLoadProc = NULL;
-void *firstLoadProcClientData = NULL;
+__MACHINE_LOCAL__ LoadProc *firstLoadProc = NULL;
+__MACHINE_LOCAL__ void *firstLoadProcClientData = NULL;
 
 int
 Loader_RegisterBus(const char *name, LoadProc * proc, void *clientData)
@@ -188,6 +189,7 @@ Load_Elf(char *filename, uint32_t startaddr, int flags, uint64_t region_size)
         li.region_end = ~UINT64_C(0);
     }
     fprintf(stderr, "Loading Elf file \"%s\"\n", filename);
+    Profiler_AddSymbolFile(filename);
     return Elf_LoadFile(filename, write_elf_to_bus, &li);
 }
 
@@ -33,6 +33,7 @@
  *************************************************************************************************
  */
 
+#include <stdio.h>
 #include <stdint.h>
 #include "nand.h"
 #include "sgstring.h"
@@ -38,7 +38,6 @@
 #include <stdio.h>
 #include "sound.h"
 #include "sgstring.h"
-#include "signode.h"
 
 static int
 NullDev_SetSoundFormat(SoundDevice * dev, SoundFormat * format)
@@ -58,12 +57,6 @@ NullSound_New(const char *name)
 	SoundDevice *sdev = sg_new(SoundDevice);
 	sdev->setSoundFormat = NullDev_SetSoundFormat;
 	sdev->playSamples = NullDev_PlaySamples;
-	sdev->speedUp = SigNode_New("%s.speedUp", name);
-	sdev->speedDown = SigNode_New("%s.speedDown", name);
-	if (!sdev->speedUp || !sdev->speedDown) {
-		fprintf(stderr, "Can not create sound speed control lines\n");
-		exit(1);
-	}
 	fprintf(stderr, "Created Null sound device \"%s\" for eating up sound\n", name);
 	return sdev;
 }
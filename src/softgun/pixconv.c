@@ -0,0 +1,404 @@
+//===-- softgun/pixconv.c -----------------------------------------*- C -*-===//
+//
+//              The Leigun Embedded System Simulator Platform
+//
+// Licensed under the Apache License, Version 2.0 (the "License");
+// you may not use this file except in compliance with the License.
+// You may obtain a copy of the License at
+//
+//     http://www.apache.org/licenses/LICENSE-2.0
+//
+// Unless required by applicable law or agreed to in writing, software
+// distributed under the License is distributed on an "AS IS" BASIS,
+// WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+// See the License for the specific language governing permissions and
+// limitations under the License.
+//
+//===----------------------------------------------------------------------===//
+///
+/// @file
+/// Row wise conversion of framebuffer pixels to a display pixel format
+///
+/// A color channel is converted by dst = src * dst_max / src_max. The
+/// scalar code uses a translation table per channel. The SSE2 code
+/// replaces the division by a multiplication with a magic number. It
+/// is only used if the magic number gives the exact same result as the
+/// table for every possible channel value, so both produce identical
+/// pixels. This covers the 16 and 32 bit formats of the LCD controllers
+/// (RGB444, RGB565, RGB666 and XRGB8888).
+///
+//===----------------------------------------------------------------------===//
+
+#include <stdint.h>
+#include <stdbool.h>
+#include <string.h>
+#ifdef __SSE2__
+#include <emmintrin.h>
+#endif
+#include "pixconv.h"
+#include "byteorder.h"
+
+/*
+ * ------------------------------------------------------------------
+ * Scalar converters, also used for the tail of a row
+ * ------------------------------------------------------------------
+ */
+static inline uint32_t
+trans_pixval(const PixConv * pc, uint32_t pixval)
+{
+	const PixConvChannel *ch = pc->chan;
+	return pc->trans[0][(pixval >> ch[0].src_shift) & ch[0].src_max]
+	    | pc->trans[1][(pixval >> ch[1].src_shift) & ch[1].src_max]
+	    | pc->trans[2][(pixval >> ch[2].src_shift) & ch[2].src_max];
+}
+
+static void
+conv_row8(const PixConv * pc, uint32_t * dst, const uint8_t * src, unsigned int count)
+{
+	unsigned int i;
+	for (i = 0; i < count; i++) {
+		dst[i] = trans_pixval(pc, src[i]);
+	}
+}
+
+static void
+conv_row16(const PixConv * pc, uint32_t * dst, const uint8_t * src, unsigned int count)
+{
+	unsigned int i;
+	uint16_t pixval;
+	for (i = 0; i < count; i++) {
+		memcpy(&pixval, src + 2 * i, 2);
+		dst[i] = trans_pixval(pc, BYTE_LeToH16(pixval));
+	}
+}
+
+static void
+conv_row32(const PixConv * pc, uint32_t * dst, const uint8_t * src, unsigned int count)
+{
+	unsigned int i;
+	uint32_t pixval;
+	for (i = 0; i < count; i++) {
+		memcpy(&pixval, src + 4 * i, 4);
+		dst[i] = trans_pixval(pc, BYTE_LeToH32(pixval));
+	}
+}
+
+static void
+conv_row_none(const PixConv * pc, uint32_t * dst, const uint8_t * src, unsigned int count)
+{
+	memset(dst, 0, count * sizeof(uint32_t));
+}
+
+#ifdef __SSE2__
+/*
+ * ------------------------------------------------------------------
+ * SSE2 converters. The channel values are kept in 16 bit lanes:
+ * value * dst_max fits into 16 bit, the division is a mulhi with the
+ * magic number followed by a shift.
+ * ------------------------------------------------------------------
+ */
+typedef struct ChanVec {
+	__m128i src_shift;
+	__m128i mask;
+	__m128i mul;
+	__m128i magic;
+	__m128i magic_shift;
+	__m128i dst_shift;
+} ChanVec;
+
+static inline void
+chanvec_init(ChanVec * cv, const PixConvChannel * ch, int lane32)
+{
+	cv->src_shift = _mm_cvtsi32_si128(ch->src_shift);
+	cv->mask = lane32 ? _mm_set1_epi32(ch->src_max) : _mm_set1_epi16(ch->src_max);
+	cv->mul = _mm_set1_epi16(ch->dst_max);
+	cv->magic = _mm_set1_epi16(ch->magic);
+	cv->magic_shift = _mm_cvtsi32_si128(ch->magic_shift);
+	cv->dst_shift = _mm_cvtsi32_si128(ch->dst_shift);
+}
+
+static inline __m128i
+chanvec_scale(const ChanVec * cv, __m128i v)
+{
+	v = _mm_mullo_epi16(v, cv->mul);
+	v = _mm_mulhi_epu16(v, cv->magic);
+	return _mm_srl_epi16(v, cv->magic_shift);
+}
+
+static void
+conv_row16_sse2(const PixConv * pc, uint32_t * dst, const uint8_t * src, unsigned int count)
+{
+	ChanVec cv[3];
+	__m128i zero = _mm_setzero_si128();
+	unsigned int i;
+	int c;
+	for (c = 0; c < 3; c++) {
+		chanvec_init(&cv[c], &pc->chan[c], 0);
+	}
+	for (i = 0; i + 8 <= count; i += 8) {
+		__m128i p = _mm_loadu_si128((const __m128i *)(src + 2 * i));
+		__m128i lo = zero;
+		__m128i hi = zero;
+		for (c = 0; c < 3; c++) {
+			__m128i v = _mm_and_si128(_mm_srl_epi16(p, cv[c].src_shift), cv[c].mask);
+			v = chanvec_scale(&cv[c], v);
+			lo = _mm_or_si128(lo, _mm_sll_epi32(_mm_unpacklo_epi16(v, zero),
+							    cv[c].dst_shift));
+			hi = _mm_or_si128(hi, _mm_sll_epi32(_mm_unpackhi_epi16(v, zero),
+							    cv[c].dst_shift));
+		}
+		_mm_storeu_si128((__m128i *) (dst + i), lo);
+		_mm_storeu_si128((__m128i *) (dst + i + 4), hi);
+	}
+	conv_row16(pc, dst + i, src + 2 * i, count - i);
+}
+
+/*
+ * The channels of a 32 bit pixel are masked to at most 8 bit, so the
+ * upper 16 bit of each lane stay zero in the 16 bit arithmetic.
+ */
+static void
+conv_row32_sse2(const PixConv * pc, uint32_t * dst, const uint8_t * src, unsigned int count)
+{
+	ChanVec cv[3];
+	unsigned int i;
+	int c;
+	for (c = 0; c < 3; c++) {
+		chanvec_init(&cv[c], &pc->chan[c], 1);
+	}
+	for (i = 0; i + 4 <= count; i += 4) {
+		__m128i p = _mm_loadu_si128((const __m128i *)(src + 4 * i));
+		__m128i out = _mm_setzero_si128();
+		for (c = 0; c < 3; c++) {
+			__m128i v = _mm_and_si128(_mm_srl_epi32(p, cv[c].src_shift), cv[c].mask);
+			v = chanvec_scale(&cv[c], v);
+			out = _mm_or_si128(out, _mm_sll_epi32(v, cv[c].dst_shift));
+		}
+		_mm_storeu_si128((__m128i *) (dst + i), out);
+	}
+	conv_row32(pc, dst + i, src + 4 * i, count - i);
+}
+#endif
+
+/*
+ * ------------------------------------------------------------------
+ * Find the magic number for the division by src_max. Verified
+ * against the exact division for every value the channel can have.
+ * ------------------------------------------------------------------
+ */
+static bool
+find_magic(PixConvChannel * ch)
+{
+	uint32_t shift, magic, v, x;
+	if ((ch->src_max == 0) || ((uint32_t) ch->src_max * ch->dst_max > 0xffff)) {
+		return false;
+	}
+	for (shift = 0; shift < 16; shift++) {
+		magic = ((UINT32_C(1) << (16 + shift)) + ch->src_max - 1) / ch->src_max;
+		if (magic > 0xffff) {
+			continue;
+		}
+		for (v = 0; v <= ch->src_max; v++) {
+			x = v * ch->dst_max;
+			if (((x * magic) >> (16 + shift)) != (x / ch->src_max)) {
+				break;
+			}
+		}
+		if (v > ch->src_max) {
+			ch->magic = magic;
+			ch->magic_shift = shift;
+			return true;
+		}
+	}
+	return false;
+}
+
+static void
+init_channel(PixConv * pc, int idx, uint16_t src_max, uint8_t src_shift, uint16_t dst_max,
+	     uint8_t dst_shift)
+{
+	PixConvChannel *ch = &pc->chan[idx];
+	uint32_t v;
+	ch->src_max = src_max;
+	ch->src_shift = src_shift;
+	ch->dst_max = dst_max;
+	ch->dst_shift = dst_shift;
+	ch->magic = 0;
+	ch->magic_shift = 0;
+	for (v = 0; (v <= src_max) && (v < 256); v++) {
+		pc->trans[idx][v] = src_max ? (v * dst_max / src_max) << dst_shift : 0;
+	}
+}
+
+void
+PixConv_Init(PixConv * pc, const PixConvFormat * src, const PixConvFormat * dst)
+{
+	bool simd = true;
+	int c;
+	memset(pc->trans, 0, sizeof(pc->trans));
+	init_channel(pc, 0, src->red_max, src->red_shift, dst->red_max, dst->red_shift);
+	init_channel(pc, 1, src->green_max, src->green_shift, dst->green_max, dst->green_shift);
+	init_channel(pc, 2, src->blue_max, src->blue_shift, dst->blue_max, dst->blue_shift);
+	for (c = 0; c < 3; c++) {
+		if (pc->chan[c].src_max > 255) {
+			/* Larger channels are not supported by the framebuffer */
+			pc->chan[c].src_max = 255;
+		}
+		simd = find_magic(&pc->chan[c]) && simd;
+	}
+	pc->src_bypp = src->bits_per_pixel >> 3;
+	switch (src->bits_per_pixel) {
+	    case 8:
+		    pc->convRow = conv_row8;
+		    break;
+	    case 16:
+		    pc->convRow = conv_row16;
+#ifdef __SSE2__
+		    if (simd) {
+			    pc->convRow = conv_row16_sse2;
+		    }
+#endif
+		    break;
+	    case 32:
+		    pc->convRow = conv_row32;
+#ifdef __SSE2__
+		    if (simd) {
+			    pc->convRow = conv_row32_sse2;
+		    }
+#endif
+		    break;
+	    default:
+		    pc->convRow = conv_row_none;
+		    break;
+	}
+}
+
+/*
+ * ------------------------------------------------------------------
+ * Packers: store pixel values with the bytes per pixel of the
+ * display. swap is set when the byte order of the display differs
+ * from the host.
+ * ------------------------------------------------------------------
+ */
+static uint8_t *
+pack8(uint8_t * dst, const uint32_t * pixvals, unsigned int count)
+{
+	unsigned int i;
+	for (i = 0; i < count; i++) {
+		dst[i] = pixvals[i];
+	}
+	return dst + count;
+}
+
+static uint8_t *
+pack16_common(uint8_t * dst, const uint32_t * pixvals, unsigned int count, int swap)
+{
+	unsigned int i = 0;
+	uint16_t pixval;
+#ifdef __SSE2__
+	for (; i + 8 <= count; i += 8) {
+		__m128i a = _mm_loadu_si128((const __m128i *)(pixvals + i));
+		__m128i b = _mm_loadu_si128((const __m128i *)(pixvals + i + 4));
+		__m128i r;
+		/* Sign extend so that the saturating pack is exact */
+		a = _mm_srai_epi32(_mm_slli_epi32(a, 16), 16);
+		b = _mm_srai_epi32(_mm_slli_epi32(b, 16), 16);
+		r = _mm_packs_epi32(a, b);
+		if (swap) {
+			r = _mm_or_si128(_mm_slli_epi16(r, 8), _mm_srli_epi16(r, 8));
+		}
+		_mm_storeu_si128((__m128i *) (dst + 2 * i), r);
+	}
+#endif
+	for (; i < count; i++) {
+		pixval = swap ? BYTE_Swap16(pixvals[i]) : pixvals[i];
+		memcpy(dst + 2 * i, &pixval, 2);
+	}
+	return dst + 2 * count;
+}
+
+static uint8_t *
+pack16(uint8_t * dst, const uint32_t * pixvals, unsigned int count)
+{
+	return pack16_common(dst, pixvals, count, 0);
+}
+
+static uint8_t *
+pack16_swap(uint8_t * dst, const uint32_t * pixvals, unsigned int count)
+{
+	return pack16_common(dst, pixvals, count, 1);
+}
+
+static uint8_t *
+pack24(uint8_t * dst, const uint32_t * pixvals, unsigned int count)
+{
+	unsigned int i;
+	for (i = 0; i < count; i++) {
+		/* Do not use write32 because of alignment traps */
+		const uint8_t *pix = (const uint8_t *)&pixvals[i];
+		*dst++ = pix[0];
+		*dst++ = pix[1];
+		*dst++ = pix[2];
+	}
+	return dst;
+}
+
+static uint8_t *
+pack24_swap(uint8_t * dst, const uint32_t * pixvals, unsigned int count)
+{
+	unsigned int i;
+	for (i = 0; i < count; i++) {
+		const uint8_t *pix = (const uint8_t *)&pixvals[i];
+		*dst++ = pix[3];
+		*dst++ = pix[2];
+		*dst++ = pix[1];
+	}
+	return dst;
+}
+
+static uint8_t *
+pack32(uint8_t * dst, const uint32_t * pixvals, unsigned int count)
+{
+	memcpy(dst, pixvals, 4 * count);
+	return dst + 4 * count;
+}
+
+static uint8_t *
+pack32_swap(uint8_t * dst, const uint32_t * pixvals, unsigned int count)
+{
+	unsigned int i = 0;
+	uint32_t pixval;
+#ifdef __SSE2__
+	__m128i mask_hi = _mm_set1_epi32(0x00ff0000);
+	__m128i mask_lo = _mm_set1_epi32(0x0000ff00);
+	for (; i + 4 <= count; i += 4) {
+		__m128i v = _mm_loadu_si128((const __m128i *)(pixvals + i));
+		__m128i r = _mm_or_si128(_mm_slli_epi32(v, 24), _mm_srli_epi32(v, 24));
+		r = _mm_or_si128(r, _mm_and_si128(_mm_slli_epi32(v, 8), mask_hi));
+		r = _mm_or_si128(r, _mm_and_si128(_mm_srli_epi32(v, 8), mask_lo));
+		_mm_storeu_si128((__m128i *) (dst + 4 * i), r);
+	}
+#endif
+	for (; i < count; i++) {
+		pixval = BYTE_Swap32(pixvals[i]);
+		memcpy(dst + 4 * i, &pixval, 4);
+	}
+	return dst + 4 * count;
+}
+
+PixConv_PackProc *
+PixConv_GetPacker(int bypp, int swap)
+{
+	switch (bypp) {
+	    case 1:
+		    return pack8;
+	    case 2:
+		    return swap ? pack16_swap : pack16;
+	    case 3:
+		    return swap ? pack24_swap : pack24;
+	    case 4:
+		    return swap ? pack32_swap : pack32;
+	    default:
+		    return NULL;
+	}
+}
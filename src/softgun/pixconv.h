@@ -0,0 +1,78 @@
+//===-- softgun/pixconv.h -----------------------------------------*- C -*-===//
+//
+//              The Leigun Embedded System Simulator Platform
+//
+// Licensed under the Apache License, Version 2.0 (the "License");
+// you may not use this file except in compliance with the License.
+// You may obtain a copy of the License at
+//
+//     http://www.apache.org/licenses/LICENSE-2.0
+//
+// Unless required by applicable law or agreed to in writing, software
+// distributed under the License is distributed on an "AS IS" BASIS,
+// WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+// See the License for the specific language governing permissions and
+// limitations under the License.
+//
+//===----------------------------------------------------------------------===//
+///
+/// @file
+/// Row wise conversion of framebuffer pixels to a display pixel format
+///
+//===----------------------------------------------------------------------===//
+#ifndef _PIXCONV_H
+#define _PIXCONV_H
+#include <stdint.h>
+
+typedef struct PixConvFormat {
+	uint8_t bits_per_pixel;
+	uint16_t red_max;
+	uint16_t green_max;
+	uint16_t blue_max;
+	uint8_t red_shift;
+	uint8_t green_shift;
+	uint8_t blue_shift;
+} PixConvFormat;
+
+typedef struct PixConvChannel {
+	uint8_t src_shift;
+	uint8_t dst_shift;
+	uint16_t src_max;
+	uint16_t dst_max;
+	/* x / src_max == (x * magic) >> (16 + magic_shift) for all used x */
+	uint16_t magic;
+	uint8_t magic_shift;
+} PixConvChannel;
+
+typedef struct PixConv PixConv;
+typedef void PixConv_RowProc(const PixConv * pc, uint32_t * dst, const uint8_t * src,
+			     unsigned int count);
+typedef uint8_t *PixConv_PackProc(uint8_t * dst, const uint32_t * pixvals, unsigned int count);
+
+struct PixConv {
+	PixConv_RowProc *convRow;
+	uint8_t src_bypp;
+	PixConvChannel chan[3];
+	uint32_t trans[3][256];
+};
+
+/*
+ * Select the row converter for framebuffer pixels (stored little endian)
+ * in format src to pixel values in format dst. Only called when one
+ * of the formats changes.
+ */
+void PixConv_Init(PixConv * pc, const PixConvFormat * src, const PixConvFormat * dst);
+
+/*
+ * Return the proc storing pixel values with bypp bytes per pixel,
+ * optionally byte swapped, NULL if bypp is not supported.
+ */
+PixConv_PackProc *PixConv_GetPacker(int bypp, int swap);
+
+/* Convert count framebuffer pixels at src to pixel values */
+static inline void
+PixConv_Row(const PixConv * pc, uint32_t * dst, const uint8_t * src, unsigned int count)
+{
+	pc->convRow(pc, dst, src, count);
+}
+#endif
@@ -0,0 +1,348 @@
+//===-- softgun/profiler.c ----------------------------------------*- C -*-===//
+//
+//              The Leigun Embedded System Simulator Platform
+//
+// Licensed under the Apache License, Version 2.0 (the "License");
+// you may not use this file except in compliance with the License.
+// You may obtain a copy of the License at
+//
+//     http://www.apache.org/licenses/LICENSE-2.0
+//
+// Unless required by applicable law or agreed to in writing, software
+// distributed under the License is distributed on an "AS IS" BASIS,
+// WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+// See the License for the specific language governing permissions and
+// limitations under the License.
+//
+//===----------------------------------------------------------------------===//
+///
+/// @file
+/// Sampling profiler for the guest code
+///
+/// A CycleTimer samples the PC of the CPU every interval cycles and
+/// counts the samples per PC. At exit the samples are resolved to the
+/// function symbols of the loaded ELF files and written in the folded
+/// stack format ("cpu;function count" per line) which is understood by
+/// flamegraph.pl and speedscope. PCs outside of any symbol are written
+/// as hex address.
+///
+/// Configuration (section "profiler"):
+///   interval: cycles between two samples, 0 (default) disables it
+///   output:   folded output file, default "leigun.folded", or
+///             "leigun@<n>.folded" for the machine instance n > 0
+///   symbols:  additional ELF file with symbols, for example the
+///             kernel image when the board boots a raw binary
+///
+//===----------------------------------------------------------------------===//
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <stdint.h>
+#include "profiler.h"
+#include "cycletimer.h"
+#include "configfile.h"
+#include "elfloader.h"
+#include "exithandler.h"
+#include "sgstring.h"
+#include "compiler_extensions.h"
+
+#define PROF_HASH_BITS		(16)
+#define PROF_HASH_SIZE		(1 << PROF_HASH_BITS)
+#define PROF_HASH_MAXFILL	(PROF_HASH_SIZE - (PROF_HASH_SIZE >> 3))
+#define PROF_HASH_INDEX(pc)	(((pc) * 0x9e3779b1U) >> (32 - PROF_HASH_BITS))
+
+/*
+ * The hash is never resized. The exit handler may run on another
+ * thread while the CPU still samples, so the table has to stay
+ * valid for reading all the time.
+ */
+typedef struct ProfSample {
+	uint32_t pc;
+	uint32_t count;
+} ProfSample;
+
+typedef struct ProfSymbol {
+	char *name;
+	uint32_t addr;
+	uint32_t size;
+} ProfSymbol;
+
+typedef struct ProfFile {
+	struct ProfFile *next;
+	char *filename;
+} ProfFile;
+
+typedef struct Profiler {
+	CycleTimer timer;
+	uint32_t interval;
+	uint32_t jitter;
+	const char *cpuname;
+	Profiler_GetPcProc *getPc;
+	void *clientData;
+	ProfSample *samples;
+	uint32_t nr_used;
+	uint64_t nr_samples;
+	uint64_t nr_dropped;
+	char *output;
+	ProfFile *files;
+	ProfSymbol *syms;
+	uint32_t nr_syms;
+	uint32_t syms_allocated;
+} Profiler;
+
+/* Each machine profiles its own first CPU */
+static __MACHINE_LOCAL__ Profiler *gprof;
+
+/*
+ * -----------------------------------------------------------------
+ * The sample interval is varied by up to 1/8 so that the samples
+ * do not lock to periodic guest activity like the timer interrupt.
+ * -----------------------------------------------------------------
+ */
+static void
+sample_proc(void *clientData)
+{
+	Profiler *pr = clientData;
+	uint32_t pc = pr->getPc(pr->clientData);
+	uint32_t idx = PROF_HASH_INDEX(pc);
+	ProfSample *smpl;
+	pr->nr_samples++;
+	while (1) {
+		smpl = &pr->samples[idx];
+		if (smpl->count == 0) {
+			if (pr->nr_used >= PROF_HASH_MAXFILL) {
+				pr->nr_dropped++;
+				break;
+			}
+			pr->nr_used++;
+			smpl->pc = pc;
+			smpl->count = 1;
+			break;
+		} else if (smpl->pc == pc) {
+			smpl->count++;
+			break;
+		}
+		idx = (idx + 1) & (PROF_HASH_SIZE - 1);
+	}
+	CycleTimer_Add(&pr->timer, pr->interval + (lrand48() % pr->jitter), sample_proc,
+		       pr);
+}
+
+static void
+add_symbol(const char *name, uint64_t addr, uint64_t size, void *clientData)
+{
+	Profiler *pr = clientData;
+	ProfSymbol *sym;
+	if (pr->nr_syms == pr->syms_allocated) {
+		pr->syms_allocated = pr->syms_allocated ? 2 * pr->syms_allocated : 1024;
+		pr->syms = sg_realloc(pr->syms, pr->syms_allocated * sizeof(ProfSymbol));
+	}
+	sym = &pr->syms[pr->nr_syms++];
+	sym->name = sg_strdup(name);
+	/* Thumb functions have bit 0 set */
+	sym->addr = addr & ~UINT64_C(1);
+	sym->size = size;
+}
+
+static int
+compare_symbols(const void *p1, const void *p2)
+{
+	const ProfSymbol *s1 = p1;
+	const ProfSymbol *s2 = p2;
+	if (s1->addr != s2->addr) {
+		return s1->addr < s2->addr ? -1 : 1;
+	}
+	/* The sized symbol wins over aliases without size */
+	return s1->size > s2->size ? -1 : (s1->size < s2->size);
+}
+
+/*
+ * -----------------------------------------------------------------
+ * Find the function containing pc. Symbols without size are
+ * assumed to extend up to the next symbol.
+ * -----------------------------------------------------------------
+ */
+static ProfSymbol *
+find_symbol(Profiler * pr, uint32_t pc)
+{
+	uint32_t lo = 0;
+	uint32_t hi = pr->nr_syms;
+	ProfSymbol *sym;
+	while (lo < hi) {
+		uint32_t mid = (lo + hi) / 2;
+		if (pr->syms[mid].addr <= pc) {
+			lo = mid + 1;
+		} else {
+			hi = mid;
+		}
+	}
+	if (lo == 0) {
+		return NULL;
+	}
+	sym = &pr->syms[lo - 1];
+	while ((sym > pr->syms) && (sym[-1].addr == sym->addr)) {
+		sym--;
+	}
+	if (sym->size && (pc - sym->addr >= sym->size)) {
+		return NULL;
+	}
+	return sym;
+}
+
+static int
+compare_samples(const void *p1, const void *p2)
+{
+	const ProfSample *s1 = p1;
+	const ProfSample *s2 = p2;
+	return s1->count < s2->count ? 1 : -(s1->count > s2->count);
+}
+
+static void
+load_symbols(Profiler * pr)
+{
+	ProfFile *pf;
+	uint32_t i, j;
+	for (pf = pr->files; pf; pf = pf->next) {
+		if (Elf_ReadSymbols(pf->filename, add_symbol, pr) < 0) {
+			fprintf(stderr, "Profiler: Can not read symbols from \"%s\"\n",
+				pf->filename);
+		}
+	}
+	if (pr->nr_syms == 0) {
+		return;
+	}
+	qsort(pr->syms, pr->nr_syms, sizeof(ProfSymbol), compare_symbols);
+	/* Drop duplicates from loading the same file twice */
+	for (i = 1, j = 1; i < pr->nr_syms; i++) {
+		if ((pr->syms[i].addr == pr->syms[j - 1].addr)
+		    && (pr->syms[i].size == pr->syms[j - 1].size)
+		    && !strcmp(pr->syms[i].name, pr->syms[j - 1].name)) {
+			sg_free(pr->syms[i].name);
+			continue;
+		}
+		pr->syms[j++] = pr->syms[i];
+	}
+	pr->nr_syms = j;
+}
+
+/*
+ * -----------------------------------------------------------------
+ * Write the folded stacks. The samples are summed up per function,
+ * PCs without symbol follow with the most frequent first.
+ * -----------------------------------------------------------------
+ */
+static void
+write_profile(void *data)
+{
+	Profiler *pr = data;
+	ProfSample *samples;
+	uint32_t *symcount;
+	uint32_t i, n;
+	FILE *file;
+
+	samples = sg_calloc(sizeof(ProfSample) * PROF_HASH_SIZE);
+	for (i = 0, n = 0; i < PROF_HASH_SIZE; i++) {
+		if (pr->samples[i].count) {
+			samples[n++] = pr->samples[i];
+		}
+	}
+	load_symbols(pr);
+	symcount = sg_calloc(sizeof(uint32_t) * (pr->nr_syms + 1));
+	file = fopen(pr->output, "w");
+	if (!file) {
+		perror("Profiler: Can not open output file");
+		goto out;
+	}
+	for (i = 0; i < n; i++) {
+		ProfSymbol *sym = find_symbol(pr, samples[i].pc);
+		if (sym) {
+			symcount[sym - pr->syms] += samples[i].count;
+			samples[i].count = 0;
+		}
+	}
+	for (i = 0; i < pr->nr_syms; i++) {
+		if (symcount[i]) {
+			fprintf(file, "%s;%s %u\n", pr->cpuname, pr->syms[i].name, symcount[i]);
+		}
+	}
+	qsort(samples, n, sizeof(ProfSample), compare_samples);
+	for (i = 0; (i < n) && samples[i].count; i++) {
+		fprintf(file, "%s;0x%08x %u\n", pr->cpuname, samples[i].pc, samples[i].count);
+	}
+	fclose(file);
+	fprintf(stderr, "Profiler: %llu samples, %llu dropped, written to \"%s\"\n",
+		(unsigned long long)pr->nr_samples, (unsigned long long)pr->nr_dropped,
+		pr->output);
+ out:
+	sg_free(symcount);
+	sg_free(samples);
+}
+
+static Profiler *
+profiler_get(void)
+{
+	if (!gprof) {
+		gprof = sg_new(Profiler);
+	}
+	return gprof;
+}
+
+/*
+ * ------------------------------------------------------------------
+ * Remember an ELF file for symbol lookup. The symbols are only read
+ * when the profile is written.
+ * ------------------------------------------------------------------
+ */
+void
+Profiler_AddSymbolFile(const char *filename)
+{
+	Profiler *pr = profiler_get();
+	ProfFile *pf = sg_new(ProfFile);
+	pf->filename = sg_strdup(filename);
+	pf->next = pr->files;
+	pr->files = pf;
+}
+
+/*
+ * ------------------------------------------------------------------
+ * Called by the CPU with a proc returning the address of the
+ * instruction executed next. Starts sampling if the profiler is
+ * configured. Only the first CPU is profiled.
+ * ------------------------------------------------------------------
+ */
+void
+Profiler_RegisterCpu(const char *cpuname, Profiler_GetPcProc * proc, void *clientData)
+{
+	Profiler *pr = profiler_get();
+	char defname[32];
+	char *str;
+	if (pr->getPc) {
+		fprintf(stderr, "Profiler: Only the first CPU (%s) is profiled\n", pr->cpuname);
+		return;
+	}
+	if ((Config_ReadUInt32(&pr->interval, "profiler", "interval") < 0)
+	    || (pr->interval == 0)) {
+		return;
+	}
+	pr->cpuname = cpuname;
+	pr->getPc = proc;
+	pr->clientData = clientData;
+	pr->jitter = (pr->interval >> 3) + 1;
+	str = Config_ReadVar("profiler", "output");
+	if (Config_GetInstance() > 0) {
+		snprintf(defname, sizeof(defname), "leigun@%u.folded", Config_GetInstance());
+	} else {
+		snprintf(defname, sizeof(defname), "leigun.folded");
+	}
+	pr->output = sg_strdup(str ? str : defname);
+	str = Config_ReadVar("profiler", "symbols");
+	if (str) {
+		Profiler_AddSymbolFile(str);
+	}
+	pr->samples = sg_calloc(sizeof(ProfSample) * PROF_HASH_SIZE);
+	CycleTimer_Init(&pr->timer, sample_proc, pr);
+	CycleTimer_Add(&pr->timer, pr->interval, sample_proc, pr);
+	ExitHandler_Register(write_profile, pr);
+	fprintf(stderr, "Profiler: Sampling %s every %u cycles\n", cpuname, pr->interval);
+}
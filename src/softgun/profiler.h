@@ -0,0 +1,9 @@
+#ifndef _PROFILER_H
+#define _PROFILER_H
+#include <stdint.h>
+
+typedef uint32_t Profiler_GetPcProc(void *clientData);
+
+void Profiler_RegisterCpu(const char *cpuname, Profiler_GetPcProc * proc, void *clientData);
+void Profiler_AddSymbolFile(const char *filename);
+#endif
@@ -59,6 +59,7 @@
 #include "fbdisplay.h"
 #include "sgstring.h"
 #include "sglib.h"
+#include "pixconv.h"
 
 #include "asyncmanager.h"
 
@@ -138,6 +139,14 @@ typedef struct RLEncoder {
 } RLEncoder;
 
 #define UDRECT_FIFOSIZE (256)
+
+/*
+ * The framebuffer is diffed in tiles of TILE_SIZE x TILE_SIZE pixels.
+ * This is also the tile size of ZRLE, so the update rectangles built
+ * from the tiles do not split ZRLE tiles.
+ */
+#define TILE_SHIFT	(6)
+#define TILE_SIZE	(1 << TILE_SHIFT)
 /*
  * -----------------------------------------------------------------------------
  * RfbConnection structure contains the state information
@@ -148,14 +157,12 @@ typedef struct RLEncoder {
 typedef struct RfbConnection {
   int protoversion;	/* major in high 16 bit minor in lower 16 Bit */
   int state;
-  int current_encoding;
+  int current_encoding;	/* changed under enc_lock, read by the encoder */
   StreamHandle_t *handle;
 
-  PixelFormat pixfmt;
-  /* translation table belongs to the pixel format */
-  uint32_t trans_red[256];
-  uint32_t trans_green[256];
-  uint32_t trans_blue[256];
+  PixelFormat pixfmt;	/* changed under enc_lock, read by the encoder */
+  /* the converter belongs to the pixel format */
+  PixConv conv;
 
   FrameBufferInfo *fbi;	/* points to fbi of RfbServer */
   struct RfbConnection *next;
@@ -174,6 +181,27 @@ typedef struct RfbConnection {
   uint8_t *obuf;
   int obuf_wp;
   int obuf_size;
+  /* One byte per tile, set when the tile changed since the last update */
+  uint8_t *dirty_tiles;
+  unsigned int nr_dirty;
+  /*
+   * Encoder thread. It works on a private copy of the rectangles of
+   * one update and hands the encoded message to the AsyncManager
+   * thread. busy is set from handing over the job until the message
+   * is written, changes meanwhile accumulate in dirty_tiles.
+   */
+  uv_thread_t encoder;
+  uv_cond_t job_cond;
+  uv_mutex_t enc_lock;	/* held while encoding, protects pixel format and encoding */
+  NotifyHandle_t *out_notify;
+  FrameBufferInfo snap;
+  UpdateRectangle job_rects[UDRECT_FIFOSIZE];
+  int nr_job_rects;
+  int job_pending;
+  int out_ready;
+  int busy;
+  int closing;
+  int quit;
 } RfbConnection;
 
 struct RfbServer {
@@ -192,6 +220,16 @@ struct RfbServer {
   /* Servers native FBI (window info & Pixelformat */
   FrameBufferInfo fbi;
   uint32_t exit_on_close;
+  unsigned int tiles_x;
+  unsigned int tiles_y;
+  /* Tiles changed by the current update request from the display user */
+  uint8_t *changed_tiles;
+  /*
+   * Protects the framebuffer, the connection list and the update
+   * state of the connections against the display user, the
+   * AsyncManager thread and the encoder threads.
+   */
+  uv_mutex_t lock;
 };
 
 /*
@@ -209,49 +247,40 @@ pixfmt_update_bits(PixelFormat * pixfmt) {
 
 static void
 pixfmt_update_translation(RfbConnection * rcon) {
-  uint32_t red, green, blue;
   FrameBufferInfo *fbi = rcon->fbi;
   PixelFormat *pixf = &rcon->pixfmt;
   PixelFormat *fbpixf = &fbi->pixfmt;
-  for (red = 0; red <= fbpixf->red_max; red++) {
-    uint32_t trans;
-    trans = red * pixf->red_max / fbpixf->red_max;
-    trans <<= pixf->red_shift;
-    rcon->trans_red[red] = trans;
-  }
-  for (green = 0; green <= fbpixf->green_max; green++) {
-    uint32_t trans;
-    trans = green * pixf->green_max / fbpixf->green_max;
-    trans <<= pixf->green_shift;
-    rcon->trans_green[green] = trans;
-  }
-  for (blue = 0; blue <= fbpixf->blue_max; blue++) {
-    uint32_t trans;
-    trans = blue * pixf->blue_max / fbpixf->blue_max;
-    trans <<= pixf->blue_shift;
-    rcon->trans_blue[blue] = trans;
-  }
+  PixConvFormat src, dst;
+  src.bits_per_pixel = fbpixf->bits_per_pixel;
+  src.red_max = fbpixf->red_max;
+  src.green_max = fbpixf->green_max;
+  src.blue_max = fbpixf->blue_max;
+  src.red_shift = fbpixf->red_shift;
+  src.green_shift = fbpixf->green_shift;
+  src.blue_shift = fbpixf->blue_shift;
+  dst.bits_per_pixel = pixf->bits_per_pixel;
+  dst.red_max = pixf->red_max;
+  dst.green_max = pixf->green_max;
+  dst.blue_max = pixf->blue_max;
+  dst.red_shift = pixf->red_shift;
+  dst.green_shift = pixf->green_shift;
+  dst.blue_shift = pixf->blue_shift;
+  PixConv_Init(&rcon->conv, &src, &dst);
 }
 
 static void free_rcon(Handle_t *handle, void *clientdata) {
-  RfbConnection *cursor, *prev;
   RfbConnection *rcon = clientdata;
   RfbServer *rfbserv = rcon->rfbserv;
-  for (prev = NULL, cursor = rfbserv->con_head; cursor; prev = cursor, cursor = cursor->next) {
-    if (cursor == rcon) {
-      if (prev) {
-        prev->next = cursor->next;
-      } else {
-        rfbserv->con_head = cursor->next;
-      }
-    }
-  }
 #ifndef NO_ZLIB
   deflateEnd(&rcon->zs);
 #endif
   if (rcon->obuf) {
     free(rcon->obuf);
   }
+  sg_free(rcon->dirty_tiles);
+  sg_free(rcon->snap.framebuffer);
+  uv_cond_destroy(&rcon->job_cond);
+  uv_mutex_destroy(&rcon->enc_lock);
   free(rcon);
   if (rfbserv->exit_on_close && !rfbserv->con_head) {
     fprintf(stderr, "Exiting after termination of last VNC connection\n");
@@ -259,6 +288,35 @@ static void free_rcon(Handle_t *handle, void *clientdata) {
   }
 }
 
+/*
+ * --------------------------------------------------------------------------
+ * rfbcon_closed
+ * 	The socket is closed. Remove the connection from the list and stop
+ *	the encoder. The encoder never waits for the AsyncManager thread,
+ *	so it can be joined here.
+ * --------------------------------------------------------------------------
+ */
+static void rfbcon_closed(Handle_t *handle, void *clientdata) {
+  RfbConnection *cursor, *prev;
+  RfbConnection *rcon = clientdata;
+  RfbServer *rfbserv = rcon->rfbserv;
+  uv_mutex_lock(&rfbserv->lock);
+  for (prev = NULL, cursor = rfbserv->con_head; cursor; prev = cursor, cursor = cursor->next) {
+    if (cursor == rcon) {
+      if (prev) {
+        prev->next = cursor->next;
+      } else {
+        rfbserv->con_head = cursor->next;
+      }
+    }
+  }
+  rcon->quit = 1;
+  uv_cond_signal(&rcon->job_cond);
+  uv_mutex_unlock(&rfbserv->lock);
+  uv_thread_join(&rcon->encoder);
+  AsyncManager_Close(AsyncManager_Notify2Handle(rcon->out_notify), &free_rcon, rcon);
+}
+
 /*
  * --------------------------------------------------------------------------
  * rfbsrv_disconnect
@@ -267,8 +325,11 @@ static void free_rcon(Handle_t *handle, void *clientdata) {
  */
 static void
 rfbsrv_disconnect(RfbConnection * rcon) {
+  uv_mutex_lock(&rcon->rfbserv->lock);
+  rcon->closing = 1;
+  uv_mutex_unlock(&rcon->rfbserv->lock);
   AsyncManager_ReadStop(rcon->handle);
-  AsyncManager_Close((Handle_t *)rcon->handle, &free_rcon, rcon);
+  AsyncManager_Close((Handle_t *)rcon->handle, &rfbcon_closed, rcon);
 }
 
 static int
@@ -481,125 +542,6 @@ Msg_ServerInitialisation(RfbConnection * rcon) {
 #define write16(addr,value) (*(uint16_t*)(addr) = (value))
 #define write32(addr,value) (*(uint32_t*)(addr) = (value))
 
-  /*
-   * ------------------------------------------------------------------------------
-   * Convert a single pixel stored in a src buffer from the framebuffer
-   * pixel format into a destination pixel format which is connection specific
-   * ------------------------------------------------------------------------------
-   */
-
-static inline uint32_t
-encode_pixval(RfbConnection * rcon, void *src, PixelFormat * pixf, PixelFormat * fbpixf) {
-  uint32_t pixval;
-  uint8_t red, green, blue;
-
-  switch (fbpixf->bits_per_pixel) {
-  case 32:
-    pixval = BYTE_LeToH32(*(uint32_t *)src);
-    break;
-  case 16:
-    pixval = BYTE_LeToH16(*(uint16_t *)src);
-    break;
-  case 8:
-    pixval = *(uint8_t *)src;
-    break;
-  default:
-    pixval = 0;
-  }
-  red = (pixval >> fbpixf->red_shift) & fbpixf->red_max;
-  green = (pixval >> fbpixf->green_shift) & fbpixf->green_max;
-  blue = (pixval >> fbpixf->blue_shift) & fbpixf->blue_max;
-  return rcon->trans_red[red] | rcon->trans_green[green] | rcon->trans_blue[blue];
-}
-
-/*
- * ---------------------------------------------------------------
- * write a pixel value into a buffer
- * ---------------------------------------------------------------
- */
-static int
-write_pixel8(uint8_t * dst, uint32_t pixval) {
-  dst[0] = pixval;
-  return 1;
-}
-
-static int
-write_pixel16_swap(uint8_t * dst, uint32_t pixval) {
-  write16(dst, BYTE_Swap16(pixval));
-  return 2;
-}
-
-static int
-write_pixel16(uint8_t * dst, uint32_t pixval) {
-  write16(dst, pixval);
-  return 2;
-}
-
-static int
-write_pixel24_swap(uint8_t * dst, uint32_t pixval) {
-  uint8_t *pix = (uint8_t *)& pixval;
-  dst[0] = pix[3];
-  dst[1] = pix[2];
-  dst[2] = pix[1];
-  return 3;
-}
-
-static int
-write_pixel24(uint8_t * dst, uint32_t pixval) {
-  /* Do not use write32 because of alignment traps */
-  uint8_t *pix = (uint8_t *)& pixval;
-  dst[0] = pix[0];
-  dst[1] = pix[1];
-  dst[2] = pix[2];
-  return 3;
-}
-
-static int
-write_pixel32_swap(uint8_t * dst, uint32_t pixval) {
-  write32(dst, BYTE_Swap32(pixval));
-  return 4;
-}
-
-static int
-write_pixel32(uint8_t * dst, uint32_t pixval) {
-  write32(dst, pixval);
-  return 4;
-}
-
-typedef int WritePixelProc(uint8_t * dst, uint32_t pixval);
-
-static WritePixelProc *
-GetWritePixelProc(int con_bypp, int swap) {
-  switch (con_bypp) {
-  case 1:
-    return write_pixel8;
-  case 2:
-    if (swap) {
-      return write_pixel16_swap;
-    } else {
-      return write_pixel16;
-    }
-    break;
-  case 3:
-    if (swap) {
-      return write_pixel24_swap;
-    } else {
-      return write_pixel24;
-    }
-    break;
-  case 4:
-    if (swap) {
-      return write_pixel32_swap;
-    } else {
-      return write_pixel32;
-    }
-    break;
-  default:
-    fprintf(stderr, "%d bytes per pixel not implemented\n", con_bypp);
-    return NULL;
-  }
-}
-
 static inline int
 write_pixel(int con_bypp, int swap, uint8_t * dst, uint32_t pixval) {
   switch (con_bypp) {
@@ -711,46 +653,47 @@ rle_flush(RLEncoder * rle, int con_bypp, int swap, uint8_t * dst) {
 /*
  * ------------------------------------------------------------------------
  * srv_encode_update_raw
- *	Make a raw update request from the rectangles in the fifo
+ *	Make a raw update message from the rectangles of the job
  * ------------------------------------------------------------------------
  */
 static inline void
 srv_fb_encode_update_raw(RfbConnection * rcon) {
-  WritePixelProc *wpProc;
-  FrameBufferInfo *fbi = rcon->fbi;
+  PixConv_PackProc *packProc;
+  FrameBufferInfo *fbi = &rcon->snap;
   PixelFormat *pixf = &rcon->pixfmt;
   PixelFormat *fbpixf = &fbi->pixfmt;
   int con_bypp = pixf->bits_per_pixel >> 3;
   int fb_bypp = fbi->pixfmt.bits_per_pixel >> 3;
+  uint32_t *pixvals = alloca(fbi->fb_width * sizeof(uint32_t));
   uint8_t *reply;
   uint8_t *data;
-  int x, y;
+  int memsize;
+  int y, i;
   int swap;
-  reply = rcon->obuf;
-  data = reply;
-  data += add_update_header(data, rcon->udrect_wp - rcon->udrect_rp);
 
   swap = (pixf->big_endian_flag != fbpixf->big_endian_flag);
-  wpProc = GetWritePixelProc(con_bypp, swap);
-  if (!wpProc) {
+  packProc = PixConv_GetPacker(con_bypp, swap);
+  if (!packProc) {
+    fprintf(stderr, "%d bytes per pixel not implemented\n", con_bypp);
     return;
   }
-  while (rcon->udrect_rp < rcon->udrect_wp) {
-    int memsize;
-    UpdateRectangle *udrect = &rcon->udrect_fifo[rcon->udrect_rp % UDRECT_FIFOSIZE];
-
-    rcon->udrect_rp++;
-    memsize = udrect->width * udrect->height * con_bypp + 16;
-    if (rcon->obuf_size < memsize) {
-      rcon->obuf_size = memsize;
-      reply = realloc(rcon->obuf, rcon->obuf_size);
-      if (!reply) {
-        fprintf(stderr, "RFB-Server: No memory\n");
-        return;
-      }
-      data = reply + (data - rcon->obuf);
-      rcon->obuf = reply;
+  memsize = 4;
+  for (i = 0; i < rcon->nr_job_rects; i++) {
+    memsize += rcon->job_rects[i].width * rcon->job_rects[i].height * con_bypp + 12;
+  }
+  if (rcon->obuf_size < memsize) {
+    reply = realloc(rcon->obuf, memsize);
+    if (!reply) {
+      fprintf(stderr, "RFB-Server: No memory\n");
+      return;
     }
+    rcon->obuf = reply;
+    rcon->obuf_size = memsize;
+  }
+  data = rcon->obuf;
+  data += add_update_header(data, rcon->nr_job_rects);
+  for (i = 0; i < rcon->nr_job_rects; i++) {
+    UpdateRectangle *udrect = &rcon->job_rects[i];
 
     write16be(data, udrect->x);
     write16be(data + 2, udrect->y);
@@ -761,16 +704,11 @@ srv_fb_encode_update_raw(RfbConnection * rcon) {
 
     for (y = udrect->y; y < (udrect->y + udrect->height); y++) {
       int ofs = (y * fbi->fb_width + udrect->x) * fb_bypp;
-      for (x = udrect->x; x < (udrect->x + udrect->width); x++) {
-        uint32_t pixval =
-          encode_pixval(rcon, &fbi->framebuffer[ofs], pixf, fbpixf);
-        data += wpProc(data, pixval);
-        ofs += fb_bypp;
-      }
+      PixConv_Row(&rcon->conv, pixvals, (uint8_t *)&fbi->framebuffer[ofs], udrect->width);
+      data = packProc(data, pixvals, udrect->width);
     }
-    AsyncManager_WriteSync(rcon->handle, reply, data - reply);
-    data = reply;
   }
+  rcon->obuf_wp = data - rcon->obuf;
   return;
 }
 
@@ -783,23 +721,36 @@ srv_fb_encode_update_raw(RfbConnection * rcon) {
  */
 static inline void
 srv_fb_encode_update_zrle(RfbConnection * rcon) {
-  FrameBufferInfo *fbi = rcon->fbi;
+  FrameBufferInfo *fbi = &rcon->snap;
   PixelFormat *pixf = &rcon->pixfmt;
   PixelFormat *fbpixf = &fbi->pixfmt;
   int con_bypp = pixf->bits_per_pixel >> 3;
   int fb_bypp = fbi->pixfmt.bits_per_pixel >> 3;
   uint8_t *tileBuf = alloca(1 + 64 * 64 * 5);
+  uint32_t pixvals[64];
   uint8_t *tileBufEnd;
   int lengthP;
   int ofs;
   int x0, y0, x1, y1, y;
+  int tile_width;
+  int i;
   RLEncoder *rle = &rcon->rle;
   z_stream *zs = &rcon->zs;
-  rcon->obuf_wp = add_update_header(rcon->obuf, rcon->udrect_wp - rcon->udrect_rp);
-  while (rcon->udrect_rp < rcon->udrect_wp) {
-    UpdateRectangle *udrect = &rcon->udrect_fifo[rcon->udrect_rp % UDRECT_FIFOSIZE];
+  rcon->obuf_wp = add_update_header(rcon->obuf, rcon->nr_job_rects);
+  for (i = 0; i < rcon->nr_job_rects; i++) {
+    UpdateRectangle *udrect = &rcon->job_rects[i];
     /* fprintf(stderr,"Udrect height %d, width %d\n",udrect->height,udrect->width); */
-    rcon->udrect_rp++;
+    if ((rcon->obuf_size - rcon->obuf_wp) < (32768 + 16)) {
+      uint8_t *obuf;
+      rcon->obuf_size *= 2;
+      obuf = realloc(rcon->obuf, rcon->obuf_size);
+      if (!obuf) {
+        fprintf(stderr, "RFB: Not enough memory\n");
+        rcon->obuf_wp = 0;
+        return;
+      }
+      rcon->obuf = obuf;
+    }
     write16be(rcon->obuf + rcon->obuf_wp, udrect->x);
     write16be(rcon->obuf + rcon->obuf_wp + 2, udrect->y);
     write16be(rcon->obuf + rcon->obuf_wp + 4, udrect->width);
@@ -822,17 +773,18 @@ srv_fb_encode_update_zrle(RfbConnection * rcon) {
         tileBufEnd = tileBuf;
         *tileBufEnd++ = 128;	/* Plain RLE */
         rle_init(rle);
+        tile_width = udrect->width - x0;
+        if (tile_width > 64) {
+          tile_width = 64;
+        }
         for (y1 = 0; (y1 < 64) && ((y0 + y1) < udrect->height); y1++) {
           y = y0 + y1 + udrect->y;
           ofs = (y * fbi->fb_width + (x0 + udrect->x)) * fb_bypp;
-          for (x1 = 0; (x1 < 64) && ((x1 + x0) < udrect->width); x1++) {
-            uint32_t pixval =
-              encode_pixval(rcon, &fbi->framebuffer[ofs],
-                pixf, fbpixf);
+          PixConv_Row(&rcon->conv, pixvals, (uint8_t *)&fbi->framebuffer[ofs], tile_width);
+          for (x1 = 0; x1 < tile_width; x1++) {
             tileBufEnd +=
               rle_add_pixval(rle, con_bypp, swap, tileBufEnd,
-                pixval);
-            ofs += fb_bypp;
+                pixvals[x1]);
           }
         }
         //fprintf(stderr,"Tile at %d %d, %d %d\n",x0+udrect->x,y0+udrect->y,x1,y1);
@@ -846,6 +798,7 @@ srv_fb_encode_update_zrle(RfbConnection * rcon) {
           obuf = realloc(rcon->obuf, rcon->obuf_size);
           if (!obuf) {
             fprintf(stderr, "RFB: Not enough memory\n");
+            rcon->obuf_wp = 0;
             return;
           }
           rcon->obuf = obuf;
@@ -858,8 +811,6 @@ srv_fb_encode_update_zrle(RfbConnection * rcon) {
     //fprintf(stderr,"total out %lu av out %lu bpp %d bytes %d\n",zs->total_out,zs->avail_out,fbpixf->bits_per_pixel,con_bypp);
     write32be(rcon->obuf + lengthP, zs->total_out);
     rcon->obuf_wp += zs->total_out;
-    AsyncManager_WriteSync(rcon->handle, rcon->obuf, rcon->obuf_wp);
-    rcon->obuf_wp = 0;
   }
   return;
 }
@@ -868,15 +819,14 @@ srv_fb_encode_update_zrle(RfbConnection * rcon) {
 /*
  * ----------------------------------------------------------------
  * srv_fb_update
- *	Calls the encoding specific framebuffer update proc
+ *	Calls the encoding specific framebuffer update proc.
+ *	Runs in the encoder thread.
  * ----------------------------------------------------------------
  */
 
 static inline void
 srv_fb_update(RfbConnection * rcon) {
-  if ((rcon->state != CONSTAT_IDLE)) {
-    return;
-  }
+  rcon->obuf_wp = 0;
   dbgprintf("SRV update display enc %d\n",rcon->current_encoding); // jk
   switch (rcon->current_encoding) {
   case ENC_RAW:
@@ -893,18 +843,180 @@ srv_fb_update(RfbConnection * rcon) {
   }
 }
 
+static void write_udrect_to_fifo(RfbConnection * rcon, UpdateRectangle * udrect);
+
+/*
+ * -------------------------------------------------------------------------
+ * dirty_tiles_to_fifo
+ *	Convert the dirty tiles of a connection to update rectangles.
+ *	Horizontally adjacent dirty tiles are merged into one rectangle.
+ * -------------------------------------------------------------------------
+ */
+static void
+dirty_tiles_to_fifo(RfbConnection * rcon) {
+  RfbServer *rfbserv = rcon->rfbserv;
+  FrameBufferInfo *fbi = rcon->fbi;
+  UpdateRectangle udrect;
+  unsigned int tx, ty, tx0;
+  uint8_t *row;
+  for (ty = 0; ty < rfbserv->tiles_y; ty++) {
+    row = rcon->dirty_tiles + ty * rfbserv->tiles_x;
+    for (tx = 0; tx < rfbserv->tiles_x; tx++) {
+      if (!row[tx]) {
+        continue;
+      }
+      for (tx0 = tx; (tx < rfbserv->tiles_x) && row[tx]; tx++) {
+        row[tx] = 0;
+      }
+      udrect.x = tx0 << TILE_SHIFT;
+      udrect.y = ty << TILE_SHIFT;
+      udrect.width = (tx << TILE_SHIFT) - udrect.x;
+      udrect.height = TILE_SIZE;
+      if (udrect.x + udrect.width > fbi->fb_width) {
+        udrect.width = fbi->fb_width - udrect.x;
+      }
+      if (udrect.y + udrect.height > fbi->fb_height) {
+        udrect.height = fbi->fb_height - udrect.y;
+      }
+      write_udrect_to_fifo(rcon, &udrect);
+    }
+  }
+  rcon->nr_dirty = 0;
+}
+
+/*
+ * -------------------------------------------------------------------------
+ * snapshot_job
+ *	Move the rectangles from the fifo to the job of the encoder and
+ *	copy their pixels to the encoders private framebuffer, so the
+ *	display user can continue to write the framebuffer while the
+ *	encoder is working.
+ * -------------------------------------------------------------------------
+ */
+static void
+snapshot_job(RfbConnection * rcon) {
+  FrameBufferInfo *fbi = rcon->fbi;
+  FrameBufferInfo *snap = &rcon->snap;
+  int fb_bypp = fbi->pixfmt.bits_per_pixel >> 3;
+  int y;
+  if (snap->fb_size != fbi->fb_size) {
+    snap->framebuffer = sg_realloc(snap->framebuffer, fbi->fb_size);
+    snap->fb_size = fbi->fb_size;
+  }
+  snap->fb_width = fbi->fb_width;
+  snap->fb_height = fbi->fb_height;
+  snap->fb_linebytes = fbi->fb_linebytes;
+  snap->pixfmt = fbi->pixfmt;
+  rcon->nr_job_rects = 0;
+  while (rcon->udrect_rp < rcon->udrect_wp) {
+    UpdateRectangle *udrect = &rcon->udrect_fifo[rcon->udrect_rp % UDRECT_FIFOSIZE];
+    rcon->udrect_rp++;
+    rcon->job_rects[rcon->nr_job_rects++] = *udrect;
+    for (y = udrect->y; y < (udrect->y + udrect->height); y++) {
+      int ofs = (y * fbi->fb_width + udrect->x) * fb_bypp;
+      memcpy(snap->framebuffer + ofs, fbi->framebuffer + ofs, udrect->width * fb_bypp);
+    }
+  }
+}
+
 /*
  * -------------------------------------------------------------------------
  * trigger_fb_update
- *	Start an update if there is something in the rectangle fifo
+ *	Start an update if there is something in the rectangle fifo or
+ *	if some tiles have changed since the last update. Nothing is
+ *	started while the previous update is not yet written to the
+ *	client, the changes are collected meanwhile. So a slow client
+ *	gets fewer updates instead of slowing down the emulator.
+ *	Called with the server lock held.
  * -------------------------------------------------------------------------
  */
 static inline void
 trigger_fb_update(RfbConnection * rcon) {
-  if ((rcon->udrect_wp != rcon->udrect_rp) && rcon->update_outstanding) {
+  if (!rcon->update_outstanding || rcon->busy || rcon->closing
+      || (rcon->state != CONSTAT_IDLE)) {
+    return;
+  }
+  if (rcon->nr_dirty) {
+    dirty_tiles_to_fifo(rcon);
+  }
+  if (rcon->udrect_wp != rcon->udrect_rp) {
     rcon->update_outstanding = 0;
+    snapshot_job(rcon);
+    rcon->busy = 1;
+    rcon->job_pending = 1;
+    uv_cond_signal(&rcon->job_cond);
+  }
+}
+
+/*
+ * -------------------------------------------------------------------------
+ * rfbcon_written
+ *	The encoded update is written to the socket. Start the next one
+ *	with the changes collected meanwhile.
+ * -------------------------------------------------------------------------
+ */
+static void
+rfbcon_written(int status, StreamHandle_t *handle, void *clientdata) {
+  RfbConnection *rcon = clientdata;
+  uv_mutex_lock(&rcon->rfbserv->lock);
+  rcon->busy = 0;
+  trigger_fb_update(rcon);
+  uv_mutex_unlock(&rcon->rfbserv->lock);
+}
+
+/*
+ * -------------------------------------------------------------------------
+ * rfbcon_output
+ *	Called in the AsyncManager thread when the encoder has finished
+ *	an update.
+ * -------------------------------------------------------------------------
+ */
+static void
+rfbcon_output(NotifyHandle_t *handle, void *clientdata) {
+  RfbConnection *rcon = clientdata;
+  uv_mutex_lock(&rcon->rfbserv->lock);
+  if (rcon->out_ready) {
+    rcon->out_ready = 0;
+    if (rcon->closing
+        || (AsyncManager_Write(rcon->handle, rcon->obuf, rcon->obuf_wp, &rfbcon_written,
+              rcon) < 0)) {
+      rcon->busy = 0;
+    }
+  }
+  uv_mutex_unlock(&rcon->rfbserv->lock);
+}
+
+/*
+ * -------------------------------------------------------------------------
+ * rfbcon_encoder
+ *	The encoder thread of a connection. It never waits for the
+ *	AsyncManager thread, the result is passed on by a notification.
+ * -------------------------------------------------------------------------
+ */
+static void
+rfbcon_encoder(void *arg) {
+  RfbConnection *rcon = arg;
+  RfbServer *rfbserv = rcon->rfbserv;
+  uv_mutex_lock(&rfbserv->lock);
+  while (!rcon->quit) {
+    if (!rcon->job_pending) {
+      uv_cond_wait(&rcon->job_cond, &rfbserv->lock);
+      continue;
+    }
+    rcon->job_pending = 0;
+    uv_mutex_unlock(&rfbserv->lock);
+    uv_mutex_lock(&rcon->enc_lock);
     srv_fb_update(rcon);
+    uv_mutex_unlock(&rcon->enc_lock);
+    uv_mutex_lock(&rfbserv->lock);
+    if (rcon->obuf_wp > 0) {
+      rcon->out_ready = 1;
+      AsyncManager_Notify(rcon->out_notify);
+    } else {
+      rcon->busy = 0;
+    }
   }
+  uv_mutex_unlock(&rfbserv->lock);
 }
 
 /*
@@ -931,6 +1043,11 @@ expand_color_to_16(int color, int bits) {
   return result;
 }
 
+static void
+free_reply(int status, StreamHandle_t *handle, void *clientdata) {
+  sg_free(clientdata);
+}
+
 /*
  * ---------------------------------------------------------------------
  * srv_set_8Bit_color_map_entries
@@ -941,7 +1058,7 @@ expand_color_to_16(int color, int bits) {
  */
 static void
 srv_set_8bit_color_map_entries(RfbConnection * rcon, PixelFormat * pixf) {
-  uint8_t reply[256 * 6 + 100];
+  uint8_t *reply;
   uint8_t *wp;
   int i;
   pixf->red_max = 7;
@@ -952,7 +1069,7 @@ srv_set_8bit_color_map_entries(RfbConnection * rcon, PixelFormat * pixf) {
   pixf->blue_shift = 0;
   pixfmt_update_bits(pixf);
   pixfmt_update_translation(rcon);
-  wp = reply;
+  wp = reply = sg_calloc(256 * 6 + 100);
   *wp++ = SRV_SET_COLOUR_MAP_ENTRIES;
   *wp++ = 0;
   *wp++ = 0;
@@ -973,7 +1090,13 @@ srv_set_8bit_color_map_entries(RfbConnection * rcon, PixelFormat * pixf) {
     write16be(wp, blue);
     wp += 2;
   }
-  AsyncManager_WriteSync(rcon->handle, reply, wp - reply);
+  /*
+   * Not WriteSync: an update may still be queued on the socket,
+   * the message has to go behind it.
+   */
+  if (AsyncManager_Write(rcon->handle, reply, wp - reply, &free_reply, reply) < 0) {
+    sg_free(reply);
+  }
 }
 
 static void
@@ -981,6 +1104,8 @@ clnt_set_pixel_format(RfbConnection * rcon, uint8_t * data, int len) {
 
   PixelFormat *pixf = &rcon->pixfmt;
 
+  /* The encoder must not see a half changed pixel format */
+  uv_mutex_lock(&rcon->enc_lock);
   pixf->bits_per_pixel = data[4];
   pixf->depth = data[5];
   pixf->big_endian_flag = !!data[6];
@@ -996,6 +1121,7 @@ clnt_set_pixel_format(RfbConnection * rcon, uint8_t * data, int len) {
     srv_set_8bit_color_map_entries(rcon, pixf);
   }
   pixfmt_update_translation(rcon);
+  uv_mutex_unlock(&rcon->enc_lock);
   dbgprintf("got set pixelformat message\n");
   dbgprintf("msgtype %02x\n", data[0]);
   dbgprintf("bpp    %d\n", data[4]);
@@ -1022,12 +1148,13 @@ clnt_set_encodings(RfbConnection * rcon, uint8_t * data, int len) {
     switch (enc) {
 #ifndef NO_ZLIB
     case ENC_ZRLE:
-      rcon->current_encoding = ENC_ZRLE;
-      dbgprintf("Switched to encoding %d\n", rcon->current_encoding);
-      return;
 #endif
     case ENC_RAW:
-      rcon->current_encoding = ENC_RAW;
+      /* The encoder must not switch encodings in the middle of an update */
+      uv_mutex_lock(&rcon->enc_lock);
+      rcon->current_encoding = enc;
+      uv_mutex_unlock(&rcon->enc_lock);
+      dbgprintf("Switched to encoding %d\n", enc);
       return;
 
     case ENC_COPYRECT:
@@ -1088,6 +1215,7 @@ clnt_fb_update_req(RfbConnection * rcon, uint8_t * data, int len) {
   udrect.width = read16be(data + 6);
   udrect.height = read16be(data + 8);
   dbgprintf("Got updaterequest from Client\n");
+  uv_mutex_lock(&rcon->rfbserv->lock);
   if (!incremental) {
     write_udrect_to_fifo(rcon, &udrect);
     rcon->update_outstanding = 1;
@@ -1097,6 +1225,7 @@ clnt_fb_update_req(RfbConnection * rcon, uint8_t * data, int len) {
     rcon->update_outstanding = 1;
     trigger_fb_update(rcon);
   }
+  uv_mutex_unlock(&rcon->rfbserv->lock);
 }
 
 #ifndef NO_KEYBOARD
@@ -1323,10 +1452,14 @@ rfbsrv_accept(int status, StreamHandle_t *handle, const char *host, int port, vo
   rcon->current_encoding = -1;	/* Hope this doesnt exist */
   rcon->handle = handle;
   rcon->rfbserv = rfbserv;
-  rcon->next = rfbserv->con_head;
   rcon->fbi = &rfbserv->fbi;
   rcon->obuf_size = 65536;
   rcon->obuf = sg_calloc(rcon->obuf_size);
+  rcon->dirty_tiles = sg_calloc(rfbserv->tiles_x * rfbserv->tiles_y);
+  uv_cond_init(&rcon->job_cond);
+  uv_mutex_init(&rcon->enc_lock);
+  rcon->out_notify = AsyncManager_NotifyInit(&rfbcon_output, rcon);
+  uv_thread_create(&rcon->encoder, rfbcon_encoder, rcon);
 
 #ifndef NO_ZLIB
   rcon->zs.zalloc = Z_NULL;
@@ -1340,8 +1473,11 @@ rfbsrv_accept(int status, StreamHandle_t *handle, const char *host, int port, vo
   /* Default Pixel format is framebuffers pixelformat */
   memcpy(&rcon->pixfmt, &rfbserv->fbi.pixfmt, sizeof(PixelFormat));
   pixfmt_update_translation(rcon);
-  rfbserv->con_head = rcon;
   rcon->current_encoding = ENC_RAW;
+  uv_mutex_lock(&rfbserv->lock);
+  rcon->next = rfbserv->con_head;
+  rfbserv->con_head = rcon;
+  uv_mutex_unlock(&rfbserv->lock);
   AsyncManager_ReadStart(handle, &rfbcon_input, rcon);
   Msg_ProtocolVersion(rcon);
   rcon->ibuf_expected = 12;	/* Expecting Protocol version reply */
@@ -1370,6 +1506,7 @@ rfbserv_set_fbformat(struct FbDisplay *fbdisp, FbFormat * fbf) {
       "Framebuffer format with more than 8 Bit per color not supported\n");
     exit(1);
   }
+  uv_mutex_lock(&rfbserv->lock);
   pixf->red_max = (1 << fbf->red_bits) - 1;
   pixf->red_bits = fbf->red_bits;
   pixf->red_shift = fbf->red_shift;
@@ -1400,9 +1537,69 @@ rfbserv_set_fbformat(struct FbDisplay *fbdisp, FbFormat * fbf) {
   }
   RfbConnection *rcon;
   for (rcon = rfbserv->con_head; rcon; rcon = rcon->next) {
+    uv_mutex_lock(&rcon->enc_lock);
     pixfmt_update_translation(rcon);
+    uv_mutex_unlock(&rcon->enc_lock);
+    /* The old contents are meaningless in the new format */
+    memset(rcon->dirty_tiles, 1, rfbserv->tiles_x * rfbserv->tiles_y);
+    rcon->nr_dirty = rfbserv->tiles_x * rfbserv->tiles_y;
   }
+  uv_mutex_unlock(&rfbserv->lock);
+}
 
+/*
+ * ----------------------------------------------------------------
+ * mark_changed_tiles
+ *	Compare an update from the display user with the framebuffer
+ *	before it is overwritten and mark the changed tiles dirty for
+ *	all connections. The update is a linear byte range, it is
+ *	compared in pieces of one tile row. Once a tile is known to be
+ *	changed the rest of it is not compared anymore.
+ * ----------------------------------------------------------------
+ */
+static void
+mark_changed_tiles(RfbServer * rfbserv, unsigned int start, const uint8_t * data,
+  unsigned int count) {
+  FrameBufferInfo *fbi = &rfbserv->fbi;
+  RfbConnection *rcon;
+  unsigned int tilebytes = TILE_SIZE * fbi->pixfmt.bypp;
+  unsigned int end = start + count;
+  unsigned int ofs = start;
+  unsigned int first_tile, last_tile;
+  unsigned int i;
+  first_tile = (start / fbi->fb_linebytes >> TILE_SHIFT) * rfbserv->tiles_x;
+  last_tile = first_tile;
+  while (ofs < end) {
+    unsigned int y = ofs / fbi->fb_linebytes;
+    unsigned int xbyte = ofs - y * fbi->fb_linebytes;
+    unsigned int tx = xbyte / tilebytes;
+    unsigned int tile = (y >> TILE_SHIFT) * rfbserv->tiles_x + tx;
+    unsigned int len = (tx + 1) * tilebytes - xbyte;
+    if (len > fbi->fb_linebytes - xbyte) {
+      len = fbi->fb_linebytes - xbyte;
+    }
+    if (len > end - ofs) {
+      len = end - ofs;
+    }
+    if (!rfbserv->changed_tiles[tile]
+        && memcmp(fbi->framebuffer + ofs, data + (ofs - start), len)) {
+      rfbserv->changed_tiles[tile] = 1;
+      last_tile = tile + 1;
+    }
+    ofs += len;
+  }
+  for (i = first_tile; i < last_tile; i++) {
+    if (!rfbserv->changed_tiles[i]) {
+      continue;
+    }
+    rfbserv->changed_tiles[i] = 0;
+    for (rcon = rfbserv->con_head; rcon; rcon = rcon->next) {
+      if (!rcon->dirty_tiles[i]) {
+        rcon->dirty_tiles[i] = 1;
+        rcon->nr_dirty++;
+      }
+    }
+  }
 }
 
 /*
@@ -1416,38 +1613,29 @@ static int
 rfbserv_update_display(struct FbDisplay *fbdisp, FbUpdateRequest * fbudreq) {
   RfbServer *rfbserv = fbdisp->owner;
   RfbConnection *rcon;
-  UpdateRectangle udrect;
   FrameBufferInfo *fbi = &rfbserv->fbi;
   unsigned int start = fbudreq->offset;
   unsigned int count = fbudreq->count;
+  uv_mutex_lock(&rfbserv->lock);
   if (start > fbi->fb_size) {
+    uv_mutex_unlock(&rfbserv->lock);
     return -1;
   }
   if (start + count > fbi->fb_size) {
     count = fbi->fb_size - start;
   }
   /*
-   * Would be better to check the differences before overwriting
-   * also comparing differences should be delayed to time of sending the
-   * the data in a fileevent handler
+   * Only the tiles which really changed are sent. The display user
+   * typically sends whole pages when a single pixel was written.
    */
-  memcpy(fbi->framebuffer + start, fbudreq->fbdata, count);
-  udrect.x = 0;
-  udrect.y = (start / fbi->fb_linebytes);
-  udrect.width = fbi->fb_width;
-  udrect.height = (count + fbi->fb_linebytes - 1) / (fbi->fb_linebytes);
-  if (udrect.height + udrect.y > fbi->fb_height) {
-    udrect.height = fbi->fb_height - udrect.y;
+  if (rfbserv->con_head) {
+    mark_changed_tiles(rfbserv, start, fbudreq->fbdata, count);
   }
-#if 0
-  fprintf(stderr, "Got update request from LCD controller x %d ,y %d, w %d h %d\n", udrect.x,
-    udrect.y, udrect.width, udrect.height);
-  fprintf(stderr, "linebytes %d count %d\n", fbi->fb_linebytes, count);
-#endif
+  memcpy(fbi->framebuffer + start, fbudreq->fbdata, count);
   for (rcon = rfbserv->con_head; rcon; rcon = rcon->next) {
-    write_udrect_to_fifo(rcon, &udrect);
     trigger_fb_update(rcon);
   }
+  uv_mutex_unlock(&rfbserv->lock);
   return 0;
 }
 
@@ -1505,6 +1693,9 @@ RfbServer_New(const char *name, FbDisplay ** displayPP, Keyboard ** keyboardPP,
   fbi->fb_linebytes = fbi->fb_width * 2;
   fbi->fb_size = fbi->fb_width * fbi->fb_height * 2;
   fbi->framebuffer = sg_calloc(fbi->fb_size);
+  rfbserv->tiles_x = (width + TILE_SIZE - 1) >> TILE_SHIFT;
+  rfbserv->tiles_y = (height + TILE_SIZE - 1) >> TILE_SHIFT;
+  rfbserv->changed_tiles = sg_calloc(rfbserv->tiles_x * rfbserv->tiles_y);
   sprintf(fbi->name_string, "%s %s", "softgun", name);
 
   pixf = &fbi->pixfmt;
@@ -1528,10 +1719,13 @@ RfbServer_New(const char *name, FbDisplay ** displayPP, Keyboard ** keyboardPP,
   pixf->green_shift = 4;
   pixf->blue_shift = 0;
   pixfmt_update_bits(pixf);
+  uv_mutex_init(&rfbserv->lock);
 
   result = AsyncManager_InitTcpServer(host, port, 5, 1, &rfbsrv_accept, rfbserv);
   if (result < 0) {
     sg_free(fbi->framebuffer);
+    sg_free(rfbserv->changed_tiles);
+    uv_mutex_destroy(&rfbserv->lock);
     sg_free(rfbserv);
     fprintf(stderr, "Can not create RFB server\n");
     return;
@@ -59,7 +59,7 @@ typedef struct SenslessMonitor {
 	uint32_t sensivity;
 } SenselessMonitor;
 
-static SenselessMonitor *smon;
+static __MACHINE_LOCAL__ SenselessMonitor *smon;
 
 /*
  * --------------------------------------------------------------------
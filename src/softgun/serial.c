@@ -112,6 +112,32 @@ SerialDevice_DoTransmit(void *eventData)
 	SerialDevice *serdev = uart->serial_device;
 	bool result;
 	UartChar c;
+	if (uart->fastConsole) {
+		UartChar *buf = uart->fcBuf;
+		bool retry = (uart->fcPending != 0);
+		int written;
+		/* Drain the frontend without baud timing, one write per batch */
+		while (!retry && uart->tx_enabled && (uart->fcPending < FASTCONSOLE_BATCH)
+		       && uart->txFetchChar(uart->owner, &buf[uart->fcPending])) {
+			buf[uart->fcPending] = buf[uart->fcPending] & uart->tx_csize_mask;
+			uart->fcPending++;
+		}
+		if (!uart->fcPending) {
+			return;
+		}
+		written = serdev->write(serdev, buf, uart->fcPending);
+		if (written > 0) {
+			uart->fcPending -= written;
+			memmove(buf, buf + written, uart->fcPending * sizeof(UartChar));
+		}
+		if (uart->fcPending) {
+			/* The backend is full, retry the tail after one character time */
+			CycleTimer_Mod(&uart->txTimer, NanosecondsToCycles(uart->nsPerTxChar));
+		} else {
+			CycleTimer_Mod(&uart->txTimer, 0);
+		}
+		return;
+	}
 	if (!uart->tx_enabled) {
 		return;
 	}
@@ -227,6 +253,7 @@ Uart_New(const char *uart_name, UartRxEventProc * rxEventProc, UartFetchTxCharPr
 	const char *filename = Config_ReadVar(uart_name, "file");
 	const char *type = Config_ReadVar(uart_name, "type");
 	SerialDevice *serdev;
+	uint32_t fastconsole = 0;
 	UartPort *port = sg_new(UartPort);
 	port->owner = owner;
 	port->rxEventProc = rxEventProc;
@@ -239,6 +266,8 @@ Uart_New(const char *uart_name, UartRxEventProc * rxEventProc, UartFetchTxCharPr
 	port->rx_csize_mask = (0xffffU >> (16 - port->rx_csize));
 	port->halfstopbits = 2;
 	update_timing(port);
+	Config_ReadUInt32(&fastconsole, uart_name, "fastconsole");
+	port->fastConsole = (fastconsole != 0);
 	CycleTimer_Init(&port->txTimer, SerialDevice_DoTransmit, port);
 	/* Compatibility to old config files */
 	if (!type) {
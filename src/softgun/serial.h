@@ -39,6 +39,8 @@ typedef void UartStatChgProc(void *dev);
 #define UART_OPC_GET_DSR	(10)
 #define UART_OPC_GET_CTS	(11)
 
+#define FASTCONSOLE_BATCH	(256)
+
 typedef struct UartCmd {
 	int opcode;
 	int flush;
@@ -86,6 +88,11 @@ struct UartPort {
 	UartStatChgProc *statProc;
 	bool rx_enabled;
 	bool tx_enabled;
+	/* Transmit without baud rate timing (config "fastconsole") */
+	bool fastConsole;
+	/* Fetched characters which the backend did not take yet */
+	unsigned int fcPending;
+	UartChar fcBuf[FASTCONSOLE_BATCH];
 };
 
 /*
@@ -47,10 +47,9 @@
 //#include "xy_hash.h"
 //#include "interpreter.h"
 
-static SHashTable signode_hash;
-static SigStamp g_stamp = 0;
-static int active_trace_deleted_flag = 0;
-static SigConflictProc *g_conflictProc = NULL;
+static __MACHINE_LOCAL__ SHashTable signode_hash;
+static __MACHINE_LOCAL__ SigStamp g_stamp = 0;
+static __MACHINE_LOCAL__ SigConflictProc *g_conflictProc = NULL;
 
 static char *
 SigVal_String(int sigval)
@@ -132,6 +131,7 @@ SigNode_New(const char *format, ...)
 	}
 	SHash_SetValue(signode->hash_entry, signode);
 	signode->propval = signode->selfval = SIG_OPEN;
+	signode->drvidx = -1;
 	//signode->propval = SIG_HIGH;
 	//signode->propval = SIG_LOW;
 	return signode;
@@ -283,116 +283,306 @@ lookup_sigval(int val1, int val2)
 }
 
 /*
- * -----------------------------------------------
- * Recursive
- * -----------------------------------------------
+ * -----------------------------------------------------------------
+ * A net is the set of all nodes connected by links. It caches
+ * the member array, the drivers (members with a selfval other
+ * than SIG_OPEN) and all traces of the members, so setting a
+ * signal does not need to walk the link graph.
+ * Nets are never modified in place when the topology or the
+ * traces change, they are only marked dirty and a new net is
+ * compiled on next use. A net is freed when no member and
+ * no running trace invocation references it anymore.
+ * -----------------------------------------------------------------
  */
+typedef struct SigNetTrace {
+	SigNode *node;
+	SigTrace *trace;
+} SigNetTrace;
+
+typedef struct SigNet {
+	unsigned int refcnt;
+	bool dirty;
+	bool invoking;		/* Traces are being invoked */
+	bool pending;		/* Changed again by a trace proc meanwhile */
+	int value;		/* propval of all members, -1 if unknown */
+	unsigned int nrMembers;
+	SigNode **members;
+	unsigned int nrDrivers;
+	SigNode **drivers;
+	unsigned int nrTraces;
+	SigNetTrace *traces;
+} SigNet;
+
+/* Rounds of changes made by the trace procs of a net before giving up */
+#define SIGNET_MAX_ROUNDS	(1000)
+
+static __MACHINE_LOCAL__ unsigned int g_invokeDepth = 0;
+static __MACHINE_LOCAL__ SigTrace *g_deadTraces = NULL;
 
-/* avoid alloca */
-static char conflict_msg[100];
+static void
+SigNet_Unref(SigNet * net)
+{
+	if (!net || --net->refcnt) {
+		return;
+	}
+	sg_free(net->members);
+	sg_free(net->drivers);
+	sg_free(net->traces);
+	sg_free(net);
+}
 
-static int
-_SigMeassure(SigNode * sig, SigStamp stamp, int sigval)
+static inline void
+SigNet_Invalidate(SigNode * sig)
+{
+	if (sig->net) {
+		sig->net->dirty = true;
+	}
+}
+
+static void
+SigNet_AddMember(SigNet * net, SigNode * sig, unsigned int *size)
+{
+	SigNet *old = sig->net;
+	if (net->nrMembers == *size) {
+		*size *= 2;
+		net->members = sg_realloc(net->members, *size * sizeof(SigNode *));
+	}
+	net->members[net->nrMembers++] = sig;
+	sig->net = net;
+	net->refcnt++;
+	SigNet_Unref(old);
+}
+
+/*
+ * ----------------------------------------------------------------
+ * Collect all nodes reachable from sig into a new net. The
+ * member array is used as the queue of the breadth first search,
+ * a node is visited when it already points to the new net.
+ * ----------------------------------------------------------------
+ */
+static SigNet *
+SigNet_Compile(SigNode * sig)
 {
+	SigNet *net = sg_new(SigNet);
 	SigLink *cursor;
-	sig->stamp = stamp;
-	for (cursor = sig->linkList; cursor; cursor = cursor->next) {
-		SigNode *partner = cursor->partner;
-		if (likely(partner->stamp != stamp)) {
-			int oldsigval = sigval;
-			sigval = lookup_sigval(sigval, partner->selfval);
-			if ((sigval == SIG_LOW) || (sigval == SIG_HIGH)) {
-				return sigval;
-			} else if (unlikely(sigval & SIG_ILLEGAL)) {
-				snprintf(conflict_msg, sizeof(conflict_msg),
-					 "************ Short circuit between %s:(%s) and %s:(%s) ",
-					 SHash_GetKey(sig->hash_entry), SigVal_String(oldsigval),
-					 SHash_GetKey(partner->hash_entry),
-					 SigVal_String(partner->selfval));
-				if (g_conflictProc) {
-					g_conflictProc(conflict_msg);
-				} else {
-					fprintf(stderr, "%s\n", conflict_msg);
-				}
-				return sigval;
+	SigTrace *trace;
+	unsigned int size = 4;
+	unsigned int i;
+	net->members = sg_calloc(size * sizeof(SigNode *));
+	SigNet_AddMember(net, sig, &size);
+	for (i = 0; i < net->nrMembers; i++) {
+		for (cursor = net->members[i]->linkList; cursor; cursor = cursor->next) {
+			if (cursor->partner->net != net) {
+				SigNet_AddMember(net, cursor->partner, &size);
+			}
+		}
+	}
+	net->drivers = sg_calloc(net->nrMembers * sizeof(SigNode *));
+	net->value = sig->propval;
+	for (i = 0; i < net->nrMembers; i++) {
+		SigNode *member = net->members[i];
+		if (member->selfval != SIG_OPEN) {
+			member->drvidx = net->nrDrivers;
+			net->drivers[net->nrDrivers++] = member;
+		} else {
+			member->drvidx = -1;
+		}
+		if (member->propval != net->value) {
+			net->value = -1;
+		}
+		for (trace = member->sigTraceList; trace; trace = trace->next) {
+			net->nrTraces++;
+		}
+	}
+	if (net->nrTraces) {
+		net->traces = sg_calloc(net->nrTraces * sizeof(SigNetTrace));
+		net->nrTraces = 0;
+		for (i = 0; i < net->nrMembers; i++) {
+			SigNode *member = net->members[i];
+			for (trace = member->sigTraceList; trace; trace = trace->next) {
+				net->traces[net->nrTraces].node = member;
+				net->traces[net->nrTraces].trace = trace;
+				net->nrTraces++;
 			}
-			sigval = _SigMeassure(partner, stamp, sigval);
 		}
 	}
-	return sigval;
+	return net;
 }
 
-static inline int
-SigMeassure(SigNode * sig)
+static inline SigNet *
+SigNode_Net(SigNode * sig)
 {
-	int propval = _SigMeassure(sig, ++g_stamp, sig->selfval);
-	int measval = sigmeassure_tab[propval & 0xf];
-	return measval;
+	SigNet *net = sig->net;
+	if (unlikely(!net || net->dirty)) {
+		net = SigNet_Compile(sig);
+	}
+	return net;
 }
 
 /*
- * -------------------------------------------------
- * Todo: Traces can only delete itself
- * from TraceProcs 
- * -------------------------------------------------
+ * -------------------------------------------------------
+ * Keep the driver set of a clean net in sync with a
+ * changed selfval. A dirty net is fixed up on compile.
+ * -------------------------------------------------------
  */
-static void
-InvokeTraces(SigNode * signode)
+static inline void
+SigNet_UpdateDriver(SigNode * sig)
 {
-	SigTrace *trace;
-	SigTrace *next;
-	for (trace = signode->sigTraceList; trace; trace = next) {
-		next = trace->next;
-		/* Avoid recursion */
-		if (!trace->isactive) {
-			trace->isactive++;
-			trace->proc(signode, signode->propval, trace->clientData);
-			if (active_trace_deleted_flag) {
-				active_trace_deleted_flag = 0;
+	SigNet *net = sig->net;
+	if (!net || net->dirty) {
+		return;
+	}
+	if (sig->selfval != SIG_OPEN) {
+		if (sig->drvidx < 0) {
+			sig->drvidx = net->nrDrivers;
+			net->drivers[net->nrDrivers++] = sig;
+		}
+	} else if (sig->drvidx >= 0) {
+		SigNode *last = net->drivers[--net->nrDrivers];
+		net->drivers[sig->drvidx] = last;
+		last->drvidx = sig->drvidx;
+		sig->drvidx = -1;
+	}
+}
+
+/* avoid alloca */
+static char conflict_msg[100];
+
+/*
+ * --------------------------------------------------------------
+ * Combine the value of sig with the other drivers of the net.
+ * Like a walk of the link graph starting at sig it stops at
+ * the first driver which makes the result a plain LOW or HIGH.
+ * --------------------------------------------------------------
+ */
+static int
+SigNet_Resolve(SigNet * net, SigNode * sig)
+{
+	SigNode *prev = sig;
+	int sigval = sig->selfval;
+	unsigned int i;
+	for (i = 0; i < net->nrDrivers; i++) {
+		SigNode *drv = net->drivers[i];
+		int oldsigval = sigval;
+		if (drv == sig) {
+			continue;
+		}
+		sigval = lookup_sigval(sigval, drv->selfval);
+		if ((sigval == SIG_LOW) || (sigval == SIG_HIGH)) {
+			break;
+		} else if (unlikely(sigval & SIG_ILLEGAL)) {
+			snprintf(conflict_msg, sizeof(conflict_msg),
+				 "************ Short circuit between %s:(%s) and %s:(%s) ",
+				 SHash_GetKey(prev->hash_entry), SigVal_String(oldsigval),
+				 SHash_GetKey(drv->hash_entry), SigVal_String(drv->selfval));
+			if (g_conflictProc) {
+				g_conflictProc(conflict_msg);
 			} else {
-				trace->isactive--;
+				fprintf(stderr, "%s\n", conflict_msg);
 			}
-		} else {
-			// fprintf(stderr,"Warning: Signal trace recursion\n");
+			break;
 		}
+		prev = drv;
+	}
+	return sigmeassure_tab[sigval & 0xf];
+}
+
+/*
+ * -------------------------------------------------------------
+ * Traces removed while trace procs are running are freed
+ * when the outermost invocation is done because the
+ * trace array of a net being invoked may still refer to them.
+ * -------------------------------------------------------------
+ */
+static void
+FreeDeadTraces(void)
+{
+	SigTrace *trace;
+	while ((trace = g_deadTraces)) {
+		g_deadTraces = trace->next;
+		sg_free(trace);
 	}
 }
 
 /*
  * -------------------------------------------------
- * Propagate a meassured value to 
- * all connected nodes
+ * Propagate a meassured value to all members of
+ * the net and invoke the traces of the members
+ * which changed their value.
+ * When a trace proc changes the net again, the
+ * members get the new value at once but the running
+ * invocation delivers it in another round. So every
+ * trace, including the one which caused the change,
+ * ends up with the final value and none gets the
+ * same change twice.
  * -------------------------------------------------
  */
-static int
-SigPropagate(SigNode * sig, SigStamp stamp, int sigval)
+static void
+SigNet_Propagate(SigNet * net, int sigval)
 {
-	SigLink *cursor;
-	int invoke_traces = 0;
-	sig->stamp = stamp;
-	if (sig->propval != sigval) {
-		sig->propval = sigval;
-		invoke_traces = 1;
-	}
-	for (cursor = sig->linkList; cursor; cursor = cursor->next) {
-		SigNode *partner = cursor->partner;
-		if (partner->stamp != stamp) {
-			sigval = SigPropagate(partner, stamp, sigval);
+	SigStamp stamp = ++g_stamp;
+	bool changed = false;
+	unsigned int rounds = 0;
+	unsigned int i;
+	net->value = sigval;
+	for (i = 0; i < net->nrMembers; i++) {
+		SigNode *member = net->members[i];
+		if (member->propval != sigval) {
+			member->propval = sigval;
+			member->stamp = stamp;
+			changed = true;
+		}
+	}
+	if (!changed || !net->nrTraces) {
+		return;
+	}
+	if (net->invoking) {
+		net->pending = true;
+		return;
+	}
+	/* Trace procs may relink or untrace, keep the arrays alive */
+	net->refcnt++;
+	net->invoking = true;
+	g_invokeDepth++;
+	do {
+		net->pending = false;
+		for (i = 0; i < net->nrTraces; i++) {
+			SigNode *member = net->traces[i].node;
+			SigTrace *trace = net->traces[i].trace;
+			/*
+			 * Skip members unchanged since the first round, traces
+			 * which already got the value, removed traces and recursion
+			 */
+			if ((member->stamp < stamp) || (member->stamp <= trace->stamp)
+			    || !trace->proc || trace->isactive) {
+				continue;
+			}
+			trace->stamp = member->stamp;
+			trace->isactive++;
+			trace->proc(member, member->propval, trace->clientData);
+			trace->isactive--;
 		}
+	} while (net->pending && (++rounds < SIGNET_MAX_ROUNDS));
+	if (net->pending) {
+		fprintf(stderr, "Signal %s oscillates, giving up after %u rounds\n",
+			SigName(net->members[0]), rounds);
+		net->pending = false;
 	}
-	if (invoke_traces) {
-		InvokeTraces(sig);
+	net->invoking = false;
+	if (--g_invokeDepth == 0) {
+		FreeDeadTraces();
 	}
-	return sigval;
+	SigNet_Unref(net);
 }
 
 static int
 update_sigval(SigNode * signode)
 {
-	int propval = SigMeassure(signode);
+	SigNet *net = SigNode_Net(signode);
+	int propval = SigNet_Resolve(net, signode);
 	/* Don't propagate open. If it is open keep old value */
-	if (propval != SIG_OPEN) {
-		propval = SigPropagate(signode, ++g_stamp, propval);
+	if ((propval != SIG_OPEN) && (propval != net->value)) {
+		SigNet_Propagate(net, propval);
 	}
 	return propval;
 }
@@ -411,6 +601,7 @@ SigNode_Set(SigNode * signode, int sigval)
 	}
 	//fprintf(stderr,"Propagate new %d, old %d ",sigval,signode->selfval); //jk
 	signode->selfval = sigval;
+	SigNet_UpdateDriver(signode);
 	update_sigval(signode);
 	return signode->propval;
 }
@@ -434,6 +625,8 @@ SigNode_Link(SigNode * sig1, SigNode * sig2)
 	link2->partner = sig1;
 	link2->next = sig2->linkList;
 	sig2->linkList = link2;
+	SigNet_Invalidate(sig1);
+	SigNet_Invalidate(sig2);
 	update_sigval(sig1);
 	return 0;
 }
@@ -497,6 +690,8 @@ Sig_RemoveLink(SigNode * sig, SigLink * link)
 	} else {
 		partner->linkList = cursor->next;
 	}
+	SigNet_Invalidate(sig);
+	SigNet_Invalidate(partner);
 	update_sigval(sig);
 	update_sigval(partner);
 	sg_free(cursor);
@@ -579,6 +774,8 @@ SigNode_RemoveLink(SigNode * sig1, SigNode * sig2)
 	} else {
 		sig2->linkList = cursor->next;
 	}
+	SigNet_Invalidate(sig1);
+	SigNet_Invalidate(sig2);
 	update_sigval(sig1);
 	update_sigval(sig2);
 	sg_free(cursor);
@@ -603,6 +800,8 @@ SigNode_Delete(SigNode * signode)
 {
 
 	SigNode_UnLink(signode);
+	SigNet_Invalidate(signode);
+	SigNet_Unref(signode->net);
 	SHash_DeleteEntry(&signode_hash, signode->hash_entry);
 	sg_free(signode);
 }
@@ -618,6 +817,7 @@ SigNode_Trace(SigNode * node, SigTraceProc * proc, void *clientData)
 	trace->next = node->sigTraceList;
 	node->sigTraceList = trace;
 	trace->isactive = 0;
+	SigNet_Invalidate(node);
 	return trace;
 }
 
@@ -636,10 +836,14 @@ SigNode_Untrace(SigNode * node, SigTrace * trace)
 		} else {
 			node->sigTraceList = cursor->next;
 		}
-		if (cursor->isactive) {
-			active_trace_deleted_flag = 1;
+		SigNet_Invalidate(node);
+		if (g_invokeDepth) {
+			cursor->proc = NULL;
+			cursor->next = g_deadTraces;
+			g_deadTraces = cursor;
+		} else {
+			sg_free(cursor);
 		}
-		sg_free(cursor);
 		return 0;
 	} else {
 		fprintf(stderr, "Bug: Deleting non existing trace\n");
@@ -653,31 +857,22 @@ SigNode_Untrace(SigNode * node, SigTrace * trace)
  * necessary to update it.
  **************************************************************************
  */
-static bool
-_SigNode_IsTraced(SigNode * sig, SigStamp stamp)
+bool
+SigNode_IsTraced(SigNode * sig)
 {
-	SigLink *cursor;
-	sig->stamp = stamp;
-	bool result;
-	if (sig->sigTraceList) {
-		return true;
-	}
-	for (cursor = sig->linkList; cursor; cursor = cursor->next) {
-		SigNode *partner = cursor->partner;
-		if (partner->stamp != stamp) {
-			result = _SigNode_IsTraced(partner, stamp);
-			if (result == true) {
-				return result;
-			}
-		}
-	}
-	return false;
+	return SigNode_Net(sig)->nrTraces != 0;
 }
 
+/*
+ * ----------------------------------------------------
+ * Check if two signal nodes are part of the same net
+ * ----------------------------------------------------
+ */
 bool
-SigNode_IsTraced(SigNode * sig)
+SigNode_Connected(SigNode * sig1, SigNode * sig2)
 {
-	return _SigNode_IsTraced(sig, ++g_stamp);
+	SigNet *net = SigNode_Net(sig1);
+	return SigNode_Net(sig2) == net;
 }
 
 /*
@@ -686,49 +881,30 @@ SigNode_IsTraced(SigNode * sig)
  * Mainly used for debugging purposes
  * -----------------------------------------------
  */
-static SigNode *
-_SigNode_FindDominant(SigNode * sig, SigStamp stamp)
-{
-	SigLink *cursor;
-	sig->stamp = stamp;
-	if ((sig->selfval == SIG_HIGH) || (sig->selfval == SIG_LOW)) {
-		return sig;
-	}
-	for (cursor = sig->linkList; cursor; cursor = cursor->next) {
-		SigNode *partner = cursor->partner;
-		if (partner->stamp != stamp) {
-			return _SigNode_FindDominant(partner, stamp);
-		}
-	}
-	return NULL;
-}
-
 SigNode *
 SigNode_FindDominant(SigNode * sig)
 {
-	return _SigNode_FindDominant(sig, ++g_stamp);
-}
-
-static void
-_SigNode_Dump(SigNode * sig, SigStamp stamp)
-{
-	SigLink *cursor;
-	sig->stamp = stamp;
-	fprintf(stderr, "node %s self %d, prop %d\n", SigName(sig), sig->selfval, sig->propval);
-	for (cursor = sig->linkList; cursor; cursor = cursor->next) {
-		SigNode *partner = cursor->partner;
-		if (partner->stamp != stamp) {
-			_SigNode_Dump(partner, stamp);
-		} else {
-			return;
+	SigNet *net = SigNode_Net(sig);
+	unsigned int i;
+	for (i = 0; i < net->nrDrivers; i++) {
+		SigNode *drv = net->drivers[i];
+		if ((drv->selfval == SIG_HIGH) || (drv->selfval == SIG_LOW)) {
+			return drv;
 		}
 	}
+	return NULL;
 }
 
 void
 SigNode_Dump(SigNode * sig)
 {
-	_SigNode_Dump(sig, ++g_stamp);
+	SigNet *net = SigNode_Net(sig);
+	unsigned int i;
+	for (i = 0; i < net->nrMembers; i++) {
+		SigNode *member = net->members[i];
+		fprintf(stderr, "node %s self %d, prop %d\n", SigName(member), member->selfval,
+			member->propval);
+	}
 }
 
 void
@@ -37,14 +37,26 @@ typedef uint64_t SigStamp;
 
 struct SigTrace;
 struct SigLink;
+struct SigNet;
+
+/*
+ * ----------------------------------------------------------------------
+ * Linked nodes are compiled into a net holding the member nodes,
+ * the nodes which currently drive a value and the traces of all
+ * members. The net is rebuilt on first use after the links or
+ * the traces of one of its members changed.
+ * ----------------------------------------------------------------------
+ */
 typedef struct SigNode {
 	uint32_t magic;
 	SHashEntry *hash_entry;
 	int selfval;
 	int propval;
-	SigStamp stamp;
+	SigStamp stamp;		/* Propagation which last changed propval */
 	struct SigLink *linkList;
 	struct SigTrace *sigTraceList;
+	struct SigNet *net;
+	int drvidx;		/* Index in the driver set of the net, -1 if open */
 } SigNode;
 
 static inline const char *
@@ -66,6 +78,7 @@ typedef struct SigTrace {
 	void *clientData;
 	struct SigTrace *next;
 	int isactive;
+	SigStamp stamp;		/* Propagation last delivered to proc */
 } SigTrace;
 
 void SignodesInit();
@@ -80,6 +93,7 @@ int SigNode_Linked(SigNode * sig1, SigNode * sig2);
 int SigName_RemoveLink(const char *name1, const char *name2);
 int SigNode_RemoveLink(SigNode * n1, SigNode * n2);
 bool SigNode_IsTraced(SigNode * sig);
+bool SigNode_Connected(SigNode * sig1, SigNode * sig2);
 static inline int
 SigNode_Val(SigNode * signode)
 {
@@ -0,0 +1,590 @@
+//===-- softgun/snapshot.c ----------------------------------------*- C -*-===//
+//
+//              The Leigun Embedded System Simulator Platform
+//
+// Licensed under the Apache License, Version 2.0 (the "License");
+// you may not use this file except in compliance with the License.
+// You may obtain a copy of the License at
+//
+//     http://www.apache.org/licenses/LICENSE-2.0
+//
+// Unless required by applicable law or agreed to in writing, software
+// distributed under the License is distributed on an "AS IS" BASIS,
+// WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+// See the License for the specific language governing permissions and
+// limitations under the License.
+//
+//===----------------------------------------------------------------------===//
+///
+/// @file
+/// Snapshots of the emulator state for boot once, run many times
+///
+/// A snapshot file contains the RAM of the memory devices, the state
+/// blocks registered by the CPU and the MMU, the CycleCounter and the
+/// queue of the CycleTimers. The RAM is stored at page aligned file
+/// offsets. A restoring instance maps it with MAP_PRIVATE, so the pages
+/// are shared between all instances started from the same snapshot until
+/// they are written.
+///
+/// Peripherals register their state with Snapshot_RegisterState. A board
+/// calls Snapshot_BoardComplete when all of its devices do so. Snapshots
+/// of other boards are refused, because the CPU would resume against
+/// devices in reset state while their timers are armed with the saved
+/// timeouts. A snapshot can only be restored by the same binary with the
+/// same configuration, because timers are identified by their proc and by
+/// the order in which they were created.
+///
+/// Configuration (section "snapshot"):
+///   save:       file written when save_at_ms of emulated time is reached
+///   save_at_ms: emulated time of the snapshot, counted from the restored
+///               snapshot when both are given
+///   restore:    file to start from instead of loading the firmware
+///
+//===----------------------------------------------------------------------===//
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <stdint.h>
+#include <unistd.h>
+#include <fcntl.h>
+#include <errno.h>
+#include <sys/types.h>
+#include <sys/mman.h>
+#include "snapshot.h"
+#include "cycletimer.h"
+#include "configfile.h"
+#include "sgstring.h"
+
+#define SNAPSHOT_MAGIC		"LGSNAP01"
+#define SNAPSHOT_ALIGN		(65536)
+#define SNAPSHOT_NAMELEN	(48)
+
+#define SNAP_TYPE_RAM		(1)
+#define SNAP_TYPE_STATE		(2)
+
+typedef struct SnapshotHeader {
+	char magic[8];
+	int64_t binary_id;	/* distance of two functions, changes with the binary */
+	uint64_t cycle_counter;
+	uint32_t nr_entries;
+	uint32_t nr_timers;
+} SnapshotHeader;
+
+typedef struct SnapshotEntry {
+	char name[SNAPSHOT_NAMELEN];
+	uint32_t type;
+	uint32_t size;
+	uint64_t offset;
+} SnapshotEntry;
+
+/*
+ * ----------------------------------------------------------------
+ * Procs are stored relative to CycleTimer_Add because the binary
+ * may be loaded to a different address.
+ * ----------------------------------------------------------------
+ */
+typedef struct SnapshotTimer {
+	uint64_t timeout;
+	int64_t proc;
+	int64_t reg_proc;
+	uint32_t ordinal;	/* among the timers with the same reg_proc */
+	uint32_t reserved;
+} SnapshotTimer;
+
+typedef struct SnapItem {
+	struct SnapItem *next;
+	char name[SNAPSHOT_NAMELEN];
+	uint32_t type;
+	uint8_t *data;
+	uint32_t size;
+	int mapped;
+	Snapshot_RestoreProc *proc;
+	void *clientData;
+} SnapItem;
+
+static __MACHINE_LOCAL__ SnapItem *firstItem;
+static __MACHINE_LOCAL__ SnapItem *lastItem;
+
+static __MACHINE_LOCAL__ struct {
+	int fd;
+	bool active;
+	SnapshotHeader hdr;
+	SnapshotEntry *entries;
+	SnapshotTimer *timers;
+} restoreFile = {
+.fd = -1};
+
+static __MACHINE_LOCAL__ char *saveFileName;
+static __MACHINE_LOCAL__ bool boardComplete;
+static __MACHINE_LOCAL__ CycleTimer saveTimer;
+
+static inline int64_t
+binary_id(void)
+{
+	return (int64_t) ((uintptr_t) Snapshot_Save - (uintptr_t) CycleTimer_Add);
+}
+
+static inline int64_t
+proc_to_ofs(CycleTimer_Proc * proc)
+{
+	return (int64_t) ((uintptr_t) proc - (uintptr_t) CycleTimer_Add);
+}
+
+static inline CycleTimer_Proc *
+ofs_to_proc(int64_t ofs)
+{
+	return (CycleTimer_Proc *) ((uintptr_t) CycleTimer_Add + ofs);
+}
+
+static SnapItem *
+add_item(const char *name, uint32_t type, uint8_t * data, uint32_t size)
+{
+	SnapItem *item = sg_new(SnapItem);
+	strncpy(item->name, name, SNAPSHOT_NAMELEN - 1);
+	item->type = type;
+	item->data = data;
+	item->size = size;
+	if (lastItem) {
+		lastItem->next = item;
+	} else {
+		firstItem = item;
+	}
+	lastItem = item;
+	return item;
+}
+
+static SnapshotEntry *
+find_entry(const char *name, uint32_t type)
+{
+	uint32_t i;
+	for (i = 0; i < restoreFile.hdr.nr_entries; i++) {
+		SnapshotEntry *entry = &restoreFile.entries[i];
+		if ((entry->type == type) && !strncmp(entry->name, name, SNAPSHOT_NAMELEN)) {
+			return entry;
+		}
+	}
+	return NULL;
+}
+
+static int
+write_all(int fd, const void *buf, uint64_t count, uint64_t offset)
+{
+	const uint8_t *p = buf;
+	while (count) {
+		ssize_t result = pwrite(fd, p, count, offset);
+		if (result <= 0) {
+			if ((result < 0) && (errno == EINTR)) {
+				continue;
+			}
+			return -1;
+		}
+		p += result;
+		count -= result;
+		offset += result;
+	}
+	return 0;
+}
+
+static int
+read_all(int fd, void *buf, uint64_t count, uint64_t offset)
+{
+	uint8_t *p = buf;
+	while (count) {
+		ssize_t result = pread(fd, p, count, offset);
+		if (result <= 0) {
+			if ((result < 0) && (errno == EINTR)) {
+				continue;
+			}
+			return -1;
+		}
+		p += result;
+		count -= result;
+		offset += result;
+	}
+	return 0;
+}
+
+/*
+ * ---------------------------------------------------------------
+ * The position of a timer among the registered timers with
+ * the same proc.
+ * ---------------------------------------------------------------
+ */
+static uint32_t
+timer_ordinal(CycleTimer ** registry, uint32_t index)
+{
+	uint32_t i;
+	uint32_t ordinal = 0;
+	for (i = 0; i < index; i++) {
+		if (registry[i]->reg_proc == registry[index]->reg_proc) {
+			ordinal++;
+		}
+	}
+	return ordinal;
+}
+
+static CycleTimer *
+find_timer(CycleTimer ** registry, uint32_t nr_timers, SnapshotTimer * st)
+{
+	CycleTimer_Proc *reg_proc = ofs_to_proc(st->reg_proc);
+	uint32_t ordinal = 0;
+	uint32_t i;
+	for (i = 0; i < nr_timers; i++) {
+		if (registry[i]->reg_proc != reg_proc) {
+			continue;
+		}
+		if (ordinal++ == st->ordinal) {
+			return registry[i];
+		}
+	}
+	return NULL;
+}
+
+static int
+compare_timers(const void *p1, const void *p2)
+{
+	const CycleTimer *t1 = *(CycleTimer * const *)p1;
+	const CycleTimer *t2 = *(CycleTimer * const *)p2;
+	if (t1->timeout != t2->timeout) {
+		return t1->timeout < t2->timeout ? -1 : 1;
+	}
+	return t1->seq < t2->seq ? -1 : (t1->seq > t2->seq);
+}
+
+static void
+save_proc(void *clientData)
+{
+	if (Snapshot_Save(saveFileName) < 0) {
+		exit(1);
+	}
+	fprintf(stderr, "Snapshot saved to \"%s\" at cycle %llu\n", saveFileName,
+		(unsigned long long)CycleCounter);
+	exit(0);
+}
+
+/*
+ * ------------------------------------------------------------------
+ * save_at_ms counts from the restored snapshot if there is one.
+ * ------------------------------------------------------------------
+ */
+static void
+start_save_timer(void)
+{
+	uint32_t save_ms = 0;
+	if (!saveFileName) {
+		return;
+	}
+	Config_ReadUInt32(&save_ms, "snapshot", "save_at_ms");
+	CycleTimer_Add(&saveTimer, MillisecondsToCycles(save_ms), save_proc, NULL);
+}
+
+/*
+ * ------------------------------------------------------------------
+ * Read the snapshot configuration and the directory of the
+ * snapshot to restore. Has to be called before the memory
+ * devices are created.
+ * ------------------------------------------------------------------
+ */
+void
+Snapshot_Init(void)
+{
+	char *filename;
+	uint32_t size;
+	CycleTimer_Init(&saveTimer, save_proc, NULL);
+	saveFileName = Config_ReadVar("snapshot", "save");
+	filename = Config_ReadVar("snapshot", "restore");
+	if (!filename) {
+		return;
+	}
+	restoreFile.fd = open(filename, O_RDONLY);
+	if (restoreFile.fd < 0) {
+		fprintf(stderr, "Can not open snapshot \"%s\": %s\n", filename, strerror(errno));
+		exit(1);
+	}
+	if (read_all(restoreFile.fd, &restoreFile.hdr, sizeof(SnapshotHeader), 0) < 0
+	    || memcmp(restoreFile.hdr.magic, SNAPSHOT_MAGIC, 8)) {
+		fprintf(stderr, "\"%s\" is not a snapshot\n", filename);
+		exit(1);
+	}
+	if (restoreFile.hdr.binary_id != binary_id()) {
+		fprintf(stderr, "Snapshot \"%s\" was written by a different binary\n", filename);
+		exit(1);
+	}
+	size = restoreFile.hdr.nr_entries * sizeof(SnapshotEntry);
+	restoreFile.entries = sg_calloc(size + 1);
+	restoreFile.timers = sg_calloc(restoreFile.hdr.nr_timers * sizeof(SnapshotTimer) + 1);
+	if (read_all(restoreFile.fd, restoreFile.entries, size, sizeof(SnapshotHeader)) < 0
+	    || read_all(restoreFile.fd, restoreFile.timers,
+			restoreFile.hdr.nr_timers * sizeof(SnapshotTimer),
+			sizeof(SnapshotHeader) + size) < 0) {
+		fprintf(stderr, "Snapshot \"%s\" is truncated\n", filename);
+		exit(1);
+	}
+	restoreFile.active = true;
+	fprintf(stderr, "Restoring snapshot \"%s\"\n", filename);
+}
+
+bool
+Snapshot_IsRestored(void)
+{
+	return restoreFile.active;
+}
+
+/*
+ * ------------------------------------------------------------------
+ * Allocate the host memory of a RAM. When a snapshot is restored
+ * the RAM is a private mapping of the snapshot file, else it is
+ * filled with the power on value.
+ * ------------------------------------------------------------------
+ */
+uint8_t *
+Snapshot_AllocRam(const char *name, uint32_t size, uint8_t fill)
+{
+	SnapItem *item = add_item(name, SNAP_TYPE_RAM, NULL, size);
+	SnapshotEntry *entry;
+	if (Snapshot_IsRestored() && (entry = find_entry(name, SNAP_TYPE_RAM))) {
+		if (entry->size != size) {
+			fprintf(stderr, "Snapshot: size of RAM \"%s\" has changed\n", name);
+			exit(1);
+		}
+		item->data = mmap(NULL, size, PROT_READ | PROT_WRITE, MAP_PRIVATE,
+				  restoreFile.fd, entry->offset);
+		if (item->data == MAP_FAILED) {
+			fprintf(stderr, "Snapshot: can not map RAM \"%s\": %s\n", name,
+				strerror(errno));
+			exit(1);
+		}
+		item->mapped = 1;
+		return item->data;
+	} else if (Snapshot_IsRestored()) {
+		fprintf(stderr, "Snapshot: RAM \"%s\" is not in the snapshot\n", name);
+	}
+	item->data = sg_calloc(size);
+	if (fill) {
+		memset(item->data, fill, size);
+	}
+	return item->data;
+}
+
+void
+Snapshot_FreeRam(uint8_t * hva)
+{
+	SnapItem *item, *prev = NULL;
+	for (item = firstItem; item; prev = item, item = item->next) {
+		if ((item->type == SNAP_TYPE_RAM) && (item->data == hva)) {
+			break;
+		}
+	}
+	if (!item) {
+		return;
+	}
+	if (prev) {
+		prev->next = item->next;
+	} else {
+		firstItem = item->next;
+	}
+	if (lastItem == item) {
+		lastItem = prev;
+	}
+	if (item->mapped) {
+		munmap(item->data, item->size);
+	} else {
+		sg_free(item->data);
+	}
+	sg_free(item);
+}
+
+/*
+ * ------------------------------------------------------------------
+ * Register a block of state without pointers. proc is called
+ * after all blocks and the timers are restored. A block of size
+ * 0 only registers the proc.
+ * ------------------------------------------------------------------
+ */
+void
+Snapshot_RegisterState(const char *name, void *data, uint32_t size,
+		       Snapshot_RestoreProc * proc, void *clientData)
+{
+	SnapItem *item = add_item(name, SNAP_TYPE_STATE, data, size);
+	item->proc = proc;
+	item->clientData = clientData;
+}
+
+/*
+ * ------------------------------------------------------------------
+ * Called by the board constructor when every device of the board
+ * has registered its state.
+ * ------------------------------------------------------------------
+ */
+void
+Snapshot_BoardComplete(void)
+{
+	boardComplete = true;
+}
+
+/*
+ * ------------------------------------------------------------------
+ * Write a snapshot. Must be called between two instructions,
+ * for example from a CycleTimer.
+ * ------------------------------------------------------------------
+ */
+int
+Snapshot_Save(const char *filename)
+{
+	SnapshotHeader hdr;
+	SnapshotEntry *entries;
+	SnapshotTimer *timers;
+	CycleTimer **registry;
+	CycleTimer **active;
+	SnapItem *item;
+	uint32_t nr_registered = CycleTimers_GetRegistry(&registry);
+	uint32_t nr_entries = 0;
+	uint32_t nr_timers = 0;
+	uint64_t offset;
+	uint32_t i;
+	int fd;
+	int result = 0;
+
+	for (item = firstItem; item; item = item->next) {
+		if (item->size) {
+			nr_entries++;
+		}
+	}
+	entries = sg_calloc(nr_entries * sizeof(SnapshotEntry) + 1);
+	timers = sg_calloc(nr_registered * sizeof(SnapshotTimer) + 1);
+	active = sg_calloc(nr_registered * sizeof(CycleTimer *) + 1);
+	for (i = 0; i < nr_registered; i++) {
+		if (CycleTimer_IsActive(registry[i])) {
+			active[nr_timers++] = registry[i];
+		}
+	}
+	/* Timers with the same timeout have to expire in the same order after restore */
+	qsort(active, nr_timers, sizeof(CycleTimer *), compare_timers);
+	for (i = 0; i < nr_timers; i++) {
+		CycleTimer *timer = active[i];
+		timers[i].timeout = timer->timeout;
+		timers[i].proc = proc_to_ofs(timer->proc);
+		timers[i].reg_proc = proc_to_ofs(timer->reg_proc);
+		timers[i].ordinal = timer_ordinal(registry, timer->reg_index - 1);
+	}
+	memset(&hdr, 0, sizeof(hdr));
+	memcpy(hdr.magic, SNAPSHOT_MAGIC, 8);
+	hdr.binary_id = binary_id();
+	hdr.cycle_counter = CycleCounter;
+	hdr.nr_entries = nr_entries;
+	hdr.nr_timers = nr_timers;
+	offset = sizeof(hdr) + nr_entries * sizeof(SnapshotEntry) + nr_timers * sizeof(SnapshotTimer);
+	for (i = 0, item = firstItem; item; item = item->next) {
+		if (!item->size) {
+			continue;
+		}
+		offset = (offset + SNAPSHOT_ALIGN - 1) & ~(uint64_t) (SNAPSHOT_ALIGN - 1);
+		memcpy(entries[i].name, item->name, SNAPSHOT_NAMELEN);
+		entries[i].type = item->type;
+		entries[i].size = item->size;
+		entries[i].offset = offset;
+		offset += item->size;
+		i++;
+	}
+	fd = open(filename, O_WRONLY | O_CREAT | O_TRUNC, 0644);
+	if (fd < 0) {
+		fprintf(stderr, "Can not create snapshot \"%s\": %s\n", filename, strerror(errno));
+		result = -1;
+		goto out;
+	}
+	if (write_all(fd, &hdr, sizeof(hdr), 0) < 0
+	    || write_all(fd, entries, nr_entries * sizeof(SnapshotEntry), sizeof(hdr)) < 0
+	    || write_all(fd, timers, nr_timers * sizeof(SnapshotTimer),
+			 sizeof(hdr) + nr_entries * sizeof(SnapshotEntry)) < 0) {
+		result = -1;
+	}
+	for (i = 0, item = firstItem; item && (result == 0); item = item->next) {
+		if (!item->size) {
+			continue;
+		}
+		if (write_all(fd, item->data, item->size, entries[i++].offset) < 0) {
+			result = -1;
+		}
+	}
+	/* The file must be long enough to map the last RAM */
+	if ((result == 0) && (ftruncate(fd, offset) < 0)) {
+		result = -1;
+	}
+	if (result < 0) {
+		fprintf(stderr, "Writing snapshot \"%s\" failed: %s\n", filename, strerror(errno));
+	}
+	close(fd);
+ out:
+	sg_free(active);
+	sg_free(timers);
+	sg_free(entries);
+	return result;
+}
+
+/*
+ * ------------------------------------------------------------------
+ * Restore the state blocks, the CycleCounter and the timers
+ * after the board is created. The RAM was already mapped when it
+ * was allocated.
+ * ------------------------------------------------------------------
+ */
+int
+Snapshot_Restore(void)
+{
+	CycleTimer **registry;
+	uint32_t nr_registered = CycleTimers_GetRegistry(&registry);
+	SnapItem *item;
+	SnapshotEntry *entry;
+	uint32_t i;
+
+	if ((Snapshot_IsRestored() || saveFileName) && !boardComplete) {
+		fprintf(stderr, "Snapshot: the board does not register the state "
+			"of all of its devices\n");
+		return -1;
+	}
+	if (!Snapshot_IsRestored()) {
+		start_save_timer();
+		return 0;
+	}
+	for (item = firstItem; item; item = item->next) {
+		if ((item->type != SNAP_TYPE_STATE) || !item->size) {
+			continue;
+		}
+		entry = find_entry(item->name, SNAP_TYPE_STATE);
+		if (!entry || (entry->size != item->size)) {
+			fprintf(stderr, "Snapshot: state \"%s\" is missing or has changed\n",
+				item->name);
+			return -1;
+		}
+		if (read_all(restoreFile.fd, item->data, item->size, entry->offset) < 0) {
+			fprintf(stderr, "Snapshot: can not read state \"%s\"\n", item->name);
+			return -1;
+		}
+	}
+	for (i = 0; i < nr_registered; i++) {
+		CycleTimer_Remove(registry[i]);
+	}
+	CycleCounter = restoreFile.hdr.cycle_counter;
+	for (i = 0; i < restoreFile.hdr.nr_timers; i++) {
+		SnapshotTimer *st = &restoreFile.timers[i];
+		CycleTimer *timer = find_timer(registry, nr_registered, st);
+		if (!timer) {
+			fprintf(stderr, "Snapshot: timer %d of proc %lld does not exist\n",
+				st->ordinal, (long long)st->reg_proc);
+			continue;
+		}
+		CycleTimer_Add(timer, st->timeout - CycleCounter, ofs_to_proc(st->proc),
+			       timer->clientData);
+	}
+	for (item = firstItem; item; item = item->next) {
+		if (item->proc) {
+			item->proc(item->clientData);
+		}
+	}
+	close(restoreFile.fd);
+	restoreFile.fd = -1;
+	start_save_timer();
+	fprintf(stderr, "Snapshot restored at cycle %llu\n", (unsigned long long)CycleCounter);
+	return 0;
+}
@@ -0,0 +1,17 @@
+#ifndef _SNAPSHOT_H
+#define _SNAPSHOT_H
+#include <stdint.h>
+#include <stdbool.h>
+
+typedef void Snapshot_RestoreProc(void *clientData);
+
+void Snapshot_Init(void);
+uint8_t *Snapshot_AllocRam(const char *name, uint32_t size, uint8_t fill);
+void Snapshot_FreeRam(uint8_t * hva);
+void Snapshot_RegisterState(const char *name, void *data, uint32_t size,
+			    Snapshot_RestoreProc * proc, void *clientData);
+void Snapshot_BoardComplete(void);
+int Snapshot_Save(const char *filename);
+int Snapshot_Restore(void);
+bool Snapshot_IsRestored(void);
+#endif
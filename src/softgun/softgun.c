@@ -51,6 +51,8 @@
 #include "version.h"
 #include "sgstring.h"
 #include "sglib.h"
+#include "snapshot.h"
+#include "cycletimer.h"
 #include "crc16.h"
 #ifndef NO_DEBUGGER
 #include "debugvars.h"
@@ -67,6 +69,8 @@
 #include "lib.h"
 #include "logging.h"
 
+#include <uv.h>
+
 typedef struct LoadChainEntry {
 	struct LoadChainEntry *next;
 	char *filename;
@@ -75,9 +79,26 @@ typedef struct LoadChainEntry {
 	uint32_t region_size;	/* 0 = unlimited */
 } LoadChainEntry;
 
+/* Emulated time between two runs of the queued AsyncManager callbacks */
+#define MACHINE_ASYNC_POLL_US	(1000)
+
+/*
+ * One emulated machine. Several instances of the configured board
+ * can run in one process, each on its own thread.
+ */
+typedef struct Machine {
+	uv_thread_t tid;
+	uint32_t instance;
+	CycleTimer asyncTimer;
+} Machine;
+
 static const char *configfpath = NULL;
 static const char *configname = "defaultboard";
 static LoadChainEntry *loadChainHead = NULL;
+static Machine *machines;
+static uint32_t machineCount;
+static uv_mutex_t machineCreateMutex;
+static uv_barrier_t machinesCreated;
 
 static void
 LoadChain_Append(const char *addr_string, const char *filename)
@@ -267,6 +288,90 @@ parse_commandline(int argc, char *argv[])
 	}
 }
 
+/*
+ * ------------------------------------------------------------------
+ * The AsyncManager queues the callbacks of the handles of the
+ * devices (serial, network, display input) for the machine, they
+ * are run here with its machine local state.
+ * ------------------------------------------------------------------
+ */
+static void
+Machine_AsyncPoll(void *clientData)
+{
+	Machine *m = clientData;
+	AsyncManager_RunMachine();
+	CycleTimer_Mod(&m->asyncTimer, MicrosecondsToCycles(MACHINE_ASYNC_POLL_US));
+}
+
+/*
+ * ------------------------------------------------------------------
+ * Create the board of a machine and load the firmware. The
+ * singletons of a machine are thread local, so this runs on the
+ * thread which runs the machine afterwards. The machines are
+ * created one after the other because the device constructors
+ * are not required to be thread safe.
+ * ------------------------------------------------------------------
+ */
+static void
+Machine_Create(Machine * m)
+{
+	const char *boardname;
+	Device_Board_t *board;
+
+	LOG_Info("MAIN", "Creating machine %u", m->instance);
+#ifndef NO_DEBUGGER
+	DbgVars_Init();
+#endif
+	SignodesInit();
+	ClocksInit();
+	Snapshot_Init();
+	boardname = Config_ReadVar("global", "board");
+	if (!boardname) {
+		LOG_Error("MAIN", "No Board selected in Configfile global section");
+		exit(1);
+	}
+	board = Device_CreateBoard(boardname);
+	if (!board) {
+		LOG_Error("MAIN", "Board(%s) Not Found", boardname);
+		exit(1);
+	}
+	CycleTimer_Init(&m->asyncTimer, Machine_AsyncPoll, m);
+	CycleTimer_Mod(&m->asyncTimer, MicrosecondsToCycles(MACHINE_ASYNC_POLL_US));
+	if (!Snapshot_IsRestored()) {
+		LoadChain_Resolve();
+		if (LoadChain_Load() < 0) {
+			LOG_Error("MAIN", "Loading failed");
+			exit(1);
+		}
+	}
+	if (Snapshot_Restore() < 0) {
+		LOG_Error("MAIN", "Restoring the snapshot failed");
+		exit(1);
+	}
+#ifdef __unix
+	Senseless_Init();
+#endif
+}
+
+static void
+Machine_Thread(void *arg)
+{
+	Machine *m = arg;
+	Config_SetInstance(m->instance);
+	GlobalClock_EnterMachine();
+	if (!AsyncManager_EnterMachine()) {
+		LOG_Error("MAIN", "AsyncManager_EnterMachine failed");
+		exit(1);
+	}
+	uv_mutex_lock(&machineCreateMutex);
+	Machine_Create(m);
+	uv_mutex_unlock(&machineCreateMutex);
+	uv_barrier_wait(&machinesCreated);
+	if (GlobalClock_RunMachine() < 0) {
+		exit(1);
+	}
+}
+
 /*
  * ------------------------------------------------------------------
  * main
@@ -277,12 +382,13 @@ parse_commandline(int argc, char *argv[])
 int
 main(int argc, char *argv[])
 {
-	const char *boardname;
 #ifdef __unix
 	struct timeval tv;
 	uint64_t seedval;
 #endif
-	Device_Board_t *board;
+	uint32_t lookahead;
+	uint32_t instances;
+	uint32_t i;
 	
 	LOG_Info("MAIN", "%s", leigun_version);
 	
@@ -308,11 +414,10 @@ main(int argc, char *argv[])
 	signal(SIGPIPE, SIG_IGN);
 #endif
 	parse_commandline(argc - 1, argv + 1);
-#ifndef NO_DEBUGGER
-//	CmdRegistry_Init();
-	DbgVars_Init();
-#endif
 	read_configfile();
+	if (Config_ReadUInt32(&lookahead, "global", "clock_lookahead") >= 0) {
+		GlobalClock_SetLookahead(lookahead);
+	}
 #ifdef __unix
 	if (Config_ReadUInt64(&seedval, "global", "random_seed") >= 0) {
 		LOG_Info("MAIN", "Random Seed from Configuration file: %" PRIu64, seedval);
@@ -323,26 +428,24 @@ main(int argc, char *argv[])
 	}
 	srand48(seedval);
 #endif
-	SignodesInit();
-	ClocksInit();
-	boardname = Config_ReadVar("global", "board");
-	if (!boardname) {
-		LOG_Error("MAIN", "No Board selected in Configfile global section");
-		exit(1);
+	if (Config_ReadUInt32(&instances, "global", "instances") < 0 || instances == 0) {
+		instances = 1;
 	}
-	board = Device_CreateBoard(boardname);
-	if (!board) {
-		LOG_Error("MAIN", "Board(%s) Not Found", boardname);
+#ifndef LEIGUN_MACHINE_LOCAL
+	if (instances > 1) {
+		LOG_Error("MAIN", "More than one instance needs a build with LEIGUN_MACHINE_LOCAL");
 		exit(1);
 	}
-	LoadChain_Resolve();
-	if (LoadChain_Load() < 0) {
-		LOG_Error("MAIN", "Loading failed");
-		exit(1);
-	}
-#ifdef __unix
-	Senseless_Init();
 #endif
+	machineCount = instances;
+	machines = sg_calloc(sizeof(Machine) * instances);
+	uv_mutex_init(&machineCreateMutex);
+	uv_barrier_init(&machinesCreated, instances + 1);
+	for (i = 0; i < instances; i++) {
+		machines[i].instance = i;
+		uv_thread_create(&machines[i].tid, Machine_Thread, &machines[i]);
+	}
+	uv_barrier_wait(&machinesCreated);
 	if (GlobalClock_Start() < 0) {
 		LOG_Error("MAIN", "GlobalClock_Start failed.");
 		exit(1);
@@ -4,12 +4,31 @@
 #include <stdint.h>
 #include <stdlib.h>
 #include <stdio.h>
+#include <string.h>
+#include <unistd.h>
+#include <pthread.h>
 #include "configfile.h"
 #include "sgstring.h"
+#include "byteorder.h"
+#include "cycletimer.h"
+#include "exithandler.h"
+#include "spscring.h"
 #ifndef NO_ALSA
 #include "alsasound.h"
 #endif
 #include "nullsound.h"
+#include "wavsound.h"
+
+#if 0
+#define dbgprintf(...) fprintf(stderr,__VA_ARGS__)
+#else
+#define dbgprintf(...)
+#endif
+
+/* Samples are delivered to the backend in blocks of 10 ms */
+#define PERIODS_PER_SEC	100
+/* The ring buffers at least 200 ms of input */
+#define RING_MSEC	200
 
 typedef struct SndBackEnd {
 	char *name;
@@ -17,6 +36,44 @@ typedef struct SndBackEnd {
 	SoundDevice_NewProc *newProc;
 } SndBackEnd;
 
+/*
+ * The mixing stage between the emulator and the backend. The CPU thread
+ * is the only producer of the ring, the delivery thread the only
+ * consumer. The position of the next output frame is kept as a 32.32
+ * fixed point offset from the ring read pointer in input frames.
+ * The delivery thread sleeps on cond until the producer has queued
+ * wake_level bytes. The mutex protects the format and the buffers, it
+ * is not held while the backend plays, delivering tells
+ * SoundPipe_SetSoundFormat to wait for the end of it.
+ */
+typedef struct SoundPipe {
+	SoundDevice sdev;
+	SoundDevice *backend;
+	char *name;
+	SPSCRing ring;
+	SoundFormat inFormat;
+	SoundFormat outFormat;
+	unsigned int in_bpf;
+	uint64_t phase;
+	uint64_t step;
+	unsigned int periodFrames;
+	unsigned int maxInFrames;
+	uint8_t *rawBuf;
+	int16_t *inBuf;
+	int16_t *outBuf;
+	pthread_mutex_t mutex;
+	pthread_cond_t cond;
+	int waiting;
+	uint32_t wake_level;
+	int delivering;
+	pthread_t thread;
+	int thread_started;
+	int quit;
+	CycleTimer levelTimer;
+	int speed_up;
+	int speed_down;
+} SoundPipe;
+
 static SndBackEnd *firstBackEnd = NULL;
 
 void
@@ -29,8 +86,341 @@ Sound_BackendRegister(const char *name, SoundDevice_NewProc * proc)
 	firstBackEnd = be;
 }
 
-SoundDevice *
-SoundDevice_New(const char *name)
+static int
+bytes_per_sample(int sg_snd_format)
+{
+	switch (sg_snd_format) {
+	    case SG_SND_PCM_FORMAT_S16_LE:
+	    case SG_SND_PCM_FORMAT_U16_LE:
+		    return 2;
+	    case SG_SND_PCM_FORMAT_S8:
+	    case SG_SND_PCM_FORMAT_U8:
+		    return 1;
+	    default:
+		    return 0;
+	}
+}
+
+/*
+ * Convert count samples of the input format to signed 16 bit host
+ * order samples.
+ */
+static void
+convert_to_s16(int16_t * dst, const uint8_t * src, unsigned int count, int sg_snd_format)
+{
+	unsigned int i;
+	switch (sg_snd_format) {
+	    case SG_SND_PCM_FORMAT_S16_LE:
+		    for (i = 0; i < count; i++, src += 2) {
+			    dst[i] = (int16_t) (src[0] | (src[1] << 8));
+		    }
+		    break;
+	    case SG_SND_PCM_FORMAT_U16_LE:
+		    for (i = 0; i < count; i++, src += 2) {
+			    dst[i] = (int16_t) ((src[0] | (src[1] << 8)) ^ 0x8000);
+		    }
+		    break;
+	    case SG_SND_PCM_FORMAT_S8:
+		    for (i = 0; i < count; i++) {
+			    dst[i] = (int8_t) src[i] * 256;
+		    }
+		    break;
+	    case SG_SND_PCM_FORMAT_U8:
+		    for (i = 0; i < count; i++) {
+			    dst[i] = ((int)src[i] - 128) * 256;
+		    }
+		    break;
+	    default:
+		    /* Rejected by SoundPipe_SetSoundFormat, play silence */
+		    memset(dst, 0, count * sizeof(int16_t));
+		    break;
+	}
+}
+
+/*
+ ***********************************************************************
+ * SoundPipe_Period
+ *	Resample one period from the ring into outBuf and return the
+ *	number of frames. Called with the mutex held. Returns 0 and sets
+ *	the wake level if the ring does not contain enough input. With
+ *	flush set a shorter last block is produced.
+ ***********************************************************************
+ */
+static unsigned int
+SoundPipe_Period(SoundPipe * sp, int flush)
+{
+	unsigned int channels = sp->inFormat.channels;
+	unsigned int avail = SPSCRing_Level(&sp->ring) / sp->in_bpf;
+	unsigned int need;
+	unsigned int last;
+	unsigned int used;
+	unsigned int i, c;
+	int16_t *out = sp->outBuf;
+
+	/* Interpolation of the last output frame reads one frame ahead */
+	need = ((sp->phase + (uint64_t) (sp->periodFrames - 1) * sp->step) >> 32) + 2;
+	last = need - 1;
+	if (avail < need) {
+		if (!flush || !avail) {
+			__atomic_store_n(&sp->wake_level, need * sp->in_bpf, __ATOMIC_RELAXED);
+			return 0;
+		}
+		/* Hold the last sample instead of reading ahead */
+		need = last = avail;
+	}
+	SPSCRing_PeekCopy(&sp->ring, sp->rawBuf, need * sp->in_bpf);
+	convert_to_s16(sp->inBuf, sp->rawBuf, need * channels, sp->inFormat.sg_snd_format);
+	if (last == need) {
+		memcpy(sp->inBuf + need * channels, sp->inBuf + (need - 1) * channels,
+		       channels * sizeof(int16_t));
+	}
+	for (i = 0; i < sp->periodFrames; i++) {
+		unsigned int idx = sp->phase >> 32;
+		int32_t frac = (sp->phase & 0xffffffff) >> 17;
+		const int16_t *a;
+		if (idx >= last) {
+			break;
+		}
+		a = sp->inBuf + idx * channels;
+		for (c = 0; c < channels; c++) {
+			int32_t val = a[c] + (((a[c + channels] - a[c]) * frac) >> 15);
+			*out++ = BYTE_HToLe16(val);
+		}
+		sp->phase += sp->step;
+	}
+	used = sp->phase >> 32;
+	sp->phase &= 0xffffffff;
+	SPSCRing_Consume(&sp->ring, used * sp->in_bpf);
+	return i;
+}
+
+/*
+ * The store of waiting and the load of the ring level are ordered
+ * against the ring write and the load of waiting in
+ * SoundPipe_PlaySamples, so one of both sides sees the other.
+ */
+static void *
+SoundPipe_Thread(void *clientData)
+{
+	SoundPipe *sp = clientData;
+	SoundDevice *backend = sp->backend;
+	unsigned int frames;
+	pthread_mutex_lock(&sp->mutex);
+	while (!sp->quit) {
+		frames = SoundPipe_Period(sp, 0);
+		if (frames) {
+			sp->delivering = 1;
+			pthread_mutex_unlock(&sp->mutex);
+			backend->playSamples(backend, sp->outBuf,
+					     frames * sp->outFormat.channels * 2);
+			pthread_mutex_lock(&sp->mutex);
+			sp->delivering = 0;
+			pthread_cond_broadcast(&sp->cond);
+			continue;
+		}
+		__atomic_store_n(&sp->waiting, 1, __ATOMIC_RELAXED);
+		__atomic_thread_fence(__ATOMIC_SEQ_CST);
+		if (SPSCRing_Level(&sp->ring) < sp->wake_level) {
+			pthread_cond_wait(&sp->cond, &sp->mutex);
+		}
+		__atomic_store_n(&sp->waiting, 0, __ATOMIC_RELAXED);
+	}
+	pthread_mutex_unlock(&sp->mutex);
+	return NULL;
+}
+
+/*
+ * Deliver what is left in the ring on exit, a file backend
+ * should not lose the end of the recording.
+ */
+static void
+SoundPipe_Exit(void *clientData)
+{
+	SoundPipe *sp = clientData;
+	if (!sp->thread_started) {
+		return;
+	}
+	unsigned int frames;
+	pthread_mutex_lock(&sp->mutex);
+	sp->quit = 1;
+	pthread_cond_broadcast(&sp->cond);
+	pthread_mutex_unlock(&sp->mutex);
+	pthread_join(sp->thread, NULL);
+	do {
+		frames = SoundPipe_Period(sp, 1);
+		if (frames) {
+			sp->backend->playSamples(sp->backend, sp->outBuf,
+						 frames * sp->outFormat.channels * 2);
+		}
+	} while (frames == sp->periodFrames);
+	if (sp->backend->close) {
+		sp->backend->close(sp->backend);
+	}
+}
+
+/*
+ *****************************************************************************
+ * Control the speed of the emulator by the fill level of the ring when
+ * the backend consumes the samples in real time.
+ *****************************************************************************
+ */
+static void
+SoundPipe_CheckLevel(void *clientData)
+{
+	SoundPipe *sp = clientData;
+	SoundDevice *sdev = &sp->sdev;
+	uint32_t size = sp->ring.size;
+	uint32_t count = size - SPSCRing_Room(&sp->ring);
+	if ((count > (3 * size / 4)) && !sp->speed_down) {
+		sp->speed_down = 1;
+		SigNode_Set(sdev->speedDown, SIG_HIGH);
+		dbgprintf("Speed down\n");
+	} else if ((count < (size / 2)) && sp->speed_down) {
+		SigNode_Set(sdev->speedDown, SIG_LOW);
+		dbgprintf("Speed Ok\n");
+		sp->speed_down = 0;
+	} else if ((count > (size / 2)) && sp->speed_up) {
+		SigNode_Set(sdev->speedUp, SIG_LOW);
+		dbgprintf("Speed Ok\n");
+		sp->speed_up = 0;
+	} else if ((count < (size / 4)) && !sp->speed_up) {
+		sp->speed_up = 1;
+		SigNode_Set(sdev->speedUp, SIG_HIGH);
+		dbgprintf("Speed up\n");
+	}
+	CycleTimer_Mod(&sp->levelTimer, CycleTimerRate_Get() >> 1);
+}
+
+/*
+ ****************************************************************************
+ * SoundPipe_SetSoundFormat
+ *	Called by the emulator. The backend always gets S16_LE with the
+ *	channels of the emulator at the configured rate, or at the rate
+ *	of the emulator when none is configured.
+ ****************************************************************************
+ */
+static int
+SoundPipe_SetSoundFormat(SoundDevice * sdev, SoundFormat * fmt)
+{
+	SoundPipe *sp = sdev->owner;
+	SoundDevice *backend = sp->backend;
+	SoundFormat out;
+	uint32_t rate;
+	uint32_t ringsize;
+	unsigned int bps = bytes_per_sample(fmt->sg_snd_format);
+	if (!bps || (fmt->channels < 1) || !fmt->samplerate) {
+		fprintf(stderr, "Unsupported sound format %d, %d channels, %u Hz\n",
+			fmt->sg_snd_format, fmt->channels, fmt->samplerate);
+		return -1;
+	}
+	out.channels = fmt->channels;
+	out.sg_snd_format = SG_SND_PCM_FORMAT_S16_LE;
+	if ((Config_ReadUInt32(&rate, sp->name, "rate") < 0) || !rate) {
+		rate = fmt->samplerate;
+	}
+	out.samplerate = rate;
+	pthread_mutex_lock(&sp->mutex);
+	while (sp->delivering) {
+		pthread_cond_wait(&sp->cond, &sp->mutex);
+	}
+	if (backend->setSoundFormat(backend, &out) < 0) {
+		pthread_mutex_unlock(&sp->mutex);
+		return -1;
+	}
+	sp->inFormat = *fmt;
+	sp->outFormat = out;
+	sp->sdev.soundFormat = *fmt;
+	sp->in_bpf = bps * fmt->channels;
+	sp->step = ((uint64_t) fmt->samplerate << 32) / out.samplerate;
+	sp->phase = 0;
+	sp->periodFrames = (out.samplerate + PERIODS_PER_SEC - 1) / PERIODS_PER_SEC;
+	sp->maxInFrames = ((uint64_t) sp->periodFrames * sp->step >> 32) + 3;
+	sg_free(sp->rawBuf);
+	sg_free(sp->inBuf);
+	sg_free(sp->outBuf);
+	sp->rawBuf = sg_calloc(sp->maxInFrames * sp->in_bpf);
+	sp->inBuf = sg_calloc(sp->maxInFrames * fmt->channels * sizeof(int16_t));
+	sp->outBuf = sg_calloc(sp->periodFrames * fmt->channels * sizeof(int16_t));
+	/* The ring has to hold a few periods of input */
+	for (ringsize = 4096; ringsize < (uint64_t) fmt->samplerate * sp->in_bpf * RING_MSEC / 1000
+	     || ringsize < 4 * sp->maxInFrames * sp->in_bpf; ringsize <<= 1) {
+		;
+	}
+	sg_free(sp->ring.buf);
+	SPSCRing_Init(&sp->ring, ringsize);
+	if (!sp->thread_started) {
+		pthread_create(&sp->thread, NULL, SoundPipe_Thread, sp);
+		sp->thread_started = 1;
+		ExitHandler_Register(SoundPipe_Exit, sp);
+		if (backend->realTime) {
+			CycleTimer_Mod(&sp->levelTimer, CycleTimerRate_Get() >> 1);
+		}
+	}
+	/* The wake level of a waiting thread belongs to the old format */
+	__atomic_store_n(&sp->wake_level, 0, __ATOMIC_RELAXED);
+	pthread_cond_broadcast(&sp->cond);
+	pthread_mutex_unlock(&sp->mutex);
+	dbgprintf("Sound %u Hz -> %u Hz, %u frames per period\n", fmt->samplerate,
+		  out.samplerate, sp->periodFrames);
+	return 0;
+}
+
+/*
+ * Called by the emulator for every few samples, so it only appends
+ * to the ring. Samples which do not fit are dropped.
+ */
+static int
+SoundPipe_PlaySamples(SoundDevice * sdev, void *data, uint32_t len)
+{
+	SoundPipe *sp = sdev->owner;
+	uint32_t count = len;
+	uint32_t room;
+	if (!sp->in_bpf) {
+		return len;
+	}
+	/* Only whole frames, the rest is dropped when the ring is full */
+	room = SPSCRing_Room(&sp->ring);
+	if (count > room) {
+		count = room;
+	}
+	count -= count % sp->in_bpf;
+	if (count) {
+		SPSCRing_Write(&sp->ring, data, count);
+	}
+	__atomic_thread_fence(__ATOMIC_SEQ_CST);
+	if (__atomic_load_n(&sp->waiting, __ATOMIC_RELAXED)
+	    && (SPSCRing_Level(&sp->ring) >= __atomic_load_n(&sp->wake_level, __ATOMIC_RELAXED))) {
+		pthread_mutex_lock(&sp->mutex);
+		pthread_cond_signal(&sp->cond);
+		pthread_mutex_unlock(&sp->mutex);
+	}
+	return len;
+}
+
+static SoundDevice *
+SoundPipe_New(const char *name, SoundDevice * backend)
+{
+	SoundPipe *sp = sg_new(SoundPipe);
+	SoundDevice *sdev = &sp->sdev;
+	sdev->owner = sp;
+	sdev->setSoundFormat = SoundPipe_SetSoundFormat;
+	sdev->playSamples = SoundPipe_PlaySamples;
+	sp->backend = backend;
+	sp->name = sg_strdup(name);
+	pthread_mutex_init(&sp->mutex, NULL);
+	pthread_cond_init(&sp->cond, NULL);
+	CycleTimer_Init(&sp->levelTimer, SoundPipe_CheckLevel, sp);
+	sdev->speedUp = SigNode_New("%s.speedUp", name);
+	sdev->speedDown = SigNode_New("%s.speedDown", name);
+	if (!sdev->speedUp || !sdev->speedDown) {
+		fprintf(stderr, "Can not create sound speed control lines\n");
+		exit(1);
+	}
+	return sdev;
+}
+
+static SoundDevice *
+SoundBackend_New(const char *name)
 {
 	SndBackEnd *cursor;
 	SoundDevice *sdev;
@@ -53,5 +443,17 @@ SoundDevice_New(const char *name)
 		}
 	}
 #endif
+	if (strcmp(bename, "wav") == 0) {
+		sdev = WavSound_New(name);
+		if (sdev) {
+			return sdev;
+		}
+	}
 	return NullSound_New(name);
 }
+
+SoundDevice *
+SoundDevice_New(const char *name)
+{
+	return SoundPipe_New(name, SoundBackend_New(name));
+}
@@ -29,14 +29,26 @@ typedef struct SoundFormat {
 /*
  *****************************************************************
  * The Abstract base class SoundDevice is implemented by the
- * backends
+ * backends. The device returned by SoundDevice_New is the
+ * front of the mixing stage: it buffers the samples of the
+ * emulator and feeds the backend with period sized blocks of
+ * S16_LE samples at the backend rate from a separate thread.
+ * The setSoundFormat of a backend stores the samplerate it
+ * really uses in the format.
+ * A backend which plays in real time sets realTime and
+ * blocks in playSamples, the mixing stage then controls the
+ * speed of the emulator with speedUp/speedDown.
+ * The optional close is called by the mixing stage on exit
+ * after the last samples were delivered.
  *****************************************************************
  */
 typedef struct SoundDevice {
 	void *owner;
 	int (*setSoundFormat) (struct SoundDevice *, SoundFormat *);
 	int (*playSamples) (struct SoundDevice *, void *data, uint32_t len);
+	void (*close) (struct SoundDevice *);
 	SoundFormat soundFormat;
+	int realTime;
 	SigNode *speedUp;
 	SigNode *speedDown;
 } SoundDevice;
@@ -35,6 +35,7 @@
  *************************************************************************************************
  */
 
+#include <stdio.h>
 #include <stdint.h>
 #include "sgstring.h"
 #include "signode.h"
@@ -0,0 +1,113 @@
+//===-- softgun/spscring.h ----------------------------------------*- C -*-===//
+//
+//              The Leigun Embedded System Simulator Platform
+//
+// Licensed under the Apache License, Version 2.0 (the "License");
+// you may not use this file except in compliance with the License.
+// You may obtain a copy of the License at
+//
+//     http://www.apache.org/licenses/LICENSE-2.0
+//
+// Unless required by applicable law or agreed to in writing, software
+// distributed under the License is distributed on an "AS IS" BASIS,
+// WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+// See the License for the specific language governing permissions and
+// limitations under the License.
+//
+//===----------------------------------------------------------------------===//
+///
+/// @file
+/// Lock free byte ring for exactly one producer and one consumer thread
+///
+/// The producer only modifies wp and the consumer only modifies rp. Both
+/// are free running counters, the size has to be a power of two. The
+/// consumer gets the readable bytes as at most two contiguous regions so
+/// that they can be handed to write() without copying.
+///
+//===----------------------------------------------------------------------===//
+#ifndef _SPSCRING_H
+#define _SPSCRING_H
+#include <stdint.h>
+#include <string.h>
+#include "sgstring.h"
+
+typedef struct SPSCRing {
+	uint8_t *buf;
+	uint32_t size;
+	uint32_t wp;
+	uint32_t rp;
+} SPSCRing;
+
+static inline void
+SPSCRing_Init(SPSCRing * ring, uint32_t size)
+{
+	ring->buf = sg_calloc(size);
+	ring->size = size;
+	ring->wp = ring->rp = 0;
+}
+
+/// Bytes readable by the consumer
+static inline uint32_t
+SPSCRing_Level(SPSCRing * ring)
+{
+	return __atomic_load_n(&ring->wp, __ATOMIC_ACQUIRE) - ring->rp;
+}
+
+/// Bytes writable by the producer
+static inline uint32_t
+SPSCRing_Room(SPSCRing * ring)
+{
+	return ring->size - (ring->wp - __atomic_load_n(&ring->rp, __ATOMIC_ACQUIRE));
+}
+
+/// Producer: append up to count bytes, returns the number of bytes taken
+static inline uint32_t
+SPSCRing_Write(SPSCRing * ring, const uint8_t * data, uint32_t count)
+{
+	uint32_t room = SPSCRing_Room(ring);
+	uint32_t idx = ring->wp & (ring->size - 1);
+	uint32_t part;
+	if (count > room) {
+		count = room;
+	}
+	part = ring->size - idx;
+	if (part > count) {
+		part = count;
+	}
+	memcpy(ring->buf + idx, data, part);
+	memcpy(ring->buf, data + part, count - part);
+	__atomic_store_n(&ring->wp, ring->wp + count, __ATOMIC_RELEASE);
+	return count;
+}
+
+/// Consumer: the first contiguous readable region, its length is returned
+static inline uint32_t
+SPSCRing_Peek(SPSCRing * ring, const uint8_t ** data)
+{
+	uint32_t level = SPSCRing_Level(ring);
+	uint32_t idx = ring->rp & (ring->size - 1);
+	uint32_t part = ring->size - idx;
+	*data = ring->buf + idx;
+	return level < part ? level : part;
+}
+
+/// Consumer: copy count readable bytes to dst without releasing them
+static inline void
+SPSCRing_PeekCopy(SPSCRing * ring, uint8_t * dst, uint32_t count)
+{
+	uint32_t idx = ring->rp & (ring->size - 1);
+	uint32_t part = ring->size - idx;
+	if (part > count) {
+		part = count;
+	}
+	memcpy(dst, ring->buf + idx, part);
+	memcpy(dst + part, ring->buf, count - part);
+}
+
+/// Consumer: release count bytes obtained by SPSCRing_Peek
+static inline void
+SPSCRing_Consume(SPSCRing * ring, uint32_t count)
+{
+	__atomic_store_n(&ring->rp, ring->rp + count, __ATOMIC_RELEASE);
+}
+#endif
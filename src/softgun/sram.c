@@ -40,6 +40,7 @@
 #include "bus.h"
 #include "configfile.h"
 #include "sgstring.h"
+#include "snapshot.h"
 
 typedef struct SRam {
 	BusDevice bdev;
@@ -105,8 +106,7 @@ SRam_New(char *sram_name)
 		return NULL;
 	}
 	sram = sg_new(SRam);
-	sram->host_mem = sg_calloc(size);
-	memset(sram->host_mem, 0xff, size);
+	sram->host_mem = Snapshot_AllocRam(sram_name, size, 0xff);
 	sram->size = size;
 	sram->bdev.first_mapping = NULL;
 	sram->bdev.Map = SRam_Map;
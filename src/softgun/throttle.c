@@ -36,15 +36,18 @@
 
 #include <time.h>
 #include <stdint.h>
+#include <uv.h>
 #include "cycletimer.h"
 #include "signode.h"
 #include "sglib.h"
 #include "sgstring.h"
 #include "throttle.h"
 #include "configfile.h"
+#include "debugvars.h"
+#include "snapshot.h"
 
 struct Throttle {
-	struct timespec tv_last_throttle;
+	uint64_t last_throttle_ns;
 	CycleCounter_t last_throttle_cycles;
 	CycleTimer throttle_timer;
 	int64_t cycles_ahead;	/* Number of cycles ahead of real cpu */
@@ -52,13 +55,62 @@ struct Throttle {
 	/* Control loop for the sound */
 	SigNode *sigSpeedUp;
 	SigNode *sigSpeedDown;
+	/* Sleeping, interruptible by Throttle_Wakeup */
+	uv_thread_t owner;	/* The CPU thread, set once in Throttle_New */
+	uv_mutex_t sleepMutex;
+	uv_cond_t sleepCond;
+	int wakeup;		/* Protected by sleepMutex */
+	/* Statistics */
+	uint64_t sleptNs;
+	uint64_t runNs;
 };
 
+/*
+ * ---------------------------------------------------------------
+ * The number of CPU cycles which should have been executed in
+ * nsecs of real time.
+ * ---------------------------------------------------------------
+ */
+static int64_t
+expected_cycles(Throttle * th, uint64_t nsecs)
+{
+	int64_t exp_cpu_cycles = NanosecondsToCycles(nsecs);
+	if (SigNode_Val(th->sigSpeedUp) == SIG_HIGH) {
+		exp_cpu_cycles += exp_cpu_cycles >> 4;
+	} else if (SigNode_Val(th->sigSpeedDown) == SIG_HIGH) {
+		exp_cpu_cycles -= exp_cpu_cycles >> 4;
+	}
+	return exp_cpu_cycles;
+}
+
+/*
+ * ---------------------------------------------------------------
+ * Sleep for nsecs or until Throttle_Wakeup() is called. A wakeup
+ * which arrived since the last sleep ends the sleep at once.
+ * Returns the time really slept.
+ * ---------------------------------------------------------------
+ */
+static uint64_t
+throttle_sleep(Throttle * th, uint64_t nsecs)
+{
+	uint64_t start = uv_hrtime();
+	uint64_t now = start;
+	uv_mutex_lock(&th->sleepMutex);
+	while (!th->wakeup && ((now - start) < nsecs)) {
+		uv_cond_timedwait(&th->sleepCond, &th->sleepMutex, nsecs - (now - start));
+		now = uv_hrtime();
+	}
+	th->wakeup = 0;
+	uv_mutex_unlock(&th->sleepMutex);
+	return now - start;
+}
+
 /**
  ******************************************************************
  * \fn static void throttle_proc(void *clientData)
  * Timer handler checking if the cpu cycles is ahead of the
- * excpected cycle counter. If yes sleep for some time. 
+ * excpected cycle counter. If yes sleep until the real time
+ * catches up. 
  * The CPU speed can be varied by some percent using a "Speed Up"
  * and "Speed Down" signal from outside. This is used by the
  * sound backend for adjusting the CPU speed exactly to the
@@ -69,38 +121,25 @@ static void
 throttle_proc(void *clientData)
 {
 	Throttle *th = (Throttle *) clientData;
-	struct timespec tv_now;
-	uint32_t nsecs;
-	uint32_t sleepCnt = 0;
+	uint64_t now;
+	uint64_t slept = 0;
 	int64_t exp_cpu_cycles, done_cpu_cycles;
 	done_cpu_cycles = CycleCounter_Get() - th->last_throttle_cycles;
 	th->cycles_ahead += done_cpu_cycles;
-	do {
-		struct timespec tout;
-		tout.tv_nsec = 200 * 1000; /* 0.2 ms */
-		tout.tv_sec = 0;
-
-#if defined(__STDC_VERSION__) && (__STDC_VERSION__ >= 201112L)
-		timespec_get(&tv_now, TIME_UTC);
-#else
-		clock_gettime(CLOCK_MONOTONIC, &tv_now);
-#endif
-		nsecs = (tv_now.tv_nsec - th->tv_last_throttle.tv_nsec) +
-		    (int64_t) 1000000000 * (tv_now.tv_sec - th->tv_last_throttle.tv_sec);
-		exp_cpu_cycles = NanosecondsToCycles(nsecs);
-		if (SigNode_Val(th->sigSpeedUp) == SIG_HIGH) {
-			exp_cpu_cycles += exp_cpu_cycles >> 4;
-		} else if (SigNode_Val(th->sigSpeedDown) == SIG_HIGH) {
-			exp_cpu_cycles -= exp_cpu_cycles >> 4;
-		}
-		if (th->cycles_ahead > exp_cpu_cycles) {
-			//FIXME: FIO_WaitEventTimeout(&tout);
-			sleepCnt++;
-		}
-	} while (th->cycles_ahead > exp_cpu_cycles);
+	now = uv_hrtime();
+	exp_cpu_cycles = expected_cycles(th, now - th->last_throttle_ns);
+	if (th->cycles_ahead > exp_cpu_cycles) {
+		slept = throttle_sleep(th, CyclesToNanoseconds(th->cycles_ahead - exp_cpu_cycles));
+		th->runNs += now - th->last_throttle_ns;
+		th->sleptNs += slept;
+		now += slept;
+		exp_cpu_cycles = expected_cycles(th, now - th->last_throttle_ns);
+	} else {
+		th->runNs += now - th->last_throttle_ns;
+	}
 	th->cycles_ahead -= exp_cpu_cycles;
 	th->last_throttle_cycles = CycleCounter_Get();
-	th->tv_last_throttle = tv_now;
+	th->last_throttle_ns = now;
 	/*  
 	 **********************************************************
 	 * Forget about catch up if CPU is more than on second 
@@ -111,17 +150,58 @@ throttle_proc(void *clientData)
 	if (-th->cycles_ahead > (CycleTimerRate_Get() >> 2)) {
 		th->cycles_ahead = 0;
 	}
-	if(sleepCnt > 1) {
+	/* Check more often when the sleeps get long (more than 0.2 ms) */
+	if (slept > 200 * 1000) {
 		th->sleepsPerSecond = th->sleepsPerSecond + 1 + (th->sleepsPerSecond >> 8);
-	//	fprintf(stderr,"SleepCnt is %u, sps %u\n",sleepCnt,th->sleepsPerSecond);
-	} else if((sleepCnt == 0) && (th->sleepsPerSecond > 40)) {
+	} else if ((slept == 0) && (th->sleepsPerSecond > 40)) {
 		th->sleepsPerSecond--;
-	//fprintf(stderr,"SleepCnt is %u, sps %u\n",sleepCnt,th->sleepsPerSecond);
 	}
 	CycleTimer_Mod(&th->throttle_timer, CycleTimerRate_Get() / th->sleepsPerSecond);
 	return;
 }
 
+/*
+ * ------------------------------------------------------------------
+ * The CycleCounter jumps when a snapshot is restored. Start
+ * measuring again from there.
+ * ------------------------------------------------------------------
+ */
+static void
+throttle_restored(void *clientData)
+{
+	Throttle *th = (Throttle *) clientData;
+	th->last_throttle_ns = uv_hrtime();
+	th->last_throttle_cycles = CycleCounter_Get();
+	th->cycles_ahead = 0;
+}
+
+/*
+ * ------------------------------------------------------------------
+ * Interrupt a sleeping throttle, for example when an interrupt
+ * for the CPU arrives from outside. May be called from any thread.
+ * Interrupts raised by the CPU thread itself are seen by the CPU
+ * anyway, they never shorten a sleep and cost no lock. A wakeup
+ * from another thread is remembered under the sleep mutex, so one
+ * arriving just before a sleep starts ends that sleep at once.
+ * ------------------------------------------------------------------
+ */
+void
+Throttle_Wakeup(Throttle * th)
+{
+	uv_thread_t self;
+	if (!th) {
+		return;
+	}
+	self = uv_thread_self();
+	if (uv_thread_equal(&self, &th->owner)) {
+		return;
+	}
+	uv_mutex_lock(&th->sleepMutex);
+	th->wakeup = 1;
+	uv_cond_signal(&th->sleepCond);
+	uv_mutex_unlock(&th->sleepMutex);
+}
+
 Throttle *
 Throttle_New(const char *name)
 {
@@ -135,13 +215,17 @@ Throttle_New(const char *name)
 	}
 	SigNode_Set(th->sigSpeedUp, SIG_PULLDOWN);
 	SigNode_Set(th->sigSpeedDown, SIG_PULLDOWN);
-#if defined(__STDC_VERSION__) && (__STDC_VERSION__ >= 201112L)
-	timespec_get(&th->tv_last_throttle, TIME_UTC);
-#else
-	clock_gettime(CLOCK_MONOTONIC, &th->tv_last_throttle);
-#endif
+	if ((uv_mutex_init(&th->sleepMutex) < 0) || (uv_cond_init(&th->sleepCond) < 0)) {
+		fprintf(stderr, "Can not create the throttle sleep condition\n");
+		exit(1);
+	}
+	th->owner = uv_thread_self();
+	th->last_throttle_ns = uv_hrtime();
 	th->last_throttle_cycles = 0;
 	th->sleepsPerSecond = 100; /* Start Value, Sleep 100 times per second */
+	DbgExport_U64(th->sleptNs, "%s.throttle.slept_ns", name);
+	DbgExport_U64(th->runNs, "%s.throttle.run_ns", name);
+	Snapshot_RegisterState(name, NULL, 0, throttle_restored, th);
 	Config_ReadUInt32(&throttle_enable, name, "throttle");
 	if (throttle_enable) {
 		CycleTimer_Add(&th->throttle_timer, CycleTimerRate_Get() / 40, throttle_proc, th);
@@ -2,4 +2,5 @@
 #define _THROTTLE_H
 typedef struct Throttle Throttle;
 Throttle *Throttle_New(const char *name);
+void Throttle_Wakeup(Throttle * th);
 #endif
@@ -548,6 +548,136 @@ UsbDev_Feed(void *dev, const UsbPacket * packet)
 	}
 }
 
+/*
+ * --------------------------------------------------------------------------------
+ * transfer_out
+ *	Hand the data of a SETUP or OUT transfer to the endpoint in packets
+ *	of maxpacket bytes. A zero length transfer is one zero length packet.
+ * --------------------------------------------------------------------------------
+ */
+static int
+transfer_out(UsbDevice * udev, UsbEndpoint * epnt, UsbTransfer * xfer)
+{
+	UsbTransaction *ta = &udev->transaction;
+	UsbPacket reply;
+	int result;
+	int len;
+	do {
+		len = xfer->len - xfer->actual;
+		if (len > xfer->maxpacket) {
+			len = xfer->maxpacket;
+		}
+		ta->token.pid = xfer->pid;
+		ta->data = xfer->data + xfer->actual;
+		ta->data_len = len;
+		result = epnt->doTransaction(udev, epnt, ta, &reply);
+		/* SETUP is always acknowledged */
+		if ((result != USBTA_OK) && (xfer->pid != USB_PID_SETUP)) {
+			return USB_RET_NAK;
+		}
+		if (xfer->pid == USB_PID_OUT) {
+			epnt->toggle ^= 1;
+		}
+		xfer->toggle ^= 1;
+		xfer->actual += len;
+		xfer->packets++;
+	} while (xfer->actual < xfer->len);
+	return 0;
+}
+
+/*
+ * --------------------------------------------------------------------------------
+ * transfer_in
+ *	Collect data packets from the endpoint until the buffer is full or
+ *	a short packet arrives. Every packet is acknowledged to the device.
+ * --------------------------------------------------------------------------------
+ */
+static int
+transfer_in(UsbDevice * udev, UsbEndpoint * epnt, UsbTransfer * xfer)
+{
+	UsbTransaction *ta = &udev->transaction;
+	UsbPacket reply;
+	int len;
+	do {
+		ta->token.pid = USB_PID_IN;
+		ta->data = NULL;
+		ta->data_len = 0;
+		reply.pid = USB_PID_RESERVED;
+		reply.len = 0;
+		epnt->doTransaction(udev, epnt, ta, &reply);
+		if (reply.pid == USB_PID_NAK) {
+			return USB_RET_NAK;
+		} else if (reply.pid == USB_PID_STALL) {
+			return USB_RET_STALL;
+		} else if ((reply.pid != USB_PID_DATA0) && (reply.pid != USB_PID_DATA1)) {
+			fprintf(stderr, "Usb doTransaction: Unknown reply pid %d \n", reply.pid);
+			return USB_RET_STALL;
+		}
+		len = reply.len;
+		if (len > (xfer->len - xfer->actual)) {
+			fprintf(stderr, "USB device: IN packet of %d bytes overruns buffer\n", len);
+			len = xfer->len - xfer->actual;
+		}
+		memcpy(xfer->data + xfer->actual, reply.data, len);
+		xfer->toggle ^= 1;
+		xfer->actual += len;
+		xfer->packets++;
+		ta->token.pid = USB_PID_ACK;
+		epnt->doTransaction(udev, epnt, ta, NULL);
+	} while ((reply.len == xfer->maxpacket) && (xfer->actual < xfer->len));
+	return 0;
+}
+
+/*
+ * --------------------------------------------------------------------------------
+ * UsbDev_Transfer
+ * 	Feed an USB device with a whole transfer. The token, data and
+ *	handshake packets of UsbDev_Feed are skipped, the endpoint
+ *	sees the same sequence of transactions.
+ * --------------------------------------------------------------------------------
+ */
+int
+UsbDev_Transfer(UsbDevice * udev, UsbTransfer * xfer)
+{
+	UsbToken *token = &udev->transaction.token;
+	UsbEndpoint *epnt;
+	int epnum = xfer->epnum & 0xf;
+	if ((xfer->addr & 0x7f) != udev->addr) {
+		return USB_RET_NODEV;
+	}
+	if (udev->ta_state != STATE_IDLE) {
+		fprintf(stderr, "UsbDevice: transfer in transaction state %d\n", udev->ta_state);
+		return USB_RET_NAK;
+	}
+	if (xfer->pid == USB_PID_IN) {
+		epnt = udev->in_endpnt[epnum];
+	} else {
+		epnt = udev->out_endpnt[epnum];
+	}
+	if (!epnt) {
+		fprintf(stderr, "USB device: accessing nonexisting endpoint %d\n", epnum);
+		return USB_RET_NODEV;
+	}
+	if ((xfer->pid == USB_PID_SETUP) && (epnt->type != EPNT_TYPE_CONTROL)) {
+		fprintf(stderr, "UsbDevice: SETUP transfer for non control endpoint %d\n", epnum);
+		return USB_RET_STALL;
+	}
+	if (xfer->maxpacket <= 0) {
+		xfer->maxpacket = epnt->maxpacket ? epnt->maxpacket : USB_MAX_PKTLEN;
+	}
+	token->addr = xfer->addr & 0x7f;
+	token->epnum = epnum;
+	token->pid = xfer->pid;
+	if (epnt->doTransfer) {
+		return epnt->doTransfer(udev, epnt, xfer);
+	}
+	if (xfer->pid == USB_PID_IN) {
+		return transfer_in(udev, epnt, xfer);
+	} else {
+		return transfer_out(udev, epnt, xfer);
+	}
+}
+
 UsbDevice *
 UsbDev_New(void *owner, usb_device_speed speed)
 {
@@ -796,6 +926,18 @@ UsbDev_RegisterRequest(UsbEndpoint * ep, uint8_t rq, uint8_t rqt, UsbRequestHand
 	XY_SetHashValue(entry, proc);
 }
 
+/*
+ * ------------------------------------------------------------------------------------------------
+ * UsbDev_RegisterTransferProc
+ *	Endpoints which can take a whole transfer in one buffer register the proc here.
+ * ------------------------------------------------------------------------------------------------
+ */
+void
+UsbDev_RegisterTransferProc(UsbEndpoint * ep, UsbTransferProc * proc)
+{
+	ep->doTransfer = proc;
+}
+
 /*
  * --------------------------------------------------------------------
  * The UsbDevices have very similar Control Endpoint 0
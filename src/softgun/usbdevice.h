@@ -32,6 +32,7 @@
 #define USB_RET_NAK             (-1)
 #define USB_RET_STALL           (-2)
 #define USB_RET_NYET            (-3)
+#define USB_RET_NODEV           (-4)
 
 #define USBDEV(ep)	((ep)->usbdev)
 
@@ -72,10 +73,30 @@ typedef struct UsbTransaction {
 	int data_len;
 } UsbTransaction;
 
+/*
+ * ---------------------------------------------------------------------------
+ * A whole transfer descriptor of a host controller. Used by the
+ * transaction level interface which exchanges all data packets of a
+ * transfer in one call without emulating tokens and handshakes.
+ * ---------------------------------------------------------------------------
+ */
+typedef struct UsbTransfer {
+	uint8_t pid;		/* USB_PID_SETUP, USB_PID_OUT or USB_PID_IN */
+	uint8_t addr;
+	uint8_t epnum;
+	int maxpacket;
+	uint8_t *data;
+	int len;		/* bytes to send or room for the received bytes */
+	int actual;		/* bytes transfered */
+	int packets;		/* data packets exchanged, for the bus timing */
+	int toggle;		/* data toggle of the next packet */
+} UsbTransfer;
+
 typedef struct UsbEndpoint UsbEndpoint;
 
 typedef int UsbTransactionProc(struct UsbDevice *, UsbEndpoint *, UsbTransaction *,
 			       UsbPacket * reply);
+typedef int UsbTransferProc(struct UsbDevice *, UsbEndpoint *, UsbTransfer *);
 
 struct UsbEndpoint {
 	struct UsbDevice *usbdev;
@@ -86,6 +107,8 @@ struct UsbEndpoint {
 
 	/* Out Endpoint is input of device */
 	UsbTransactionProc *doTransaction;
+	/* optional, takes a whole transfer at once */
+	UsbTransferProc *doTransfer;
 
 	int status;
 	int epaddr;
@@ -435,6 +458,18 @@ typedef UsbTaRes UsbRequestHandler(UsbEndpoint *, UsbSetupBuffer *);
  */
 void UsbDev_Feed(void *dev, const UsbPacket * packet);
 
+/*
+ * ------------------------------------------------------------------------------------
+ * UsbDev_Transfer
+ *	The transaction level alternative to UsbDev_Feed. The host hands a whole
+ *	transfer to the device. Returns 0 when the transfer is complete (all data
+ *	or a short packet), USB_RET_NAK if the device did not accept or deliver
+ *	all data, USB_RET_STALL or USB_RET_NODEV if the device does not have the
+ *	address of the transfer.
+ * ------------------------------------------------------------------------------------
+ */
+int UsbDev_Transfer(UsbDevice * udev, UsbTransfer * xfer);
+
 /*
  * ------------------------------------------------------------------------
  * An usb device uses the packet sink provided by the USB host.
@@ -457,6 +492,15 @@ UsbEndpoint *UsbDev_RegisterEndpoint(UsbDevice * udev, int epaddr, int eptype, i
 
 void UsbDev_RegisterRequest(UsbEndpoint *, uint8_t rq, uint8_t rqt, UsbRequestHandler * proc);
 
+/*
+ * ------------------------------------------------------------------------
+ * A device emulator which can take or deliver the data of a transfer in
+ * one buffer registers a transfer proc for the endpoint. Without it
+ * UsbDev_Transfer splits the transfer into calls of doTransaction.
+ * ------------------------------------------------------------------------
+ */
+void UsbDev_RegisterTransferProc(UsbEndpoint *, UsbTransferProc *);
+
 /*
  * ---------------------------------------------------------
  * Here the Library part starts
@@ -0,0 +1,179 @@
+//===-- softgun/wavsound.c ----------------------------------------*- C -*-===//
+//
+//              The Leigun Embedded System Simulator Platform
+//
+// Licensed under the Apache License, Version 2.0 (the "License");
+// you may not use this file except in compliance with the License.
+// You may obtain a copy of the License at
+//
+//     http://www.apache.org/licenses/LICENSE-2.0
+//
+// Unless required by applicable law or agreed to in writing, software
+// distributed under the License is distributed on an "AS IS" BASIS,
+// WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+// See the License for the specific language governing permissions and
+// limitations under the License.
+//
+//===----------------------------------------------------------------------===//
+///
+/// @file
+/// Sound backend writing the samples to a WAV file
+///
+/// Used for running audio regression tests without a sound card. The
+/// mixing stage delivers S16_LE samples. The sizes in the RIFF header
+/// are written on exit and once per second of audio, so a killed
+/// emulator loses at most the last second of the file.
+///
+/// Configuration (section of the sound device):
+///   backend: wav
+///   file:    output file, default "<device name>.wav"
+///   rate:    samplerate of the file, default is the rate of the
+///            emulated device (handled by the mixing stage)
+///
+//===----------------------------------------------------------------------===//
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <stdint.h>
+#include <unistd.h>
+#include <fcntl.h>
+#include <errno.h>
+#include "wavsound.h"
+#include "configfile.h"
+#include "sgstring.h"
+
+#define WAV_HDR_SIZE	44
+
+typedef struct WavSound {
+	SoundDevice sdev;
+	char *filename;
+	int fd;
+	uint32_t dataBytes;
+	/* dataBytes when the header is written again */
+	uint32_t nextHeader;
+} WavSound;
+
+static void
+put_le32(uint8_t * p, uint32_t val)
+{
+	p[0] = val;
+	p[1] = val >> 8;
+	p[2] = val >> 16;
+	p[3] = val >> 24;
+}
+
+static void
+put_le16(uint8_t * p, uint16_t val)
+{
+	p[0] = val;
+	p[1] = val >> 8;
+}
+
+static int
+WavSound_WriteHeader(WavSound * ws)
+{
+	SoundFormat *fmt = &ws->sdev.soundFormat;
+	uint8_t hdr[WAV_HDR_SIZE];
+	unsigned int bpf = fmt->channels * 2;
+	memcpy(hdr, "RIFF", 4);
+	put_le32(hdr + 4, WAV_HDR_SIZE - 8 + ws->dataBytes);
+	memcpy(hdr + 8, "WAVEfmt ", 8);
+	put_le32(hdr + 16, 16);
+	put_le16(hdr + 20, 1);	/* PCM */
+	put_le16(hdr + 22, fmt->channels);
+	put_le32(hdr + 24, fmt->samplerate);
+	put_le32(hdr + 28, fmt->samplerate * bpf);
+	put_le16(hdr + 32, bpf);
+	put_le16(hdr + 34, 16);
+	memcpy(hdr + 36, "data", 4);
+	put_le32(hdr + 40, ws->dataBytes);
+	if (pwrite(ws->fd, hdr, sizeof(hdr), 0) != sizeof(hdr)) {
+		return -1;
+	}
+	return 0;
+}
+
+/*
+ * Only 16 bit signed samples are written. A change of the format
+ * starts a new recording.
+ */
+static int
+WavSound_SetSoundFormat(SoundDevice * sdev, SoundFormat * fmt)
+{
+	WavSound *ws = sdev->owner;
+	if (fmt->sg_snd_format != SG_SND_PCM_FORMAT_S16_LE) {
+		fprintf(stderr, "WAV sound backend only supports S16_LE samples\n");
+		return -1;
+	}
+	sdev->soundFormat = *fmt;
+	ws->dataBytes = 0;
+	ws->nextHeader = fmt->samplerate * fmt->channels * 2;
+	if ((ftruncate(ws->fd, 0) < 0) || (WavSound_WriteHeader(ws) < 0)) {
+		fprintf(stderr, "Can not write WAV header to \"%s\": %s\n", ws->filename,
+			strerror(errno));
+		return -1;
+	}
+	return 0;
+}
+
+static int
+WavSound_PlaySamples(SoundDevice * sdev, void *data, uint32_t len)
+{
+	WavSound *ws = sdev->owner;
+	ssize_t result;
+	result = pwrite(ws->fd, data, len, WAV_HDR_SIZE + ws->dataBytes);
+	if (result <= 0) {
+		return -1;
+	}
+	ws->dataBytes += result;
+	/* Keep the file playable after a crash, but not at every block */
+	if (ws->dataBytes >= ws->nextHeader) {
+		ws->nextHeader = ws->dataBytes + sdev->soundFormat.samplerate
+		    * sdev->soundFormat.channels * 2;
+		WavSound_WriteHeader(ws);
+	}
+	return result;
+}
+
+static void
+WavSound_Close(SoundDevice * sdev)
+{
+	WavSound *ws = sdev->owner;
+	if (WavSound_WriteHeader(ws) < 0) {
+		fprintf(stderr, "Can not write WAV header to \"%s\": %s\n", ws->filename,
+			strerror(errno));
+	}
+	close(ws->fd);
+	ws->fd = -1;
+}
+
+SoundDevice *
+WavSound_New(const char *name)
+{
+	WavSound *ws;
+	SoundDevice *sdev;
+	char *filename = Config_ReadVar(name, "file");
+	int fd;
+	if (filename) {
+		filename = sg_strdup(filename);
+	} else {
+		filename = sg_calloc(strlen(name) + 5);
+		sprintf(filename, "%s.wav", name);
+	}
+	fd = open(filename, O_RDWR | O_CREAT | O_TRUNC, 0644);
+	if (fd < 0) {
+		fprintf(stderr, "Can not open WAV file \"%s\": %s\n", filename, strerror(errno));
+		sg_free(filename);
+		return NULL;
+	}
+	ws = sg_new(WavSound);
+	ws->filename = filename;
+	ws->fd = fd;
+	sdev = &ws->sdev;
+	sdev->owner = ws;
+	sdev->setSoundFormat = WavSound_SetSoundFormat;
+	sdev->playSamples = WavSound_PlaySamples;
+	sdev->close = WavSound_Close;
+	fprintf(stderr, "Created WAV sound device \"%s\" writing to \"%s\"\n", name, filename);
+	return sdev;
+}
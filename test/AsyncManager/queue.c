@@ -0,0 +1,226 @@
+//===-- test/AsyncManager/queue.c ---------------------------------*- C -*-===//
+//
+//              The Leigun Embedded System Simulator Platform
+//
+// Licensed under the Apache License, Version 2.0 (the "License");
+// you may not use this file except in compliance with the License.
+// You may obtain a copy of the License at
+//
+//     http://www.apache.org/licenses/LICENSE-2.0
+//
+// Unless required by applicable law or agreed to in writing, software
+// distributed under the License is distributed on an "AS IS" BASIS,
+// WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+// See the License for the specific language governing permissions and
+// limitations under the License.
+//
+//===----------------------------------------------------------------------===//
+///
+/// @file
+/// Stress test of the request queue and the object pools of the
+/// AsyncManager. The functions are static, so asyncmanager.c is included.
+///
+/// Build from the top directory and run, best with -fsanitize=thread:
+///   cc -O2 -D_GNU_SOURCE -Isrc -o asyncmanager-queue
+///      test/AsyncManager/queue.c src/exithandler.c src/logging.c
+///      -luv -lpthread
+///
+//===----------------------------------------------------------------------===//
+
+#include "asyncmanager.c"
+
+#include <stdio.h>
+
+#define NR_PRODUCERS (4)
+#define NR_ITEMS (200000)
+#define NR_POOL_THREADS (4)
+#define NR_POOL_ROUNDS (200000)
+
+struct item {
+    struct req_node node;
+    int producer;
+    int seq;
+};
+
+struct producer {
+    uv_thread_t tid;
+    int id;
+    struct req_queue *queue;
+    struct item *items;
+};
+
+struct pool_user {
+    uv_thread_t tid;
+    int id;
+    struct obj_pool *pool;
+    int errors;
+};
+
+static void producer_thread(void *arg) {
+    struct producer *p = arg;
+    int i;
+    for (i = 0; i < NR_ITEMS; i++) {
+        p->items[i].producer = p->id;
+        p->items[i].seq = i;
+        queue_push(p->queue, &p->items[i].node);
+    }
+}
+
+// Every producer pushes its items in order, the single consumer has to
+// see all of them exactly once and in the order of each producer.
+static int test_queue(void) {
+    struct req_queue queue;
+    struct producer prod[NR_PRODUCERS];
+    int expected[NR_PRODUCERS] = {0};
+    struct req_node *node;
+    long received = 0;
+    int errors = 0;
+    int i;
+    queue_init(&queue);
+    for (i = 0; i < NR_PRODUCERS; i++) {
+        prod[i].id = i;
+        prod[i].queue = &queue;
+        prod[i].items = LEIGUN_NEW_ARRAY(NR_ITEMS, struct item);
+        uv_thread_create(&prod[i].tid, producer_thread, &prod[i]);
+    }
+    while (received < (long)NR_PRODUCERS * NR_ITEMS) {
+        node = queue_pop(&queue);
+        if (!node) {
+            continue;
+        }
+        struct item *it = (struct item *)node;
+        if (it->seq != expected[it->producer]) {
+            if (errors++ < 10) {
+                fprintf(stderr, "producer %d: got item %d, expected %d\n",
+                        it->producer, it->seq, expected[it->producer]);
+            }
+        }
+        expected[it->producer] = it->seq + 1;
+        received++;
+    }
+    for (i = 0; i < NR_PRODUCERS; i++) {
+        uv_thread_join(&prod[i].tid);
+    }
+    if (queue_pop(&queue) != NULL) {
+        fprintf(stderr, "queue not empty after all items\n");
+        errors++;
+    }
+    for (i = 0; i < NR_PRODUCERS; i++) {
+        free(prod[i].items);
+    }
+    printf("queue: %ld items from %d producers, %d errors\n", received,
+           NR_PRODUCERS, errors);
+    return errors;
+}
+
+static bool in_pool(struct obj_pool *pool, void *obj) {
+    char *p = obj;
+    return (p >= pool->objs) && (p < pool->objs + REQ_POOL_SIZE * pool->objsize);
+}
+
+// Drain the pool, check that the next object comes from the heap and that
+// the returned objects are handed out again, cleared.
+static int test_pool_reuse(void) {
+    struct obj_pool pool;
+    void *objs[REQ_POOL_SIZE];
+    void *extra;
+    int errors = 0;
+    int i, j;
+    pool_init(&pool, sizeof(struct req_node));
+    for (i = 0; i < REQ_POOL_SIZE; i++) {
+        objs[i] = pool_get(&pool);
+        if (!in_pool(&pool, objs[i])) {
+            fprintf(stderr, "object %d not from the pool\n", i);
+            errors++;
+        }
+        for (j = 0; j < i; j++) {
+            if (objs[j] == objs[i]) {
+                fprintf(stderr, "object %d handed out twice\n", i);
+                errors++;
+            }
+        }
+        memset(objs[i], 0xa5, pool.objsize);
+    }
+    extra = pool_get(&pool);
+    if (!extra || in_pool(&pool, extra)) {
+        fprintf(stderr, "exhausted pool did not fall back to the heap\n");
+        errors++;
+    }
+    pool_put(&pool, extra);
+    for (i = 0; i < REQ_POOL_SIZE; i++) {
+        pool_put(&pool, objs[i]);
+    }
+    for (i = 0; i < REQ_POOL_SIZE; i++) {
+        unsigned char *obj = pool_get(&pool);
+        if (!in_pool(&pool, obj)) {
+            fprintf(stderr, "returned object %d not reused\n", i);
+            errors++;
+            continue;
+        }
+        for (j = 0; j < (int)pool.objsize; j++) {
+            if (obj[j] != 0) {
+                fprintf(stderr, "reused object %d not cleared\n", i);
+                errors++;
+                break;
+            }
+        }
+    }
+    free(pool.objs);
+    printf("pool reuse: %d errors\n", errors);
+    return errors;
+}
+
+// An object must belong to one thread at a time. Every thread marks the
+// objects it holds and checks the mark before it gives them back.
+static void pool_thread(void *arg) {
+    struct pool_user *u = arg;
+    struct item *held[8];
+    int round, i;
+    for (round = 0; round < NR_POOL_ROUNDS; round++) {
+        int n = 1 + (round % 8);
+        for (i = 0; i < n; i++) {
+            held[i] = pool_get(u->pool);
+            if (held[i]->producer != 0) {
+                u->errors++;
+            }
+            held[i]->producer = u->id;
+            held[i]->seq = round;
+        }
+        for (i = 0; i < n; i++) {
+            if ((held[i]->producer != u->id) || (held[i]->seq != round)) {
+                u->errors++;
+            }
+            held[i]->producer = 0;
+            pool_put(u->pool, held[i]);
+        }
+    }
+}
+
+static int test_pool_threads(void) {
+    struct obj_pool pool;
+    struct pool_user users[NR_POOL_THREADS];
+    int errors = 0;
+    int i;
+    pool_init(&pool, sizeof(struct item));
+    for (i = 0; i < NR_POOL_THREADS; i++) {
+        users[i].id = i + 1;
+        users[i].pool = &pool;
+        users[i].errors = 0;
+        uv_thread_create(&users[i].tid, pool_thread, &users[i]);
+    }
+    for (i = 0; i < NR_POOL_THREADS; i++) {
+        uv_thread_join(&users[i].tid);
+        errors += users[i].errors;
+    }
+    free(pool.objs);
+    printf("pool threads: %d threads, %d errors\n", NR_POOL_THREADS, errors);
+    return errors;
+}
+
+int main(int argc, const char *argv[]) {
+    int errors = 0;
+    errors += test_queue();
+    errors += test_pool_reuse();
+    errors += test_pool_threads();
+    return errors ? 1 : 0;
+}
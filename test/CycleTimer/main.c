@@ -0,0 +1,234 @@
+//===-- test/CycleTimer/main.c ------------------------------------*- C -*-===//
+//
+//              The Leigun Embedded System Simulator Platform
+//
+// Licensed under the Apache License, Version 2.0 (the "License");
+// you may not use this file except in compliance with the License.
+// You may obtain a copy of the License at
+//
+//     http://www.apache.org/licenses/LICENSE-2.0
+//
+// Unless required by applicable law or agreed to in writing, software
+// distributed under the License is distributed on an "AS IS" BASIS,
+// WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+// See the License for the specific language governing permissions and
+// limitations under the License.
+//
+//===----------------------------------------------------------------------===//
+///
+/// @file
+/// Microbenchmark of the CycleTimer queue against the former red-black
+/// tree implementation.
+///
+/// Build from the top directory:
+///   cc -O2 -D_GNU_SOURCE -Isrc/softgun -o cycletimer-bench
+///      test/CycleTimer/main.c src/softgun/cycletimer.c src/softgun/clock.c
+///      src/softgun/strhash.c src/softgun/xy_hash.c src/softgun/xy_tree.c
+///      src/softgun/sgstring.c
+///
+//===----------------------------------------------------------------------===//
+
+#include "cycletimer.h"
+#include "xy_tree.h"
+
+#include <stdio.h>
+#include <stdint.h>
+#include <time.h>
+
+#define NR_TIMERS	(64)
+#define NR_CYCLES	(200000000ULL)
+#define CYCLE_STEP	(6)
+
+/*
+ * The workload mimics the peripherals: every timer re-arms itself
+ * from its handler (periodic timers like the LCD controller or the
+ * USB frame timer) and every 8th expiry a UART like timer is
+ * modified before it fires.
+ */
+static uint32_t periods[NR_TIMERS];
+static uint32_t rnd_state = 12345;
+static uint64_t fired;
+
+static uint32_t
+rnd(void)
+{
+	rnd_state = rnd_state * 1103515245 + 12345;
+	return rnd_state >> 8;
+}
+
+static double
+now_sec(void)
+{
+	struct timespec ts;
+	clock_gettime(CLOCK_MONOTONIC, &ts);
+	return ts.tv_sec + ts.tv_nsec * 1e-9;
+}
+
+/*
+ * ------------------------------------------------------------------
+ * The reference: CycleTimer queue as red-black tree (former code)
+ * ------------------------------------------------------------------
+ */
+typedef struct TreeTimer {
+	xy_node node;
+	uint64_t timeout;
+	void (*proc) (void *);
+	void *clientData;
+	int isactive;
+} TreeTimer;
+
+static XY_Tree tree;
+static xy_node *treeFirstNode;
+static uint64_t treeFirstTimeout = ~(uint64_t) 0;
+
+static int
+is_later(const void *t1, const void *t2)
+{
+	return *(const uint64_t *)t2 < *(const uint64_t *)t1;
+}
+
+static void
+tree_remove(TreeTimer * timer)
+{
+	if (!timer->isactive)
+		return;
+	XY_DeleteTreeNode(&tree, &timer->node);
+	timer->isactive = 0;
+	if (timer == XY_NodeValue(treeFirstNode)) {
+		treeFirstNode = XY_NextTreeNode(&tree, treeFirstNode);
+		if (treeFirstNode) {
+			treeFirstTimeout = ((TreeTimer *) XY_NodeValue(treeFirstNode))->timeout;
+		} else {
+			treeFirstTimeout = ~(uint64_t) 0;
+		}
+	}
+}
+
+static void
+tree_add(TreeTimer * timer, uint64_t cycles, void (*proc) (void *), void *clientData)
+{
+	timer->proc = proc;
+	timer->isactive = 1;
+	timer->clientData = clientData;
+	timer->timeout = CycleCounter + cycles;
+	XY_AddTreeNode(&tree, &timer->node, &timer->timeout, timer);
+	if (!treeFirstNode
+	    || (timer->timeout < ((TreeTimer *) XY_NodeValue(treeFirstNode))->timeout)) {
+		treeFirstNode = &timer->node;
+		treeFirstTimeout = timer->timeout;
+	}
+}
+
+static inline void
+tree_check(void)
+{
+	if (CycleCounter >= treeFirstTimeout) {
+		xy_node *node = treeFirstNode;
+		TreeTimer *timer = XY_NodeValue(node);
+		treeFirstNode = XY_NextTreeNode(&tree, treeFirstNode);
+		if (treeFirstNode) {
+			treeFirstTimeout = ((TreeTimer *) XY_NodeValue(treeFirstNode))->timeout;
+		} else {
+			treeFirstTimeout = ~(uint64_t) 0;
+		}
+		XY_DeleteTreeNode(&tree, node);
+		timer->isactive = 0;
+		timer->proc(timer->clientData);
+	}
+}
+
+static TreeTimer treeTimers[NR_TIMERS];
+
+static void
+tree_proc(void *clientData)
+{
+	TreeTimer *timer = clientData;
+	unsigned int idx = timer - treeTimers;
+	fired++;
+	tree_add(timer, periods[idx], tree_proc, timer);
+	if ((fired & 7) == 0) {
+		TreeTimer *uart = &treeTimers[rnd() % NR_TIMERS];
+		tree_remove(uart);
+		tree_add(uart, periods[uart - treeTimers], tree_proc, uart);
+	}
+}
+
+static double
+bench_tree(void)
+{
+	double start;
+	int i;
+	XY_InitTree(&tree, is_later, NULL, NULL, NULL);
+	CycleCounter = 0;
+	fired = 0;
+	rnd_state = 12345;
+	for (i = 0; i < NR_TIMERS; i++) {
+		tree_add(&treeTimers[i], periods[i], tree_proc, &treeTimers[i]);
+	}
+	start = now_sec();
+	while (CycleCounter < NR_CYCLES) {
+		CycleCounter += CYCLE_STEP;
+		tree_check();
+	}
+	return now_sec() - start;
+}
+
+/*
+ * ------------------------------------------------------------------
+ * The CycleTimer API
+ * ------------------------------------------------------------------
+ */
+static CycleTimer heapTimers[NR_TIMERS];
+
+static void
+heap_proc(void *clientData)
+{
+	CycleTimer *timer = clientData;
+	unsigned int idx = timer - heapTimers;
+	fired++;
+	CycleTimer_Add(timer, periods[idx], heap_proc, timer);
+	if ((fired & 7) == 0) {
+		CycleTimer *uart = &heapTimers[rnd() % NR_TIMERS];
+		CycleTimer_Mod(uart, periods[uart - heapTimers]);
+	}
+}
+
+static double
+bench_heap(void)
+{
+	double start;
+	int i;
+	CycleCounter = 0;
+	fired = 0;
+	rnd_state = 12345;
+	for (i = 0; i < NR_TIMERS; i++) {
+		CycleTimer_Init(&heapTimers[i], heap_proc, &heapTimers[i]);
+		CycleTimer_Add(&heapTimers[i], periods[i], heap_proc, &heapTimers[i]);
+	}
+	start = now_sec();
+	while (CycleCounter < NR_CYCLES) {
+		CycleCounter += CYCLE_STEP;
+		CycleTimers_Check();
+	}
+	return now_sec() - start;
+}
+
+int
+main(int argc, const char *argv[])
+{
+	double t_tree, t_heap;
+	uint64_t fired_tree;
+	int i;
+	for (i = 0; i < NR_TIMERS; i++) {
+		periods[i] = 200 + rnd() % 20000;
+	}
+	t_tree = bench_tree();
+	fired_tree = fired;
+	t_heap = bench_heap();
+	printf("%d timers, %llu cycles\n", NR_TIMERS, (unsigned long long)NR_CYCLES);
+	printf("tree: %.3f s, %llu expiries, %.1f ns/expiry\n", t_tree,
+	       (unsigned long long)fired_tree, t_tree * 1e9 / fired_tree);
+	printf("heap: %.3f s, %llu expiries, %.1f ns/expiry\n", t_heap,
+	       (unsigned long long)fired, t_heap * 1e9 / fired);
+	return fired != fired_tree;
+}